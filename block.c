@@ -4231,16 +4231,23 @@ void bdrv_get_backing_filename(BlockDriverState *bs,
     pstrcpy(filename, filename_size, bs->backing_file);
 }
 
-int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                          const uint8_t *buf, int nb_sectors)
+/*
+ * Writes nb_sectors from qiov compressed.  This is normally one cluster at a
+ * time; a write of zero sectors tells the driver that the image is complete.
+ */
+int coroutine_fn bdrv_co_write_compressed(BlockDriverState *bs,
+                                          int64_t sector_num, int nb_sectors,
+                                          QEMUIOVector *qiov)
 {
     BlockDriver *drv = bs->drv;
+    BdrvTrackedRequest req;
+    uint8_t *buf;
     int ret;
 
     if (!drv) {
         return -ENOMEDIUM;
     }
-    if (!drv->bdrv_write_compressed) {
+    if (!drv->bdrv_write_compressed && !drv->bdrv_co_write_compressed) {
         return -ENOTSUP;
     }
     ret = bdrv_check_request(bs, sector_num, nb_sectors);
@@ -4250,7 +4257,110 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
     assert(QLIST_EMPTY(&bs->dirty_bitmaps));
 
-    return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
+    /* Make bdrv_drain() and bdrv_close() wait for the write */
+    tracked_request_begin(&req, bs, sector_num << BDRV_SECTOR_BITS,
+                          nb_sectors << BDRV_SECTOR_BITS, true);
+
+    if (drv->bdrv_co_write_compressed) {
+        ret = drv->bdrv_co_write_compressed(bs, sector_num, nb_sectors, qiov);
+    } else if (qiov->niov == 1) {
+        ret = drv->bdrv_write_compressed(bs, sector_num,
+                                         qiov->iov[0].iov_base, nb_sectors);
+    } else {
+        buf = qemu_blockalign(bs, qiov->size);
+        qemu_iovec_to_buf(qiov, 0, buf, qiov->size);
+        ret = drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
+        qemu_vfree(buf);
+    }
+
+    tracked_request_end(&req);
+    return ret;
+}
+
+/*
+ * Copies nb_sectors from src to dst within the storage, e.g. with
+ * copy_file_range(), without reading the data into memory.  Returns -ENOTSUP
+ * if the drivers can't do that; the caller must then read and write the
+ * data itself.
+ *
+ * The write to dst bypasses dirty bitmaps, before-write notifiers and request
+ * tracking, so this is only for images that nothing else is using, like the
+ * target of qemu-img convert.
+ */
+int coroutine_fn bdrv_co_copy_range(BlockDriverState *src, int64_t src_sector,
+                                    BlockDriverState *dst, int64_t dst_sector,
+                                    int nb_sectors)
+{
+    int ret;
+
+    if (!src->drv || !dst->drv) {
+        return -ENOMEDIUM;
+    }
+    if (dst->read_only) {
+        return -EACCES;
+    }
+    ret = bdrv_check_request(src, src_sector, nb_sectors);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = bdrv_check_request(dst, dst_sector, nb_sectors);
+    if (ret < 0) {
+        return ret;
+    }
+    if (!src->drv->bdrv_co_copy_range || !QLIST_EMPTY(&dst->dirty_bitmaps)) {
+        return -ENOTSUP;
+    }
+
+    return src->drv->bdrv_co_copy_range(src, src_sector, dst, dst_sector,
+                                        nb_sectors);
+}
+
+static void coroutine_fn bdrv_write_compressed_co_entry(void *opaque)
+{
+    RwCo *rwco = opaque;
+
+    rwco->ret = bdrv_co_write_compressed(rwco->bs,
+                                         rwco->offset >> BDRV_SECTOR_BITS,
+                                         rwco->qiov->size >> BDRV_SECTOR_BITS,
+                                         rwco->qiov);
+}
+
+int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
+                          const uint8_t *buf, int nb_sectors)
+{
+    Coroutine *co;
+    QEMUIOVector qiov;
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = nb_sectors * BDRV_SECTOR_SIZE,
+    };
+    RwCo rwco = {
+        .bs = bs,
+        .offset = sector_num << BDRV_SECTOR_BITS,
+        .qiov = &qiov,
+        .is_write = true,
+        .ret = NOT_DONE,
+    };
+
+    if (nb_sectors < 0 || nb_sectors > BDRV_REQUEST_MAX_SECTORS) {
+        return -EINVAL;
+    }
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    if (qemu_in_coroutine()) {
+        /* Fast-path if already in coroutine context */
+        bdrv_write_compressed_co_entry(&rwco);
+    } else {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
+        co = qemu_coroutine_create(bdrv_write_compressed_co_entry);
+        qemu_coroutine_enter(co, &rwco);
+        while (rwco.ret == NOT_DONE) {
+            aio_poll(aio_context, true);
+        }
+    }
+    return rwco.ret;
 }
 
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
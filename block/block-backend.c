@@ -845,6 +845,56 @@ void *blk_aio_get(const AIOCBInfo *aiocb_info, BlockBackend *blk,
     return qemu_aio_get(aiocb_info, blk_bs(blk), cb, opaque);
 }
 
+int coroutine_fn blk_co_readv(BlockBackend *blk, int64_t sector_num,
+                              int nb_sectors, QEMUIOVector *qiov)
+{
+    int ret = blk_check_request(blk, sector_num, nb_sectors);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_co_readv(blk->bs, sector_num, nb_sectors, qiov);
+}
+
+int coroutine_fn blk_co_writev(BlockBackend *blk, int64_t sector_num,
+                               int nb_sectors, QEMUIOVector *qiov)
+{
+    int ret = blk_check_request(blk, sector_num, nb_sectors);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_co_writev(blk->bs, sector_num, nb_sectors, qiov);
+}
+
+int coroutine_fn blk_co_write_compressed(BlockBackend *blk, int64_t sector_num,
+                                         int nb_sectors, QEMUIOVector *qiov)
+{
+    int ret = blk_check_request(blk, sector_num, nb_sectors);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_co_write_compressed(blk->bs, sector_num, nb_sectors, qiov);
+}
+
+int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t sector_in,
+                                   BlockBackend *blk_out, int64_t sector_out,
+                                   int nb_sectors)
+{
+    int ret = blk_check_request(blk_in, sector_in, nb_sectors);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = blk_check_request(blk_out, sector_out, nb_sectors);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_co_copy_range(blk_in->bs, sector_in, blk_out->bs, sector_out,
+                              nb_sectors);
+}
+
 int coroutine_fn blk_co_write_zeroes(BlockBackend *blk, int64_t sector_num,
                                      int nb_sectors, BdrvRequestFlags flags)
 {
@@ -24,55 +24,136 @@
 
 #include "block/block_int.h"
 #include "qemu-common.h"
+#include "qemu/host-utils.h"
 #include "qcow2.h"
 #include "trace.h"
 
+/*
+ * Tables live back to back in one buffer, so the entry of a table pointer
+ * handed out by qcow2_cache_get() is found with a division instead of a
+ * search.  Lookups by image offset go through a chained hash index, and
+ * replacement uses the CLOCK approximation of LRU: every hit sets the
+ * entry's reference bit, and the clock hand evicts the first unreferenced
+ * entry it finds, clearing the bits it passes over.
+ */
+
 typedef struct Qcow2CachedTable {
-    void*   table;
     int64_t offset;
-    bool    dirty;
-    int     cache_hits;
+    int     next;       /* next entry in the same hash chain, or -1 */
     int     ref;
+    bool    dirty;
+    bool    referenced;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
     Qcow2CachedTable*       entries;
     struct Qcow2Cache*      depends;
     int                     size;
+    int                     table_size;
     bool                    depends_on_flush;
+    void*                   table_array;
+    int*                    buckets;
+    int                     bucket_bits;
+    int                     clock_hand;
 };
 
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
+static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int table)
+{
+    return (uint8_t *) c->table_array + (size_t) table * c->table_size;
+}
+
+static inline int qcow2_cache_get_table_idx(Qcow2Cache *c, void *table)
+{
+    ptrdiff_t table_offset = (uint8_t *) table - (uint8_t *) c->table_array;
+    int idx = table_offset / c->table_size;
+
+    assert(idx >= 0 && idx < c->size && table_offset % c->table_size == 0);
+    return idx;
+}
+
+static inline unsigned int qcow2_cache_hash(Qcow2Cache *c, uint64_t offset)
+{
+    uint64_t h = (offset / c->table_size) * 0x9e3779b97f4a7c15ULL;
+
+    return h >> (64 - c->bucket_bits);
+}
+
+static int qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
 {
-    BDRVQcowState *s = bs->opaque;
-    Qcow2Cache *c;
     int i;
 
-    c = g_new0(Qcow2Cache, 1);
-    c->size = num_tables;
-    c->entries = g_try_new0(Qcow2CachedTable, num_tables);
-    if (!c->entries) {
-        goto fail;
+    for (i = c->buckets[qcow2_cache_hash(c, offset)]; i >= 0;
+         i = c->entries[i].next) {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
     }
+    return -1;
+}
 
+static void qcow2_cache_hash_insert(Qcow2Cache *c, int i)
+{
+    unsigned int h = qcow2_cache_hash(c, c->entries[i].offset);
+
+    c->entries[i].next = c->buckets[h];
+    c->buckets[h] = i;
+}
+
+static void qcow2_cache_hash_remove(Qcow2Cache *c, int i)
+{
+    int *p = &c->buckets[qcow2_cache_hash(c, c->entries[i].offset)];
+
+    while (*p != i) {
+        assert(*p >= 0);
+        p = &c->entries[*p].next;
+    }
+    *p = c->entries[i].next;
+    c->entries[i].next = -1;
+}
+
+static void qcow2_cache_reset(Qcow2Cache *c)
+{
+    int i;
+
+    for (i = 0; i < (1 << c->bucket_bits); i++) {
+        c->buckets[i] = -1;
+    }
     for (i = 0; i < c->size; i++) {
-        c->entries[i].table = qemu_try_blockalign(bs->file, s->cluster_size);
-        if (c->entries[i].table == NULL) {
-            goto fail;
-        }
+        c->entries[i].offset = 0;
+        c->entries[i].next = -1;
+        c->entries[i].referenced = false;
     }
+    c->clock_hand = 0;
+}
 
-    return c;
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               int table_size)
+{
+    Qcow2Cache *c;
 
-fail:
-    if (c->entries) {
-        for (i = 0; i < c->size; i++) {
-            qemu_vfree(c->entries[i].table);
-        }
+    assert(num_tables > 0);
+    assert(is_power_of_2(table_size) && table_size >= BDRV_SECTOR_SIZE);
+
+    c = g_new0(Qcow2Cache, 1);
+    c->size = num_tables;
+    c->table_size = table_size;
+    /* At least twice as many buckets as entries keeps the chains short */
+    c->bucket_bits = 64 - clz64(num_tables);
+    c->entries = g_try_new0(Qcow2CachedTable, num_tables);
+    c->buckets = g_try_new(int, 1 << c->bucket_bits);
+    c->table_array = qemu_try_blockalign(bs->file,
+                                         (size_t) num_tables * table_size);
+
+    if (!c->entries || !c->buckets || !c->table_array) {
+        qemu_vfree(c->table_array);
+        g_free(c->buckets);
+        g_free(c->entries);
+        g_free(c);
+        return NULL;
     }
-    g_free(c->entries);
-    g_free(c);
-    return NULL;
+
+    qcow2_cache_reset(c);
+    return c;
 }
 
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
@@ -81,9 +162,10 @@ int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        qemu_vfree(c->entries[i].table);
     }
 
+    qemu_vfree(c->table_array);
+    g_free(c->buckets);
     g_free(c->entries);
     g_free(c);
 
@@ -132,13 +214,13 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
 
     if (c == s->refcount_block_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_REFCOUNT_BLOCK,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     } else if (c == s->l2_table_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_ACTIVE_L2,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     } else {
         ret = qcow2_pre_write_overlap_check(bs, 0,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     }
 
     if (ret < 0) {
@@ -151,8 +233,8 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
         BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
     }
 
-    ret = bdrv_pwrite(bs->file, c->entries[i].offset, c->entries[i].table,
-        s->cluster_size);
+    ret = bdrv_pwrite(bs->file, c->entries[i].offset,
+        qcow2_cache_get_table_addr(c, i), c->table_size);
     if (ret < 0) {
         return ret;
     }
@@ -227,43 +309,35 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        c->entries[i].offset = 0;
-        c->entries[i].cache_hits = 0;
     }
+    qcow2_cache_reset(c);
 
     return 0;
 }
 
 static int qcow2_cache_find_entry_to_replace(Qcow2Cache *c)
 {
-    int i;
-    int min_count = INT_MAX;
-    int min_index = -1;
+    int n;
 
+    /* The first sweep may only clear reference bits, the second one then
+     * finds an entry unless every table is in use */
+    for (n = 0; n < 2 * c->size; n++) {
+        int i = c->clock_hand;
 
-    for (i = 0; i < c->size; i++) {
+        c->clock_hand = (i + 1 == c->size) ? 0 : i + 1;
         if (c->entries[i].ref) {
             continue;
         }
-
-        if (c->entries[i].cache_hits < min_count) {
-            min_index = i;
-            min_count = c->entries[i].cache_hits;
-        }
-
-        /* Give newer hits priority */
-        /* TODO Check how to optimize the replacement strategy */
-        if (c->entries[i].cache_hits > 1) {
-            c->entries[i].cache_hits /= 2;
+        if (c->entries[i].referenced) {
+            c->entries[i].referenced = false;
+            continue;
         }
+        return i;
     }
 
-    if (min_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
-        abort();
-    }
-    return min_index;
+    /* This can't happen in current synchronous code, but leave the check
+     * here as a reminder for whoever starts using AIO with the cache */
+    abort();
 }
 
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
@@ -273,23 +347,21 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     int i;
     int ret;
 
+    assert(offset != 0 && offset % c->table_size == 0);
+
     trace_qcow2_cache_get(qemu_coroutine_self(), c == s->l2_table_cache,
                           offset, read_from_disk);
 
     /* Check if the table is already cached */
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            goto found;
-        }
+    i = qcow2_cache_lookup(c, offset);
+    if (i >= 0) {
+        goto found;
     }
 
     /* If not, write a table back and replace it */
     i = qcow2_cache_find_entry_to_replace(c);
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
-    if (i < 0) {
-        return i;
-    }
 
     ret = qcow2_cache_entry_flush(bs, c, i);
     if (ret < 0) {
@@ -298,28 +370,30 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    if (c->entries[i].offset) {
+        qcow2_cache_hash_remove(c, i);
+        c->entries[i].offset = 0;
+    }
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
         }
 
-        ret = bdrv_pread(bs->file, offset, c->entries[i].table, s->cluster_size);
+        ret = bdrv_pread(bs->file, offset, qcow2_cache_get_table_addr(c, i),
+                         c->table_size);
         if (ret < 0) {
             return ret;
         }
     }
 
-    /* Give the table some hits for the start so that it won't be replaced
-     * immediately. The number 32 is completely arbitrary. */
-    c->entries[i].cache_hits = 32;
     c->entries[i].offset = offset;
+    qcow2_cache_hash_insert(c, i);
 
     /* And return the right table */
 found:
-    c->entries[i].cache_hits++;
+    c->entries[i].referenced = true;
     c->entries[i].ref++;
-    *table = c->entries[i].table;
+    *table = qcow2_cache_get_table_addr(c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
@@ -341,16 +415,8 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 {
-    int i;
-
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == *table) {
-            goto found;
-        }
-    }
-    return -ENOENT;
+    int i = qcow2_cache_get_table_idx(c, *table);
 
-found:
     c->entries[i].ref--;
     *table = NULL;
 
@@ -360,15 +426,8 @@ found:
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 {
-    int i;
-
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == table) {
-            goto found;
-        }
-    }
-    abort();
+    int i = qcow2_cache_get_table_idx(c, table);
 
-found:
+    assert(c->entries[i].offset != 0);
     c->entries[i].dirty = true;
 }
@@ -22,8 +22,6 @@
  * THE SOFTWARE.
  */
 
-#include <zlib.h>
-
 #include "qemu-common.h"
 #include "block/block_int.h"
 #include "block/qcow2.h"
@@ -138,22 +136,22 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
 /*
  * l2_load
  *
- * Loads a L2 table into memory. If the table is in the cache, the cache
- * is used; otherwise the L2 table is loaded from the image file.
+ * Loads the slice of the L2 table at l2_offset that maps the guest
+ * offset into memory. If the slice is in the cache, the cache is used;
+ * otherwise it is loaded from the image file.
  *
- * Returns a pointer to the L2 table on success, or NULL if the read from
- * the image file failed.
+ * Returns 0 on success and -errno if the read from the image file failed.
  */
 
-static int l2_load(BlockDriverState *bs, uint64_t l2_offset,
-    uint64_t **l2_table)
+static int l2_load(BlockDriverState *bs, uint64_t offset,
+    uint64_t l2_offset, uint64_t **l2_slice)
 {
     BDRVQcowState *s = bs->opaque;
-    int ret;
-
-    ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset, (void**) l2_table);
+    int start_of_slice = sizeof(uint64_t) *
+        (offset_to_l2_index(s, offset) - offset_to_l2_slice_index(s, offset));
 
-    return ret;
+    return qcow2_cache_get(bs, s->l2_table_cache, l2_offset + start_of_slice,
+                           (void**) l2_slice);
 }
 
 /*
@@ -199,14 +197,17 @@ int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index)
  * table) copy the contents of the old L2 table into the newly allocated one.
  * Otherwise the new table is initialized with zeros.
  *
+ * The table is set up one cache entry (L2 slice) at a time and is written
+ * out before the L1 entry is updated to point to it.
  */
 
-static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
+static int l2_allocate(BlockDriverState *bs, int l1_index)
 {
     BDRVQcowState *s = bs->opaque;
     uint64_t old_l2_offset;
-    uint64_t *l2_table = NULL;
+    uint64_t *l2_slice = NULL;
     int64_t l2_offset;
+    unsigned int slice, slice_size2, n_slices;
     int ret;
 
     old_l2_offset = s->l1_table[l1_index];
@@ -226,34 +227,46 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         goto fail;
     }
 
-    /* allocate a new entry in the l2 cache */
-
-    trace_qcow2_l2_allocate_get_empty(bs, l1_index);
-    ret = qcow2_cache_get_empty(bs, s->l2_table_cache, l2_offset, (void**) table);
-    if (ret < 0) {
-        goto fail;
-    }
-
-    l2_table = *table;
+    /* allocate new entries in the l2 cache */
 
-    if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
-        /* if there was no old l2 table, clear the new table */
-        memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
-    } else {
-        uint64_t* old_table;
+    slice_size2 = s->l2_slice_size * sizeof(uint64_t);
+    n_slices = s->cluster_size / slice_size2;
 
-        /* if there was an old l2 table, read it from the disk */
-        BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_COW_READ);
-        ret = qcow2_cache_get(bs, s->l2_table_cache,
-            old_l2_offset & L1E_OFFSET_MASK,
-            (void**) &old_table);
+    trace_qcow2_l2_allocate_get_empty(bs, l1_index);
+    for (slice = 0; slice < n_slices; slice++) {
+        ret = qcow2_cache_get_empty(bs, s->l2_table_cache,
+                                    l2_offset + slice * slice_size2,
+                                    (void**) &l2_slice);
         if (ret < 0) {
             goto fail;
         }
 
-        memcpy(l2_table, old_table, s->cluster_size);
+        if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
+            /* if there was no old l2 table, clear the new slice */
+            memset(l2_slice, 0, slice_size2);
+        } else {
+            uint64_t *old_slice;
+            uint64_t old_l2_slice_offset =
+                (old_l2_offset & L1E_OFFSET_MASK) + slice * slice_size2;
+
+            /* if there was an old l2 table, read its slice from the disk */
+            BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_COW_READ);
+            ret = qcow2_cache_get(bs, s->l2_table_cache, old_l2_slice_offset,
+                                  (void**) &old_slice);
+            if (ret < 0) {
+                goto fail;
+            }
+
+            memcpy(l2_slice, old_slice, slice_size2);
 
-        ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &old_table);
+            ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &old_slice);
+            if (ret < 0) {
+                goto fail;
+            }
+        }
+
+        qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+        ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_slice);
         if (ret < 0) {
             goto fail;
         }
@@ -263,7 +276,6 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
     BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_WRITE);
 
     trace_qcow2_l2_allocate_write_l2(bs, l1_index);
-    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret < 0) {
         goto fail;
@@ -277,14 +289,13 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         goto fail;
     }
 
-    *table = l2_table;
     trace_qcow2_l2_allocate_done(bs, l1_index, 0);
     return 0;
 
 fail:
     trace_qcow2_l2_allocate_done(bs, l1_index, ret);
-    if (l2_table != NULL) {
-        qcow2_cache_put(bs, s->l2_table_cache, (void**) table);
+    if (l2_slice != NULL) {
+        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_slice);
     }
     s->l1_table[l1_index] = old_l2_offset;
     if (l2_offset > 0) {
@@ -459,10 +470,12 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     l1_bits = s->l2_bits + s->cluster_bits;
 
     /* compute how many bytes there are between the offset and
-     * the end of the l1 entry
+     * the end of the l2 slice that maps it
      */
 
-    nb_available = (1ULL << l1_bits) - (offset & ((1ULL << l1_bits) - 1));
+    l2_index = offset_to_l2_slice_index(s, offset);
+    nb_available = ((uint64_t) (s->l2_slice_size - l2_index)
+                    << s->cluster_bits) - offset_into_cluster(s, offset);
 
     /* compute the number of available sectors */
 
@@ -495,16 +508,15 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
         return -EIO;
     }
 
-    /* load the l2 table in memory */
+    /* load the l2 slice in memory */
 
-    ret = l2_load(bs, l2_offset, &l2_table);
+    ret = l2_load(bs, offset, l2_offset, &l2_table);
     if (ret < 0) {
         return ret;
     }
 
     /* find the cluster offset for the given disk offset */
 
-    l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
     *cluster_offset = be64_to_cpu(l2_table[l2_index]);
     nb_clusters = size_to_clusters(s, nb_needed << 9);
 
@@ -519,7 +531,8 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
         if (s->qcow_version < 3) {
             qcow2_signal_corruption(bs, true, -1, -1, "Zero cluster entry found"
                                     " in pre-v3 image (L2 offset: %#" PRIx64
-                                    ", L2 index: %#x)", l2_offset, l2_index);
+                                    ", L2 index: %#x)", l2_offset,
+                                    offset_to_l2_index(s, offset));
             ret = -EIO;
             goto fail;
         }
@@ -541,7 +554,7 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
             qcow2_signal_corruption(bs, true, -1, -1, "Data cluster offset %#"
                                     PRIx64 " unaligned (L2 offset: %#" PRIx64
                                     ", L2 index: %#x)", *cluster_offset,
-                                    l2_offset, l2_index);
+                                    l2_offset, offset_to_l2_index(s, offset));
             ret = -EIO;
             goto fail;
         }
@@ -571,10 +584,10 @@ fail:
  * get_cluster_table
  *
  * for a given disk offset, load (and allocate if needed)
- * the l2 table.
+ * the l2 slice that maps it.
  *
- * the l2 table offset in the qcow2 file and the cluster index
- * in the l2 table are given to the caller.
+ * the l2 slice and the cluster index in the l2 slice are given to the
+ * caller.
  *
  * Returns 0 on success, -errno in failure case
  */
@@ -609,15 +622,9 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
 
     /* seek the l2 table of the given l2 offset */
 
-    if (s->l1_table[l1_index] & QCOW_OFLAG_COPIED) {
-        /* load the l2 table in memory */
-        ret = l2_load(bs, l2_offset, &l2_table);
-        if (ret < 0) {
-            return ret;
-        }
-    } else {
+    if (!(s->l1_table[l1_index] & QCOW_OFLAG_COPIED)) {
         /* First allocate a new L2 table (and do COW if needed) */
-        ret = l2_allocate(bs, l1_index, &l2_table);
+        ret = l2_allocate(bs, l1_index);
         if (ret < 0) {
             return ret;
         }
@@ -627,11 +634,19 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
             qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
                                 QCOW2_DISCARD_OTHER);
         }
+
+        l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+    }
+
+    /* load the l2 slice in memory */
+    ret = l2_load(bs, offset, l2_offset, &l2_table);
+    if (ret < 0) {
+        return ret;
     }
 
     /* find the cluster offset for the given disk offset */
 
-    l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
+    l2_index = offset_to_l2_slice_index(s, offset);
 
     *new_l2_table = l2_table;
     *new_l2_index = l2_index;
@@ -738,9 +753,23 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
     uint64_t *old_cluster, *l2_table;
     uint64_t cluster_offset = m->alloc_offset;
 
+    if (m->joined) {
+        /* The allocation we wrote into updates the L2 table for us */
+        qcow2_alloc_cluster_data_written(m, 0);
+        while (m->owner) {
+            qemu_co_mutex_unlock(&s->lock);
+            qemu_co_queue_wait(&m->owner->dependent_requests);
+            qemu_co_mutex_lock(&s->lock);
+        }
+        return m->owner_ret;
+    }
+
     trace_qcow2_cluster_link_l2(qemu_coroutine_self(), m->nb_clusters);
     assert(m->nb_clusters > 0);
 
+    /* The COW regions are final from here on */
+    m->linking = true;
+
     old_cluster = g_try_new(uint64_t, m->nb_clusters);
     if (old_cluster == NULL) {
         ret = -ENOMEM;
@@ -758,6 +787,20 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
         goto err;
     }
 
+    /* Requests that joined this allocation must have written their data
+     * before the clusters become visible in the L2 table */
+    if (m->nb_joined_writes > 0) {
+        qemu_co_mutex_unlock(&s->lock);
+        while (m->nb_joined_writes > 0) {
+            qemu_co_queue_wait(&m->joined_writes);
+        }
+        qemu_co_mutex_lock(&s->lock);
+    }
+    if (m->joined_ret < 0) {
+        ret = m->joined_ret;
+        goto err;
+    }
+
     /* Update L2 table. */
     if (s->use_lazy_refcounts) {
         qcow2_mark_dirty(bs);
@@ -773,7 +816,7 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
     }
     qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
 
-    assert(l2_index + m->nb_clusters <= s->l2_size);
+    assert(l2_index + m->nb_clusters <= s->l2_slice_size);
     for (i = 0; i < m->nb_clusters; i++) {
         /* if two concurrent writes happen to the same unallocated cluster
 	 * each write allocates separate cluster and writes data concurrently.
@@ -814,6 +857,64 @@ err:
     return ret;
  }
 
+/*
+ * Called once the guest data of the request part described by m has been
+ * written, or failed to be. Only joined requests need to report this, the
+ * allocation they joined waits for it before linking its clusters.
+ */
+void qcow2_alloc_cluster_data_written(QCowL2Meta *m, int ret)
+{
+    QCowL2Meta *owner = m->owner;
+
+    if (!m->joined || m->data_written) {
+        return;
+    }
+    m->data_written = true;
+
+    if (owner) {
+        if (ret < 0 && owner->joined_ret == 0) {
+            owner->joined_ret = ret;
+        }
+        if (--owner->nb_joined_writes == 0) {
+            qemu_co_queue_restart_all(&owner->joined_writes);
+        }
+    }
+}
+
+/*
+ * Takes the request part described by m off the list of running
+ * allocations once it has completed with result ret, and restarts the
+ * requests that waited for it. Requests that joined the allocation take
+ * over its result.
+ */
+void qcow2_alloc_cluster_done(QCowL2Meta *m, int ret)
+{
+    QCowL2Meta *r, *next_r;
+
+    if (m->joined) {
+        /* A request that failed before its data was written must still
+         * fail the allocation that it joined */
+        qcow2_alloc_cluster_data_written(m, ret < 0 ? ret : -EIO);
+        if (m->owner) {
+            QLIST_REMOVE(m, next_joiner);
+            m->owner = NULL;
+        }
+        return;
+    }
+
+    if (m->nb_clusters != 0) {
+        QLIST_REMOVE(m, next_in_flight);
+    }
+
+    QLIST_FOREACH_SAFE(r, &m->joiners, next_joiner, next_r) {
+        QLIST_REMOVE(r, next_joiner);
+        r->owner = NULL;
+        r->owner_ret = ret;
+    }
+
+    qemu_co_queue_restart_all(&m->dependent_requests);
+}
+
 /*
  * Returns the number of contiguous clusters that can be used for an allocating
  * write, but require COW to be performed (this includes yet unallocated space,
@@ -848,22 +949,83 @@ out:
     return i;
 }
 
+/*
+ * Tries to let a request starting at guest_offset write into the COW area of
+ * the in-flight allocation old_alloc instead of waiting for it to complete.
+ * This works if the request starts exactly where the COW area behind the
+ * data of old_alloc begins, or ends exactly where the COW area in front of
+ * it ends, and old_alloc hasn't started its COW yet. That COW area is then
+ * shrunk so that the COW doesn't overwrite the new data.
+ *
+ * Returns true and sets up *m for the joined request on success; *bytes is
+ * reduced to the part that lies within old_alloc and *host_offset points to
+ * where it must be written.
+ */
+static bool join_allocation(QCowL2Meta *old_alloc, uint64_t guest_offset,
+    uint64_t *bytes, uint64_t *host_offset, QCowL2Meta **m)
+{
+    Qcow2COWRegion *cow_start = &old_alloc->cow_start;
+    Qcow2COWRegion *cow_end = &old_alloc->cow_end;
+    uint64_t cow_start_end = l2meta_cow_start(old_alloc)
+                           + (cow_start->nb_sectors << BDRV_SECTOR_BITS);
+    uint64_t len;
+
+    if (old_alloc->linking) {
+        return false;
+    }
+
+    if (cow_end->nb_sectors &&
+        guest_offset == old_alloc->offset + cow_end->offset) {
+        len = MIN(*bytes, cow_end->nb_sectors << BDRV_SECTOR_BITS);
+        cow_end->offset += len;
+        cow_end->nb_sectors -= len >> BDRV_SECTOR_BITS;
+    } else if (guest_offset >= l2meta_cow_start(old_alloc) &&
+               guest_offset + *bytes == cow_start_end) {
+        len = *bytes;
+        cow_start->nb_sectors -= len >> BDRV_SECTOR_BITS;
+    } else {
+        return false;
+    }
+
+    *m = g_malloc0(sizeof(**m));
+    **m = (QCowL2Meta) {
+        .offset         = guest_offset,
+        .joined         = true,
+        .owner          = old_alloc,
+    };
+    qemu_co_queue_init(&(*m)->dependent_requests);
+    QLIST_INSERT_HEAD(&old_alloc->joiners, *m, next_joiner);
+    old_alloc->nb_joined_writes++;
+
+    *host_offset = old_alloc->alloc_offset + (guest_offset - old_alloc->offset);
+    *bytes = len;
+    return true;
+}
+
 /*
  * Check if there already is an AIO write request in flight which allocates
  * the same cluster. In this case we need to wait until the previous
- * request has completed and updated the L2 table accordingly.
+ * request has completed and updated the L2 table accordingly, unless the
+ * request can write into the COW area of the previous one (see
+ * join_allocation()). Joining is only possible while nothing has been
+ * gathered yet for this part of the request, i.e. *host_offset is 0 and *m
+ * is NULL.
  *
  * Returns:
  *   0       if there was no dependency. *cur_bytes indicates the number of
  *           bytes from guest_offset that can be read before the next
  *           dependency must be processed (or the request is complete)
  *
+ *   1       if the request joined an in-flight allocation. *cur_bytes bytes
+ *           from guest_offset must be written to *host_offset, and the part
+ *           is complete; *m describes it.
+ *
  *   -EAGAIN if we had to wait for another request, previously gathered
  *           information on cluster allocation may be invalid now. The caller
  *           must start over anyway, so consider *cur_bytes undefined.
  */
 static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
-    uint64_t *cur_bytes, QCowL2Meta **m)
+    uint64_t *host_offset, uint64_t *cur_bytes, QCowL2Meta **m)
 {
     BDRVQcowState *s = bs->opaque;
     QCowL2Meta *old_alloc;
@@ -895,6 +1057,15 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
                 return 0;
             }
 
+            if (bytes == 0 && *host_offset == 0 &&
+                join_allocation(old_alloc, guest_offset, cur_bytes,
+                                host_offset, m)) {
+                trace_qcow2_handle_dependencies_join(qemu_coroutine_self(),
+                                                     guest_offset, *cur_bytes,
+                                                     *host_offset);
+                return 1;
+            }
+
             if (bytes == 0) {
                 /* Wait for the dependency to complete. We need to recheck
                  * the free/allocated clusters when we continue. */
@@ -953,14 +1124,14 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
                                 == offset_into_cluster(s, *host_offset));
 
     /*
-     * Calculate the number of clusters to look for. We stop at L2 table
+     * Calculate the number of clusters to look for. We stop at L2 slice
      * boundaries to keep things simple.
      */
     nb_clusters =
         size_to_clusters(s, offset_into_cluster(s, guest_offset) + *bytes);
 
-    l2_index = offset_to_l2_index(s, guest_offset);
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    l2_index = offset_to_l2_slice_index(s, guest_offset);
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
 
     /* Find L2 entry for the first involved cluster */
     ret = get_cluster_table(bs, guest_offset, &l2_table, &l2_index);
@@ -1110,14 +1281,14 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     assert(*bytes > 0);
 
     /*
-     * Calculate the number of clusters to look for. We stop at L2 table
+     * Calculate the number of clusters to look for. We stop at L2 slice
      * boundaries to keep things simple.
      */
     nb_clusters =
         size_to_clusters(s, offset_into_cluster(s, guest_offset) + *bytes);
 
-    l2_index = offset_to_l2_index(s, guest_offset);
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    l2_index = offset_to_l2_slice_index(s, guest_offset);
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
 
     /* Find L2 entry for the first involved cluster */
     ret = get_cluster_table(bs, guest_offset, &l2_table, &l2_index);
@@ -1213,6 +1384,8 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         },
     };
     qemu_co_queue_init(&(*m)->dependent_requests);
+    qemu_co_queue_init(&(*m)->joined_writes);
+    QLIST_INIT(&(*m)->joiners);
     QLIST_INSERT_HEAD(&s->cluster_allocs, *m, next_in_flight);
 
     *host_offset = alloc_cluster_offset + offset_into_cluster(s, guest_offset);
@@ -1244,7 +1417,9 @@ fail:
  * cluster.
  *
  * If the request conflicts with another write request in flight, the coroutine
- * is queued and will be reentered when the dependency has completed.
+ * is queued and will be reentered when the dependency has completed. If it
+ * only touches the COW area of that request, it may instead write into its
+ * clusters; *m then describes a joined part (see join_allocation()).
  *
  * Return 0 on success and -errno in error cases
  */
@@ -1299,14 +1474,18 @@ again:
          *         for contiguous clusters (the situation could have changed
          *         while we were sleeping)
          *
-         *      c) TODO: Request starts in the same cluster as the in-flight
-         *         allocation ends. Shorten the COW of the in-fight allocation,
-         *         set cluster_offset to write to the same cluster and set up
-         *         the right synchronisation between the in-flight request and
-         *         the new one.
+         *      c) Request starts where the COW area behind the in-flight
+         *         allocation's data begins (or ends where the COW area in
+         *         front of it ends). Shorten the COW of the in-flight
+         *         allocation and write into its clusters; it links them for
+         *         us. This is a part of its own.
          */
-        ret = handle_dependencies(bs, start, &cur_bytes, m);
-        if (ret == -EAGAIN) {
+        ret = handle_dependencies(bs, start, &cluster_offset, &cur_bytes, m);
+        if (ret == 1) {
+            *host_offset = start_of_cluster(s, cluster_offset);
+            remaining -= cur_bytes;
+            break;
+        } else if (ret == -EAGAIN) {
             /* Currently handle_dependencies() doesn't yield if we already had
              * an allocation. If it did, we would have to clean up the L2Meta
              * structs before starting over. */
@@ -1356,61 +1535,87 @@ again:
     return 0;
 }
 
-static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
-                             const uint8_t *buf, int buf_size)
-{
-    z_stream strm1, *strm = &strm1;
-    int ret, out_len;
-
-    memset(strm, 0, sizeof(*strm));
-
-    strm->next_in = (uint8_t *)buf;
-    strm->avail_in = buf_size;
-    strm->next_out = out_buf;
-    strm->avail_out = out_buf_size;
-
-    ret = inflateInit2(strm, -12);
-    if (ret != Z_OK)
-        return -1;
-    ret = inflate(strm, Z_FINISH);
-    out_len = strm->next_out - out_buf;
-    if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) ||
-        out_len != out_buf_size) {
-        inflateEnd(strm);
-        return -1;
-    }
-    inflateEnd(strm);
-    return 0;
-}
-
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
+/*
+ * Copies qiov->size bytes starting at offset_in_cluster of the decompressed
+ * data of the compressed cluster described by the L2 entry cluster_offset
+ * into qiov.
+ *
+ * Called with s->lock held.  The lock is dropped while the compressed data is
+ * read and inflated, so reads of several compressed clusters can be in flight
+ * at the same time.  The last cluster decompressed is kept in
+ * s->cluster_cache for sequential reads that are smaller than a cluster.
+ */
+int coroutine_fn qcow2_co_read_compressed(BlockDriverState *bs,
+                                          uint64_t cluster_offset,
+                                          int offset_in_cluster,
+                                          QEMUIOVector *qiov)
 {
     BDRVQcowState *s = bs->opaque;
     int ret, csize, nb_csectors, sector_offset;
     uint64_t coffset;
+    uint8_t *in_buf, *out_buf;
+    unsigned gen;
+    QEMUIOVector local_qiov;
+    struct iovec iov;
 
     coffset = cluster_offset & s->cluster_offset_mask;
-    if (s->cluster_cache_offset != coffset) {
-        nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
-        sector_offset = coffset & 511;
-        csize = nb_csectors * 512 - sector_offset;
-        BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-        ret = bdrv_read(bs->file, coffset >> 9, s->cluster_data, nb_csectors);
-        if (ret < 0) {
-            return ret;
-        }
-        if (decompress_buffer(s->cluster_cache, s->cluster_size,
-                              s->cluster_data + sector_offset, csize) < 0) {
-            return -EIO;
-        }
+    if (s->cluster_cache_offset == coffset) {
+        qemu_iovec_from_buf(qiov, 0, s->cluster_cache + offset_in_cluster,
+                            qiov->size);
+        return 0;
+    }
+
+    nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
+    sector_offset = coffset & 511;
+    csize = nb_csectors * 512 - sector_offset;
+
+    in_buf = qemu_try_blockalign(bs->file, nb_csectors * 512);
+    out_buf = g_try_malloc(s->cluster_size);
+    if (in_buf == NULL || out_buf == NULL) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    iov.iov_base = in_buf;
+    iov.iov_len = nb_csectors * 512;
+    qemu_iovec_init_external(&local_qiov, &iov, 1);
+
+    gen = s->cluster_cache_gen;
+    qemu_co_mutex_unlock(&s->lock);
+
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_co_readv(bs->file, coffset >> 9, nb_csectors, &local_qiov);
+    if (ret >= 0) {
+        ret = qcow2_co_decompress(bs, out_buf, s->cluster_size,
+                                  in_buf + sector_offset, csize);
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    if (ret < 0) {
+        goto out;
+    }
+
+    qemu_iovec_from_buf(qiov, 0, out_buf + offset_in_cluster, qiov->size);
+
+    /* Don't cache data that a write may have freed in the meantime */
+    if (s->cluster_cache_gen == gen) {
+        uint8_t *old_cache = s->cluster_cache;
+
+        s->cluster_cache = out_buf;
         s->cluster_cache_offset = coffset;
+        out_buf = old_cache;
     }
-    return 0;
+    ret = 0;
+
+out:
+    qemu_vfree(in_buf);
+    g_free(out_buf);
+    return ret;
 }
 
 /*
  * This discards as many clusters of nb_clusters as possible at once (i.e.
- * all clusters in the same L2 table) and returns the number of discarded
+ * all clusters in the same L2 slice) and returns the number of discarded
  * clusters.
  */
 static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
@@ -1427,8 +1632,8 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
         return ret;
     }
 
-    /* Limit nb_clusters to one L2 table */
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    /* Limit nb_clusters to one L2 slice */
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
 
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_l2_entry;
@@ -1511,7 +1716,7 @@ int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
 
     s->cache_discards = true;
 
-    /* Each L2 table is handled by its own loop iteration */
+    /* Each L2 slice is handled by its own loop iteration */
     while (nb_clusters > 0) {
         ret = discard_single_l2(bs, offset, nb_clusters, type, full_discard);
         if (ret < 0) {
@@ -1532,7 +1737,7 @@ fail:
 
 /*
  * This zeroes as many clusters of nb_clusters as possible at once (i.e.
- * all clusters in the same L2 table) and returns the number of zeroed
+ * all clusters in the same L2 slice) and returns the number of zeroed
  * clusters.
  */
 static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
@@ -1549,8 +1754,8 @@ static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
         return ret;
     }
 
-    /* Limit nb_clusters to one L2 table */
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    /* Limit nb_clusters to one L2 slice */
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
 
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_offset;
@@ -1586,7 +1791,7 @@ int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors)
         return -ENOTSUP;
     }
 
-    /* Each L2 table is handled by its own loop iteration */
+    /* Each L2 slice is handled by its own loop iteration */
     nb_clusters = size_to_clusters(s, nb_sectors << BDRV_SECTOR_BITS);
 
     s->cache_discards = true;
@@ -1624,22 +1829,25 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
 {
     BDRVQcowState *s = bs->opaque;
     bool is_active_l1 = (l1_table == s->l1_table);
-    uint64_t *l2_table = NULL;
+    uint64_t *l2_slice = NULL;
+    unsigned int slice, slice_size2, n_slices;
     int ret;
     int i, j;
 
+    slice_size2 = s->l2_slice_size * sizeof(uint64_t);
+    n_slices = s->cluster_size / slice_size2;
+
     if (!is_active_l1) {
         /* inactive L2 tables require a buffer to be stored in when loading
          * them from disk */
-        l2_table = qemu_try_blockalign(bs->file, s->cluster_size);
-        if (l2_table == NULL) {
+        l2_slice = qemu_try_blockalign(bs->file, slice_size2);
+        if (l2_slice == NULL) {
             return -ENOMEM;
         }
     }
 
     for (i = 0; i < l1_size; i++) {
         uint64_t l2_offset = l1_table[i] & L1E_OFFSET_MASK;
-        bool l2_dirty = false;
         uint64_t l2_refcount;
 
         if (!l2_offset) {
@@ -1659,128 +1867,136 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
             goto fail;
         }
 
-        if (is_active_l1) {
-            /* get active L2 tables from cache */
-            ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
-                    (void **)&l2_table);
-        } else {
-            /* load inactive L2 tables from disk */
-            ret = bdrv_read(bs->file, l2_offset / BDRV_SECTOR_SIZE,
-                    (void *)l2_table, s->cluster_sectors);
-        }
-        if (ret < 0) {
-            goto fail;
-        }
-
         ret = qcow2_get_refcount(bs, l2_offset >> s->cluster_bits,
                                  &l2_refcount);
         if (ret < 0) {
             goto fail;
         }
 
-        for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
-            int64_t offset = l2_entry & L2E_OFFSET_MASK;
-            int cluster_type = qcow2_get_cluster_type(l2_entry);
-            bool preallocated = offset != 0;
+        for (slice = 0; slice < n_slices; slice++) {
+            uint64_t slice_offset = l2_offset + slice * slice_size2;
+            bool l2_dirty = false;
 
-            if (cluster_type != QCOW2_CLUSTER_ZERO) {
-                continue;
+            if (is_active_l1) {
+                /* get active L2 tables from cache */
+                ret = qcow2_cache_get(bs, s->l2_table_cache, slice_offset,
+                        (void **)&l2_slice);
+            } else {
+                /* load inactive L2 tables from disk */
+                ret = bdrv_read(bs->file, slice_offset / BDRV_SECTOR_SIZE,
+                        (void *)l2_slice, slice_size2 / BDRV_SECTOR_SIZE);
+            }
+            if (ret < 0) {
+                goto fail;
             }
 
-            if (!preallocated) {
-                if (!bs->backing_hd) {
-                    /* not backed; therefore we can simply deallocate the
-                     * cluster */
-                    l2_table[j] = 0;
-                    l2_dirty = true;
+            for (j = 0; j < s->l2_slice_size; j++) {
+                uint64_t l2_entry = be64_to_cpu(l2_slice[j]);
+                int64_t offset = l2_entry & L2E_OFFSET_MASK;
+                int cluster_type = qcow2_get_cluster_type(l2_entry);
+                bool preallocated = offset != 0;
+
+                if (cluster_type != QCOW2_CLUSTER_ZERO) {
                     continue;
                 }
 
-                offset = qcow2_alloc_clusters(bs, s->cluster_size);
-                if (offset < 0) {
-                    ret = offset;
-                    goto fail;
-                }
+                if (!preallocated) {
+                    if (!bs->backing_hd) {
+                        /* not backed; therefore we can simply deallocate the
+                         * cluster */
+                        l2_slice[j] = 0;
+                        l2_dirty = true;
+                        continue;
+                    }
 
-                if (l2_refcount > 1) {
-                    /* For shared L2 tables, set the refcount accordingly (it is
-                     * already 1 and needs to be l2_refcount) */
-                    ret = qcow2_update_cluster_refcount(bs,
-                            offset >> s->cluster_bits,
-                            refcount_diff(1, l2_refcount), false,
-                            QCOW2_DISCARD_OTHER);
-                    if (ret < 0) {
-                        qcow2_free_clusters(bs, offset, s->cluster_size,
-                                            QCOW2_DISCARD_OTHER);
+                    offset = qcow2_alloc_clusters(bs, s->cluster_size);
+                    if (offset < 0) {
+                        ret = offset;
                         goto fail;
                     }
+
+                    if (l2_refcount > 1) {
+                        /* For shared L2 tables, set the refcount accordingly
+                         * (it is already 1 and needs to be l2_refcount) */
+                        ret = qcow2_update_cluster_refcount(bs,
+                                offset >> s->cluster_bits,
+                                refcount_diff(1, l2_refcount), false,
+                                QCOW2_DISCARD_OTHER);
+                        if (ret < 0) {
+                            qcow2_free_clusters(bs, offset, s->cluster_size,
+                                                QCOW2_DISCARD_OTHER);
+                            goto fail;
+                        }
+                    }
                 }
-            }
 
-            if (offset_into_cluster(s, offset)) {
-                qcow2_signal_corruption(bs, true, -1, -1, "Data cluster offset "
-                                        "%#" PRIx64 " unaligned (L2 offset: %#"
-                                        PRIx64 ", L2 index: %#x)", offset,
-                                        l2_offset, j);
-                if (!preallocated) {
-                    qcow2_free_clusters(bs, offset, s->cluster_size,
-                                        QCOW2_DISCARD_ALWAYS);
+                if (offset_into_cluster(s, offset)) {
+                    qcow2_signal_corruption(bs, true, -1, -1, "Data cluster "
+                                            "offset %#" PRIx64 " unaligned "
+                                            "(L2 offset: %#" PRIx64 ", L2 "
+                                            "index: %#x)", offset, l2_offset,
+                                            slice * s->l2_slice_size + j);
+                    if (!preallocated) {
+                        qcow2_free_clusters(bs, offset, s->cluster_size,
+                                            QCOW2_DISCARD_ALWAYS);
+                    }
+                    ret = -EIO;
+                    goto fail;
                 }
-                ret = -EIO;
-                goto fail;
-            }
 
-            ret = qcow2_pre_write_overlap_check(bs, 0, offset, s->cluster_size);
-            if (ret < 0) {
-                if (!preallocated) {
-                    qcow2_free_clusters(bs, offset, s->cluster_size,
-                                        QCOW2_DISCARD_ALWAYS);
+                ret = qcow2_pre_write_overlap_check(bs, 0, offset,
+                                                    s->cluster_size);
+                if (ret < 0) {
+                    if (!preallocated) {
+                        qcow2_free_clusters(bs, offset, s->cluster_size,
+                                            QCOW2_DISCARD_ALWAYS);
+                    }
+                    goto fail;
                 }
-                goto fail;
-            }
 
-            ret = bdrv_write_zeroes(bs->file, offset / BDRV_SECTOR_SIZE,
-                                    s->cluster_sectors, 0);
-            if (ret < 0) {
-                if (!preallocated) {
-                    qcow2_free_clusters(bs, offset, s->cluster_size,
-                                        QCOW2_DISCARD_ALWAYS);
+                ret = bdrv_write_zeroes(bs->file, offset / BDRV_SECTOR_SIZE,
+                                        s->cluster_sectors, 0);
+                if (ret < 0) {
+                    if (!preallocated) {
+                        qcow2_free_clusters(bs, offset, s->cluster_size,
+                                            QCOW2_DISCARD_ALWAYS);
+                    }
+                    goto fail;
                 }
-                goto fail;
-            }
 
-            if (l2_refcount == 1) {
-                l2_table[j] = cpu_to_be64(offset | QCOW_OFLAG_COPIED);
-            } else {
-                l2_table[j] = cpu_to_be64(offset);
+                if (l2_refcount == 1) {
+                    l2_slice[j] = cpu_to_be64(offset | QCOW_OFLAG_COPIED);
+                } else {
+                    l2_slice[j] = cpu_to_be64(offset);
+                }
+                l2_dirty = true;
             }
-            l2_dirty = true;
-        }
 
-        if (is_active_l1) {
-            if (l2_dirty) {
-                qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
-                qcow2_cache_depends_on_flush(s->l2_table_cache);
-            }
-            ret = qcow2_cache_put(bs, s->l2_table_cache, (void **)&l2_table);
-            if (ret < 0) {
-                l2_table = NULL;
-                goto fail;
-            }
-        } else {
-            if (l2_dirty) {
-                ret = qcow2_pre_write_overlap_check(bs,
-                        QCOW2_OL_INACTIVE_L2 | QCOW2_OL_ACTIVE_L2, l2_offset,
-                        s->cluster_size);
+            if (is_active_l1) {
+                if (l2_dirty) {
+                    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+                    qcow2_cache_depends_on_flush(s->l2_table_cache);
+                }
+                ret = qcow2_cache_put(bs, s->l2_table_cache,
+                                      (void **)&l2_slice);
                 if (ret < 0) {
+                    l2_slice = NULL;
                     goto fail;
                 }
+            } else {
+                if (l2_dirty) {
+                    ret = qcow2_pre_write_overlap_check(bs,
+                            QCOW2_OL_INACTIVE_L2 | QCOW2_OL_ACTIVE_L2,
+                            slice_offset, slice_size2);
+                    if (ret < 0) {
+                        goto fail;
+                    }
 
-                ret = bdrv_write(bs->file, l2_offset / BDRV_SECTOR_SIZE,
-                        (void *)l2_table, s->cluster_sectors);
-                if (ret < 0) {
-                    goto fail;
+                    ret = bdrv_write(bs->file, slice_offset / BDRV_SECTOR_SIZE,
+                            (void *)l2_slice, slice_size2 / BDRV_SECTOR_SIZE);
+                    if (ret < 0) {
+                        goto fail;
+                    }
                 }
             }
         }
@@ -1794,15 +2010,15 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
     ret = 0;
 
 fail:
-    if (l2_table) {
+    if (l2_slice) {
         if (!is_active_l1) {
-            qemu_vfree(l2_table);
+            qemu_vfree(l2_slice);
         } else {
             if (ret < 0) {
-                qcow2_cache_put(bs, s->l2_table_cache, (void **)&l2_table);
+                qcow2_cache_put(bs, s->l2_table_cache, (void **)&l2_slice);
             } else {
                 ret = qcow2_cache_put(bs, s->l2_table_cache,
-                        (void **)&l2_table);
+                        (void **)&l2_slice);
             }
         }
     }
@@ -24,7 +24,6 @@
 #include "qemu-common.h"
 #include "block/block_int.h"
 #include "qemu/module.h"
-#include <zlib.h>
 #include "qemu/aes.h"
 #include "block/qcow2.h"
 #include "qemu/error-report.h"
@@ -462,11 +461,21 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_SIZE,
             .help = "Maximum L2 table cache size",
         },
+        {
+            .name = QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of each entry in the L2 cache",
+        },
         {
             .name = QCOW2_OPT_REFCOUNT_CACHE_SIZE,
             .type = QEMU_OPT_SIZE,
             .help = "Maximum refcount block cache size",
         },
+        {
+            .name = QCOW2_OPT_COMPRESS_WRITES,
+            .type = QEMU_OPT_BOOL,
+            .help = "Compress full cluster writes to unallocated clusters",
+        },
         { /* end of list */ }
     },
 };
@@ -550,7 +559,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     uint64_t l1_vm_state_index;
     const char *opt_overlap_check, *opt_overlap_check_template;
     int overlap_check_template = 0;
-    uint64_t l2_cache_size, refcount_cache_size;
+    uint64_t l2_cache_size, l2_cache_entry_size, refcount_cache_size;
 
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
@@ -809,7 +818,22 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
-    l2_cache_size /= s->cluster_size;
+    /* L2 cache entries may hold just a slice of an L2 table, so that a
+     * given amount of cache memory covers more scattered guest areas */
+    l2_cache_entry_size = qemu_opt_get_size(opts,
+                                            QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
+                                            s->cluster_size);
+    if (l2_cache_entry_size < BDRV_SECTOR_SIZE ||
+        l2_cache_entry_size > s->cluster_size ||
+        !is_power_of_2(l2_cache_entry_size)) {
+        error_setg(errp, "L2 cache entry size must be a power of two between "
+                   "512 and the cluster size (%d)", s->cluster_size);
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->l2_slice_size = l2_cache_entry_size / sizeof(uint64_t);
+
+    l2_cache_size /= l2_cache_entry_size;
     if (l2_cache_size < MIN_L2_CACHE_SIZE) {
         l2_cache_size = MIN_L2_CACHE_SIZE;
     }
@@ -830,8 +854,10 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     /* alloc L2 table/refcount block cache */
-    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_size);
-    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size);
+    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_size,
+                                           l2_cache_entry_size);
+    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size,
+                                                 s->cluster_size);
     if (s->l2_table_cache == NULL || s->refcount_block_cache == NULL) {
         error_setg(errp, "Could not allocate metadata caches");
         ret = -ENOMEM;
@@ -839,15 +865,6 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     s->cluster_cache = g_malloc(s->cluster_size);
-    /* one more sector for decompressed data alignment */
-    s->cluster_data = qemu_try_blockalign(bs->file, QCOW_MAX_CRYPT_CLUSTERS
-                                                    * s->cluster_size + 512);
-    if (s->cluster_data == NULL) {
-        error_setg(errp, "Could not allocate temporary cluster buffer");
-        ret = -ENOMEM;
-        goto fail;
-    }
-
     s->cluster_cache_offset = -1;
     s->flags = flags;
 
@@ -935,6 +952,15 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     s->discard_passthrough[QCOW2_DISCARD_OTHER] =
         qemu_opt_get_bool(opts, QCOW2_OPT_DISCARD_OTHER, false);
 
+    s->compress_writes = qemu_opt_get_bool(opts, QCOW2_OPT_COMPRESS_WRITES,
+                                           false);
+    if (s->compress_writes && s->crypt_method_header) {
+        error_setg(errp, "Compressed writes are not supported on encrypted "
+                   "images");
+        ret = -EINVAL;
+        goto fail;
+    }
+
     opt_overlap_check = qemu_opt_get(opts, QCOW2_OPT_OVERLAP);
     opt_overlap_check_template = qemu_opt_get(opts, QCOW2_OPT_OVERLAP_TEMPLATE);
     if (opt_overlap_check_template && opt_overlap_check &&
@@ -1009,7 +1035,6 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         qcow2_cache_destroy(bs, s->refcount_block_cache);
     }
     g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
     return ret;
 }
 
@@ -1205,15 +1230,11 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
             break;
 
         case QCOW2_CLUSTER_COMPRESSED:
-            /* add AIO support for compressed blocks ? */
-            ret = qcow2_decompress_cluster(bs, cluster_offset);
+            ret = qcow2_co_read_compressed(bs, cluster_offset,
+                                           index_in_cluster * 512, &hd_qiov);
             if (ret < 0) {
                 goto fail;
             }
-
-            qemu_iovec_from_buf(&hd_qiov, 0,
-                s->cluster_cache + index_in_cluster * 512,
-                512 * cur_nr_sectors);
             break;
 
         case QCOW2_CLUSTER_NORMAL:
@@ -1282,7 +1303,7 @@ fail:
     return ret;
 }
 
-static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
+static coroutine_fn int qcow2_co_do_writev(BlockDriverState *bs,
                            int64_t sector_num,
                            int remaining_sectors,
                            QEMUIOVector *qiov)
@@ -1303,6 +1324,7 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
     s->cluster_cache_offset = -1; /* disable compressed cache */
+    s->cluster_cache_gen++;
 
     qemu_co_mutex_lock(&s->lock);
 
@@ -1369,6 +1391,9 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
         ret = bdrv_co_writev(bs->file,
                              (cluster_offset >> 9) + index_in_cluster,
                              cur_nr_sectors, &hd_qiov);
+        if (l2meta != NULL) {
+            qcow2_alloc_cluster_data_written(l2meta, ret);
+        }
         qemu_co_mutex_lock(&s->lock);
         if (ret < 0) {
             goto fail;
@@ -1383,11 +1408,7 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
             }
 
             /* Take the request off the list of running requests */
-            if (l2meta->nb_clusters != 0) {
-                QLIST_REMOVE(l2meta, next_in_flight);
-            }
-
-            qemu_co_queue_restart_all(&l2meta->dependent_requests);
+            qcow2_alloc_cluster_done(l2meta, 0);
 
             next = l2meta->next;
             g_free(l2meta);
@@ -1407,10 +1428,7 @@ fail:
     while (l2meta != NULL) {
         QCowL2Meta *next;
 
-        if (l2meta->nb_clusters != 0) {
-            QLIST_REMOVE(l2meta, next_in_flight);
-        }
-        qemu_co_queue_restart_all(&l2meta->dependent_requests);
+        qcow2_alloc_cluster_done(l2meta, ret);
 
         next = l2meta->next;
         g_free(l2meta);
@@ -1458,7 +1476,6 @@ static void qcow2_close(BlockDriverState *bs)
     cleanup_unknown_header_ext(bs);
 
     g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
     qcow2_refcount_close(bs);
     qcow2_free_snapshots(bs);
 }
@@ -1741,20 +1758,24 @@ static int preallocate(BlockDriverState *bs)
         while (meta) {
             QCowL2Meta *next = meta->next;
 
-            ret = qcow2_alloc_cluster_link_l2(bs, meta);
+            if (ret >= 0) {
+                ret = qcow2_alloc_cluster_link_l2(bs, meta);
+            }
             if (ret < 0) {
                 qcow2_free_any_clusters(bs, meta->alloc_offset,
                                         meta->nb_clusters, QCOW2_DISCARD_NEVER);
-                return ret;
             }
 
-            /* There are no dependent requests, but we need to remove our
-             * request from the list of in-flight requests */
-            QLIST_REMOVE(meta, next_in_flight);
+            /* Take the request off the list of in-flight allocations and
+             * pass its result on to any writes that joined it */
+            qcow2_alloc_cluster_done(meta, ret);
 
             g_free(meta);
             meta = next;
         }
+        if (ret < 0) {
+            return ret;
+        }
 
         /* TODO Preallocate data if requested */
 
@@ -2188,95 +2209,179 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
 
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
-static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                                  const uint8_t *buf, int nb_sectors)
+/*
+ * Compress one cluster and write it to a newly allocated compressed cluster.
+ * Returns 0 on success, and 1 if the data does not compress or, with
+ * @unallocated_only, if the cluster was allocated since the caller looked it
+ * up; the caller must then write it normally.
+ */
+static coroutine_fn int qcow2_co_compress_cluster(BlockDriverState *bs,
+                                                  int64_t sector_num,
+                                                  int nb_sectors,
+                                                  QEMUIOVector *qiov,
+                                                  bool unallocated_only)
 {
     BDRVQcowState *s = bs->opaque;
-    z_stream strm;
-    int ret, out_len;
-    uint8_t *out_buf;
+    ssize_t ret, out_len;
+    uint8_t *buf = NULL, *out_buf = NULL;
     uint64_t cluster_offset;
 
-    if (nb_sectors == 0) {
-        /* align end of file to a sector boundary to ease reading with
-           sector based I/Os */
-        cluster_offset = bdrv_getlength(bs->file);
-        return bdrv_truncate(bs->file, cluster_offset);
+    buf = qemu_try_blockalign(bs, s->cluster_size);
+    out_buf = g_try_malloc(s->cluster_size);
+    if (buf == NULL || out_buf == NULL) {
+        ret = -ENOMEM;
+        goto fail;
     }
 
-    if (nb_sectors != s->cluster_sectors) {
-        ret = -EINVAL;
+    qemu_iovec_to_buf(qiov, 0, buf, qiov->size);
+    memset(buf + qiov->size, 0, s->cluster_size - qiov->size);
 
-        /* Zero-pad last write if image size is not cluster aligned */
-        if (sector_num + nb_sectors == bs->total_sectors &&
-            nb_sectors < s->cluster_sectors) {
-            uint8_t *pad_buf = qemu_blockalign(bs, s->cluster_size);
-            memset(pad_buf, 0, s->cluster_size);
-            memcpy(pad_buf, buf, nb_sectors * BDRV_SECTOR_SIZE);
-            ret = qcow2_write_compressed(bs, sector_num,
-                                         pad_buf, s->cluster_sectors);
-            qemu_vfree(pad_buf);
-        }
-        return ret;
+    /* Only worth it if the result is smaller than the cluster itself */
+    out_len = qcow2_co_compress(bs, out_buf, s->cluster_size - 1,
+                                buf, s->cluster_size);
+    if (out_len == -ENOSPC) {
+        ret = 1;
+        goto fail;
+    } else if (out_len < 0) {
+        ret = out_len;
+        goto fail;
     }
 
-    out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
+    qemu_co_mutex_lock(&s->lock);
+    if (unallocated_only) {
+        int num = nb_sectors;
 
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
+        ret = qcow2_get_cluster_offset(bs, sector_num << 9, &num,
+                                       &cluster_offset);
+        if (ret != QCOW2_CLUSTER_UNALLOCATED) {
+            qemu_co_mutex_unlock(&s->lock);
+            ret = ret < 0 ? ret : 1;
+            goto fail;
+        }
+    }
+    cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
+        sector_num << 9, out_len);
+    if (!cluster_offset) {
+        qemu_co_mutex_unlock(&s->lock);
+        ret = -EIO;
         goto fail;
     }
+    cluster_offset &= s->cluster_offset_mask;
 
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
+    ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len);
+    qemu_co_mutex_unlock(&s->lock);
+    if (ret < 0) {
+        goto fail;
+    }
 
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
+    BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
+    ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
+    if (ret < 0) {
         goto fail;
     }
-    out_len = strm.next_out - out_buf;
 
-    deflateEnd(&strm);
+    ret = 0;
+fail:
+    qemu_vfree(buf);
+    g_free(out_buf);
+    return ret;
+}
+
+/* XXX: put compressed sectors first, then all the cluster aligned
+   tables to avoid losing bytes in alignment */
+static coroutine_fn int qcow2_co_write_compressed(BlockDriverState *bs,
+                                                  int64_t sector_num,
+                                                  int nb_sectors,
+                                                  QEMUIOVector *qiov)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+    if (nb_sectors == 0) {
+        /* align end of file to a sector boundary to ease reading with
+           sector based I/Os */
+        return bdrv_truncate(bs->file, bdrv_getlength(bs->file));
+    }
+
+    /* Only the last write may be shorter, if the image size is not cluster
+     * aligned; it is zero-padded below */
+    if (nb_sectors != s->cluster_sectors &&
+        (sector_num + nb_sectors != bs->total_sectors ||
+         nb_sectors > s->cluster_sectors)) {
+        return -EINVAL;
+    }
+
+    ret = qcow2_co_compress_cluster(bs, sector_num, nb_sectors, qiov, false);
+    if (ret == 1) {
         /* could not compress: write normal cluster */
-        ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
-        if (ret < 0) {
-            goto fail;
+        ret = bdrv_co_writev(bs, sector_num, nb_sectors, qiov);
+    }
+    return ret;
+}
+
+/*
+ * With the compress-writes option, full clusters that are written for the
+ * first time are stored compressed.  Everything else, including clusters
+ * that don't compress, goes through the normal write path: compressed
+ * clusters can't be rewritten in place.
+ */
+static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
+                                        int64_t sector_num,
+                                        int remaining_sectors,
+                                        QEMUIOVector *qiov)
+{
+    BDRVQcowState *s = bs->opaque;
+    QEMUIOVector cluster_qiov;
+    uint64_t cluster_offset;
+    uint64_t bytes_done = 0;
+    int index_in_cluster;
+    int cur_nr_sectors;
+    int ret = 0;
+
+    if (!s->compress_writes) {
+        return qcow2_co_do_writev(bs, sector_num, remaining_sectors, qiov);
+    }
+
+    qemu_iovec_init(&cluster_qiov, qiov->niov);
+
+    while (remaining_sectors != 0) {
+        index_in_cluster = sector_num & (s->cluster_sectors - 1);
+        cur_nr_sectors = MIN(remaining_sectors,
+                             s->cluster_sectors - index_in_cluster);
+
+        qemu_iovec_reset(&cluster_qiov);
+        qemu_iovec_concat(&cluster_qiov, qiov, bytes_done,
+                          cur_nr_sectors * BDRV_SECTOR_SIZE);
+
+        ret = 1;
+        if (cur_nr_sectors == s->cluster_sectors) {
+            int num = cur_nr_sectors;
+
+            qemu_co_mutex_lock(&s->lock);
+            ret = qcow2_get_cluster_offset(bs, sector_num << 9, &num,
+                                           &cluster_offset);
+            qemu_co_mutex_unlock(&s->lock);
+            if (ret == QCOW2_CLUSTER_UNALLOCATED) {
+                ret = qcow2_co_compress_cluster(bs, sector_num, cur_nr_sectors,
+                                                &cluster_qiov, true);
+            } else if (ret >= 0) {
+                ret = 1;
+            }
         }
-    } else {
-        cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
-            sector_num << 9, out_len);
-        if (!cluster_offset) {
-            ret = -EIO;
-            goto fail;
+        if (ret == 1) {
+            ret = qcow2_co_do_writev(bs, sector_num, cur_nr_sectors,
+                                     &cluster_qiov);
         }
-        cluster_offset &= s->cluster_offset_mask;
-
-        ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len);
         if (ret < 0) {
-            goto fail;
+            break;
         }
 
-        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
-        ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
-        if (ret < 0) {
-            goto fail;
-        }
+        remaining_sectors -= cur_nr_sectors;
+        sector_num += cur_nr_sectors;
+        bytes_done += cur_nr_sectors * BDRV_SECTOR_SIZE;
     }
 
-    ret = 0;
-fail:
-    g_free(out_buf);
+    qemu_iovec_destroy(&cluster_qiov);
     return ret;
 }
 
@@ -2922,7 +3027,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_co_write_zeroes   = qcow2_co_write_zeroes,
     .bdrv_co_discard        = qcow2_co_discard,
     .bdrv_truncate          = qcow2_truncate,
-    .bdrv_write_compressed  = qcow2_write_compressed,
+    .bdrv_co_write_compressed = qcow2_co_write_compressed,
     .bdrv_make_empty        = qcow2_make_empty,
 
     .bdrv_snapshot_create   = qcow2_snapshot_create,
@@ -62,7 +62,8 @@
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
-#define MIN_L2_CACHE_SIZE 1 /* cluster */
+/* l2_allocate() holds the slices of the old and the new table at once */
+#define MIN_L2_CACHE_SIZE 2 /* entries */
 
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define MIN_REFCOUNT_CACHE_SIZE 4 /* clusters */
@@ -92,7 +93,9 @@
 #define QCOW2_OPT_OVERLAP_INACTIVE_L2 "overlap-check.inactive-l2"
 #define QCOW2_OPT_CACHE_SIZE "cache-size"
 #define QCOW2_OPT_L2_CACHE_SIZE "l2-cache-size"
+#define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
+#define QCOW2_OPT_COMPRESS_WRITES "compress-writes"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -224,6 +227,7 @@ typedef struct BDRVQcowState {
     int cluster_sectors;
     int l2_bits;
     int l2_size;
+    int l2_slice_size; /* L2 entries per L2 table cache entry */
     int l1_size;
     int l1_vm_state_index;
     int refcount_block_bits;
@@ -238,8 +242,9 @@ typedef struct BDRVQcowState {
     Qcow2Cache* refcount_block_cache;
 
     uint8_t *cluster_cache;
-    uint8_t *cluster_data;
     uint64_t cluster_cache_offset;
+    /* bumped whenever writes may have made cluster_cache stale */
+    unsigned cluster_cache_gen;
     QLIST_HEAD(QCowClusterAlloc, QCowL2Meta) cluster_allocs;
 
     uint64_t *refcount_table;
@@ -262,6 +267,7 @@ typedef struct BDRVQcowState {
     int flags;
     int qcow_version;
     bool use_lazy_refcounts;
+    bool compress_writes;
     int refcount_order;
     int refcount_bits;
     uint64_t refcount_max;
@@ -341,6 +347,34 @@ typedef struct QCowL2Meta
     struct QCowL2Meta *next;
 
     QLIST_ENTRY(QCowL2Meta) next_in_flight;
+
+    /**
+     * Set if this request writes into the COW area of another in-flight
+     * allocation instead of allocating clusters itself. It then has no
+     * clusters of its own and the other allocation links them.
+     */
+    bool joined;
+
+    /**
+     * For joined requests: the allocation owning the clusters while it is
+     * still in flight, and its result once it has completed.
+     */
+    struct QCowL2Meta *owner;
+    int owner_ret;
+    bool data_written;
+
+    /**
+     * For allocations: set once the COW has started, after which no more
+     * requests may join. Joined requests whose data hasn't been written yet
+     * are counted in nb_joined_writes; the first error of such a write is
+     * kept in joined_ret and fails the allocation.
+     */
+    bool linking;
+    int nb_joined_writes;
+    int joined_ret;
+    CoQueue joined_writes;
+    QLIST_HEAD(, QCowL2Meta) joiners;
+    QLIST_ENTRY(QCowL2Meta) next_joiner;
 } QCowL2Meta;
 
 enum {
@@ -421,6 +455,11 @@ static inline int offset_to_l2_index(BDRVQcowState *s, int64_t offset)
     return (offset >> s->cluster_bits) & (s->l2_size - 1);
 }
 
+static inline int offset_to_l2_slice_index(BDRVQcowState *s, int64_t offset)
+{
+    return (offset >> s->cluster_bits) & (s->l2_slice_size - 1);
+}
+
 static inline int64_t align_offset(int64_t offset, int n)
 {
     offset = (offset + n - 1) & ~(n - 1);
@@ -526,7 +565,10 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
                         bool exact_size);
 int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index);
 void qcow2_l2_cache_reset(BlockDriverState *bs);
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset);
+int coroutine_fn qcow2_co_read_compressed(BlockDriverState *bs,
+                                          uint64_t cluster_offset,
+                                          int offset_in_cluster,
+                                          QEMUIOVector *qiov);
 void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
                      uint8_t *out_buf, const uint8_t *in_buf,
                      int nb_sectors, int enc,
@@ -541,6 +583,8 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
                                          int compressed_size);
 
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m);
+void qcow2_alloc_cluster_data_written(QCowL2Meta *m, int ret);
+void qcow2_alloc_cluster_done(QCowL2Meta *m, int ret);
 int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
     int nb_sectors, enum qcow2_discard_type type, bool full_discard);
 int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors);
@@ -564,8 +608,17 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs,
 void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
 
+/* qcow2-threads.c functions */
+ssize_t coroutine_fn qcow2_co_compress(BlockDriverState *bs,
+                                       void *dest, size_t dest_size,
+                                       const void *src, size_t src_size);
+ssize_t coroutine_fn qcow2_co_decompress(BlockDriverState *bs,
+                                         void *dest, size_t dest_size,
+                                         const void *src, size_t src_size);
+
 /* qcow2-cache.c functions */
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               int table_size);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table);
@@ -178,6 +178,8 @@ typedef struct RawPosixAIOData {
 #define aio_ioctl_cmd   aio_nbytes /* for QEMU_AIO_IOCTL */
     off_t aio_offset;
     int aio_type;
+    int aio_fd2;        /* destination for QEMU_AIO_COPY_RANGE */
+    off_t aio_offset2;
 } RawPosixAIOData;
 
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
@@ -1186,6 +1188,42 @@ static ssize_t handle_aiocb_discard(RawPosixAIOData *aiocb)
     return ret;
 }
 
+static ssize_t handle_aiocb_copy_range(RawPosixAIOData *aiocb)
+{
+#ifdef CONFIG_COPY_FILE_RANGE
+    uint64_t bytes = aiocb->aio_nbytes;
+    off_t in_off = aiocb->aio_offset;
+    off_t out_off = aiocb->aio_offset2;
+    ssize_t ret;
+
+    while (bytes) {
+        ret = copy_file_range(aiocb->aio_fildes, &in_off,
+                              aiocb->aio_fd2, &out_off, bytes, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            /* different file systems, or files that the kernel can't copy
+             * between; the caller falls back to read and write */
+            if (errno == EXDEV || errno == EINVAL) {
+                return -ENOTSUP;
+            }
+            return translate_err(-errno);
+        }
+        if (ret == 0) {
+            /* end of the source file; the rest reads as zeroes, but the
+             * destination may hold other data there, so let the caller
+             * read and write the range instead */
+            return -ENOTSUP;
+        }
+        bytes -= ret;
+    }
+    return 0;
+#else
+    return -ENOTSUP;
+#endif
+}
+
 static int aio_worker(void *arg)
 {
     RawPosixAIOData *aiocb = arg;
@@ -1226,6 +1264,9 @@ static int aio_worker(void *arg)
     case QEMU_AIO_WRITE_ZEROES:
         ret = handle_aiocb_write_zeroes(aiocb);
         break;
+    case QEMU_AIO_COPY_RANGE:
+        ret = handle_aiocb_copy_range(aiocb);
+        break;
     default:
         fprintf(stderr, "invalid aio request (0x%x)\n", aiocb->aio_type);
         ret = -EINVAL;
@@ -1876,6 +1917,35 @@ static int coroutine_fn raw_co_write_zeroes(
     return -ENOTSUP;
 }
 
+static int coroutine_fn raw_co_copy_range(BlockDriverState *bs,
+                                          int64_t sector_num,
+                                          BlockDriverState *dst,
+                                          int64_t dst_sector_num,
+                                          int nb_sectors)
+{
+    BDRVRawState *s = bs->opaque;
+    BDRVRawState *d = dst->opaque;
+    RawPosixAIOData *acb;
+    ThreadPool *pool;
+
+    if (dst->drv != bs->drv) {
+        return -ENOTSUP;
+    }
+
+    acb = g_slice_new(RawPosixAIOData);
+    acb->bs = bs;
+    acb->aio_type = QEMU_AIO_COPY_RANGE;
+    acb->aio_fildes = s->fd;
+    acb->aio_offset = sector_num * BDRV_SECTOR_SIZE;
+    acb->aio_nbytes = nb_sectors * BDRV_SECTOR_SIZE;
+    acb->aio_fd2 = d->fd;
+    acb->aio_offset2 = dst_sector_num * BDRV_SECTOR_SIZE;
+
+    trace_paio_submit_co(sector_num, nb_sectors, QEMU_AIO_COPY_RANGE);
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    return thread_pool_submit_co(pool, aio_worker, acb);
+}
+
 static int raw_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
     BDRVRawState *s = bs->opaque;
@@ -1924,6 +1994,7 @@ BlockDriver bdrv_file = {
     .bdrv_has_zero_init = bdrv_has_zero_init_1,
     .bdrv_co_get_block_status = raw_co_get_block_status,
     .bdrv_co_write_zeroes = raw_co_write_zeroes,
+    .bdrv_co_copy_range = raw_co_copy_range,
 
     .bdrv_aio_readv = raw_aio_readv,
     .bdrv_aio_writev = raw_aio_writev,
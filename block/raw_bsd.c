@@ -128,6 +128,21 @@ static int coroutine_fn raw_co_write_zeroes(BlockDriverState *bs,
     return bdrv_co_write_zeroes(bs->file, sector_num, nb_sectors, flags);
 }
 
+static int coroutine_fn raw_co_copy_range(BlockDriverState *bs,
+                                          int64_t sector_num,
+                                          BlockDriverState *dst,
+                                          int64_t dst_sector_num,
+                                          int nb_sectors)
+{
+    /* Between two raw images, the protocols can copy directly.  Writes to
+     * the start of a probed image have to go through raw_co_writev. */
+    if (dst->drv != bs->drv || (dst->probed && dst_sector_num == 0)) {
+        return -ENOTSUP;
+    }
+    return bdrv_co_copy_range(bs->file, sector_num, dst->file, dst_sector_num,
+                              nb_sectors);
+}
+
 static int coroutine_fn raw_co_discard(BlockDriverState *bs,
                                        int64_t sector_num, int nb_sectors)
 {
@@ -256,6 +271,7 @@ BlockDriver bdrv_raw = {
     .bdrv_co_writev       = &raw_co_writev,
     .bdrv_co_write_zeroes = &raw_co_write_zeroes,
     .bdrv_co_discard      = &raw_co_discard,
+    .bdrv_co_copy_range   = &raw_co_copy_range,
     .bdrv_co_get_block_status = &raw_co_get_block_status,
     .bdrv_truncate        = &raw_truncate,
     .bdrv_getlength       = &raw_getlength,
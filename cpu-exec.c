@@ -27,6 +27,7 @@
 #include "exec/address-spaces.h"
 #include "exec/memory-internal.h"
 #include "qemu/rcu.h"
+#include "qemu/main-loop.h"
 
 /* -icount align implementation. */
 
@@ -127,6 +128,63 @@ static void init_delay_params(SyncClocks *sc, const CPUState *cpu)
 }
 #endif /* CONFIG USER ONLY */
 
+#if !defined(CONFIG_USER_ONLY)
+/* With multi-threaded TCG, translated code runs without the BQL.  It is
+   taken for interrupt and exception delivery, and dropped again on every
+   exit from the execution loop.  */
+static inline void cpu_exec_lock_iothread(void)
+{
+    if (qemu_tcg_mttcg_enabled()) {
+        qemu_mutex_lock_iothread();
+    }
+}
+
+static inline void cpu_exec_unlock_iothread(void)
+{
+    if (qemu_tcg_mttcg_enabled() && qemu_mutex_iothread_locked()) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+#else
+static inline void cpu_exec_lock_iothread(void)
+{
+}
+
+static inline void cpu_exec_unlock_iothread(void)
+{
+}
+#endif
+
+/* Guest atomic operations.  Targets without a host cmpxchg mapping wrap
+   their read-modify-write sequences in cpu_atomic_lock/unlock.  This does
+   not stop plain stores from other vCPUs, which is what guests expect of
+   a locked bus cycle anyway.  */
+static int atomic_lock;
+static __thread bool have_atomic_lock;
+
+void cpu_atomic_lock(void)
+{
+#if !defined(CONFIG_USER_ONLY)
+    if (!qemu_tcg_mttcg_enabled()) {
+        return;
+    }
+#endif
+    while (atomic_xchg(&atomic_lock, 1)) {
+        while (atomic_read(&atomic_lock)) {
+            g_thread_yield();
+        }
+    }
+    have_atomic_lock = true;
+}
+
+void cpu_atomic_unlock(void)
+{
+    if (have_atomic_lock) {
+        have_atomic_lock = false;
+        atomic_mb_set(&atomic_lock, 0);
+    }
+}
+
 void cpu_loop_exit(CPUState *cpu)
 {
     cpu->current_tb = NULL;
@@ -145,10 +203,24 @@ void cpu_resume_from_signal(CPUState *cpu, void *puc)
     siglongjmp(cpu->jmp_env, 1);
 }
 
+static void cpu_reload_memory_map_work(void *opaque)
+{
+    cpu_reload_memory_map(opaque);
+}
+
 void cpu_reload_memory_map(CPUState *cpu)
 {
     AddressSpaceDispatch *d;
 
+    if (qemu_tcg_mttcg_enabled() && cpu->created && !qemu_cpu_is_self(cpu)) {
+        /* cpu->memory_dispatch is only read by the vCPU thread itself,
+         * which holds the RCU read lock on the old one until it leaves
+         * cpu_exec().
+         */
+        async_run_on_cpu(cpu, cpu_reload_memory_map_work, cpu);
+        return;
+    }
+
     if (qemu_in_vcpu_thread()) {
         /* Do not let the guest prolong the critical section as much as it
          * as it desires.
@@ -253,60 +325,86 @@ static void cpu_exec_nocache(CPUArchState *env, int max_cycles,
     tb_free(tb);
 }
 
+typedef struct TBLookupDesc {
+    CPUArchState *env;
+    target_ulong pc;
+    target_ulong cs_base;
+    uint64_t flags;
+    tb_page_addr_t phys_page1;
+} TBLookupDesc;
+
+static bool tb_cmp(const void *p, const void *d)
+{
+    const TranslationBlock *tb = p;
+    const TBLookupDesc *desc = d;
+
+    if (tb->pc == desc->pc &&
+        tb->page_addr[0] == desc->phys_page1 &&
+        tb->cs_base == desc->cs_base &&
+        tb->flags == desc->flags &&
+        !(atomic_read(&tb->cflags) & CF_INVALID)) {
+        /* check next page if needed */
+        if (tb->page_addr[1] == -1) {
+            return true;
+        } else {
+            tb_page_addr_t phys_page2;
+            target_ulong virt_page2;
+
+            virt_page2 = (desc->pc & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
+            phys_page2 = get_page_addr_code(desc->env, virt_page2);
+            if (tb->page_addr[1] == phys_page2) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/* find translated block using physical mappings; lock-free, the caller
+   is within cpu_exec's RCU critical section */
+static TranslationBlock *tb_find_physical(CPUArchState *env,
+                                          target_ulong pc,
+                                          target_ulong cs_base,
+                                          uint64_t flags)
+{
+    TBLookupDesc desc;
+    tb_page_addr_t phys_pc;
+    uint32_t h;
+
+    desc.env = env;
+    desc.pc = pc;
+    desc.cs_base = cs_base;
+    desc.flags = flags;
+    phys_pc = get_page_addr_code(env, pc);
+    desc.phys_page1 = phys_pc & TARGET_PAGE_MASK;
+    h = tb_hash_func(phys_pc, pc, flags, cs_base);
+    return qht_lookup(&tcg_ctx.tb_ctx.htable, tb_cmp, &desc, h);
+}
+
 static TranslationBlock *tb_find_slow(CPUArchState *env,
                                       target_ulong pc,
                                       target_ulong cs_base,
                                       uint64_t flags)
 {
     CPUState *cpu = ENV_GET_CPU(env);
-    TranslationBlock *tb, **ptb1;
-    unsigned int h;
-    tb_page_addr_t phys_pc, phys_page1;
-    target_ulong virt_page2;
+    TranslationBlock *tb;
 
     tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
 
-    /* find translated block using physical mappings */
-    phys_pc = get_page_addr_code(env, pc);
-    phys_page1 = phys_pc & TARGET_PAGE_MASK;
-    h = tb_phys_hash_func(phys_pc);
-    ptb1 = &tcg_ctx.tb_ctx.tb_phys_hash[h];
-    for(;;) {
-        tb = *ptb1;
-        if (!tb)
-            goto not_found;
-        if (tb->pc == pc &&
-            tb->page_addr[0] == phys_page1 &&
-            tb->cs_base == cs_base &&
-            tb->flags == flags) {
-            /* check next page if needed */
-            if (tb->page_addr[1] != -1) {
-                tb_page_addr_t phys_page2;
-
-                virt_page2 = (pc & TARGET_PAGE_MASK) +
-                    TARGET_PAGE_SIZE;
-                phys_page2 = get_page_addr_code(env, virt_page2);
-                if (tb->page_addr[1] == phys_page2)
-                    goto found;
-            } else {
-                goto found;
-            }
+    tb = tb_find_physical(env, pc, cs_base, flags);
+    if (!tb) {
+        tb_lock();
+        /* another vCPU may have translated it meanwhile */
+        tb = tb_find_physical(env, pc, cs_base, flags);
+        if (!tb) {
+            /* if no translated code available, then translate it now */
+            tb = tb_gen_code(cpu, pc, cs_base, flags, 0);
         }
-        ptb1 = &tb->phys_hash_next;
-    }
- not_found:
-   /* if no translated code available, then translate it now */
-    tb = tb_gen_code(cpu, pc, cs_base, flags, 0);
-
- found:
-    /* Move the last found TB to the head of the list */
-    if (likely(*ptb1)) {
-        *ptb1 = tb->phys_hash_next;
-        tb->phys_hash_next = tcg_ctx.tb_ctx.tb_phys_hash[h];
-        tcg_ctx.tb_ctx.tb_phys_hash[h] = tb;
+        tb_unlock();
     }
+
     /* we add the TB in the virtual pc hash table */
-    cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
+    atomic_rcu_set(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)], tb);
     return tb;
 }
 
@@ -321,9 +419,9 @@ static inline TranslationBlock *tb_find_fast(CPUArchState *env)
        always be the same before a given translated block
        is executed. */
     cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
-    tb = cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    tb = atomic_rcu_read(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)]);
     if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
-                 tb->flags != flags)) {
+                 tb->flags != flags || (tb->cflags & CF_INVALID))) {
         tb = tb_find_slow(env, pc, cs_base, flags);
     }
     return tb;
@@ -361,9 +459,6 @@ int cpu_exec(CPUArchState *env)
     uintptr_t next_tb;
     SyncClocks sc;
 
-    /* This must be volatile so it is not trashed by longjmp() */
-    volatile bool have_tb_lock = false;
-
     if (cpu->halted) {
         if (!cpu_has_work(cpu)) {
             return EXCP_HALTED;
@@ -422,7 +517,9 @@ int cpu_exec(CPUArchState *env)
                     cpu->exception_index = -1;
                     break;
 #else
+                    cpu_exec_lock_iothread();
                     cc->do_interrupt(cpu);
+                    cpu_exec_unlock_iothread();
                     cpu->exception_index = -1;
 #endif
                 }
@@ -432,6 +529,7 @@ int cpu_exec(CPUArchState *env)
             for(;;) {
                 interrupt_request = cpu->interrupt_request;
                 if (unlikely(interrupt_request)) {
+                    cpu_exec_lock_iothread();
                     if (unlikely(cpu->singlestep_enabled & SSTEP_NOIRQ)) {
                         /* Mask out external interrupts for this step. */
                         interrupt_request &= ~CPU_INTERRUPT_SSTEP_MASK;
@@ -474,24 +572,14 @@ int cpu_exec(CPUArchState *env)
                            the program flow was changed */
                         next_tb = 0;
                     }
+                    cpu_exec_unlock_iothread();
                 }
                 if (unlikely(cpu->exit_request)) {
                     cpu->exit_request = 0;
                     cpu->exception_index = EXCP_INTERRUPT;
                     cpu_loop_exit(cpu);
                 }
-                spin_lock(&tcg_ctx.tb_ctx.tb_lock);
-                have_tb_lock = true;
                 tb = tb_find_fast(env);
-                /* Note: we do it here to avoid a gcc bug on Mac OS X when
-                   doing it in tb_find_slow */
-                if (tcg_ctx.tb_ctx.tb_invalidated_flag) {
-                    /* as some TB could have been invalidated because
-                       of memory exceptions while generating the code, we
-                       must recompute the hash index here */
-                    next_tb = 0;
-                    tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
-                }
                 if (qemu_loglevel_mask(CPU_LOG_EXEC)) {
                     qemu_log("Trace %p [" TARGET_FMT_lx "] %s\n",
                              tb->tc_ptr, tb->pc, lookup_symbol(tb->pc));
@@ -500,11 +588,23 @@ int cpu_exec(CPUArchState *env)
                    spans two pages, we cannot safely do a direct
                    jump. */
                 if (next_tb != 0 && tb->page_addr[1] == -1) {
-                    tb_add_jump((TranslationBlock *)(next_tb & ~TB_EXIT_MASK),
-                                next_tb & TB_EXIT_MASK, tb);
+                    TranslationBlock *last_tb;
+
+                    tb_lock();
+                    last_tb = (TranslationBlock *)(next_tb & ~TB_EXIT_MASK);
+                    /* Note: we do it here to avoid a gcc bug on Mac OS X
+                       when doing it in tb_find_slow */
+                    if (tcg_ctx.tb_ctx.tb_invalidated_flag) {
+                        /* as some TB could have been invalidated because
+                           of memory exceptions while generating the code,
+                           we must recompute the hash index here */
+                        next_tb = 0;
+                        tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
+                    } else if (!((tb->cflags | last_tb->cflags) & CF_INVALID)) {
+                        tb_add_jump(last_tb, next_tb & TB_EXIT_MASK, tb);
+                    }
+                    tb_unlock();
                 }
-                have_tb_lock = false;
-                spin_unlock(&tcg_ctx.tb_ctx.tb_lock);
 
                 /* cpu_interrupt might be called while translating the
                    TB, but before it is linked into a potentially
@@ -572,10 +672,9 @@ int cpu_exec(CPUArchState *env)
 #ifdef TARGET_I386
             x86_cpu = X86_CPU(cpu);
 #endif
-            if (have_tb_lock) {
-                spin_unlock(&tcg_ctx.tb_ctx.tb_lock);
-                have_tb_lock = false;
-            }
+            tb_lock_reset();
+            cpu_atomic_unlock();
+            cpu_exec_unlock_iothread();
         }
     } /* for(;;) */
 
@@ -32,6 +32,7 @@
 #include "sysemu/dma.h"
 #include "sysemu/kvm.h"
 #include "qmp-commands.h"
+#include "tcg.h"
 
 #include "qemu/thread.h"
 #include "sysemu/cpus.h"
@@ -39,6 +40,7 @@
 #include "qemu/main-loop.h"
 #include "qemu/bitmap.h"
 #include "qemu/seqlock.h"
+#include "qemu/rcu.h"
 #include "qapi-event.h"
 #include "hw/nmi.h"
 
@@ -541,6 +543,71 @@ void configure_icount(QemuOpts *opts, Error **errp)
                    get_ticks_per_sec() / 10);
 }
 
+void qemu_tcg_configure(QemuOpts *opts, Error **errp)
+{
+    const char *t, *cache;
+    uint64_t threshold;
+    Error *local_err = NULL;
+
+    cache = qemu_opt_get(opts, "cache");
+    if (cache) {
+        tb_cache_open(cache, &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            return;
+        }
+    }
+
+    /* Hot TBs count their executions through a pointer to themselves,
+       which keeps them out of the cache; superblocks must be asked for.  */
+    threshold = qemu_opt_get_number(opts, "superblock",
+                                    cache ? 0 : TB_SUPERBLOCK_THRESHOLD);
+    if (threshold > INT32_MAX) {
+        error_setg(errp, "superblock threshold too large");
+        return;
+    }
+    tcg_superblock_threshold = threshold;
+
+    t = qemu_opt_get(opts, "optimize");
+    if (!t || strcmp(t, "full") == 0) {
+        tcg_opt_redundancy = true;
+    } else if (strcmp(t, "basic") == 0) {
+        tcg_opt_redundancy = false;
+    } else {
+        error_setg(errp, "Invalid 'optimize' setting %s", t);
+        return;
+    }
+
+    t = qemu_opt_get(opts, "thread");
+    if (!t || strcmp(t, "single") == 0) {
+        mttcg_enabled = false;
+    } else if (strcmp(t, "multi") == 0) {
+        if (!tcg_enabled()) {
+            error_setg(errp, "thread=multi requires the TCG accelerator");
+            return;
+        }
+#if !defined(TARGET_SUPPORTS_MTTCG)
+        error_setg(errp, "multi-threaded TCG is not supported for this guest");
+        return;
+#elif !defined(TCG_TARGET_SUPPORTS_MTTCG)
+        error_setg(errp, "multi-threaded TCG is not supported on this host");
+        return;
+#elif TCG_TARGET_REG_BITS < TARGET_LONG_BITS
+        error_setg(errp, "multi-threaded TCG needs a 64-bit host "
+                   "for this guest");
+        return;
+#else
+        if (use_icount) {
+            error_setg(errp, "thread=multi is not compatible with -icount");
+            return;
+        }
+        mttcg_enabled = true;
+#endif
+    } else {
+        error_setg(errp, "Invalid 'thread' setting %s", t);
+    }
+}
+
 /***********************************************************/
 void hw_error(const char *fmt, ...)
 {
@@ -636,7 +703,9 @@ static void cpu_signal(int sig)
     if (current_cpu) {
         cpu_exit(current_cpu);
     }
-    exit_request = 1;
+    if (!qemu_tcg_mttcg_enabled()) {
+        exit_request = 1;
+    }
 }
 
 #ifdef CONFIG_LINUX
@@ -779,6 +848,7 @@ static void qemu_tcg_init_cpu_signals(void)
 static QemuMutex qemu_global_mutex;
 static QemuCond qemu_io_proceeded_cond;
 static unsigned iothread_requesting_mutex;
+static __thread bool iothread_locked;
 
 static QemuThread io_thread;
 
@@ -791,12 +861,21 @@ static QemuCond qemu_cpu_cond;
 static QemuCond qemu_pause_cond;
 static QemuCond qemu_work_cond;
 
+/* With multi-threaded TCG, work that must not race with any vCPU running
+ * translated code is queued here and run by the last vCPU thread to leave
+ * cpu_exec().  Protected by the BQL.
+ */
+static int tcg_running_cpus;
+static struct qemu_work_item *exclusive_work_first, *exclusive_work_last;
+static QemuCond qemu_exclusive_cond;
+
 void qemu_init_cpu_loop(void)
 {
     qemu_init_sigbus();
     qemu_cond_init(&qemu_cpu_cond);
     qemu_cond_init(&qemu_pause_cond);
     qemu_cond_init(&qemu_work_cond);
+    qemu_cond_init(&qemu_exclusive_cond);
     qemu_cond_init(&qemu_io_proceeded_cond);
     qemu_mutex_init(&qemu_global_mutex);
 
@@ -858,6 +937,45 @@ void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
     qemu_cpu_kick(cpu);
 }
 
+void async_run_exclusive(void (*func)(void *data), void *data)
+{
+    struct qemu_work_item *wi;
+    CPUState *cpu;
+
+    if (!qemu_tcg_mttcg_enabled() || tcg_running_cpus == 0) {
+        func(data);
+        return;
+    }
+
+    wi = g_malloc0(sizeof(struct qemu_work_item));
+    wi->func = func;
+    wi->data = data;
+    wi->free = true;
+    if (exclusive_work_first == NULL) {
+        exclusive_work_first = wi;
+    } else {
+        exclusive_work_last->next = wi;
+    }
+    exclusive_work_last = wi;
+
+    CPU_FOREACH(cpu) {
+        cpu_exit(cpu);
+    }
+}
+
+static void flush_exclusive_work(void)
+{
+    struct qemu_work_item *wi;
+
+    while ((wi = exclusive_work_first)) {
+        exclusive_work_first = wi->next;
+        wi->func(wi->data);
+        g_free(wi);
+    }
+    exclusive_work_last = NULL;
+    qemu_cond_broadcast(&qemu_exclusive_cond);
+}
+
 static void flush_queued_work(CPUState *cpu)
 {
     struct qemu_work_item *wi;
@@ -925,6 +1043,7 @@ static void *qemu_kvm_cpu_thread_fn(void *arg)
     int r;
 
     qemu_mutex_lock(&qemu_global_mutex);
+    iothread_locked = true;
     qemu_thread_get_self(cpu->thread);
     cpu->thread_id = qemu_get_thread_id();
     cpu->can_do_io = 1;
@@ -999,15 +1118,18 @@ static void *qemu_dummy_cpu_thread_fn(void *arg)
 }
 
 static void tcg_exec_all(void);
+static int tcg_cpu_exec(CPUArchState *env);
 
 static void *qemu_tcg_cpu_thread_fn(void *arg)
 {
     CPUState *cpu = arg;
 
+    rcu_register_thread();
     qemu_tcg_init_cpu_signals();
     qemu_thread_get_self(cpu->thread);
 
     qemu_mutex_lock(&qemu_global_mutex);
+    iothread_locked = true;
     CPU_FOREACH(cpu) {
         cpu->thread_id = qemu_get_thread_id();
         cpu->created = true;
@@ -1044,6 +1166,56 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
     return NULL;
 }
 
+/* Multi-threaded TCG: each vCPU thread runs translated code without the
+ * BQL, and only takes it for slow paths (translation, MMIO, interrupts).
+ */
+static void *qemu_tcg_mttcg_cpu_thread_fn(void *arg)
+{
+    CPUState *cpu = arg;
+    int r;
+
+    rcu_register_thread();
+    qemu_tcg_init_cpu_signals();
+    qemu_thread_get_self(cpu->thread);
+
+    qemu_mutex_lock(&qemu_global_mutex);
+    iothread_locked = true;
+    cpu->thread_id = qemu_get_thread_id();
+    cpu->created = true;
+    cpu->can_do_io = 1;
+    qemu_cond_signal(&qemu_cpu_cond);
+
+    while (1) {
+        while (exclusive_work_first) {
+            if (tcg_running_cpus == 0) {
+                flush_exclusive_work();
+            } else {
+                qemu_cond_wait(&qemu_exclusive_cond, &qemu_global_mutex);
+            }
+        }
+
+        if (cpu_can_run(cpu)) {
+            tcg_running_cpus++;
+            qemu_mutex_unlock_iothread();
+            r = tcg_cpu_exec(cpu->env_ptr);
+            qemu_mutex_lock_iothread();
+            if (--tcg_running_cpus == 0 && exclusive_work_first) {
+                flush_exclusive_work();
+            }
+            if (r == EXCP_DEBUG) {
+                cpu_handle_guest_debug(cpu);
+            }
+        }
+
+        while (cpu_thread_is_idle(cpu)) {
+            qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+        }
+        qemu_wait_io_event_common(cpu);
+    }
+
+    return NULL;
+}
+
 static void qemu_cpu_kick_thread(CPUState *cpu)
 {
 #ifndef _WIN32
@@ -1086,7 +1258,9 @@ static void qemu_cpu_kick_thread(CPUState *cpu)
 void qemu_cpu_kick(CPUState *cpu)
 {
     qemu_cond_broadcast(cpu->halt_cond);
-    if (!tcg_enabled() && !cpu->thread_kicked) {
+    if (qemu_tcg_mttcg_enabled()) {
+        cpu_exit(cpu);
+    } else if (!tcg_enabled() && !cpu->thread_kicked) {
         qemu_cpu_kick_thread(cpu);
         cpu->thread_kicked = true;
     }
@@ -1119,7 +1293,7 @@ bool qemu_in_vcpu_thread(void)
 void qemu_mutex_lock_iothread(void)
 {
     atomic_inc(&iothread_requesting_mutex);
-    if (!tcg_enabled() || !first_cpu) {
+    if (!tcg_enabled() || qemu_tcg_mttcg_enabled() || !first_cpu) {
         qemu_mutex_lock(&qemu_global_mutex);
         atomic_dec(&iothread_requesting_mutex);
     } else {
@@ -1130,13 +1304,30 @@ void qemu_mutex_lock_iothread(void)
         atomic_dec(&iothread_requesting_mutex);
         qemu_cond_broadcast(&qemu_io_proceeded_cond);
     }
+    iothread_locked = true;
 }
 
 void qemu_mutex_unlock_iothread(void)
 {
+    iothread_locked = false;
     qemu_mutex_unlock(&qemu_global_mutex);
 }
 
+bool qemu_mutex_iothread_locked(void)
+{
+    return iothread_locked;
+}
+
+bool qemu_tcg_lock_iothread(void)
+{
+    if (!qemu_tcg_mttcg_enabled() || iothread_locked ||
+        !qemu_in_vcpu_thread()) {
+        return false;
+    }
+    qemu_mutex_lock_iothread();
+    return true;
+}
+
 static int all_vcpus_paused(void)
 {
     CPUState *cpu;
@@ -1162,7 +1353,7 @@ void pause_all_vcpus(void)
 
     if (qemu_in_vcpu_thread()) {
         cpu_stop_current();
-        if (!kvm_enabled()) {
+        if (!kvm_enabled() && !qemu_tcg_mttcg_enabled()) {
             CPU_FOREACH(cpu) {
                 cpu->stop = false;
                 cpu->stopped = true;
@@ -1205,6 +1396,24 @@ static void qemu_tcg_init_vcpu(CPUState *cpu)
 
     tcg_cpu_address_space_init(cpu, cpu->as);
 
+    if (qemu_tcg_mttcg_enabled()) {
+        cpu->thread = g_malloc0(sizeof(QemuThread));
+        cpu->halt_cond = g_malloc0(sizeof(QemuCond));
+        qemu_cond_init(cpu->halt_cond);
+        snprintf(thread_name, VCPU_THREAD_NAME_SIZE, "CPU %d/TCG",
+                 cpu->cpu_index);
+        qemu_thread_create(cpu->thread, thread_name,
+                           qemu_tcg_mttcg_cpu_thread_fn,
+                           cpu, QEMU_THREAD_JOINABLE);
+#ifdef _WIN32
+        cpu->hThread = qemu_thread_get_handle(cpu->thread);
+#endif
+        while (!cpu->created) {
+            qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        }
+        return;
+    }
+
     /* share a single thread for all cpus with TCG */
     if (!tcg_cpu_thread) {
         cpu->thread = g_malloc0(sizeof(QemuThread));
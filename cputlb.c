@@ -29,6 +29,8 @@
 #include "exec/memory-internal.h"
 #include "exec/ram_addr.h"
 #include "tcg/tcg.h"
+#include "qemu/main-loop.h"
+#include "qemu/timer.h"
 
 //#define DEBUG_TLB
 //#define DEBUG_TLB_CHECK
@@ -36,6 +38,185 @@
 /* statistics */
 int tlb_flush_count;
 
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+#if defined(TARGET_VIRT_ADDR_SPACE_BITS)
+#define CPU_TLB_DYN_MAX_BITS \
+    MIN(22, TARGET_VIRT_ADDR_SPACE_BITS - TARGET_PAGE_BITS)
+#else
+#define CPU_TLB_DYN_MAX_BITS 22
+#endif
+
+/* A TLB is only shrunk if it stayed underused for this long */
+#define TLB_RESIZE_WINDOW_NS (100 * 1000 * 1000)
+
+typedef struct CPUTLBDesc {
+    CPUTLBEntry *table;
+    hwaddr *iotlb;
+    size_t n_entries;
+    /* entries filled since the last flush */
+    size_t n_used_entries;
+    /* valid entries replaced by another page since the last flush */
+    size_t n_evictions;
+    /* largest n_used_entries at a flush in the current window */
+    size_t window_max_entries;
+    int64_t window_begin_ns;
+    /* entries were filled since the table was last reset.  Unlike
+     * n_used_entries this stays set across tlb_flush_page(), because a
+     * victim TLB hit can move an entry back into the table. */
+    bool dirty;
+} CPUTLBDesc;
+
+static void tlb_mmu_alloc(CPUTLBDesc *desc, size_t n_entries)
+{
+    g_free(desc->table);
+    g_free(desc->iotlb);
+    desc->n_entries = n_entries;
+    desc->table = g_new(CPUTLBEntry, n_entries);
+    desc->iotlb = g_new(hwaddr, n_entries);
+}
+
+void tlb_init(CPUState *cpu)
+{
+    CPUArchState *env = cpu->env_ptr;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int mmu_idx;
+
+    cpu->tlb_desc = g_new0(CPUTLBDesc, NB_MMU_MODES);
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        CPUTLBDesc *desc = &cpu->tlb_desc[mmu_idx];
+
+        tlb_mmu_alloc(desc, 1 << CPU_TLB_DYN_DEFAULT_BITS);
+        desc->window_begin_ns = now;
+        memset(desc->table, -1, desc->n_entries * sizeof(CPUTLBEntry));
+        env->tlb_table[mmu_idx] = desc->table;
+        env->iotlb[mmu_idx] = desc->iotlb;
+        env->tlb_mask[mmu_idx] = (desc->n_entries - 1) << CPU_TLB_ENTRY_BITS;
+    }
+}
+
+/* Pick a new size for the TLB of one MMU index when it is flushed.
+ *
+ * The TLB is grown if more than 70% of it was in use, or if more pages
+ * were evicted by conflicting ones than it has entries: either way the
+ * working set did not fit.  It is shrunk if its use stayed below 30% for a
+ * whole TLB_RESIZE_WINDOW_NS, to the smallest size that holds the largest
+ * working set seen in the window without growing again; the window keeps
+ * a burst of flushes, e.g. from address space switches, from shrinking a
+ * TLB that is about to be refilled.
+ */
+static size_t tlb_mmu_resize(CPUTLBDesc *desc, int64_t now)
+{
+    size_t old_size = desc->n_entries;
+    size_t new_size = old_size;
+    bool window_expired = now > desc->window_begin_ns + TLB_RESIZE_WINDOW_NS;
+    size_t rate;
+
+    if (desc->n_used_entries > desc->window_max_entries) {
+        desc->window_max_entries = desc->n_used_entries;
+    }
+    rate = desc->window_max_entries * 100 / old_size;
+
+    if (rate > 70 || desc->n_evictions > old_size) {
+        new_size = MIN(old_size << 1, (size_t)1 << CPU_TLB_DYN_MAX_BITS);
+    } else if (rate < 30 && window_expired) {
+        size_t ceil = pow2ceil(desc->window_max_entries);
+
+        if (desc->window_max_entries * 100 / ceil > 70) {
+            ceil <<= 1;
+        }
+        new_size = MAX(ceil, (size_t)1 << CPU_TLB_DYN_MIN_BITS);
+    }
+
+    if (new_size != old_size || window_expired) {
+        desc->window_begin_ns = now;
+        desc->window_max_entries = 0;
+    }
+    return new_size;
+}
+
+static void tlb_mmu_flush(CPUState *cpu, int mmu_idx, int64_t now)
+{
+    CPUArchState *env = cpu->env_ptr;
+    CPUTLBDesc *desc = &cpu->tlb_desc[mmu_idx];
+    size_t new_size = tlb_mmu_resize(desc, now);
+    bool locked = false;
+
+    if (new_size != desc->n_entries) {
+        /* cpu_tlb_reset_dirty_all walks the tables of all vCPUs under the
+         * BQL, so the new table is published and reset before it is
+         * dropped */
+        locked = qemu_tcg_lock_iothread();
+        tlb_mmu_alloc(desc, new_size);
+        desc->dirty = true;
+    }
+    /* Always reload: a target's reset may have cleared these */
+    env->tlb_table[mmu_idx] = desc->table;
+    env->iotlb[mmu_idx] = desc->iotlb;
+    env->tlb_mask[mmu_idx] = (new_size - 1) << CPU_TLB_ENTRY_BITS;
+    /* A table of up to 4M entries that nothing was put in since it was
+     * last reset, e.g. that of an MMU mode the guest doesn't use, needs
+     * no resetting */
+    if (desc->dirty) {
+        memset(desc->table, -1, new_size * sizeof(CPUTLBEntry));
+        desc->dirty = false;
+    }
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+    desc->n_used_entries = 0;
+    desc->n_evictions = 0;
+}
+
+static inline bool tlb_entry_is_empty(const CPUTLBEntry *te)
+{
+    return te->addr_read == -1 && te->addr_write == -1 &&
+           te->addr_code == -1;
+}
+#else
+void tlb_init(CPUState *cpu)
+{
+}
+#endif
+
+/* With multi-threaded TCG a vCPU's TLB may only be changed by its own
+ * thread.  Flushes requested by other threads are queued as work items,
+ * which the vCPU runs once it leaves cpu_exec().
+ */
+static bool tlb_flush_is_remote(CPUState *cpu)
+{
+    return qemu_tcg_mttcg_enabled() && cpu->created &&
+           !qemu_cpu_is_self(cpu);
+}
+
+static void tlb_flush_async_work(void *opaque)
+{
+    tlb_flush(opaque, 1);
+}
+
+typedef struct TLBFlushPageWork {
+    CPUState *cpu;
+    target_ulong addr;
+} TLBFlushPageWork;
+
+static void tlb_flush_page_async_work(void *opaque)
+{
+    TLBFlushPageWork *work = opaque;
+
+    tlb_flush_page(work->cpu, work->addr);
+    g_free(work);
+}
+
+static void tlb_queue_flush(CPUState *cpu, void (*func)(void *data),
+                            void *data)
+{
+    bool locked = qemu_tcg_lock_iothread();
+
+    async_run_on_cpu(cpu, func, data);
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
 /* NOTE:
  * If flush_global is true (the usual case), flush all tlb entries.
  * If flush_global is false, flush (at least) all tlb entries not
@@ -52,6 +233,11 @@ void tlb_flush(CPUState *cpu, int flush_global)
 {
     CPUArchState *env = cpu->env_ptr;
 
+    if (tlb_flush_is_remote(cpu)) {
+        tlb_queue_flush(cpu, tlb_flush_async_work, cpu);
+        return;
+    }
+
 #if defined(DEBUG_TLB)
     printf("tlb_flush:\n");
 #endif
@@ -59,7 +245,18 @@ void tlb_flush(CPUState *cpu, int flush_global)
        links while we are modifying them */
     cpu->current_tb = NULL;
 
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+    {
+        int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        int mmu_idx;
+
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            tlb_mmu_flush(cpu, mmu_idx, now);
+        }
+    }
+#else
     memset(env->tlb_table, -1, sizeof(env->tlb_table));
+#endif
     memset(env->tlb_v_table, -1, sizeof(env->tlb_v_table));
     memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
 
@@ -69,7 +266,7 @@ void tlb_flush(CPUState *cpu, int flush_global)
     tlb_flush_count++;
 }
 
-static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
+static inline bool tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
 {
     if (addr == (tlb_entry->addr_read &
                  (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
@@ -78,7 +275,9 @@ static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
         addr == (tlb_entry->addr_code &
                  (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
         memset(tlb_entry, -1, sizeof(*tlb_entry));
+        return true;
     }
+    return false;
 }
 
 void tlb_flush_page(CPUState *cpu, target_ulong addr)
@@ -87,6 +286,15 @@ void tlb_flush_page(CPUState *cpu, target_ulong addr)
     int i;
     int mmu_idx;
 
+    if (tlb_flush_is_remote(cpu)) {
+        TLBFlushPageWork *work = g_new(TLBFlushPageWork, 1);
+
+        work->cpu = cpu;
+        work->addr = addr;
+        tlb_queue_flush(cpu, tlb_flush_page_async_work, work);
+        return;
+    }
+
 #if defined(DEBUG_TLB)
     printf("tlb_flush_page: " TARGET_FMT_lx "\n", addr);
 #endif
@@ -105,9 +313,17 @@ void tlb_flush_page(CPUState *cpu, target_ulong addr)
     cpu->current_tb = NULL;
 
     addr &= TARGET_PAGE_MASK;
-    i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
+        i = tlb_index(env, mmu_idx, addr);
+        if (tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr)) {
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+            CPUTLBDesc *desc = &cpu->tlb_desc[mmu_idx];
+
+            if (desc->n_used_entries) {
+                desc->n_used_entries--;
+            }
+#endif
+        }
     }
 
     /* check whether there are entries that need to be flushed in the vtlb */
@@ -137,20 +353,28 @@ void tlb_unprotect_code_phys(CPUState *cpu, ram_addr_t ram_addr,
     cpu_physical_memory_set_dirty_flag(ram_addr, DIRTY_MEMORY_CODE);
 }
 
-static bool tlb_is_dirty_ram(CPUTLBEntry *tlbe)
+static bool tlb_is_dirty_ram(target_ulong addr_write)
 {
-    return (tlbe->addr_write & (TLB_INVALID_MASK|TLB_MMIO|TLB_NOTDIRTY)) == 0;
+    return (addr_write & (TLB_INVALID_MASK|TLB_MMIO|TLB_NOTDIRTY)) == 0;
 }
 
+/* With multi-threaded TCG this runs on entries of other vCPUs, which may
+ * be refilling them concurrently.  Only the TLB_NOTDIRTY flag is set, and
+ * only if the entry still maps the page that was checked; if the vCPU
+ * replaced it meanwhile, tlb_set_page() read the dirty bitmap itself.
+ */
 void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry, uintptr_t start,
                            uintptr_t length)
 {
+    target_ulong addr_write = atomic_read(&tlb_entry->addr_write);
     uintptr_t addr;
 
-    if (tlb_is_dirty_ram(tlb_entry)) {
-        addr = (tlb_entry->addr_write & TARGET_PAGE_MASK) + tlb_entry->addend;
+    if (tlb_is_dirty_ram(addr_write)) {
+        addr = (addr_write & TARGET_PAGE_MASK) +
+               atomic_read(&tlb_entry->addend);
         if ((addr - start) < length) {
-            tlb_entry->addr_write |= TLB_NOTDIRTY;
+            atomic_cmpxchg(&tlb_entry->addr_write, addr_write,
+                           addr_write | TLB_NOTDIRTY);
         }
     }
 }
@@ -176,9 +400,9 @@ void cpu_tlb_reset_dirty_all(ram_addr_t start1, ram_addr_t length)
 
         env = cpu->env_ptr;
         for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-            unsigned int i;
+            size_t i, n = tlb_n_entries(env, mmu_idx);
 
-            for (i = 0; i < CPU_TLB_SIZE; i++) {
+            for (i = 0; i < n; i++) {
                 tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
                                       start1, length);
             }
@@ -193,9 +417,7 @@ void cpu_tlb_reset_dirty_all(ram_addr_t start1, ram_addr_t length)
 
 static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
 {
-    if (tlb_entry->addr_write == (vaddr | TLB_NOTDIRTY)) {
-        tlb_entry->addr_write = vaddr;
-    }
+    atomic_cmpxchg(&tlb_entry->addr_write, vaddr | TLB_NOTDIRTY, vaddr);
 }
 
 /* update the TLB corresponding to virtual page vaddr
@@ -206,8 +428,8 @@ void tlb_set_dirty(CPUArchState *env, target_ulong vaddr)
     int mmu_idx;
 
     vaddr &= TARGET_PAGE_MASK;
-    i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        i = tlb_index(env, mmu_idx, vaddr);
         tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
     }
 
@@ -293,9 +515,18 @@ void tlb_set_page(CPUState *cpu, target_ulong vaddr,
     iotlb = memory_region_section_get_iotlb(cpu, section, vaddr, paddr, xlat,
                                             prot, &address);
 
-    index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    index = tlb_index(env, mmu_idx, vaddr);
     te = &env->tlb_table[mmu_idx][index];
 
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+    if (tlb_entry_is_empty(te)) {
+        cpu->tlb_desc[mmu_idx].n_used_entries++;
+    } else {
+        cpu->tlb_desc[mmu_idx].n_evictions++;
+    }
+    cpu->tlb_desc[mmu_idx].dirty = true;
+#endif
+
     /* do not discard the translation in te, evict it into a victim tlb */
     env->tlb_v_table[mmu_idx][vidx] = *te;
     env->iotlb_v[mmu_idx][vidx] = env->iotlb[mmu_idx][index];
@@ -331,6 +562,24 @@ void tlb_set_page(CPUState *cpu, target_ulong vaddr,
     }
 }
 
+/* tlb_fill() for the softmmu helpers, timed for the TCG profile */
+void tcg_tlb_fill(CPUState *cpu, target_ulong addr, int is_write,
+                  int mmu_idx, uintptr_t retaddr)
+{
+    int64_t ti;
+
+    if (likely(!tcg_profiling)) {
+        tlb_fill(cpu, addr, is_write, mmu_idx, retaddr);
+        return;
+    }
+    atomic_inc(&tb_profile.tlb_fill_count);
+    ti = get_clock();
+    tlb_fill(cpu, addr, is_write, mmu_idx, retaddr);
+    /* not reached if the fill raised a guest exception */
+    atomic_add(&tb_profile.tlb_fill_ns, get_clock() - ti);
+    atomic_inc(&tb_profile.tlb_fill_done);
+}
+
 /* NOTE: this function can trigger an exception */
 /* NOTE2: the returned address is not exactly the physical address: it
  * is actually a ram_addr_t (in system mode; the user mode emulation
@@ -343,11 +592,12 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
     MemoryRegion *mr;
     CPUState *cpu = ENV_GET_CPU(env1);
 
-    page_index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     mmu_idx = cpu_mmu_index(env1);
+    page_index = tlb_index(env1, mmu_idx, addr);
     if (unlikely(env1->tlb_table[mmu_idx][page_index].addr_code !=
                  (addr & TARGET_PAGE_MASK))) {
         cpu_ldub_code(env1, addr);
+        page_index = tlb_index(env1, mmu_idx, addr);
     }
     pd = env1->iotlb[mmu_idx][page_index] & ~TARGET_PAGE_MASK;
     mr = iotlb_to_region(cpu, pd);
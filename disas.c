@@ -195,15 +195,16 @@ static int print_insn_od_target(bfd_vma pc, disassemble_info *info)
            bit 16 indicates little endian.
     other targets - unused
  */
-void target_disas(FILE *out, CPUArchState *env, target_ulong code,
-                  target_ulong size, int flags)
+static void do_target_disas(FILE *out, fprintf_function out_fprintf,
+                            CPUArchState *env, target_ulong code,
+                            target_ulong size, int flags)
 {
     target_ulong pc;
     int count;
     CPUDebug s;
     int (*print_insn)(bfd_vma pc, disassemble_info *info) = NULL;
 
-    INIT_DISASSEMBLE_INFO(s.info, out, fprintf);
+    INIT_DISASSEMBLE_INFO(s.info, out, out_fprintf);
 
     s.env = env;
     s.info.read_memory_func = target_read_memory;
@@ -307,33 +308,61 @@ void target_disas(FILE *out, CPUArchState *env, target_ulong code,
     }
 
     for (pc = code; size > 0; pc += count, size -= count) {
-	fprintf(out, "0x" TARGET_FMT_lx ":  ", pc);
+	out_fprintf(out, "0x" TARGET_FMT_lx ":  ", pc);
 	count = print_insn(pc, &s.info);
 #if 0
         {
             int i;
             uint8_t b;
-            fprintf(out, " {");
+            out_fprintf(out, " {");
             for(i = 0; i < count; i++) {
                 target_read_memory(pc + i, &b, 1, &s.info);
-                fprintf(out, " %02x", b);
+                out_fprintf(out, " %02x", b);
             }
-            fprintf(out, " }");
+            out_fprintf(out, " }");
         }
 #endif
-	fprintf(out, "\n");
+	out_fprintf(out, "\n");
 	if (count < 0)
 	    break;
         if (size < count) {
-            fprintf(out,
-                    "Disassembler disagrees with translator over instruction "
-                    "decoding\n"
-                    "Please report this to qemu-devel@nongnu.org\n");
+            out_fprintf(out,
+                        "Disassembler disagrees with translator over "
+                        "instruction decoding\n"
+                        "Please report this to qemu-devel@nongnu.org\n");
             break;
         }
     }
 }
 
+void target_disas(FILE *out, CPUArchState *env, target_ulong code,
+                  target_ulong size, int flags)
+{
+    do_target_disas(out, fprintf, env, code, size, flags);
+}
+
+static int GCC_FMT_ATTR(2, 3)
+gstring_fprintf(FILE *stream, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    g_string_append_vprintf((GString *)stream, fmt, ap);
+    va_end(ap);
+    return 0;
+}
+
+/* Like target_disas, but return the text as a string to be freed with
+   g_free().  */
+char *target_disas_str(CPUArchState *env, target_ulong code,
+                       target_ulong size, int flags)
+{
+    GString *str = g_string_new("");
+
+    do_target_disas((FILE *)str, gstring_fprintf, env, code, size, flags);
+    return g_string_free(str, false);
+}
+
 /* Disassemble this for me please... (debugging). */
 void disas(FILE *out, void *code, unsigned long size)
 {
@@ -55,6 +55,7 @@
 #include "exec/ram_addr.h"
 
 #include "qemu/range.h"
+#include "qemu/main-loop.h"
 
 //#define DEBUG_SUBPAGE
 
@@ -92,6 +93,8 @@ struct CPUTailQ cpus = QTAILQ_HEAD_INITIALIZER(cpus);
 /* current CPU in the current thread. It is only valid inside
    cpu_exec() */
 DEFINE_TLS(CPUState *, current_cpu);
+/* One thread per vCPU, see qemu_tcg_configure() */
+bool mttcg_enabled;
 /* 0 = Do not count executed instructions.
    1 = Precise instruction counting.
    2 = Adaptive rate instruction counting.  */
@@ -551,6 +554,7 @@ void cpu_exec_init(CPUArchState *env)
 #ifndef CONFIG_USER_ONLY
     cpu->as = &address_space_memory;
     cpu->thread_id = qemu_get_thread_id();
+    tlb_init(cpu);
     cpu_reload_memory_map(cpu);
 #endif
     QTAILQ_INSERT_TAIL(&cpus, cpu, node);
@@ -774,8 +778,7 @@ void cpu_single_step(CPUState *cpu, int enabled)
         } else {
             /* must flush all the translated code to avoid inconsistencies */
             /* XXX: only flush what is necessary */
-            CPUArchState *env = cpu->env_ptr;
-            tb_flush(env);
+            tb_flush_async(cpu->env_ptr);
         }
     }
 }
@@ -2270,8 +2273,13 @@ static void invalidate_and_set_dirty(hwaddr addr,
                                      hwaddr length)
 {
     if (cpu_physical_memory_range_includes_clean(addr, length)) {
+        bool locked = qemu_tcg_lock_iothread();
+
         tb_invalidate_phys_range(addr, addr + length, 0);
         cpu_physical_memory_set_dirty_range_nocode(addr, length);
+        if (locked) {
+            qemu_mutex_unlock_iothread();
+        }
     }
     xen_modified_memory(addr, length);
 }
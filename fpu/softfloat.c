@@ -88,6 +88,9 @@ this code that are retained.
 
 /* We only need stdlib for abort() */
 #include <stdlib.h>
+/* and math.h/float.h for the host FPU fast path */
+#include <math.h>
+#include <float.h>
 
 /*----------------------------------------------------------------------------
 | Primitive arithmetic functions, including multi-word arithmetic, and
@@ -2153,6 +2156,157 @@ static float32 subFloat32Sigs(float32 a, float32 b, flag zSign,
 
 }
 
+/*----------------------------------------------------------------------------
+| Host FPU fast path.
+|
+| Addition, subtraction, multiplication, division and square root of single
+| and double precision values are done with the host FPU whenever its result
+| is bound to be the one softfloat would compute: the rounding mode is round
+| to nearest even (the host's, which QEMU never changes), the inexact flag is
+| already set so we need not find out whether the result is exact, and the
+| inputs are zero or normal.  An infinite result raises overflow.  Results
+| that may be tiny, and everything else, take the softfloat path, which deals
+| with NaNs, infinities, denormals, underflow and flushing to zero.
+*----------------------------------------------------------------------------*/
+
+#if defined(__FLT_EVAL_METHOD__) && __FLT_EVAL_METHOD__ == 0
+#define USE_HARDFLOAT 1
+#else
+/* Host arithmetic with excess precision (x87) would round twice */
+#define USE_HARDFLOAT 0
+#endif
+
+enum {
+    hardfloat_add,
+    hardfloat_sub,
+    hardfloat_mul,
+    hardfloat_div,
+    hardfloat_sqrt,
+};
+
+typedef union {
+    float32 s;
+    float h;
+} union_float32;
+
+typedef union {
+    float64 s;
+    double h;
+} union_float64;
+
+static inline bool can_use_hardfloat(float_status *status)
+{
+    return USE_HARDFLOAT
+        && status->float_rounding_mode == float_round_nearest_even
+        && (status->float_exception_flags & float_flag_inexact);
+}
+
+static inline bool float32_is_zero_or_normal(float32 a)
+{
+    int_fast16_t aExp = extractFloat32Exp(a);
+
+    return aExp != 0xFF && (aExp != 0 || extractFloat32Frac(a) == 0);
+}
+
+static inline bool float64_is_zero_or_normal(float64 a)
+{
+    int_fast16_t aExp = extractFloat64Exp(a);
+
+    return aExp != 0x7FF && (aExp != 0 || extractFloat64Frac(a) == 0);
+}
+
+/* Compute `a' op `b' (or the square root of `a') into `*r' with the host FPU.
+   Returns false if the softfloat implementation must be used instead.  */
+static inline bool float32_hardfloat(int op, float32 a, float32 b,
+                                     float32 *r, float_status *status)
+{
+    union_float32 ua, ub, ur;
+
+    if (!can_use_hardfloat(status)
+        || !float32_is_zero_or_normal(a) || !float32_is_zero_or_normal(b)) {
+        return false;
+    }
+    ua.s = a;
+    ub.s = b;
+    switch (op) {
+    case hardfloat_add:
+        ur.h = ua.h + ub.h;
+        break;
+    case hardfloat_sub:
+        ur.h = ua.h - ub.h;
+        break;
+    case hardfloat_mul:
+        ur.h = ua.h * ub.h;
+        break;
+    case hardfloat_div:
+        if (float32_is_zero(b)) {
+            return false;
+        }
+        ur.h = ua.h / ub.h;
+        break;
+    case hardfloat_sqrt:
+        if (float32_is_neg(a)) {
+            return false;
+        }
+        ur.h = sqrtf(ua.h);
+        break;
+    default:
+        abort();
+    }
+    if (isinf(ur.h)) {
+        float_raise(float_flag_overflow, status);
+    } else if (fabsf(ur.h) <= FLT_MIN) {
+        return false;
+    }
+    *r = ur.s;
+    return true;
+}
+
+static inline bool float64_hardfloat(int op, float64 a, float64 b,
+                                     float64 *r, float_status *status)
+{
+    union_float64 ua, ub, ur;
+
+    if (!can_use_hardfloat(status)
+        || !float64_is_zero_or_normal(a) || !float64_is_zero_or_normal(b)) {
+        return false;
+    }
+    ua.s = a;
+    ub.s = b;
+    switch (op) {
+    case hardfloat_add:
+        ur.h = ua.h + ub.h;
+        break;
+    case hardfloat_sub:
+        ur.h = ua.h - ub.h;
+        break;
+    case hardfloat_mul:
+        ur.h = ua.h * ub.h;
+        break;
+    case hardfloat_div:
+        if (float64_is_zero(b)) {
+            return false;
+        }
+        ur.h = ua.h / ub.h;
+        break;
+    case hardfloat_sqrt:
+        if (float64_is_neg(a)) {
+            return false;
+        }
+        ur.h = sqrt(ua.h);
+        break;
+    default:
+        abort();
+    }
+    if (isinf(ur.h)) {
+        float_raise(float_flag_overflow, status);
+    } else if (fabs(ur.h) <= DBL_MIN) {
+        return false;
+    }
+    *r = ur.s;
+    return true;
+}
+
 /*----------------------------------------------------------------------------
 | Returns the result of adding the single-precision floating-point values `a'
 | and `b'.  The operation is performed according to the IEC/IEEE Standard for
@@ -2162,6 +2316,12 @@ static float32 subFloat32Sigs(float32 a, float32 b, flag zSign,
 float32 float32_add(float32 a, float32 b, float_status *status)
 {
     flag aSign, bSign;
+    float32 r;
+
+    if (float32_hardfloat(hardfloat_add, a, b, &r, status)) {
+        return r;
+    }
+
     a = float32_squash_input_denormal(a, status);
     b = float32_squash_input_denormal(b, status);
 
@@ -2185,6 +2345,12 @@ float32 float32_add(float32 a, float32 b, float_status *status)
 float32 float32_sub(float32 a, float32 b, float_status *status)
 {
     flag aSign, bSign;
+    float32 r;
+
+    if (float32_hardfloat(hardfloat_sub, a, b, &r, status)) {
+        return r;
+    }
+
     a = float32_squash_input_denormal(a, status);
     b = float32_squash_input_denormal(b, status);
 
@@ -2212,6 +2378,11 @@ float32 float32_mul(float32 a, float32 b, float_status *status)
     uint32_t aSig, bSig;
     uint64_t zSig64;
     uint32_t zSig;
+    float32 r;
+
+    if (float32_hardfloat(hardfloat_mul, a, b, &r, status)) {
+        return r;
+    }
 
     a = float32_squash_input_denormal(a, status);
     b = float32_squash_input_denormal(b, status);
@@ -2275,6 +2446,12 @@ float32 float32_div(float32 a, float32 b, float_status *status)
     flag aSign, bSign, zSign;
     int_fast16_t aExp, bExp, zExp;
     uint32_t aSig, bSig, zSig;
+    float32 r;
+
+    if (float32_hardfloat(hardfloat_div, a, b, &r, status)) {
+        return r;
+    }
+
     a = float32_squash_input_denormal(a, status);
     b = float32_squash_input_denormal(b, status);
 
@@ -2674,6 +2851,12 @@ float32 float32_sqrt(float32 a, float_status *status)
     int_fast16_t aExp, zExp;
     uint32_t aSig, zSig;
     uint64_t rem, term;
+    float32 r;
+
+    if (float32_hardfloat(hardfloat_sqrt, a, a, &r, status)) {
+        return r;
+    }
+
     a = float32_squash_input_denormal(a, status);
 
     aSig = extractFloat32Frac( a );
@@ -3948,6 +4131,12 @@ static float64 subFloat64Sigs(float64 a, float64 b, flag zSign,
 float64 float64_add(float64 a, float64 b, float_status *status)
 {
     flag aSign, bSign;
+    float64 r;
+
+    if (float64_hardfloat(hardfloat_add, a, b, &r, status)) {
+        return r;
+    }
+
     a = float64_squash_input_denormal(a, status);
     b = float64_squash_input_denormal(b, status);
 
@@ -3971,6 +4160,12 @@ float64 float64_add(float64 a, float64 b, float_status *status)
 float64 float64_sub(float64 a, float64 b, float_status *status)
 {
     flag aSign, bSign;
+    float64 r;
+
+    if (float64_hardfloat(hardfloat_sub, a, b, &r, status)) {
+        return r;
+    }
+
     a = float64_squash_input_denormal(a, status);
     b = float64_squash_input_denormal(b, status);
 
@@ -3996,6 +4191,11 @@ float64 float64_mul(float64 a, float64 b, float_status *status)
     flag aSign, bSign, zSign;
     int_fast16_t aExp, bExp, zExp;
     uint64_t aSig, bSig, zSig0, zSig1;
+    float64 r;
+
+    if (float64_hardfloat(hardfloat_mul, a, b, &r, status)) {
+        return r;
+    }
 
     a = float64_squash_input_denormal(a, status);
     b = float64_squash_input_denormal(b, status);
@@ -4061,6 +4261,12 @@ float64 float64_div(float64 a, float64 b, float_status *status)
     uint64_t aSig, bSig, zSig;
     uint64_t rem0, rem1;
     uint64_t term0, term1;
+    float64 r;
+
+    if (float64_hardfloat(hardfloat_div, a, b, &r, status)) {
+        return r;
+    }
+
     a = float64_squash_input_denormal(a, status);
     b = float64_squash_input_denormal(b, status);
 
@@ -4473,6 +4679,12 @@ float64 float64_sqrt(float64 a, float_status *status)
     int_fast16_t aExp, zExp;
     uint64_t aSig, zSig, doubleZSig;
     uint64_t rem0, rem1, term0, term1;
+    float64 r;
+
+    if (float64_hardfloat(hardfloat_sqrt, a, a, &r, status)) {
+        return r;
+    }
+
     a = float64_squash_input_denormal(a, status);
 
     aSig = extractFloat64Frac( a );
@@ -373,6 +373,21 @@ STEXI
 @findex singlestep
 Run the emulation in single step mode.
 If called with option off, the emulation returns to normal mode.
+ETEXI
+
+    {
+        .name       = "tcg_profile",
+        .args_type  = "enable:b",
+        .params     = "on|off",
+        .help       = "start or stop the TCG profiler",
+        .mhandler.cmd = hmp_tcg_profile,
+    },
+
+STEXI
+@item tcg_profile on|off
+@findex tcg_profile
+Start or stop the TCG profiler; see @code{info tcg-profile}.  Starting it
+resets the counters.  The translated code is discarded either way.
 ETEXI
 
     {
@@ -1762,6 +1777,10 @@ show roms
 show the TPM device
 @item info memory-devices
 show the memory devices
+@item info seki
+show the performance counters of pcie-seki devices
+@item info tcg-profile [@var{n}]
+show the TCG profile with the @var{n} most executed blocks (default 10)
 @end table
 ETEXI
 
@@ -1866,3 +1866,142 @@ void hmp_info_memory_devices(Monitor *mon, const QDict *qdict)
 
     qapi_free_MemoryDeviceInfoList(info_list);
 }
+
+/* Print the non-empty buckets of a log2 histogram, see SekiQueueInfo */
+static void hmp_info_seki_hist(Monitor *mon, const char *name,
+                               intList *hist)
+{
+    int i;
+
+    monitor_printf(mon, "    %s:", name);
+    for (i = 0; hist; hist = hist->next, i++) {
+        if (!hist->value) {
+            continue;
+        }
+        if (i == 0) {
+            monitor_printf(mon, " 0:");
+        } else if (!hist->next) {
+            monitor_printf(mon, " %" PRIu64 "+:", (uint64_t)1 << (i - 1));
+        } else if (i == 1) {
+            monitor_printf(mon, " 1:");
+        } else {
+            monitor_printf(mon, " %" PRIu64 "-%" PRIu64 ":",
+                           (uint64_t)1 << (i - 1), ((uint64_t)1 << i) - 1);
+        }
+        monitor_printf(mon, "%" PRId64, hist->value);
+    }
+    monitor_printf(mon, "\n");
+}
+
+void hmp_info_seki(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+    SekiInfoList *info_list = qmp_query_seki(&err);
+    SekiInfoList *info;
+    SekiQueueInfoList *q;
+
+    if (err) {
+        hmp_handle_error(mon, &err);
+        return;
+    }
+
+    for (info = info_list; info; info = info->next) {
+        SekiInfo *s = info->value;
+
+        monitor_printf(mon, "%s: %s, card %" PRId64 ", blas %s, %" PRId64
+                       " compute threads\n", s->has_id ? s->id : "(no id)",
+                       s->path, s->card_id, s->blas, s->compute_threads);
+        monitor_printf(mon, "  bytes in: %" PRId64 ", bytes out: %" PRId64
+                       ", bytes p2p: %" PRId64 "\n", s->bytes_in,
+                       s->bytes_out, s->bytes_p2p);
+        monitor_printf(mon, "  commands completed: %" PRId64
+                       ", failed: %" PRId64 "\n",
+                       s->commands_completed, s->commands_failed);
+        monitor_printf(mon, "  compute time: %" PRId64 " us, max %" PRId64
+                       " us", s->compute_time / 1000,
+                       s->compute_time_max / 1000);
+        if (s->compute_time) {
+            monitor_printf(mon, ", %.2f GFLOPS",
+                           (double)s->flops / s->compute_time);
+        }
+        monitor_printf(mon, "\n");
+        hmp_info_seki_hist(mon, "compute time histogram (us)",
+                           s->compute_time_histogram);
+
+        for (q = s->queues; q; q = q->next) {
+            monitor_printf(mon, "  queue %" PRId64 ": size %" PRId64
+                           ", outstanding %" PRId64 "\n", q->value->id,
+                           q->value->size, q->value->outstanding);
+            hmp_info_seki_hist(mon, "depth histogram",
+                               q->value->depth_histogram);
+        }
+    }
+
+    qapi_free_SekiInfoList(info_list);
+}
+
+void hmp_tcg_profile(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_tcg_profile(qdict_get_bool(qdict, "enable"), &err);
+    hmp_handle_error(mon, &err);
+}
+
+void hmp_info_tcg_profile(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+    TcgProfileInfo *info;
+    TcgProfileBlockList *b;
+    TcgProfileHelperList *h;
+    char **lines;
+    int i;
+
+    info = qmp_query_tcg_profile(qdict_haskey(qdict, "blocks"),
+                                 qdict_get_try_int(qdict, "blocks", 10),
+                                 &err);
+    if (err) {
+        hmp_handle_error(mon, &err);
+        return;
+    }
+
+    monitor_printf(mon, "TCG profiler %s\n",
+                   info->enabled ? "running" : "stopped");
+    monitor_printf(mon, "translations: %" PRId64 " in %" PRId64 " us\n",
+                   info->translations, info->translation_time / 1000);
+    monitor_printf(mon, "TLB fills: %" PRId64 " (%" PRId64 " faulted), %"
+                   PRId64 " us in those that did not fault\n",
+                   info->tlb_fills, info->tlb_fill_faults,
+                   info->tlb_fill_time / 1000);
+    monitor_printf(mon, "state restores: %" PRId64 " in %" PRId64 " us\n",
+                   info->restores, info->restore_time / 1000);
+
+    if (info->blocks) {
+        monitor_printf(mon, "most executed blocks:\n");
+    }
+    for (b = info->blocks; b; b = b->next) {
+        monitor_printf(mon, "  0x%" PRIx64 ": %" PRId64 " executions, %"
+                       PRId64 " guest bytes, %" PRId64 " host bytes, "
+                       "translated in %" PRId64 " us\n", b->value->pc,
+                       b->value->exec_count, b->value->size,
+                       b->value->host_size,
+                       b->value->translation_time / 1000);
+        lines = g_strsplit(b->value->disassembly, "\n", -1);
+        for (i = 0; lines[i]; i++) {
+            if (*lines[i]) {
+                monitor_printf(mon, "    %s\n", lines[i]);
+            }
+        }
+        g_strfreev(lines);
+    }
+
+    if (info->helpers) {
+        monitor_printf(mon, "helper calls:\n");
+    }
+    for (h = info->helpers; h; h = h->next) {
+        monitor_printf(mon, "  %s: %" PRId64 "\n", h->value->name,
+                       h->value->calls);
+    }
+
+    qapi_free_TcgProfileInfo(info);
+}
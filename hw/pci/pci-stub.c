@@ -29,6 +29,12 @@ PciInfoList *qmp_query_pci(Error **errp)
     return NULL;
 }
 
+SekiInfoList *qmp_query_seki(Error **errp)
+{
+    error_set(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
 static void pci_error_message(Monitor *mon)
 {
     monitor_printf(mon, "PCI devices not supported\n");
@@ -19,6 +19,10 @@
  */
 
 #include "hw/pci/msi.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qmp-commands.h"
+#include "trace.h"
 
 #include "pcie_seki.h"
 
@@ -30,7 +34,20 @@ static int pcie_seki_init(PCIDevice *dev)
 
     pcie_port_init_reg(dev);
 
-    pcie_seki_setup_mmio(dev, seki);
+    if (seki->num_queues < 1 || seki->num_queues > SEKI_MAX_QUEUES) {
+        error_report("pcie-seki: '" SEKI_QUEUES_PROP "' must be between 1 "
+                     "and %d", SEKI_MAX_QUEUES);
+        return -EINVAL;
+    }
+
+    rv = pcie_seki_compute_init(seki);
+    if (rv < 0) {
+        return rv;
+    }
+
+    rv = pcie_seki_setup_mmio(dev, seki);
+    if (rv < 0)
+        goto err;
 
     rv = msi_init(dev, 0x70, 0x01,
                   PCI_MSI_FLAGS_64BIT & PCI_MSI_FLAGS_64BIT,
@@ -60,6 +77,9 @@ static int pcie_seki_init(PCIDevice *dev)
     if (rv < 0)
         goto err_cap;
 
+    pcie_seki_queue_init(seki);
+    pcie_seki_dma_init(seki);
+
     return 0;
 
     // Errors:
@@ -68,11 +88,19 @@ err_cap:
 err_msi:
     msi_uninit(dev);
 err:
+    pcie_seki_free_mmio(seki);
+    pcie_seki_compute_exit(seki);
     return rv;
 }
 
 static void pcie_seki_uninit(PCIDevice *dev)
 {
+    PCIESekiDeviceState *seki = PCIE_SEKI_DEV(dev);
+
+    pcie_seki_dma_exit(seki);
+    pcie_seki_queue_exit(seki);
+    pcie_seki_free_mmio(seki);
+    pcie_seki_compute_exit(seki);
     pcie_aer_exit(dev);
     pcie_cap_exit(dev);
     msi_uninit(dev);
@@ -83,31 +111,219 @@ static void pcie_seki_uninit(PCIDevice *dev)
 static void pcie_seki_reset(DeviceState *qdev)
 {
     PCIDevice *dev = PCI_DEVICE(qdev);
+    PCIESekiDeviceState *seki = PCIE_SEKI_DEV(dev);
 
     pcie_cap_deverr_reset(dev);
+    pcie_seki_queue_reset(seki);
+    pcie_seki_dma_reset(seki);
 }
 
 static void pcie_seki_write_config(PCIDevice *dev,
                                    uint32_t address, uint32_t val, int len)
 {
-//    fprintf(stderr, "CW: Addr: %x, Val: %x, Len: %x\n", address, val, len);
+    trace_pcie_seki_config_write(dev, address, val, len);
     pci_default_write_config(dev, address, val, len);
     pcie_cap_flr_write_config(dev, address, val, len);
     pcie_aer_write_config(dev, address, val, len);
 }
 
+// Migration
+//
+// The input and output BARs are RAM and migrate through the iterative RAM
+// path.  The device section carries the registers and the queues,
+// including the commands in flight, see seki_vm_state_change().
+const VMStateDescription vmstate_seki_gemm_regs = {
+    .name = "pcie-seki/gemm",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(flags, SekiGemmRegs),
+        VMSTATE_UINT32(m, SekiGemmRegs),
+        VMSTATE_UINT32(n, SekiGemmRegs),
+        VMSTATE_UINT32(k, SekiGemmRegs),
+        VMSTATE_UINT32(lda, SekiGemmRegs),
+        VMSTATE_UINT32(ldb, SekiGemmRegs),
+        VMSTATE_UINT32(ldc, SekiGemmRegs),
+        VMSTATE_UINT32(a_offset, SekiGemmRegs),
+        VMSTATE_UINT32(b_offset, SekiGemmRegs),
+        VMSTATE_UINT32(c_offset, SekiGemmRegs),
+        VMSTATE_UINT64(alpha, SekiGemmRegs),
+        VMSTATE_UINT64(beta, SekiGemmRegs),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_seki_copy_regs = {
+    .name = "pcie-seki/copy",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(peer, SekiCopyRegs),
+        VMSTATE_UINT64(src_offset, SekiCopyRegs),
+        VMSTATE_UINT64(dst_offset, SekiCopyRegs),
+        VMSTATE_UINT64(len, SekiCopyRegs),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+// The DGEMM registers are always sent, as they were before copies existed
+static bool seki_request_is_copy(void *opaque, int version_id)
+{
+    SekiRequest *req = opaque;
+
+    return req->cmd.opcode == SEKI_CMD_COPY;
+}
+
+static const VMStateDescription vmstate_seki_request = {
+    .name = "pcie-seki/request",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(cmd.opcode, SekiRequest),
+        VMSTATE_UINT32(cmd.cid, SekiRequest),
+        VMSTATE_STRUCT(cmd.gemm, SekiRequest, 1, vmstate_seki_gemm_regs,
+                       SekiGemmRegs),
+        VMSTATE_STRUCT_TEST(cmd.copy, SekiRequest, seki_request_is_copy, 1,
+                            vmstate_seki_copy_regs, SekiCopyRegs),
+        VMSTATE_UINT16(status, SekiRequest),
+        VMSTATE_BOOL(legacy, SekiRequest),
+        VMSTATE_BOOL(done, SekiRequest),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+// At most a full ring of commands plus one from the doorbell register
+static bool seki_queue_saved_valid(void *opaque, int version_id)
+{
+    SekiQueue *q = opaque;
+
+    return q->nr_saved >= 0 && q->nr_saved <= SEKI_MAX_QUEUE_SIZE + 1;
+}
+
+static const VMStateDescription vmstate_seki_queue = {
+    .name = "pcie-seki/queue",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_save = pcie_seki_queue_pre_save,
+    .post_load = pcie_seki_queue_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT64(sq_base, SekiQueue),
+        VMSTATE_UINT64(cq_base, SekiQueue),
+        VMSTATE_UINT32(size, SekiQueue),
+        VMSTATE_UINT32(sq_head, SekiQueue),
+        VMSTATE_UINT32(sq_tail, SekiQueue),
+        VMSTATE_UINT32(cq_head, SekiQueue),
+        VMSTATE_UINT32(cq_tail, SekiQueue),
+        VMSTATE_BOOL(cq_phase, SekiQueue),
+        VMSTATE_UINT32(outstanding, SekiQueue),
+        VMSTATE_INT32(nr_saved, SekiQueue),
+        VMSTATE_VALIDATE("saved requests in range", seki_queue_saved_valid),
+        VMSTATE_STRUCT_VARRAY_ALLOC(saved, SekiQueue, nr_saved, 1,
+                                    vmstate_seki_request, SekiRequest),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static int pcie_seki_post_load(void *opaque, int version_id)
+{
+    PCIESekiDeviceState *seki = opaque;
+
+    if (version_id < 2) {
+        return 0;
+    }
+
+    if (seki->dma_ring_size ? seki->dma_head >= seki->dma_ring_size
+                            : seki->dma_head != 0) {
+        return -EINVAL;
+    }
+    if (seki->status & SEKI_STATUS_DMA_BUSY) {
+        pcie_seki_dma_kick(seki);
+    }
+
+    // Deliver the completions that were pending on the source
+    qemu_bh_schedule(seki->irq_bh);
+    return 0;
+}
+
 static const VMStateDescription vmstate_pcie_seki = {
     .name = "pcie-seki",
-    .version_id = 1,
+    .version_id = 2,
     .minimum_version_id = 1,
+    .post_load = pcie_seki_post_load,
     .fields = (VMStateField[]) {
         VMSTATE_PCIE_DEVICE(parent_obj.parent_obj, PCIEPort),
         VMSTATE_STRUCT(parent_obj.parent_obj.exp.aer_log, PCIEPort, 0,
                        vmstate_pcie_aer_log, PCIEAERLog),
+        VMSTATE_UINT32_V(status, PCIESekiDeviceState, 2),
+        VMSTATE_STRUCT(regs, PCIESekiDeviceState, 2, vmstate_seki_gemm_regs,
+                       SekiGemmRegs),
+        VMSTATE_UINT64_V(dma_ring, PCIESekiDeviceState, 2),
+        VMSTATE_UINT32_V(dma_ring_size, PCIESekiDeviceState, 2),
+        VMSTATE_UINT32_V(dma_head, PCIESekiDeviceState, 2),
+        VMSTATE_UINT32_V(dma_tail, PCIESekiDeviceState, 2),
+        VMSTATE_UINT32_EQUAL_V(num_queues, PCIESekiDeviceState, 2),
+        {
+            // VMSTATE_STRUCT_VARRAY_POINTER_UINT32, but only from version 2
+            .name       = "queues",
+            .version_id = 2,
+            .num_offset = vmstate_offset_value(PCIESekiDeviceState,
+                                               num_queues, uint32_t),
+            .size       = sizeof(SekiQueue),
+            .vmsd       = &vmstate_seki_queue,
+            .flags      = VMS_POINTER | VMS_VARRAY_UINT32 | VMS_STRUCT,
+            .offset     = vmstate_offset_pointer(PCIESekiDeviceState, queues,
+                                                 SekiQueue),
+        },
         VMSTATE_END_OF_LIST()
     }
 };
 
+static void pcie_seki_check_memdev_is_busy(Object *obj, const char *name,
+                                           Object *val, Error **errp)
+{
+    MemoryRegion *mr;
+
+    mr = host_memory_backend_get_memory(MEMORY_BACKEND(val), errp);
+    if (memory_region_is_mapped(mr)) {
+        char *path = object_get_canonical_path_component(val);
+        error_setg(errp, "can't use already busy memdev: %s", path);
+        g_free(path);
+    } else {
+        qdev_prop_allow_set_link_before_realize(obj, name, val, errp);
+    }
+}
+
+static void pcie_seki_instance_init(Object *obj)
+{
+    PCIESekiDeviceState *seki = PCIE_SEKI_DEV(obj);
+
+    object_property_add_link(obj, SEKI_INPUT_MEMDEV_PROP, TYPE_MEMORY_BACKEND,
+                             (Object **)&seki->input_memdev,
+                             pcie_seki_check_memdev_is_busy,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE,
+                             &error_abort);
+    object_property_add_link(obj, SEKI_OUTPUT_MEMDEV_PROP, TYPE_MEMORY_BACKEND,
+                             (Object **)&seki->output_memdev,
+                             pcie_seki_check_memdev_is_busy,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE,
+                             &error_abort);
+}
+
+static Property pcie_seki_props[] = {
+    DEFINE_PROP_UINT8("port", PCIEPort, port, 0),
+    DEFINE_PROP_UINT16("aer_log_max", PCIEPort,
+                       parent_obj.parent_obj.exp.aer_log.log_max,
+                       PCIE_AER_LOG_MAX_DEFAULT),
+    DEFINE_PROP_UINT32(SEKI_QUEUES_PROP, PCIESekiDeviceState, num_queues, 1),
+    DEFINE_PROP_UINT32(SEKI_COMPUTE_THREADS_PROP, PCIESekiDeviceState,
+                       compute_threads, 1),
+    DEFINE_PROP_STRING(SEKI_BLAS_PROP, PCIESekiDeviceState, blas_name),
+    DEFINE_PROP_UINT32(SEKI_CARD_ID_PROP, PCIESekiDeviceState, card_id,
+                       SEKI_CARD_ID_AUTO),
+    DEFINE_PROP_STRING(SEKI_CAPTURE_PROP, PCIESekiDeviceState, capture_path),
+    DEFINE_PROP_END_OF_LIST()
+};
+
 static void pcie_seki_class_init(ObjectClass *oc, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(oc);
@@ -125,18 +341,105 @@ static void pcie_seki_class_init(ObjectClass *oc, void *data)
     dc->desc        = "Seki HPL Accelerator";
     dc->reset       = pcie_seki_reset;
     dc->vmsd        = &vmstate_pcie_seki;
+    dc->props       = pcie_seki_props;
+}
+
+static intList *seki_hist_list(const uint64_t *hist)
+{
+    intList *head = NULL;
+    int i;
+
+    for (i = SEKI_HIST_BUCKETS - 1; i >= 0; i--) {
+        intList *elem = g_new0(intList, 1);
+
+        elem->value = hist[i];
+        elem->next = head;
+        head = elem;
+    }
+    return head;
+}
+
+static SekiQueueInfoList *seki_queue_info_list(PCIESekiDeviceState *seki)
+{
+    SekiQueueInfoList *head = NULL;
+    int i;
+
+    for (i = seki->num_queues - 1; i >= 0; i--) {
+        SekiQueueInfoList *elem = g_new0(SekiQueueInfoList, 1);
+        SekiQueueInfo *info = g_new0(SekiQueueInfo, 1);
+        SekiQueue *q = &seki->queues[i];
+
+        info->id = q->id;
+        info->size = q->size;
+        info->outstanding = q->outstanding;
+        info->depth_histogram = seki_hist_list(q->depth_hist);
+        elem->value = info;
+        elem->next = head;
+        head = elem;
+    }
+    return head;
+}
+
+static int seki_info_list(Object *obj, void *opaque)
+{
+    SekiInfoList ***prev = opaque;
+
+    if (object_dynamic_cast(obj, TYPE_PCIE_SEKI_DEVICE) &&
+        DEVICE(obj)->realized) {
+        PCIESekiDeviceState *seki = PCIE_SEKI_DEV(obj);
+        SekiCounters *c = &seki->counters;
+        SekiInfoList *elem = g_new0(SekiInfoList, 1);
+        SekiInfo *info = g_new0(SekiInfo, 1);
+
+        info->path = object_get_canonical_path(obj);
+        if (DEVICE(obj)->id) {
+            info->has_id = true;
+            info->id = g_strdup(DEVICE(obj)->id);
+        }
+        info->card_id = seki->card_id;
+        info->blas = g_strdup(seki->blas->name);
+        info->compute_threads = pcie_seki_pool_threads();
+        info->bytes_in = c->bytes_in;
+        info->bytes_out = c->bytes_out;
+        info->bytes_p2p = c->bytes_p2p;
+        info->commands_completed = c->commands_completed;
+        info->commands_failed = c->commands_failed;
+        info->flops = c->flops;
+        info->compute_time = c->compute_ns;
+        info->compute_time_max = c->compute_max_ns;
+        info->compute_time_histogram = seki_hist_list(c->compute_hist);
+        info->queues = seki_queue_info_list(seki);
+
+        elem->value = info;
+        **prev = elem;
+        *prev = &elem->next;
+    }
+
+    object_child_foreach(obj, seki_info_list, opaque);
+    return 0;
+}
+
+SekiInfoList *qmp_query_seki(Error **errp)
+{
+    SekiInfoList *head = NULL;
+    SekiInfoList **prev = &head;
+
+    seki_info_list(qdev_get_machine(), &prev);
+    return head;
 }
 
 static const TypeInfo pcie_seki_info = {
     .name           = TYPE_PCIE_SEKI_DEVICE,
     .parent         = TYPE_PCIE_PORT,
     .instance_size  = sizeof(PCIESekiDeviceState),
+    .instance_init  = pcie_seki_instance_init,
     .class_init     = pcie_seki_class_init,
 };
 
 
 static void pcie_seki_register_types(void)
 {
+    pcie_seki_compute_class_init();
     type_register_static(&pcie_seki_info);
 }
 
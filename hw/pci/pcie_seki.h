@@ -22,10 +22,96 @@
 #define PCIE_SEKI_H
 
 #include "hw/pci/pcie_port.h"
+#include "qemu/thread.h"
+#include "qemu/queue.h"
+#include "qemu/host-utils.h"
+#include "sysemu/hostmem.h"
+#include "sysemu/sysemu.h"
+
+#include "pcie_seki_blas.h"
+#include "pcie_seki_capture.h"
+#include "pcie_seki_cmd.h"
 
 
 #define TYPE_PCIE_SEKI_DEVICE "pcie-seki"
 
+// Properties
+#define SEKI_QUEUES_PROP        "queues"
+#define SEKI_COMPUTE_THREADS_PROP "compute-threads"
+#define SEKI_BLAS_PROP          "blas"
+#define SEKI_CARD_ID_PROP       "card-id"
+#define SEKI_CAPTURE_PROP       "capture"
+#define SEKI_INPUT_MEMDEV_PROP  "input-memdev"
+#define SEKI_OUTPUT_MEMDEV_PROP "output-memdev"
+
+#define SEKI_MAX_COMPUTE_THREADS SEKI_POOL_MAX_THREADS
+#define SEKI_MAX_CARDS          256
+#define SEKI_CARD_ID_AUTO       UINT32_MAX  // lowest id not in use
+
+
+// Host-side performance counters.  They survive device reset, so that a
+// whole guest run can be profiled, and are only updated under the iothread
+// lock.  Histograms are log2: bucket 0 counts zero, bucket i > 0 counts
+// values in [2^(i-1), 2^i) and the last bucket is open ended.
+#define SEKI_HIST_BUCKETS       16
+
+typedef struct SekiCounters {
+    uint64_t bytes_in;              // guest -> input BAR, DMA engine
+    uint64_t bytes_out;             // output BAR -> guest
+    uint64_t bytes_p2p;             // output BAR -> peer input BAR
+    uint64_t commands_completed;
+    uint64_t commands_failed;
+    uint64_t flops;
+    uint64_t compute_ns;
+    uint64_t compute_max_ns;
+    uint64_t compute_hist[SEKI_HIST_BUCKETS];   // in microseconds
+} SekiCounters;
+
+static inline void seki_hist_add(uint64_t *hist, uint64_t val)
+{
+    hist[val ? MIN(64 - clz64(val), SEKI_HIST_BUCKETS - 1) : 0]++;
+}
+
+typedef struct SekiRequest {
+    SekiCommand cmd;
+    uint16_t status;        // SEKI_CQE_*
+    bool legacy;            // from the doorbell register, not a queue
+    bool done;              // executed, completion not delivered yet
+    int64_t compute_ns;
+    QSIMPLEQ_ENTRY(SekiRequest) next;
+} SekiRequest;
+
+typedef struct SekiQueue {
+    struct PCIE_Seki_Device_State *seki;
+    uint32_t id;
+
+    // Ring state, only touched under the iothread lock
+    uint64_t sq_base;
+    uint64_t cq_base;
+    uint32_t size;
+    uint32_t sq_head;
+    uint32_t sq_tail;
+    uint32_t cq_head;
+    uint32_t cq_tail;
+    bool cq_phase;
+    uint32_t outstanding;   // fetched from the SQ, CQE not posted yet
+    QSIMPLEQ_HEAD(, SekiRequest) cq_wait;   // done, waiting for CQ space
+    uint64_t depth_hist[SEKI_HIST_BUCKETS]; // queue depth at fetch time
+
+    // Worker thread, protected by lock
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+    QSIMPLEQ_HEAD(, SekiRequest) submitted;
+    QSIMPLEQ_HEAD(, SekiRequest) completed;
+    bool busy;
+    bool paused;            // VM stopped, leave submitted requests alone
+    bool stopping;
+
+    // Requests in flight, flattened into an array for migration
+    int32_t nr_saved;
+    SekiRequest *saved;
+} SekiQueue;
 
 typedef struct PCIE_Seki_Device_State {
     PCIEPort parent_obj;
@@ -34,6 +120,55 @@ typedef struct PCIE_Seki_Device_State {
     MemoryRegion input_memregion;
     MemoryRegion output_memregion;
 
+    // Input/output BARs are RAM, optionally provided by a memory backend.
+    // input_mr/output_mr point at whichever region is actually mapped.
+    HostMemoryBackend *input_memdev;
+    HostMemoryBackend *output_memdev;
+    MemoryRegion *input_mr;
+    MemoryRegion *output_mr;
+    uint8_t *input_buf;
+    uint8_t *output_buf;
+
+    // Host compute: BLAS backend, by default the fastest one the host
+    // supports.  All cards share one pool of compute threads, which splits
+    // its time fairly between them.
+    char *blas_name;
+    uint32_t compute_threads;
+    const SekiBlasBackend *blas;
+    SekiPoolClient *pool_client;
+
+    // Peer-to-peer: every card is on a global list under its card id.
+    // p2p_users counts copies into this card's input BAR that are running.
+    uint32_t card_id;
+    uint32_t p2p_users;
+    QTAILQ_ENTRY(PCIE_Seki_Device_State) card_next;
+
+    // Optional capture of commands and input data, see pcie_seki_capture.h
+    char *capture_path;
+    SekiCapture *capture;
+
+    // Control registers, as programmed by the guest
+    uint32_t status;
+    SekiGemmRegs regs;
+
+    // Command queues, each serviced by its own worker thread.  The legacy
+    // doorbell register submits to queue 0.  Workers never take the
+    // iothread lock: completions are posted, output is marked dirty and
+    // MSI is raised from irq_bh, which coalesces completions of all queues.
+    uint32_t num_queues;
+    SekiQueue *queues;
+    QEMUBH *irq_bh;
+    VMChangeStateEntry *vm_state;
+
+    // DMA engine, run from a bottom half under the iothread lock
+    uint64_t dma_ring;
+    uint32_t dma_ring_size;
+    uint32_t dma_head;
+    uint32_t dma_tail;
+    QEMUBH *dma_bh;
+
+    SekiCounters counters;
+
 } PCIESekiDeviceState;
 
 
@@ -43,12 +178,37 @@ typedef struct PCIE_Seki_Device_State {
 
 // Structs
 extern const MemoryRegionOps seki_ctrl_memregion_ops;
-extern const MemoryRegionOps seki_input_memregion_ops;
-extern const MemoryRegionOps seki_output_memregion_ops;
+extern const VMStateDescription vmstate_seki_gemm_regs;
 
 
 // Functions
-void pcie_seki_setup_mmio(PCIDevice *dev, PCIESekiDeviceState *seki);
+int pcie_seki_setup_mmio(PCIDevice *dev, PCIESekiDeviceState *seki);
+void pcie_seki_free_mmio(PCIESekiDeviceState *seki);
+
+void pcie_seki_compute_class_init(void);
+int pcie_seki_compute_init(PCIESekiDeviceState *seki);
+void pcie_seki_compute_exit(PCIESekiDeviceState *seki);
+void pcie_seki_doorbell(PCIESekiDeviceState *seki, uint32_t cmd);
+void pcie_seki_execute(PCIESekiDeviceState *seki, SekiRequest *req);
+int pcie_seki_pool_threads(void);
+void pcie_seki_mark_output(PCIESekiDeviceState *seki, const SekiCommand *cmd);
+void pcie_seki_count_command(PCIESekiDeviceState *seki,
+                             const SekiRequest *req);
+
+void pcie_seki_queue_init(PCIESekiDeviceState *seki);
+void pcie_seki_queue_exit(PCIESekiDeviceState *seki);
+void pcie_seki_queue_reset(PCIESekiDeviceState *seki);
+void pcie_seki_queue_submit(SekiQueue *q, SekiRequest *req);
+uint64_t pcie_seki_queue_read(PCIESekiDeviceState *seki, hwaddr addr);
+void pcie_seki_queue_write(PCIESekiDeviceState *seki, hwaddr addr,
+                           uint64_t val);
+void pcie_seki_queue_pre_save(void *opaque);
+int pcie_seki_queue_post_load(void *opaque, int version_id);
+
+void pcie_seki_dma_init(PCIESekiDeviceState *seki);
+void pcie_seki_dma_exit(PCIESekiDeviceState *seki);
+void pcie_seki_dma_reset(PCIESekiDeviceState *seki);
+void pcie_seki_dma_kick(PCIESekiDeviceState *seki);
 
 
 #endif // PCIE_SEKI_H
@@ -0,0 +1,486 @@
+/*
+ * pcie_seki_blas.c
+ *
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu-common.h"
+
+#include "pcie_seki_blas.h"
+
+#if defined(CONFIG_AVX2_OPT) || defined(CONFIG_AVX512F_OPT)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+// DGEMM driver
+//
+// Classic three-level blocking: a KC x TILE_N panel of op(B) and an MC x KC
+// block of op(A) are packed into contiguous, zero-padded micro-panels so
+// that the inner kernel streams through cache-resident data with unit
+// stride.  The backend's MR x NR micro-kernel keeps the C tile in vector
+// registers.
+
+// Element (i, j) of op(X) for a column-major X
+static inline double seki_elem(const double *x, int ldx, bool trans,
+                               int i, int j)
+{
+    return trans ? x[j + (size_t)i * ldx] : x[i + (size_t)j * ldx];
+}
+
+// Pack op(A)[0..mc, 0..kc) into MR-row micro-panels, k-major
+static void seki_pack_a(int mc, int kc, const double *a, int lda, bool trans,
+                        int mr_max, double *pa)
+{
+    int i, ir, p;
+
+    for (ir = 0; ir < mc; ir += mr_max) {
+        int mr = MIN(mr_max, mc - ir);
+
+        for (p = 0; p < kc; p++) {
+            for (i = 0; i < mr; i++) {
+                *pa++ = seki_elem(a, lda, trans, ir + i, p);
+            }
+            for (; i < mr_max; i++) {
+                *pa++ = 0.0;
+            }
+        }
+    }
+}
+
+// Pack op(B)[0..kc, 0..nc) into NR-column micro-panels, k-major
+static void seki_pack_b(int kc, int nc, const double *b, int ldb, bool trans,
+                        int nr_max, double *pb)
+{
+    int j, jr, p;
+
+    for (jr = 0; jr < nc; jr += nr_max) {
+        int nr = MIN(nr_max, nc - jr);
+
+        for (p = 0; p < kc; p++) {
+            for (j = 0; j < nr; j++) {
+                *pb++ = seki_elem(b, ldb, trans, p, jr + j);
+            }
+            for (; j < nr_max; j++) {
+                *pb++ = 0.0;
+            }
+        }
+    }
+}
+
+static void seki_scale_c(int m, int n, double beta, double *c, int ldc)
+{
+    int i, j;
+
+    if (beta == 1.0) {
+        return;
+    }
+
+    for (j = 0; j < n; j++) {
+        double *cj = c + (size_t)j * ldc;
+
+        if (beta == 0.0) {
+            // BLAS semantics: C is not read when beta is zero
+            memset(cj, 0, m * sizeof(double));
+        } else {
+            for (i = 0; i < m; i++) {
+                cj[i] *= beta;
+            }
+        }
+    }
+}
+
+// Add a spilled MR x NR accumulator tile to a partial C tile
+static void seki_store_partial(const double *acc, int mr_max, double alpha,
+                               double *c, int ldc, int mr, int nr)
+{
+    int i, j;
+
+    for (j = 0; j < nr; j++) {
+        double *cj = c + (size_t)j * ldc;
+
+        for (i = 0; i < mr; i++) {
+            cj[i] += alpha * acc[j * mr_max + i];
+        }
+    }
+}
+
+static size_t seki_pack_b_size(const SekiBlasBackend *be)
+{
+    return (size_t)SEKI_KC * DIV_ROUND_UP(SEKI_TILE_N, be->nr) * be->nr *
+           sizeof(double);
+}
+
+static size_t seki_scratch_size(const SekiBlasBackend *be)
+{
+    return (size_t)SEKI_MC * SEKI_KC * sizeof(double) + seki_pack_b_size(be);
+}
+
+int seki_dgemm_tiles(const SekiDgemm *g)
+{
+    if (g->m <= 0 || g->n <= 0) {
+        return 0;
+    }
+    return DIV_ROUND_UP(g->m, SEKI_TILE_M) * DIV_ROUND_UP(g->n, SEKI_TILE_N);
+}
+
+void seki_dgemm_tile(const SekiBlasBackend *be, const SekiDgemm *g,
+                     int tile, void *scratch)
+{
+    int tiles_m = DIV_ROUND_UP(g->m, SEKI_TILE_M);
+    int i0 = (tile % tiles_m) * SEKI_TILE_M;
+    int j0 = (tile / tiles_m) * SEKI_TILE_N;
+    int mt = MIN(SEKI_TILE_M, g->m - i0);
+    int nt = MIN(SEKI_TILE_N, g->n - j0);
+    double *pb = scratch;
+    double *pa = (double *)((uint8_t *)scratch + seki_pack_b_size(be));
+    double *ct = g->c + i0 + (size_t)j0 * g->ldc;
+    int ic, pc, ir, jr;
+
+    seki_scale_c(mt, nt, g->beta, ct, g->ldc);
+    if (g->k <= 0 || g->alpha == 0.0) {
+        return;
+    }
+
+    for (pc = 0; pc < g->k; pc += SEKI_KC) {
+        int kc = MIN(SEKI_KC, g->k - pc);
+        const double *bp = g->transb ? g->b + j0 + (size_t)pc * g->ldb
+                                     : g->b + pc + (size_t)j0 * g->ldb;
+
+        seki_pack_b(kc, nt, bp, g->ldb, g->transb, be->nr, pb);
+
+        for (ic = 0; ic < mt; ic += SEKI_MC) {
+            int mc = MIN(SEKI_MC, mt - ic);
+            const double *ap = g->transa
+                ? g->a + pc + (size_t)(i0 + ic) * g->lda
+                : g->a + i0 + ic + (size_t)pc * g->lda;
+
+            seki_pack_a(mc, kc, ap, g->lda, g->transa, be->mr, pa);
+
+            for (jr = 0; jr < nt; jr += be->nr) {
+                for (ir = 0; ir < mc; ir += be->mr) {
+                    be->kernel(kc, pa + ir * kc, pb + jr * kc, g->alpha,
+                               ct + ic + ir + (size_t)jr * g->ldc, g->ldc,
+                               MIN(be->mr, mc - ir), MIN(be->nr, nt - jr));
+                }
+            }
+        }
+    }
+}
+
+void seki_dgemm(const SekiBlasBackend *be, const SekiDgemm *g)
+{
+    int i, tiles = seki_dgemm_tiles(g);
+    void *scratch;
+
+    if (!tiles) {
+        return;
+    }
+
+    scratch = qemu_memalign(64, seki_blas_scratch_size(be));
+    for (i = 0; i < tiles; i++) {
+        seki_dgemm_tile(be, g, i, scratch);
+    }
+    qemu_vfree(scratch);
+}
+
+
+// Generic backend, portable vector extensions
+#define SEKI_GENERIC_MR     4
+#define SEKI_GENERIC_NR     4
+
+typedef double SekiVec
+    __attribute__((vector_size(SEKI_GENERIC_MR * sizeof(double))));
+
+static void seki_kernel_generic(int kc, const double *pa, const double *pb,
+                                double alpha, double *c, int ldc,
+                                int mr, int nr)
+{
+    SekiVec acc[SEKI_GENERIC_NR];
+    int i, j, p;
+
+    for (j = 0; j < SEKI_GENERIC_NR; j++) {
+        acc[j] = (SekiVec) { 0 };
+    }
+
+    for (p = 0; p < kc; p++) {
+        SekiVec av = *(const SekiVec *)(pa + p * SEKI_GENERIC_MR);
+
+        for (j = 0; j < SEKI_GENERIC_NR; j++) {
+            acc[j] += av * pb[p * SEKI_GENERIC_NR + j];
+        }
+    }
+
+    for (j = 0; j < nr; j++) {
+        double *cj = c + (size_t)j * ldc;
+
+        for (i = 0; i < mr; i++) {
+            cj[i] += alpha * acc[j][i];
+        }
+    }
+}
+
+
+#if defined(CONFIG_AVX2_OPT) || defined(CONFIG_AVX512F_OPT)
+// Older <cpuid.h> lack some of these
+#ifndef bit_OSXSAVE
+#define bit_OSXSAVE         (1 << 27)
+#endif
+#ifndef bit_FMA
+#define bit_FMA             (1 << 12)
+#endif
+#ifndef bit_AVX2
+#define bit_AVX2            (1 << 5)
+#endif
+#ifndef bit_AVX512F
+#define bit_AVX512F         (1 << 16)
+#endif
+
+#define SEKI_XCR0_AVX       0x06    // SSE and AVX state
+#define SEKI_XCR0_AVX512    0xe0    // opmask and ZMM state
+
+// XCR0 bits the OS enables, 0 if the OS does not use XSAVE
+static uint64_t seki_xcr0(void)
+{
+    unsigned a, b, c, d;
+    uint32_t lo, hi;
+
+    if (__get_cpuid_max(0, 0) < 1) {
+        return 0;
+    }
+    __cpuid(1, a, b, c, d);
+    if (!(c & bit_OSXSAVE)) {
+        return 0;
+    }
+    asm volatile("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static unsigned seki_cpuid7_ebx(void)
+{
+    unsigned a, b, c, d;
+
+    if (__get_cpuid_max(0, 0) < 7) {
+        return 0;
+    }
+    __cpuid_count(7, 0, a, b, c, d);
+    return b;
+}
+#endif
+
+
+#ifdef CONFIG_AVX2_OPT
+// AVX2 backend: 8 x 6 tile, twelve ymm accumulators
+#define SEKI_AVX2_MR        8
+#define SEKI_AVX2_NR        6
+
+static bool seki_avx2_supported(void)
+{
+    unsigned a, b, c, d;
+
+    if ((seki_xcr0() & SEKI_XCR0_AVX) != SEKI_XCR0_AVX) {
+        return false;
+    }
+    __cpuid(1, a, b, c, d);
+    return (c & bit_FMA) && (seki_cpuid7_ebx() & bit_AVX2);
+}
+
+static void __attribute__((target("avx2,fma")))
+seki_kernel_avx2(int kc, const double *pa, const double *pb,
+                 double alpha, double *c, int ldc, int mr, int nr)
+{
+    __m256d acc[SEKI_AVX2_NR][2];
+    __m256d va = _mm256_set1_pd(alpha);
+    int j, p;
+
+    for (j = 0; j < SEKI_AVX2_NR; j++) {
+        acc[j][0] = _mm256_setzero_pd();
+        acc[j][1] = _mm256_setzero_pd();
+    }
+
+    for (p = 0; p < kc; p++) {
+        __m256d a0 = _mm256_loadu_pd(pa);
+        __m256d a1 = _mm256_loadu_pd(pa + 4);
+
+        for (j = 0; j < SEKI_AVX2_NR; j++) {
+            __m256d bj = _mm256_broadcast_sd(pb + j);
+
+            acc[j][0] = _mm256_fmadd_pd(a0, bj, acc[j][0]);
+            acc[j][1] = _mm256_fmadd_pd(a1, bj, acc[j][1]);
+        }
+        pa += SEKI_AVX2_MR;
+        pb += SEKI_AVX2_NR;
+    }
+
+    if (mr == SEKI_AVX2_MR && nr == SEKI_AVX2_NR) {
+        for (j = 0; j < SEKI_AVX2_NR; j++) {
+            double *cj = c + (size_t)j * ldc;
+
+            _mm256_storeu_pd(cj, _mm256_fmadd_pd(va, acc[j][0],
+                                                 _mm256_loadu_pd(cj)));
+            _mm256_storeu_pd(cj + 4, _mm256_fmadd_pd(va, acc[j][1],
+                                                     _mm256_loadu_pd(cj + 4)));
+        }
+    } else {
+        double spill[SEKI_AVX2_NR * SEKI_AVX2_MR];
+
+        for (j = 0; j < SEKI_AVX2_NR; j++) {
+            _mm256_storeu_pd(spill + j * SEKI_AVX2_MR, acc[j][0]);
+            _mm256_storeu_pd(spill + j * SEKI_AVX2_MR + 4, acc[j][1]);
+        }
+        seki_store_partial(spill, SEKI_AVX2_MR, alpha, c, ldc, mr, nr);
+    }
+}
+#endif
+
+#ifdef CONFIG_AVX512F_OPT
+// AVX-512 backend: 16 x 8 tile, sixteen zmm accumulators
+#define SEKI_AVX512_MR      16
+#define SEKI_AVX512_NR      8
+
+static bool seki_avx512_supported(void)
+{
+    const uint64_t xcr0 = SEKI_XCR0_AVX | SEKI_XCR0_AVX512;
+
+    return (seki_xcr0() & xcr0) == xcr0 &&
+           (seki_cpuid7_ebx() & bit_AVX512F);
+}
+
+static void __attribute__((target("avx512f")))
+seki_kernel_avx512(int kc, const double *pa, const double *pb,
+                   double alpha, double *c, int ldc, int mr, int nr)
+{
+    __m512d acc[SEKI_AVX512_NR][2];
+    __m512d va = _mm512_set1_pd(alpha);
+    int j, p;
+
+    for (j = 0; j < SEKI_AVX512_NR; j++) {
+        acc[j][0] = _mm512_setzero_pd();
+        acc[j][1] = _mm512_setzero_pd();
+    }
+
+    for (p = 0; p < kc; p++) {
+        __m512d a0 = _mm512_loadu_pd(pa);
+        __m512d a1 = _mm512_loadu_pd(pa + 8);
+
+        for (j = 0; j < SEKI_AVX512_NR; j++) {
+            __m512d bj = _mm512_set1_pd(pb[j]);
+
+            acc[j][0] = _mm512_fmadd_pd(a0, bj, acc[j][0]);
+            acc[j][1] = _mm512_fmadd_pd(a1, bj, acc[j][1]);
+        }
+        pa += SEKI_AVX512_MR;
+        pb += SEKI_AVX512_NR;
+    }
+
+    if (mr == SEKI_AVX512_MR && nr == SEKI_AVX512_NR) {
+        for (j = 0; j < SEKI_AVX512_NR; j++) {
+            double *cj = c + (size_t)j * ldc;
+
+            _mm512_storeu_pd(cj, _mm512_fmadd_pd(va, acc[j][0],
+                                                 _mm512_loadu_pd(cj)));
+            _mm512_storeu_pd(cj + 8, _mm512_fmadd_pd(va, acc[j][1],
+                                                     _mm512_loadu_pd(cj + 8)));
+        }
+    } else {
+        double spill[SEKI_AVX512_NR * SEKI_AVX512_MR];
+
+        for (j = 0; j < SEKI_AVX512_NR; j++) {
+            _mm512_storeu_pd(spill + j * SEKI_AVX512_MR, acc[j][0]);
+            _mm512_storeu_pd(spill + j * SEKI_AVX512_MR + 8, acc[j][1]);
+        }
+        seki_store_partial(spill, SEKI_AVX512_MR, alpha, c, ldc, mr, nr);
+    }
+}
+#endif
+
+
+// Backend registry, fastest first
+static const SekiBlasBackend seki_blas_backends[] = {
+#ifdef CONFIG_AVX512F_OPT
+    {
+        .name = "avx512",
+        .mr = SEKI_AVX512_MR,
+        .nr = SEKI_AVX512_NR,
+        .supported = seki_avx512_supported,
+        .kernel = seki_kernel_avx512,
+    },
+#endif
+#ifdef CONFIG_AVX2_OPT
+    {
+        .name = "avx2",
+        .mr = SEKI_AVX2_MR,
+        .nr = SEKI_AVX2_NR,
+        .supported = seki_avx2_supported,
+        .kernel = seki_kernel_avx2,
+    },
+#endif
+    {
+        .name = "generic",
+        .mr = SEKI_GENERIC_MR,
+        .nr = SEKI_GENERIC_NR,
+        .kernel = seki_kernel_generic,
+    },
+};
+
+static bool seki_blas_usable(const SekiBlasBackend *be)
+{
+    return !be->supported || be->supported();
+}
+
+const SekiBlasBackend *seki_blas_find(const char *name)
+{
+    int i;
+
+    QEMU_BUILD_BUG_ON(SEKI_MC % 16 != 0);
+    for (i = 0; i < ARRAY_SIZE(seki_blas_backends); i++) {
+        const SekiBlasBackend *be = &seki_blas_backends[i];
+
+        if ((!strcmp(name, SEKI_BLAS_AUTO) || !strcmp(name, be->name)) &&
+            seki_blas_usable(be)) {
+            return be;
+        }
+    }
+    return NULL;
+}
+
+size_t seki_blas_scratch_size(const SekiBlasBackend *be)
+{
+    size_t size = 0;
+    int i;
+
+    if (be) {
+        return seki_scratch_size(be);
+    }
+    for (i = 0; i < ARRAY_SIZE(seki_blas_backends); i++) {
+        size = MAX(size, seki_scratch_size(&seki_blas_backends[i]));
+    }
+    return size;
+}
+
+char *seki_blas_list(void)
+{
+    GString *s = g_string_new(SEKI_BLAS_AUTO);
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(seki_blas_backends); i++) {
+        if (seki_blas_usable(&seki_blas_backends[i])) {
+            g_string_append_printf(s, ", %s", seki_blas_backends[i].name);
+        }
+    }
+    return g_string_free(s, false);
+}
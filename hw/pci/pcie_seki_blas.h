@@ -0,0 +1,116 @@
+/*
+ * pcie_seki_blas.h
+ *
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PCIE_SEKI_BLAS_H
+#define PCIE_SEKI_BLAS_H
+
+#include "qemu-common.h"
+
+// Host BLAS backends.  This header does not depend on the device, so the
+// compute code can be linked into standalone tools as well.
+//
+// A backend supplies the MR x NR register-blocked micro-kernel; packing and
+// cache blocking are shared.  The kernel computes
+//     C[0..mr, 0..nr) += alpha * Apanel * Bpanel
+// where Apanel is kc MR-element columns and Bpanel kc NR-element rows, both
+// zero-padded, and mr <= MR, nr <= NR.
+typedef void SekiMicroKernel(int kc, const double *pa, const double *pb,
+                             double alpha, double *c, int ldc,
+                             int mr, int nr);
+
+typedef struct SekiBlasBackend {
+    const char *name;
+    int mr;
+    int nr;
+    bool (*supported)(void);    // NULL: always usable
+    SekiMicroKernel *kernel;
+} SekiBlasBackend;
+
+// Cache blocking, shared by all backends.  SEKI_MC is a multiple of every
+// backend's MR.  A tile is the unit of work handed to a compute thread.
+#define SEKI_MC                 128
+#define SEKI_KC                 256
+#define SEKI_TILE_M             SEKI_MC
+#define SEKI_TILE_N             512
+
+#define SEKI_BLAS_AUTO          "auto"
+
+// Look up a backend by name; SEKI_BLAS_AUTO picks the fastest one the host
+// supports.  Returns NULL for unknown or unsupported backends.
+const SekiBlasBackend *seki_blas_find(const char *name);
+// Comma separated list of the backends usable on this host
+char *seki_blas_list(void);
+
+// Bytes of packing scratch a thread needs for one tile, NULL for the
+// largest amount any backend needs
+size_t seki_blas_scratch_size(const SekiBlasBackend *be);
+
+// Column-major DGEMM:  C := alpha * op(A) * op(B) + beta * C
+typedef struct SekiDgemm {
+    bool transa;
+    bool transb;
+    int m;
+    int n;
+    int k;
+    double alpha;
+    const double *a;
+    int lda;
+    const double *b;
+    int ldb;
+    double beta;
+    double *c;
+    int ldc;
+} SekiDgemm;
+
+// C is split into independent SEKI_TILE_M x SEKI_TILE_N tiles, which may be
+// computed in any order and concurrently.
+int seki_dgemm_tiles(const SekiDgemm *g);
+void seki_dgemm_tile(const SekiBlasBackend *be, const SekiDgemm *g,
+                     int tile, void *scratch);
+
+// Single threaded convenience wrapper
+void seki_dgemm(const SekiBlasBackend *be, const SekiDgemm *g);
+
+
+// Work-stealing pool of compute threads, shared by any number of clients.
+// The tiles of a job are split into one range per thread; a thread takes
+// work from the front of its own range and, once that is empty, steals the
+// back half of another thread's range.  Clients take turns for every tile,
+// and so do the jobs of one client, so a large job cannot starve others.
+typedef struct SekiPool SekiPool;
+typedef struct SekiPoolClient SekiPoolClient;
+typedef void SekiPoolFunc(void *opaque, int tile, void *scratch);
+
+#define SEKI_POOL_MAX_THREADS   256
+
+SekiPool *seki_pool_new(int threads, size_t scratch_size);
+void seki_pool_free(SekiPool *pool);
+void seki_pool_grow(SekiPool *pool, int threads);
+int seki_pool_threads(SekiPool *pool);
+
+SekiPoolClient *seki_pool_client_new(SekiPool *pool);
+void seki_pool_client_free(SekiPoolClient *client);
+// Run fn on tiles [0, ntiles) on the pool threads and wait for all of
+// them.  Thread safe, a client may have several jobs running.
+void seki_pool_run(SekiPoolClient *client, SekiPoolFunc *fn, void *opaque,
+                   int ntiles);
+
+
+#endif // PCIE_SEKI_BLAS_H
@@ -0,0 +1,230 @@
+/*
+ * pcie_seki_capture.c
+ *
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu-common.h"
+#include "qemu/error-report.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+
+#include "pcie_seki_capture.h"
+
+// Records larger than this are not accepted on reading
+#define SEKI_CAPTURE_MAX_LEN    (sizeof(SekiCaptureData) + SEKI_INPUT_SIZE)
+
+struct SekiCapture {
+    char *path;
+    QemuMutex lock;
+    FILE *f;                // NULL once a write failed
+    int64_t start;
+};
+
+static bool seki_capture_write(SekiCapture *cap, const void *buf, size_t len)
+{
+    if (fwrite(buf, 1, len, cap->f) == len) {
+        return true;
+    }
+    error_report("pcie-seki: writing capture '%s' failed: %s, capture "
+                 "stopped", cap->path, strerror(errno));
+    fclose(cap->f);
+    cap->f = NULL;
+    return false;
+}
+
+// Called with cap->lock held
+static bool seki_capture_record(SekiCapture *cap, uint32_t type, uint64_t len)
+{
+    SekiCaptureRecord rec = {
+        .type = cpu_to_le32(type),
+        .timestamp = cpu_to_le64(get_clock() - cap->start),
+        .len = cpu_to_le64(len),
+    };
+
+    return cap->f && seki_capture_write(cap, &rec, sizeof(rec));
+}
+
+void seki_capture_data(SekiCapture *cap, uint64_t offset, const void *buf,
+                       uint64_t len)
+{
+    SekiCaptureData data = {
+        .offset = cpu_to_le64(offset),
+    };
+
+    qemu_mutex_lock(&cap->lock);
+    if (seki_capture_record(cap, SEKI_CAPTURE_DATA, sizeof(data) + len) &&
+        seki_capture_write(cap, &data, sizeof(data))) {
+        seki_capture_write(cap, buf, len);
+    }
+    qemu_mutex_unlock(&cap->lock);
+}
+
+void seki_capture_command(SekiCapture *cap, uint32_t queue, uint32_t flags,
+                          const SekiCommand *cmd)
+{
+    SekiCaptureCommand c = {
+        .queue = cpu_to_le32(queue),
+        .flags = cpu_to_le32(flags),
+        .cmd = *cmd,
+    };
+
+    seki_command_to_le(&c.cmd);
+
+    qemu_mutex_lock(&cap->lock);
+    if (seki_capture_record(cap, SEKI_CAPTURE_COMMAND, sizeof(c))) {
+        seki_capture_write(cap, &c, sizeof(c));
+    }
+    qemu_mutex_unlock(&cap->lock);
+}
+
+SekiCapture *seki_capture_open(const char *path, uint32_t card_id,
+                               Error **errp)
+{
+    SekiCapture *cap;
+    SekiCaptureHeader hdr = {
+        .version = cpu_to_le32(SEKI_CAPTURE_VERSION),
+        .card_id = cpu_to_le32(card_id),
+        .input_size = cpu_to_le64(SEKI_INPUT_SIZE),
+        .output_size = cpu_to_le64(SEKI_OUTPUT_SIZE),
+    };
+    FILE *f;
+
+    memcpy(hdr.magic, SEKI_CAPTURE_MAGIC, sizeof(hdr.magic));
+    f = fopen(path, "wb");
+    if (!f) {
+        error_setg_file_open(errp, errno, path);
+        return NULL;
+    }
+    if (fwrite(&hdr, sizeof(hdr), 1, f) != 1) {
+        error_setg_errno(errp, errno, "Could not write to '%s'", path);
+        fclose(f);
+        return NULL;
+    }
+
+    cap = g_new0(SekiCapture, 1);
+    cap->path = g_strdup(path);
+    cap->f = f;
+    cap->start = get_clock();
+    qemu_mutex_init(&cap->lock);
+    return cap;
+}
+
+void seki_capture_close(SekiCapture *cap)
+{
+    if (cap->f && fclose(cap->f)) {
+        error_report("pcie-seki: writing capture '%s' failed: %s",
+                     cap->path, strerror(errno));
+    }
+    qemu_mutex_destroy(&cap->lock);
+    g_free(cap->path);
+    g_free(cap);
+}
+
+FILE *seki_capture_read_open(const char *path, SekiCaptureHeader *hdr,
+                             Error **errp)
+{
+    FILE *f;
+
+    f = fopen(path, "rb");
+    if (!f) {
+        error_setg_file_open(errp, errno, path);
+        return NULL;
+    }
+    if (fread(hdr, sizeof(*hdr), 1, f) != 1 ||
+        memcmp(hdr->magic, SEKI_CAPTURE_MAGIC, sizeof(hdr->magic))) {
+        error_setg(errp, "'%s' is not a pcie-seki capture", path);
+        fclose(f);
+        return NULL;
+    }
+
+    le32_to_cpus(&hdr->version);
+    le32_to_cpus(&hdr->card_id);
+    le64_to_cpus(&hdr->input_size);
+    le64_to_cpus(&hdr->output_size);
+    if (hdr->version != SEKI_CAPTURE_VERSION) {
+        error_setg(errp, "'%s': unsupported capture version %" PRIu32,
+                   path, hdr->version);
+        fclose(f);
+        return NULL;
+    }
+    return f;
+}
+
+int seki_capture_read(FILE *f, SekiCaptureRecord *rec, void **payload,
+                      Error **errp)
+{
+    size_t n;
+
+    *payload = NULL;
+    n = fread(rec, 1, sizeof(*rec), f);
+    if (n == 0 && feof(f)) {
+        return 0;
+    }
+    if (n != sizeof(*rec)) {
+        error_setg(errp, "truncated capture record");
+        return -1;
+    }
+
+    le32_to_cpus(&rec->type);
+    le64_to_cpus(&rec->timestamp);
+    le64_to_cpus(&rec->len);
+    switch (rec->type) {
+    case SEKI_CAPTURE_DATA:
+        if (rec->len < sizeof(SekiCaptureData) ||
+            rec->len > SEKI_CAPTURE_MAX_LEN) {
+            error_setg(errp, "bad capture data record");
+            return -1;
+        }
+        break;
+    case SEKI_CAPTURE_COMMAND:
+        if (rec->len != sizeof(SekiCaptureCommand)) {
+            error_setg(errp, "bad capture command record");
+            return -1;
+        }
+        break;
+    default:
+        // Unknown records are skipped, for forward compatibility
+        if (rec->len > SEKI_CAPTURE_MAX_LEN ||
+            fseeko(f, rec->len, SEEK_CUR)) {
+            error_setg_errno(errp, errno, "truncated capture record");
+            return -1;
+        }
+        return seki_capture_read(f, rec, payload, errp);
+    }
+
+    *payload = g_malloc(rec->len);
+    if (fread(*payload, 1, rec->len, f) != rec->len) {
+        error_setg(errp, "truncated capture record");
+        g_free(*payload);
+        *payload = NULL;
+        return -1;
+    }
+
+    if (rec->type == SEKI_CAPTURE_DATA) {
+        SekiCaptureData *d = *payload;
+
+        le64_to_cpus(&d->offset);
+    } else {
+        SekiCaptureCommand *c = *payload;
+
+        le32_to_cpus(&c->queue);
+        le32_to_cpus(&c->flags);
+        seki_command_from_le(&c->cmd);
+    }
+    return 1;
+}
@@ -0,0 +1,95 @@
+/*
+ * pcie_seki_capture.h
+ *
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PCIE_SEKI_CAPTURE_H
+#define PCIE_SEKI_CAPTURE_H
+
+#include "qemu-common.h"
+#include "qapi/error.h"
+
+#include "pcie_seki_cmd.h"
+
+// Capture files record what a card is asked to do, so that it can be
+// replayed without a guest (tests/seki-bench).  A capture is a header and
+// a sequence of records, all little endian:
+//  - SEKI_CAPTURE_DATA: bytes that arrived in the input BAR, from the DMA
+//    engine or a peer's copy command.  Guest CPU stores into the BAR are
+//    not seen by the device and so are not captured.
+//  - SEKI_CAPTURE_COMMAND: a command as the guest submitted it.
+// Records are in the order the device saw them, which is the order a
+// replay must apply them in.
+#define SEKI_CAPTURE_MAGIC      "SEKICAP1"
+#define SEKI_CAPTURE_VERSION    1
+
+typedef struct SekiCaptureHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t card_id;       // to tell copies to the card itself apart
+    uint64_t input_size;
+    uint64_t output_size;
+} SekiCaptureHeader;
+
+#define SEKI_CAPTURE_DATA       0x1
+#define SEKI_CAPTURE_COMMAND    0x2
+
+typedef struct SekiCaptureRecord {
+    uint32_t type;          // SEKI_CAPTURE_*
+    uint32_t reserved;
+    uint64_t timestamp;     // ns since the capture was opened
+    uint64_t len;           // of the payload that follows
+} SekiCaptureRecord;
+
+// Payload of SEKI_CAPTURE_DATA, followed by the data
+typedef struct SekiCaptureData {
+    uint64_t offset;        // into the input BAR
+} SekiCaptureData;
+
+// Payload of SEKI_CAPTURE_COMMAND
+typedef struct SekiCaptureCommand {
+    uint32_t queue;
+    uint32_t flags;         // SEKI_CAPTURE_LEGACY
+    SekiCommand cmd;
+} SekiCaptureCommand;
+
+#define SEKI_CAPTURE_LEGACY     (1u << 0)   // from the doorbell register
+
+// Writing.  A capture may be written from several threads.  Write errors
+// are reported once, after which the capture is silently dropped.
+typedef struct SekiCapture SekiCapture;
+
+SekiCapture *seki_capture_open(const char *path, uint32_t card_id,
+                               Error **errp);
+void seki_capture_close(SekiCapture *cap);
+void seki_capture_data(SekiCapture *cap, uint64_t offset, const void *buf,
+                       uint64_t len);
+// cmd is in host byte order
+void seki_capture_command(SekiCapture *cap, uint32_t queue, uint32_t flags,
+                          const SekiCommand *cmd);
+
+// Reading.  seki_capture_read() returns 1 and a g_malloc'ed payload in host
+// byte order (the data of SEKI_CAPTURE_DATA excepted) for each record, 0 at
+// the end of the file and -1 on error.
+FILE *seki_capture_read_open(const char *path, SekiCaptureHeader *hdr,
+                             Error **errp);
+int seki_capture_read(FILE *f, SekiCaptureRecord *rec, void **payload,
+                      Error **errp);
+
+
+#endif // PCIE_SEKI_CAPTURE_H
@@ -0,0 +1,129 @@
+/*
+ * pcie_seki_cmd.c
+ *
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu-common.h"
+
+#include "pcie_seki_cmd.h"
+
+// Little endian to host and back are the same swaps; the opcode, in host
+// order, tells which fields there are
+static void seki_command_swap(SekiCommand *cmd, uint32_t opcode)
+{
+    SekiGemmRegs *r = &cmd->gemm;
+
+    le32_to_cpus(&cmd->opcode);
+    le32_to_cpus(&cmd->cid);
+    if (opcode == SEKI_CMD_COPY) {
+        le32_to_cpus(&cmd->copy.peer);
+        le64_to_cpus(&cmd->copy.src_offset);
+        le64_to_cpus(&cmd->copy.dst_offset);
+        le64_to_cpus(&cmd->copy.len);
+        return;
+    }
+    le32_to_cpus(&r->flags);
+    le32_to_cpus(&r->m);
+    le32_to_cpus(&r->n);
+    le32_to_cpus(&r->k);
+    le32_to_cpus(&r->lda);
+    le32_to_cpus(&r->ldb);
+    le32_to_cpus(&r->ldc);
+    le32_to_cpus(&r->a_offset);
+    le32_to_cpus(&r->b_offset);
+    le32_to_cpus(&r->c_offset);
+    le64_to_cpus(&r->alpha);
+    le64_to_cpus(&r->beta);
+}
+
+void seki_command_from_le(SekiCommand *cmd)
+{
+    seki_command_swap(cmd, le32_to_cpu(cmd->opcode));
+}
+
+void seki_command_to_le(SekiCommand *cmd)
+{
+    seki_command_swap(cmd, cmd->opcode);
+}
+
+uint64_t seki_matrix_span(uint32_t rows, uint32_t cols, uint32_t ld)
+{
+    if (rows == 0 || cols == 0) {
+        return 0;
+    }
+    return ((uint64_t)ld * (cols - 1) + rows) * sizeof(double);
+}
+
+bool seki_gemm_valid(const SekiGemmRegs *r)
+{
+    bool transa = r->flags & SEKI_FLAG_TRANSA;
+    bool transb = r->flags & SEKI_FLAG_TRANSB;
+    uint32_t a_rows = transa ? r->k : r->m;
+    uint32_t a_cols = transa ? r->m : r->k;
+    uint32_t b_rows = transb ? r->n : r->k;
+    uint32_t b_cols = transb ? r->k : r->n;
+
+    if (r->m > INT_MAX || r->n > INT_MAX || r->k > INT_MAX ||
+        r->lda > INT_MAX || r->ldb > INT_MAX || r->ldc > INT_MAX) {
+        return false;
+    }
+    if (r->lda < MAX(a_rows, 1) || r->ldb < MAX(b_rows, 1) ||
+        r->ldc < MAX(r->m, 1)) {
+        return false;
+    }
+    if ((r->a_offset | r->b_offset | r->c_offset) & (sizeof(double) - 1)) {
+        return false;
+    }
+    if ((uint64_t)r->a_offset + seki_matrix_span(a_rows, a_cols, r->lda) >
+            SEKI_INPUT_SIZE ||
+        (uint64_t)r->b_offset + seki_matrix_span(b_rows, b_cols, r->ldb) >
+            SEKI_INPUT_SIZE ||
+        (uint64_t)r->c_offset + seki_matrix_span(r->m, r->n, r->ldc) >
+            SEKI_OUTPUT_SIZE) {
+        return false;
+    }
+    return true;
+}
+
+bool seki_copy_valid(const SekiCopyRegs *r)
+{
+    return r->src_offset <= SEKI_OUTPUT_SIZE &&
+           r->len <= SEKI_OUTPUT_SIZE - r->src_offset &&
+           r->dst_offset <= SEKI_INPUT_SIZE &&
+           r->len <= SEKI_INPUT_SIZE - r->dst_offset;
+}
+
+void seki_gemm_setup(SekiDgemm *g, const SekiGemmRegs *r,
+                     uint8_t *input, uint8_t *output)
+{
+    *g = (SekiDgemm) {
+        .transa = r->flags & SEKI_FLAG_TRANSA,
+        .transb = r->flags & SEKI_FLAG_TRANSB,
+        .m = r->m,
+        .n = r->n,
+        .k = r->k,
+        .alpha = seki_reg_to_double(r->alpha),
+        .a = (const double *)(input + r->a_offset),
+        .lda = r->lda,
+        .b = (const double *)(input + r->b_offset),
+        .ldb = r->ldb,
+        .beta = seki_reg_to_double(r->beta),
+        .c = (double *)(output + r->c_offset),
+        .ldc = r->ldc,
+    };
+}
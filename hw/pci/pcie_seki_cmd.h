@@ -0,0 +1,208 @@
+/*
+ * pcie_seki_cmd.h
+ *
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PCIE_SEKI_CMD_H
+#define PCIE_SEKI_CMD_H
+
+#include "qemu-common.h"
+
+#include "pcie_seki_blas.h"
+
+// The guest-visible interface: registers, commands as the guest submits
+// them, and how they map onto the input and output BARs.  Like
+// pcie_seki_blas.h this does not depend on the device, so that tools and
+// tests can validate and execute commands.
+
+// BAR sizes
+#define SEKI_CTRL_SIZE          0x100000    // 1MB
+#define SEKI_INPUT_SIZE         0x8000000   // 128MB
+#define SEKI_OUTPUT_SIZE        0x4000000   // 64MB
+
+// Control BAR registers, all 32-bit little endian.
+// Matrices are column-major, as in the reference BLAS:
+//     C := alpha * op(A) * op(B) + beta * C
+// with op(A) M x K and op(B) K x N.  A and B live in the input BAR, C in the
+// output BAR; the offsets are byte offsets into the respective BAR.
+#define SEKI_REG_ID             0x00    // RO: SEKI_ID_VALUE
+#define SEKI_REG_STATUS         0x04    // RO, except DONE/ERROR are W1C
+#define SEKI_REG_DOORBELL       0x08    // WO: SEKI_CMD_*
+#define SEKI_REG_FLAGS          0x0C    // SEKI_FLAG_*
+#define SEKI_REG_M              0x10
+#define SEKI_REG_N              0x14
+#define SEKI_REG_K              0x18
+#define SEKI_REG_LDA            0x1C    // in elements
+#define SEKI_REG_LDB            0x20
+#define SEKI_REG_LDC            0x24
+#define SEKI_REG_A_OFFSET       0x28
+#define SEKI_REG_B_OFFSET       0x2C
+#define SEKI_REG_C_OFFSET       0x30
+#define SEKI_REG_ALPHA_LO       0x38    // IEEE-754 double, low word first
+#define SEKI_REG_ALPHA_HI       0x3C
+#define SEKI_REG_BETA_LO        0x40
+#define SEKI_REG_BETA_HI        0x44
+#define SEKI_REG_NUM_QUEUES     0x48    // RO: number of queue pairs
+#define SEKI_REG_CARD_ID        0x4C    // RO: peer id for SEKI_CMD_COPY
+
+// DMA engine: a ring of SekiDmaDesc in guest memory.  The guest fills
+// descriptors and advances DMA_TAIL; the engine processes them in order,
+// advances DMA_HEAD and writes each descriptor's status back.
+#define SEKI_REG_DMA_RING_LO    0x80    // guest address of the ring
+#define SEKI_REG_DMA_RING_HI    0x84
+#define SEKI_REG_DMA_RING_SIZE  0x88    // in descriptors
+#define SEKI_REG_DMA_HEAD       0x8C    // RO: next descriptor to process
+#define SEKI_REG_DMA_TAIL       0x90    // doorbell: producer index
+
+// Submission/completion queue pairs.  Queue q has its register block at
+// SEKI_REG_QUEUE_BASE + q * SEKI_QUEUE_STRIDE.  The submission queue is a
+// ring of SekiCommand, the completion queue a ring of SekiCompletion, both
+// in guest memory and both SIZE entries long.  The guest produces commands
+// by advancing SQ_TAIL and consumes completions by advancing CQ_HEAD.
+#define SEKI_REG_QUEUE_BASE     0x1000
+#define SEKI_QUEUE_STRIDE       0x40
+#define SEKI_MAX_QUEUES         64
+#define SEKI_MAX_QUEUE_SIZE     4096
+
+#define SEKI_QREG_SQ_BASE_LO    0x00
+#define SEKI_QREG_SQ_BASE_HI    0x04
+#define SEKI_QREG_CQ_BASE_LO    0x08
+#define SEKI_QREG_CQ_BASE_HI    0x0C
+#define SEKI_QREG_SIZE          0x10    // ignored while commands are queued
+#define SEKI_QREG_SQ_TAIL       0x14    // doorbell
+#define SEKI_QREG_SQ_HEAD       0x18    // RO
+#define SEKI_QREG_CQ_TAIL       0x1C    // RO
+#define SEKI_QREG_CQ_HEAD       0x20
+
+#define SEKI_ID_VALUE           0x5345B100
+
+#define SEKI_STATUS_BUSY        (1u << 0)
+#define SEKI_STATUS_DONE        (1u << 1)
+#define SEKI_STATUS_ERROR       (1u << 2)
+#define SEKI_STATUS_DMA_BUSY    (1u << 3)
+#define SEKI_STATUS_DMA_DONE    (1u << 4)   // W1C, ring drained
+#define SEKI_STATUS_DMA_ERROR   (1u << 5)   // W1C, engine halted
+
+// DMA descriptor, little endian
+typedef struct SekiDmaDesc {
+    uint64_t addr;          // guest address
+    uint64_t offset;        // byte offset into the input or output BAR
+    uint32_t len;
+    uint32_t flags;         // SEKI_DMA_*
+    uint32_t status;        // written back by the engine
+    uint32_t reserved;
+} SekiDmaDesc;
+
+#define SEKI_DMA_FROM_DEVICE    (1u << 0)   // output BAR -> guest, else
+                                            // guest -> input BAR
+#define SEKI_DMA_IRQ            (1u << 1)   // interrupt when completed
+
+#define SEKI_DMA_DESC_DONE      0x1
+#define SEKI_DMA_DESC_ERROR     0x2
+
+#define SEKI_CMD_DGEMM          0x1
+#define SEKI_CMD_COPY           0x2     // queues only, see SekiCopyRegs
+
+#define SEKI_FLAG_TRANSA        (1u << 0)
+#define SEKI_FLAG_TRANSB        (1u << 1)
+
+#define SEKI_CQE_SUCCESS        0x0
+#define SEKI_CQE_INVALID_FIELD  0x1
+#define SEKI_CQE_INVALID_OPCODE 0x2
+
+// Completion queue entry, little endian.  The phase bit flips every time
+// the device wraps around the completion ring, so the guest can poll the
+// ring in memory instead of reading CQ_TAIL.
+typedef struct SekiCompletion {
+    uint32_t cid;
+    uint16_t sq_head;
+    uint16_t status;        // bit 0: phase, bits 15..1: SEKI_CQE_*
+    uint64_t reserved;
+} SekiCompletion;
+
+typedef struct SekiGemmRegs {
+    uint32_t flags;
+    uint32_t m;
+    uint32_t n;
+    uint32_t k;
+    uint32_t lda;
+    uint32_t ldb;
+    uint32_t ldc;
+    uint32_t a_offset;
+    uint32_t b_offset;
+    uint32_t c_offset;
+    uint64_t alpha;     // bit pattern of a double
+    uint64_t beta;
+} SekiGemmRegs;
+
+// Peer-to-peer copy: len bytes from this card's output BAR to the input
+// BAR of card 'peer', which may be this card itself.  The data does not
+// pass through guest memory.
+typedef struct SekiCopyRegs {
+    uint32_t peer;          // SEKI_REG_CARD_ID of the destination
+    uint32_t reserved;
+    uint64_t src_offset;    // into the output BAR
+    uint64_t dst_offset;    // into the peer's input BAR
+    uint64_t len;
+} SekiCopyRegs;
+
+// Submission queue entry, little endian
+typedef struct SekiCommand {
+    uint32_t opcode;        // SEKI_CMD_*
+    uint32_t cid;           // echoed in the completion
+    union {
+        SekiGemmRegs gemm;
+        SekiCopyRegs copy;
+    };
+} SekiCommand;
+
+/* alpha and beta registers hold the bit pattern of a double.  Not
+ * CPU_DoubleU: its double member is softfloat's float64, an integer type. */
+static inline double seki_reg_to_double(uint64_t bits)
+{
+    double d;
+
+    memcpy(&d, &bits, sizeof(d));
+    return d;
+}
+
+static inline uint64_t seki_double_to_reg(double d)
+{
+    uint64_t bits;
+
+    memcpy(&bits, &d, sizeof(bits));
+    return bits;
+}
+
+// Byte order of a command between little endian (the guest's) and host
+void seki_command_from_le(SekiCommand *cmd);
+void seki_command_to_le(SekiCommand *cmd);
+
+// Bytes spanned by a column-major rows x cols matrix with leading dimension ld
+uint64_t seki_matrix_span(uint32_t rows, uint32_t cols, uint32_t ld);
+
+// Whether the operands of a command lie within the BARs
+bool seki_gemm_valid(const SekiGemmRegs *r);
+bool seki_copy_valid(const SekiCopyRegs *r);
+
+// The DGEMM of a valid command, on the given BAR contents
+void seki_gemm_setup(SekiDgemm *g, const SekiGemmRegs *r,
+                     uint8_t *input, uint8_t *output);
+
+
+#endif // PCIE_SEKI_CMD_H
@@ -0,0 +1,365 @@
+/*
+ * pcie_seki_compute.c
+ *
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "qemu/atomic.h"
+#include "qemu/error-report.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "trace.h"
+
+#include "pcie_seki.h"
+
+// Host compute threads shared by all cards, created with the first card
+// and sized for the largest compute-threads any card asked for.  Only
+// touched under the iothread lock.
+static SekiPool *seki_pool;
+static int seki_pool_users;
+
+// All realized cards, for peer-to-peer copies.  Queue workers look cards up
+// without the iothread lock, so the list and p2p_users are protected by
+// seki_cards_lock.
+static QTAILQ_HEAD(, PCIE_Seki_Device_State) seki_cards =
+    QTAILQ_HEAD_INITIALIZER(seki_cards);
+static QemuMutex seki_cards_lock;
+static QemuCond seki_cards_cond;
+
+// Copies are split into chunks that are spread over the pool like tiles
+#define SEKI_COPY_CHUNK         (1 << 20)
+
+// Compute engine
+static PCIESekiDeviceState *seki_card_find(uint32_t id)
+{
+    PCIESekiDeviceState *card;
+
+    QTAILQ_FOREACH(card, &seki_cards, card_next) {
+        if (card->card_id == id) {
+            return card;
+        }
+    }
+    return NULL;
+}
+
+typedef struct SekiGemmJob {
+    const SekiBlasBackend *be;
+    SekiDgemm g;
+} SekiGemmJob;
+
+static void seki_gemm_tile(void *opaque, int tile, void *scratch)
+{
+    SekiGemmJob *job = opaque;
+
+    seki_dgemm_tile(job->be, &job->g, tile, scratch);
+}
+
+typedef struct SekiCopyJob {
+    const uint8_t *src;
+    uint8_t *dst;
+    uint64_t len;
+} SekiCopyJob;
+
+static void seki_copy_chunk(void *opaque, int chunk, void *scratch)
+{
+    SekiCopyJob *job = opaque;
+    uint64_t off = (uint64_t)chunk * SEKI_COPY_CHUNK;
+
+    memcpy(job->dst + off, job->src + off,
+           MIN(job->len - off, SEKI_COPY_CHUNK));
+}
+
+static void seki_execute_copy(PCIESekiDeviceState *seki, SekiRequest *req)
+{
+    const SekiCopyRegs *r = &req->cmd.copy;
+    PCIESekiDeviceState *peer;
+    SekiCopyJob job;
+
+    if (!seki_copy_valid(r)) {
+        req->status = SEKI_CQE_INVALID_FIELD;
+        return;
+    }
+
+    // Pin the peer, so that it cannot be unplugged under the copy
+    qemu_mutex_lock(&seki_cards_lock);
+    peer = seki_card_find(r->peer);
+    if (peer) {
+        peer->p2p_users++;
+    }
+    qemu_mutex_unlock(&seki_cards_lock);
+    if (!peer) {
+        req->status = SEKI_CQE_INVALID_FIELD;
+        return;
+    }
+
+    trace_pcie_seki_copy(seki, req->cmd.cid, r->peer, r->src_offset,
+                         r->dst_offset, r->len);
+    job.src = seki->output_buf + r->src_offset;
+    job.dst = peer->input_buf + r->dst_offset;
+    job.len = r->len;
+    seki_pool_run(seki->pool_client, seki_copy_chunk, &job,
+                  DIV_ROUND_UP(r->len, SEKI_COPY_CHUNK));
+    req->status = SEKI_CQE_SUCCESS;
+
+    // For the peer this is input data like any other.  A copy to the card
+    // itself is replayed from the command.
+    if (peer != seki && peer->capture && r->len) {
+        seki_capture_data(peer->capture, r->dst_offset, job.dst, r->len);
+    }
+
+    qemu_mutex_lock(&seki_cards_lock);
+    if (!--peer->p2p_users) {
+        qemu_cond_broadcast(&seki_cards_cond);
+    }
+    qemu_mutex_unlock(&seki_cards_lock);
+}
+
+// Called from a queue worker thread.  The tiles of the command are spread
+// over the compute pool.
+void pcie_seki_execute(PCIESekiDeviceState *seki, SekiRequest *req)
+{
+    const SekiGemmRegs *r = &req->cmd.gemm;
+    SekiGemmJob job;
+
+    if (req->cmd.opcode == SEKI_CMD_COPY) {
+        seki_execute_copy(seki, req);
+        return;
+    }
+    if (req->cmd.opcode != SEKI_CMD_DGEMM) {
+        req->status = SEKI_CQE_INVALID_OPCODE;
+        return;
+    }
+    if (!seki_gemm_valid(r)) {
+        req->status = SEKI_CQE_INVALID_FIELD;
+        return;
+    }
+
+    trace_pcie_seki_execute(seki, req->cmd.cid, r->m, r->n, r->k, r->flags);
+    job.be = seki->blas;
+    seki_gemm_setup(&job.g, r, seki->input_buf, seki->output_buf);
+    seki_pool_run(seki->pool_client, seki_gemm_tile, &job,
+                  seki_dgemm_tiles(&job.g));
+    req->status = SEKI_CQE_SUCCESS;
+}
+
+// Called with the iothread lock held, once the command has completed.
+// A copy writes the peer's input BAR; if the peer is gone, so is its RAM.
+void pcie_seki_mark_output(PCIESekiDeviceState *seki, const SekiCommand *cmd)
+{
+    const SekiGemmRegs *r = &cmd->gemm;
+    uint64_t len;
+
+    if (cmd->opcode == SEKI_CMD_COPY) {
+        PCIESekiDeviceState *peer;
+
+        if (!cmd->copy.len || !seki_copy_valid(&cmd->copy)) {
+            return;
+        }
+        qemu_mutex_lock(&seki_cards_lock);
+        peer = seki_card_find(cmd->copy.peer);
+        if (peer) {
+            memory_region_set_dirty(peer->input_mr, cmd->copy.dst_offset,
+                                    cmd->copy.len);
+        }
+        qemu_mutex_unlock(&seki_cards_lock);
+        return;
+    }
+    if (cmd->opcode != SEKI_CMD_DGEMM || !seki_gemm_valid(r)) {
+        return;
+    }
+    len = seki_matrix_span(r->m, r->n, r->ldc);
+    if (len) {
+        memory_region_set_dirty(seki->output_mr, r->c_offset, len);
+    }
+}
+
+// Called with the iothread lock held, once the command has completed
+void pcie_seki_count_command(PCIESekiDeviceState *seki,
+                             const SekiRequest *req)
+{
+    SekiCounters *c = &seki->counters;
+    const SekiGemmRegs *r = &req->cmd.gemm;
+
+    if (req->status != SEKI_CQE_SUCCESS) {
+        c->commands_failed++;
+        return;
+    }
+
+    c->commands_completed++;
+    if (req->cmd.opcode == SEKI_CMD_COPY) {
+        c->bytes_p2p += req->cmd.copy.len;
+    } else {
+        c->flops += 2 * (uint64_t)r->m * r->n * r->k;
+    }
+    c->compute_ns += req->compute_ns;
+    c->compute_max_ns = MAX(c->compute_max_ns, req->compute_ns);
+    seki_hist_add(c->compute_hist, req->compute_ns / 1000);
+}
+
+// Called with the iothread lock held
+void pcie_seki_doorbell(PCIESekiDeviceState *seki, uint32_t cmd)
+{
+    SekiRequest *req;
+
+    trace_pcie_seki_doorbell(seki, cmd);
+    if (cmd != SEKI_CMD_DGEMM) {
+        atomic_or(&seki->status, SEKI_STATUS_ERROR);
+        return;
+    }
+
+    // A doorbell while busy is dropped, the guest must poll STATUS first
+    if (atomic_read(&seki->status) & SEKI_STATUS_BUSY) {
+        return;
+    }
+
+    req = g_new0(SekiRequest, 1);
+    req->cmd.opcode = cmd;
+    req->cmd.gemm = seki->regs;
+    req->legacy = true;
+    if (seki->capture) {
+        seki_capture_command(seki->capture, 0, SEKI_CAPTURE_LEGACY,
+                             &req->cmd);
+    }
+
+    atomic_and(&seki->status, ~(SEKI_STATUS_DONE | SEKI_STATUS_ERROR));
+    atomic_or(&seki->status, SEKI_STATUS_BUSY);
+    pcie_seki_queue_submit(&seki->queues[0], req);
+}
+
+int pcie_seki_pool_threads(void)
+{
+    return seki_pool ? seki_pool_threads(seki_pool) : 0;
+}
+
+// Give the card the requested id, or the lowest free one.  Called with the
+// iothread lock held, which serializes changes to the list.
+static int seki_card_add(PCIESekiDeviceState *seki)
+{
+    uint32_t id = seki->card_id;
+
+    if (id == SEKI_CARD_ID_AUTO) {
+        for (id = 0; id < SEKI_MAX_CARDS && seki_card_find(id); id++) {
+        }
+    }
+    if (id >= SEKI_MAX_CARDS) {
+        error_report("pcie-seki: '" SEKI_CARD_ID_PROP "' must be less "
+                     "than %d", SEKI_MAX_CARDS);
+        return -EINVAL;
+    }
+    if (seki_card_find(id)) {
+        error_report("pcie-seki: card id %" PRIu32 " is already in use", id);
+        return -EBUSY;
+    }
+
+    seki->card_id = id;
+    qemu_mutex_lock(&seki_cards_lock);
+    QTAILQ_INSERT_TAIL(&seki_cards, seki, card_next);
+    qemu_mutex_unlock(&seki_cards_lock);
+    return 0;
+}
+
+// Take the card off the list and wait for copies into it to finish
+static void seki_card_remove(PCIESekiDeviceState *seki)
+{
+    qemu_mutex_lock(&seki_cards_lock);
+    QTAILQ_REMOVE(&seki_cards, seki, card_next);
+    while (seki->p2p_users) {
+        qemu_cond_wait(&seki_cards_cond, &seki_cards_lock);
+    }
+    qemu_mutex_unlock(&seki_cards_lock);
+}
+
+int pcie_seki_compute_init(PCIESekiDeviceState *seki)
+{
+    const char *name = seki->blas_name ? seki->blas_name : SEKI_BLAS_AUTO;
+    int rv;
+
+    if (seki->compute_threads < 1 ||
+        seki->compute_threads > SEKI_MAX_COMPUTE_THREADS) {
+        error_report("pcie-seki: '" SEKI_COMPUTE_THREADS_PROP "' must be "
+                     "between 1 and %d", SEKI_MAX_COMPUTE_THREADS);
+        return -EINVAL;
+    }
+
+    seki->blas = seki_blas_find(name);
+    if (!seki->blas) {
+        char *list = seki_blas_list();
+
+        error_report("pcie-seki: BLAS backend '%s' is not available on this "
+                     "host, use one of: %s", name, list);
+        g_free(list);
+        return -EINVAL;
+    }
+
+    rv = seki_card_add(seki);
+    if (rv < 0) {
+        return rv;
+    }
+
+    if (seki->capture_path) {
+        Error *err = NULL;
+
+        seki->capture = seki_capture_open(seki->capture_path, seki->card_id,
+                                          &err);
+        if (!seki->capture) {
+            error_report_err(err);
+            seki_card_remove(seki);
+            return -EIO;
+        }
+    }
+
+    // Cards may use different backends, so the scratch of every pool
+    // thread is sized for the hungriest one
+    if (!seki_pool) {
+        seki_pool = seki_pool_new(seki->compute_threads,
+                                  seki_blas_scratch_size(NULL));
+    } else {
+        seki_pool_grow(seki_pool, seki->compute_threads);
+    }
+    seki_pool_users++;
+    seki->pool_client = seki_pool_client_new(seki_pool);
+    return 0;
+}
+
+// Called after the queues are stopped, or if they were never started
+void pcie_seki_compute_exit(PCIESekiDeviceState *seki)
+{
+    if (!seki->pool_client) {
+        return;
+    }
+
+    seki_card_remove(seki);
+    seki_pool_client_free(seki->pool_client);
+    seki->pool_client = NULL;
+    if (!--seki_pool_users) {
+        seki_pool_free(seki_pool);
+        seki_pool = NULL;
+    }
+
+    if (seki->capture) {
+        seki_capture_close(seki->capture);
+        seki->capture = NULL;
+    }
+}
+
+void pcie_seki_compute_class_init(void)
+{
+    qemu_mutex_init(&seki_cards_lock);
+    qemu_cond_init(&seki_cards_cond);
+}
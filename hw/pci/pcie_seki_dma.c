@@ -0,0 +1,212 @@
+/*
+ * pcie_seki_dma.c
+ *
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/main-loop.h"
+#include "hw/pci/msi.h"
+#include "trace.h"
+
+#include "pcie_seki.h"
+
+// Descriptors handled per bottom half run, so that a long ring does not
+// starve the main loop
+#define SEKI_DMA_BATCH      256
+
+// A run of descriptors whose guest and device ranges are both contiguous
+// and which move data in the same direction.  A whole run is moved with a
+// single pci_dma_read/pci_dma_write.
+typedef struct SekiDmaRun {
+    uint32_t first;         // ring index of the first descriptor
+    uint32_t count;
+    uint32_t flags;
+    dma_addr_t addr;
+    uint64_t offset;
+    uint64_t len;
+} SekiDmaRun;
+
+static bool seki_dma_run_extends(const SekiDmaRun *run, const SekiDmaDesc *d)
+{
+    return run->count &&
+           run->flags == d->flags &&
+           run->addr + run->len == d->addr &&
+           run->offset + run->len == d->offset;
+}
+
+static hwaddr seki_dma_desc_addr(PCIESekiDeviceState *seki, uint32_t index)
+{
+    return seki->dma_ring + (hwaddr)index * sizeof(SekiDmaDesc);
+}
+
+static bool seki_dma_transfer(PCIESekiDeviceState *seki, const SekiDmaRun *run)
+{
+    PCIDevice *dev = PCI_DEVICE(seki);
+
+    if (run->flags & SEKI_DMA_FROM_DEVICE) {
+        if (run->offset > SEKI_OUTPUT_SIZE ||
+            run->len > SEKI_OUTPUT_SIZE - run->offset) {
+            return false;
+        }
+        pci_dma_write(dev, run->addr, seki->output_buf + run->offset,
+                      run->len);
+        seki->counters.bytes_out += run->len;
+    } else {
+        if (run->offset > SEKI_INPUT_SIZE ||
+            run->len > SEKI_INPUT_SIZE - run->offset) {
+            return false;
+        }
+        pci_dma_read(dev, run->addr, seki->input_buf + run->offset, run->len);
+        memory_region_set_dirty(seki->input_mr, run->offset, run->len);
+        if (seki->capture) {
+            seki_capture_data(seki->capture, run->offset,
+                              seki->input_buf + run->offset, run->len);
+        }
+        seki->counters.bytes_in += run->len;
+    }
+    return true;
+}
+
+// Move the data of a run and write back the status of its descriptors.
+// Returns false if the engine must halt.
+static bool seki_dma_flush_run(PCIESekiDeviceState *seki, SekiDmaRun *run,
+                               bool *notify)
+{
+    PCIDevice *dev = PCI_DEVICE(seki);
+    uint32_t status, i;
+    bool ok;
+
+    if (!run->count) {
+        return true;
+    }
+
+    trace_pcie_seki_dma_run(seki, run->first, run->count, run->addr,
+                            run->offset, run->len, run->flags);
+    ok = seki_dma_transfer(seki, run);
+    status = ok ? SEKI_DMA_DESC_DONE : SEKI_DMA_DESC_ERROR;
+    for (i = 0; i < run->count; i++) {
+        uint32_t index = (run->first + i) % seki->dma_ring_size;
+
+        stl_le_pci_dma(dev, seki_dma_desc_addr(seki, index) +
+                       offsetof(SekiDmaDesc, status), status);
+    }
+
+    if (run->flags & SEKI_DMA_IRQ) {
+        *notify = true;
+    }
+    run->count = 0;
+    return ok;
+}
+
+static void seki_dma_bh(void *opaque)
+{
+    PCIESekiDeviceState *seki = opaque;
+    PCIDevice *dev = PCI_DEVICE(seki);
+    SekiDmaRun run = { 0 };
+    bool notify = false;
+    bool ok = true;
+    int budget = SEKI_DMA_BATCH;
+
+    while (seki->dma_head != seki->dma_tail && budget--) {
+        SekiDmaDesc d;
+
+        pci_dma_read(dev, seki_dma_desc_addr(seki, seki->dma_head),
+                     &d, sizeof(d));
+        d.addr = le64_to_cpu(d.addr);
+        d.offset = le64_to_cpu(d.offset);
+        d.len = le32_to_cpu(d.len);
+        d.flags = le32_to_cpu(d.flags);
+
+        if (!seki_dma_run_extends(&run, &d)) {
+            ok = seki_dma_flush_run(seki, &run, &notify);
+            if (!ok) {
+                break;
+            }
+            run.first = seki->dma_head;
+            run.flags = d.flags;
+            run.addr = d.addr;
+            run.offset = d.offset;
+            run.len = 0;
+        }
+        run.len += d.len;
+        run.count++;
+
+        seki->dma_head = (seki->dma_head + 1) % seki->dma_ring_size;
+    }
+
+    if (ok) {
+        ok = seki_dma_flush_run(seki, &run, &notify);
+    }
+
+    if (!ok) {
+        trace_pcie_seki_dma_error(seki, seki->dma_head);
+        atomic_and(&seki->status, ~SEKI_STATUS_DMA_BUSY);
+        atomic_or(&seki->status, SEKI_STATUS_DMA_ERROR);
+        notify = true;
+    } else if (seki->dma_head == seki->dma_tail) {
+        atomic_and(&seki->status, ~SEKI_STATUS_DMA_BUSY);
+        atomic_or(&seki->status, SEKI_STATUS_DMA_DONE);
+    } else {
+        qemu_bh_schedule(seki->dma_bh);
+    }
+
+    if (notify && msi_enabled(dev)) {
+        msi_notify(dev, 0);
+    }
+}
+
+// Called with the iothread lock held, after the guest moved DMA_TAIL
+void pcie_seki_dma_kick(PCIESekiDeviceState *seki)
+{
+    if (atomic_read(&seki->status) & SEKI_STATUS_DMA_ERROR) {
+        return;
+    }
+
+    if (!seki->dma_ring_size || seki->dma_tail >= seki->dma_ring_size) {
+        atomic_or(&seki->status, SEKI_STATUS_DMA_ERROR);
+        return;
+    }
+
+    if (seki->dma_head != seki->dma_tail) {
+        atomic_and(&seki->status, ~SEKI_STATUS_DMA_DONE);
+        atomic_or(&seki->status, SEKI_STATUS_DMA_BUSY);
+        qemu_bh_schedule(seki->dma_bh);
+    }
+}
+
+void pcie_seki_dma_init(PCIESekiDeviceState *seki)
+{
+    QEMU_BUILD_BUG_ON(sizeof(SekiDmaDesc) != 32);
+
+    seki->dma_bh = qemu_bh_new(seki_dma_bh, seki);
+}
+
+void pcie_seki_dma_exit(PCIESekiDeviceState *seki)
+{
+    qemu_bh_delete(seki->dma_bh);
+}
+
+void pcie_seki_dma_reset(PCIESekiDeviceState *seki)
+{
+    qemu_bh_cancel(seki->dma_bh);
+    seki->dma_ring = 0;
+    seki->dma_ring_size = 0;
+    seki->dma_head = 0;
+    seki->dma_tail = 0;
+}
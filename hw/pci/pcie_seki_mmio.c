@@ -18,22 +18,167 @@
  * with this program; if not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/bitops.h"
+#include "qemu/error-report.h"
+#include "qapi/error.h"
+#include "migration/vmstate.h"
+#include "trace.h"
+
 #include "pcie_seki.h"
 
 // Ctrl Memory Region
+static uint64_t seki_ctrl_reg_read(PCIESekiDeviceState *seki, hwaddr addr)
+{
+    SekiGemmRegs *r = &seki->regs;
+
+    if (addr >= SEKI_REG_QUEUE_BASE) {
+        return pcie_seki_queue_read(seki, addr);
+    }
+
+    switch (addr) {
+    case SEKI_REG_ID:
+        return SEKI_ID_VALUE;
+    case SEKI_REG_STATUS:
+        return atomic_read(&seki->status);
+    case SEKI_REG_FLAGS:
+        return r->flags;
+    case SEKI_REG_M:
+        return r->m;
+    case SEKI_REG_N:
+        return r->n;
+    case SEKI_REG_K:
+        return r->k;
+    case SEKI_REG_LDA:
+        return r->lda;
+    case SEKI_REG_LDB:
+        return r->ldb;
+    case SEKI_REG_LDC:
+        return r->ldc;
+    case SEKI_REG_A_OFFSET:
+        return r->a_offset;
+    case SEKI_REG_B_OFFSET:
+        return r->b_offset;
+    case SEKI_REG_C_OFFSET:
+        return r->c_offset;
+    case SEKI_REG_ALPHA_LO:
+        return (uint32_t)r->alpha;
+    case SEKI_REG_ALPHA_HI:
+        return r->alpha >> 32;
+    case SEKI_REG_BETA_LO:
+        return (uint32_t)r->beta;
+    case SEKI_REG_BETA_HI:
+        return r->beta >> 32;
+    case SEKI_REG_NUM_QUEUES:
+        return seki->num_queues;
+    case SEKI_REG_CARD_ID:
+        return seki->card_id;
+    case SEKI_REG_DMA_RING_LO:
+        return (uint32_t)seki->dma_ring;
+    case SEKI_REG_DMA_RING_HI:
+        return seki->dma_ring >> 32;
+    case SEKI_REG_DMA_RING_SIZE:
+        return seki->dma_ring_size;
+    case SEKI_REG_DMA_HEAD:
+        return seki->dma_head;
+    case SEKI_REG_DMA_TAIL:
+        return seki->dma_tail;
+    }
+
+    return 0;
+}
+
 static uint64_t
 seki_ctrl_memregion_read(void *opaque, hwaddr addr, unsigned size)
 {
-    fprintf(stderr, "CTRL MMIO Read at 0x%16lx, size 0x%8x\n", addr, size);
-    return 0;
+    PCIESekiDeviceState *seki = opaque;
+    uint64_t val = seki_ctrl_reg_read(seki, addr);
+
+    trace_pcie_seki_ctrl_read(seki, addr, size, val);
+    return val;
 }
 
 static void
 seki_ctrl_memregion_write(void *opaque, hwaddr addr, uint64_t val,
                  unsigned size)
 {
-    fprintf(stderr, "CTRL MMIO Write at 0x%16lx, size 0x%8x, value 0x%lx\n",
-            addr, size, val);
+    PCIESekiDeviceState *seki = opaque;
+    SekiGemmRegs *r = &seki->regs;
+
+    trace_pcie_seki_ctrl_write(seki, addr, size, val);
+    if (addr >= SEKI_REG_QUEUE_BASE) {
+        pcie_seki_queue_write(seki, addr, val);
+        return;
+    }
+
+    switch (addr) {
+    case SEKI_REG_STATUS:
+        atomic_and(&seki->status,
+                   ~(val & (SEKI_STATUS_DONE | SEKI_STATUS_ERROR |
+                            SEKI_STATUS_DMA_DONE | SEKI_STATUS_DMA_ERROR)));
+        break;
+    case SEKI_REG_DOORBELL:
+        pcie_seki_doorbell(seki, val);
+        break;
+    case SEKI_REG_FLAGS:
+        r->flags = val;
+        break;
+    case SEKI_REG_M:
+        r->m = val;
+        break;
+    case SEKI_REG_N:
+        r->n = val;
+        break;
+    case SEKI_REG_K:
+        r->k = val;
+        break;
+    case SEKI_REG_LDA:
+        r->lda = val;
+        break;
+    case SEKI_REG_LDB:
+        r->ldb = val;
+        break;
+    case SEKI_REG_LDC:
+        r->ldc = val;
+        break;
+    case SEKI_REG_A_OFFSET:
+        r->a_offset = val;
+        break;
+    case SEKI_REG_B_OFFSET:
+        r->b_offset = val;
+        break;
+    case SEKI_REG_C_OFFSET:
+        r->c_offset = val;
+        break;
+    case SEKI_REG_ALPHA_LO:
+        r->alpha = deposit64(r->alpha, 0, 32, val);
+        break;
+    case SEKI_REG_ALPHA_HI:
+        r->alpha = deposit64(r->alpha, 32, 32, val);
+        break;
+    case SEKI_REG_BETA_LO:
+        r->beta = deposit64(r->beta, 0, 32, val);
+        break;
+    case SEKI_REG_BETA_HI:
+        r->beta = deposit64(r->beta, 32, 32, val);
+        break;
+    case SEKI_REG_DMA_RING_LO:
+        seki->dma_ring = deposit64(seki->dma_ring, 0, 32, val);
+        break;
+    case SEKI_REG_DMA_RING_HI:
+        seki->dma_ring = deposit64(seki->dma_ring, 32, 32, val);
+        break;
+    case SEKI_REG_DMA_RING_SIZE:
+        // Resizing the ring restarts it from the beginning
+        seki->dma_ring_size = val;
+        seki->dma_head = seki->dma_tail = 0;
+        break;
+    case SEKI_REG_DMA_TAIL:
+        seki->dma_tail = val;
+        pcie_seki_dma_kick(seki);
+        break;
+    }
 }
 
 const MemoryRegionOps seki_ctrl_memregion_ops = {
@@ -46,82 +191,93 @@ const MemoryRegionOps seki_ctrl_memregion_ops = {
     },
 };
 
-// Input Memory Region
-static uint64_t
-seki_input_memregion_read(void *opaque, hwaddr addr, unsigned size)
-{
-    fprintf(stderr, "INPUT MMIO Read at 0x%16lx, size 0x%8x\n", addr, size);
-    return 0;
-}
+// End of MMIO functions/data structures
 
-static void
-seki_input_memregion_write(void *opaque, hwaddr addr, uint64_t val,
-                 unsigned size)
-{
-    fprintf(stderr, "INPUT MMIO Write at 0x%16lx, size 0x%8x, value 0x%lx\n",
-            addr, size, val);
-}
 
-const MemoryRegionOps seki_input_memregion_ops = {
-    .read   = seki_input_memregion_read,
-    .write  = seki_input_memregion_write,
-    .endianness = DEVICE_LITTLE_ENDIAN,
-    .impl = {
-        .min_access_size = 4,
-        .max_access_size = 4,
-    },
-};
 
-// Output Memory Region
-static uint64_t
-seki_output_memregion_read(void *opaque, hwaddr addr, unsigned size)
+// Input/output BARs are plain RAM so that the guest CPU reads and writes
+// them directly through the softmmu TLB or KVM.  They can be backed by a
+// memory backend object (e.g. memory-backend-file on hugetlbfs).
+static MemoryRegion *seki_ram_bar(PCIESekiDeviceState *seki,
+                                  HostMemoryBackend *memdev,
+                                  MemoryRegion *own, const char *name,
+                                  uint64_t size, Error **errp)
 {
-    fprintf(stderr, "OUTPUT MMIO Read at 0x%16lx, size 0x%8x\n", addr, size);
-    return 0;
-}
+    MemoryRegion *mr;
 
-static void
-seki_output_memregion_write(void *opaque, hwaddr addr, uint64_t val,
-                 unsigned size)
-{
-    fprintf(stderr, "OUTPUT MMIO Write at 0x%16lx, size 0x%8x, value 0x%lx\n",
-            addr, size, val);
+    if (!memdev) {
+        memory_region_init_ram(own, OBJECT(seki), name, size, errp);
+        return own;
+    }
+
+    mr = host_memory_backend_get_memory(memdev, errp);
+    if (!mr) {
+        return NULL;
+    }
+    if (memory_region_size(mr) != size) {
+        error_setg(errp, "%s: memdev must be exactly %" PRIu64 " bytes",
+                   name, size);
+        return NULL;
+    }
+    return mr;
 }
 
-const MemoryRegionOps seki_output_memregion_ops = {
-    .read   = seki_output_memregion_read,
-    .write  = seki_output_memregion_write,
-    .endianness = DEVICE_LITTLE_ENDIAN,
-    .impl = {
-        .min_access_size = 4,
-        .max_access_size = 4,
-    },
-};
-// End of MMIO functions/data structures
+int pcie_seki_setup_mmio(PCIDevice *dev, PCIESekiDeviceState *seki)
+{
+    Error *err = NULL;
 
+    seki->input_mr = seki_ram_bar(seki, seki->input_memdev,
+                                  &seki->input_memregion, "seki-input",
+                                  SEKI_INPUT_SIZE, &err);
+    if (err) {
+        goto err;
+    }
+    seki->output_mr = seki_ram_bar(seki, seki->output_memdev,
+                                   &seki->output_memregion, "seki-output",
+                                   SEKI_OUTPUT_SIZE, &err);
+    if (err) {
+        goto err;
+    }
 
+    vmstate_register_ram(seki->input_mr, DEVICE(seki));
+    vmstate_register_ram(seki->output_mr, DEVICE(seki));
+    seki->input_buf = memory_region_get_ram_ptr(seki->input_mr);
+    seki->output_buf = memory_region_get_ram_ptr(seki->output_mr);
 
-void pcie_seki_setup_mmio(PCIDevice *dev, PCIESekiDeviceState *seki)
-{
     // Setup MMIO, each 64-bit BAR takes 2 registers
     // Control/Status Registers
     memory_region_init_io(&seki->ctrl_memregion, OBJECT(seki), &seki_ctrl_memregion_ops,
-                          seki, "seki-mmio", 0x100000); // 1MB 0x100000
+                          seki, "seki-mmio", SEKI_CTRL_SIZE);
 
     pci_register_bar(dev, 0, PCI_BASE_ADDRESS_MEM_TYPE_64 |
                      PCI_BASE_ADDRESS_SPACE_MEMORY, &seki->ctrl_memregion);
 
     // Input Memory
-    memory_region_init_io(&seki->input_memregion, OBJECT(seki), &seki_input_memregion_ops,
-                          seki, "seki-mmio", 0x8000000); // 128MB 0x8000000
-
     pci_register_bar(dev, 2, PCI_BASE_ADDRESS_MEM_TYPE_64 |
-                     PCI_BASE_ADDRESS_SPACE_MEMORY, &seki->input_memregion);
+                     PCI_BASE_ADDRESS_SPACE_MEMORY |
+                     PCI_BASE_ADDRESS_MEM_PREFETCH, seki->input_mr);
 
     // Output Memory
-    memory_region_init_io(&seki->output_memregion, OBJECT(seki), &seki_output_memregion_ops,
-                          seki, "seki-mmio", 0x4000000); // 64MB 0x8000000
-
     pci_register_bar(dev, 4, PCI_BASE_ADDRESS_MEM_TYPE_64 |
-                     PCI_BASE_ADDRESS_SPACE_MEMORY, &seki->output_memregion);
+                     PCI_BASE_ADDRESS_SPACE_MEMORY |
+                     PCI_BASE_ADDRESS_MEM_PREFETCH, seki->output_mr);
+
+    return 0;
+
+err:
+    error_report("pcie-seki: %s", error_get_pretty(err));
+    error_free(err);
+    return -ENOMEM;
+}
+
+void pcie_seki_free_mmio(PCIESekiDeviceState *seki)
+{
+    if (seki->input_buf) {
+        vmstate_unregister_ram(seki->input_mr, DEVICE(seki));
+    }
+    if (seki->output_buf) {
+        vmstate_unregister_ram(seki->output_mr, DEVICE(seki));
+    }
+    seki->input_buf = NULL;
+    seki->output_buf = NULL;
 }
@@ -0,0 +1,358 @@
+/*
+ * pcie_seki_pool.c
+ *
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+
+#include "pcie_seki_blas.h"
+
+// A job's tiles are split into one range per pool thread.  A range packs
+// [lo, hi) into 64 bits so that taking from the front (owner) and from the
+// back (thief) are both a single compare-and-swap.
+#define SEKI_RANGE(lo, hi)      (((uint64_t)(lo) << 32) | (uint32_t)(hi))
+#define SEKI_RANGE_LO(r)        ((uint32_t)((r) >> 32))
+#define SEKI_RANGE_HI(r)        ((uint32_t)(r))
+
+typedef struct SekiPoolJob {
+    SekiPoolClient *client;
+    SekiPoolFunc *fn;
+    void *opaque;
+    int nranges;
+    uint64_t *ranges;
+
+    // Protected by the pool lock
+    int remaining;          // tiles not finished
+    int users;              // pool threads looking at the job
+    bool listed;            // on client->jobs, may still have tiles
+    QTAILQ_ENTRY(SekiPoolJob) next;
+} SekiPoolJob;
+
+struct SekiPoolClient {
+    SekiPool *pool;
+    QTAILQ_HEAD(, SekiPoolJob) jobs;
+    QTAILQ_ENTRY(SekiPoolClient) next;
+};
+
+typedef struct SekiPoolSlot {
+    struct SekiPool *pool;
+    int index;
+    void *scratch;
+    QemuThread thread;
+} SekiPoolSlot;
+
+struct SekiPool {
+    size_t scratch_size;
+    SekiPoolSlot *slots;    // SEKI_POOL_MAX_THREADS entries
+
+    QemuMutex lock;
+    QemuCond wake;          // a job was queued, or stopping
+    QemuCond done;          // a job finished
+    int threads;
+    QTAILQ_HEAD(, SekiPoolClient) clients;
+    SekiPoolClient *next_client;    // round-robin cursor
+    bool stopping;
+};
+
+static bool seki_pool_take(SekiPoolJob *job, int index, int *tile)
+{
+    uint64_t r, old;
+
+    if (index >= job->nranges) {
+        return false;
+    }
+
+    r = atomic_read(&job->ranges[index]);
+    while (SEKI_RANGE_LO(r) < SEKI_RANGE_HI(r)) {
+        old = atomic_cmpxchg(&job->ranges[index], r,
+                             SEKI_RANGE(SEKI_RANGE_LO(r) + 1,
+                                        SEKI_RANGE_HI(r)));
+        if (old == r) {
+            *tile = SEKI_RANGE_LO(r);
+            return true;
+        }
+        r = old;
+    }
+    return false;
+}
+
+// Steal from the first non-empty range after our own.  A thread with a
+// range in the job takes the back half and keeps the rest as its range, so
+// that it can be stolen in turn; a thread that joined the pool after the
+// job was queued only takes single tiles.
+static bool seki_pool_steal(SekiPoolJob *job, int index, bool own, int *tile)
+{
+    int i;
+
+    for (i = 1; i <= job->nranges; i++) {
+        int victim = (index + i) % job->nranges;
+        uint64_t r;
+
+        if (own && victim == index) {
+            continue;
+        }
+
+        r = atomic_read(&job->ranges[victim]);
+        while (SEKI_RANGE_LO(r) < SEKI_RANGE_HI(r)) {
+            uint32_t lo = SEKI_RANGE_LO(r), hi = SEKI_RANGE_HI(r);
+            uint32_t mid = own ? hi - (hi - lo + 1) / 2 : hi - 1;
+            uint64_t old;
+
+            old = atomic_cmpxchg(&job->ranges[victim], r, SEKI_RANGE(lo, mid));
+            if (old == r) {
+                // Our range is empty, so no thief can be updating it
+                if (own && mid + 1 < hi) {
+                    atomic_set(&job->ranges[index], SEKI_RANGE(mid + 1, hi));
+                }
+                *tile = mid;
+                return true;
+            }
+            r = old;
+        }
+    }
+    return false;
+}
+
+static bool seki_pool_next_tile(SekiPoolJob *job, int index, int *tile)
+{
+    bool own = index < job->nranges;
+
+    return (own && seki_pool_take(job, index, tile)) ||
+           seki_pool_steal(job, index, own, tile);
+}
+
+// Fair scheduling: clients (devices) take turns, and each client's jobs
+// take turns, one tile at a time.  Called with the pool lock held.
+static SekiPoolJob *seki_pool_pick(SekiPool *pool)
+{
+    SekiPoolClient *c = pool->next_client;
+    SekiPoolClient *start;
+    SekiPoolJob *job;
+
+    if (!c) {
+        c = QTAILQ_FIRST(&pool->clients);
+    }
+    start = c;
+    while (c) {
+        job = QTAILQ_FIRST(&c->jobs);
+        if (job) {
+            QTAILQ_REMOVE(&c->jobs, job, next);
+            QTAILQ_INSERT_TAIL(&c->jobs, job, next);
+            pool->next_client = QTAILQ_NEXT(c, next);
+            return job;
+        }
+        c = QTAILQ_NEXT(c, next) ? QTAILQ_NEXT(c, next)
+                                 : QTAILQ_FIRST(&pool->clients);
+        if (c == start) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void seki_pool_unlist(SekiPoolJob *job)
+{
+    if (job->listed) {
+        QTAILQ_REMOVE(&job->client->jobs, job, next);
+        job->listed = false;
+    }
+}
+
+static void *seki_pool_thread(void *opaque)
+{
+    SekiPoolSlot *slot = opaque;
+    SekiPool *pool = slot->pool;
+
+    qemu_mutex_lock(&pool->lock);
+    for (;;) {
+        SekiPoolJob *job;
+        bool got;
+        int tile;
+
+        while (!pool->stopping && !(job = seki_pool_pick(pool))) {
+            qemu_cond_wait(&pool->wake, &pool->lock);
+        }
+        if (pool->stopping) {
+            break;
+        }
+
+        job->users++;
+        qemu_mutex_unlock(&pool->lock);
+
+        got = seki_pool_next_tile(job, slot->index, &tile);
+        if (got) {
+            job->fn(job->opaque, tile, slot->scratch);
+        }
+
+        qemu_mutex_lock(&pool->lock);
+        job->users--;
+        if (got) {
+            job->remaining--;
+        } else {
+            // Every tile is taken, stop handing the job out
+            seki_pool_unlist(job);
+        }
+        if (!job->remaining && !job->users) {
+            qemu_cond_broadcast(&pool->done);
+        }
+    }
+    qemu_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+void seki_pool_run(SekiPoolClient *client, SekiPoolFunc *fn, void *opaque,
+                   int ntiles)
+{
+    SekiPool *pool = client->pool;
+    SekiPoolJob job = {
+        .client = client,
+        .fn = fn,
+        .opaque = opaque,
+        .remaining = ntiles,
+        .listed = true,
+    };
+    int i;
+
+    if (ntiles <= 0) {
+        return;
+    }
+
+    qemu_mutex_lock(&pool->lock);
+    job.nranges = MIN(pool->threads, ntiles);
+    job.ranges = g_new(uint64_t, job.nranges);
+    for (i = 0; i < job.nranges; i++) {
+        job.ranges[i] = SEKI_RANGE((int64_t)ntiles * i / job.nranges,
+                                   (int64_t)ntiles * (i + 1) / job.nranges);
+    }
+    QTAILQ_INSERT_TAIL(&client->jobs, &job, next);
+    if (job.nranges == 1) {
+        qemu_cond_signal(&pool->wake);
+    } else {
+        qemu_cond_broadcast(&pool->wake);
+    }
+
+    while (job.remaining || job.users) {
+        qemu_cond_wait(&pool->done, &pool->lock);
+    }
+    seki_pool_unlist(&job);
+    qemu_mutex_unlock(&pool->lock);
+
+    g_free(job.ranges);
+}
+
+SekiPoolClient *seki_pool_client_new(SekiPool *pool)
+{
+    SekiPoolClient *client = g_new0(SekiPoolClient, 1);
+
+    client->pool = pool;
+    QTAILQ_INIT(&client->jobs);
+
+    qemu_mutex_lock(&pool->lock);
+    QTAILQ_INSERT_TAIL(&pool->clients, client, next);
+    qemu_mutex_unlock(&pool->lock);
+    return client;
+}
+
+// The client must have no job running
+void seki_pool_client_free(SekiPoolClient *client)
+{
+    SekiPool *pool = client->pool;
+
+    qemu_mutex_lock(&pool->lock);
+    assert(QTAILQ_EMPTY(&client->jobs));
+    if (pool->next_client == client) {
+        pool->next_client = QTAILQ_NEXT(client, next);
+    }
+    QTAILQ_REMOVE(&pool->clients, client, next);
+    qemu_mutex_unlock(&pool->lock);
+
+    g_free(client);
+}
+
+int seki_pool_threads(SekiPool *pool)
+{
+    int threads;
+
+    qemu_mutex_lock(&pool->lock);
+    threads = pool->threads;
+    qemu_mutex_unlock(&pool->lock);
+    return threads;
+}
+
+// Add threads until the pool has at least the given number.  Jobs already
+// queued keep their ranges; the new threads help them by stealing.
+void seki_pool_grow(SekiPool *pool, int threads)
+{
+    threads = MIN(threads, SEKI_POOL_MAX_THREADS);
+
+    qemu_mutex_lock(&pool->lock);
+    while (pool->threads < threads) {
+        SekiPoolSlot *slot = &pool->slots[pool->threads];
+
+        slot->pool = pool;
+        slot->index = pool->threads;
+        slot->scratch = qemu_memalign(64, pool->scratch_size);
+        qemu_thread_create(&slot->thread, "seki-compute",
+                           seki_pool_thread, slot, QEMU_THREAD_JOINABLE);
+        pool->threads++;
+    }
+    qemu_mutex_unlock(&pool->lock);
+}
+
+SekiPool *seki_pool_new(int threads, size_t scratch_size)
+{
+    SekiPool *pool = g_new0(SekiPool, 1);
+
+    pool->scratch_size = scratch_size;
+    pool->slots = g_new0(SekiPoolSlot, SEKI_POOL_MAX_THREADS);
+    QTAILQ_INIT(&pool->clients);
+    qemu_mutex_init(&pool->lock);
+    qemu_cond_init(&pool->wake);
+    qemu_cond_init(&pool->done);
+
+    seki_pool_grow(pool, MAX(threads, 1));
+    return pool;
+}
+
+// All clients must be gone
+void seki_pool_free(SekiPool *pool)
+{
+    int i;
+
+    assert(QTAILQ_EMPTY(&pool->clients));
+
+    qemu_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    qemu_cond_broadcast(&pool->wake);
+    qemu_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->threads; i++) {
+        qemu_thread_join(&pool->slots[i].thread);
+        qemu_vfree(pool->slots[i].scratch);
+    }
+
+    qemu_cond_destroy(&pool->done);
+    qemu_cond_destroy(&pool->wake);
+    qemu_mutex_destroy(&pool->lock);
+    g_free(pool->slots);
+    g_free(pool);
+}
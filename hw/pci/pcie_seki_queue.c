@@ -0,0 +1,522 @@
+/*
+ * pcie_seki_queue.c
+ *
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/bitops.h"
+#include "qemu/main-loop.h"
+#include "qemu/timer.h"
+#include "hw/pci/msi.h"
+#include "trace.h"
+
+#include "pcie_seki.h"
+
+static bool seki_cq_full(SekiQueue *q)
+{
+    return (q->cq_tail + 1) % q->size == q->cq_head;
+}
+
+// Worker thread: executes submitted requests in order
+static void *seki_queue_thread(void *opaque)
+{
+    SekiQueue *q = opaque;
+
+    qemu_mutex_lock(&q->lock);
+    while (1) {
+        SekiRequest *req;
+        int64_t start;
+
+        while ((QSIMPLEQ_EMPTY(&q->submitted) || q->paused) && !q->stopping) {
+            qemu_cond_wait(&q->cond, &q->lock);
+        }
+        if (q->stopping) {
+            break;
+        }
+
+        req = QSIMPLEQ_FIRST(&q->submitted);
+        QSIMPLEQ_REMOVE_HEAD(&q->submitted, next);
+        q->busy = true;
+        qemu_mutex_unlock(&q->lock);
+
+        start = get_clock();
+        pcie_seki_execute(q->seki, req);
+        req->compute_ns = get_clock() - start;
+        req->done = true;
+        trace_pcie_seki_complete(q->seki, q->id, req->cmd.cid, req->status,
+                                 req->compute_ns);
+
+        qemu_mutex_lock(&q->lock);
+        QSIMPLEQ_INSERT_TAIL(&q->completed, req, next);
+        q->busy = false;
+        qemu_cond_broadcast(&q->cond);
+        qemu_bh_schedule(q->seki->irq_bh);
+    }
+    qemu_mutex_unlock(&q->lock);
+
+    return NULL;
+}
+
+void pcie_seki_queue_submit(SekiQueue *q, SekiRequest *req)
+{
+    qemu_mutex_lock(&q->lock);
+    QSIMPLEQ_INSERT_TAIL(&q->submitted, req, next);
+    qemu_cond_signal(&q->cond);
+    qemu_mutex_unlock(&q->lock);
+}
+
+// Pull new commands off the submission ring.  At most q->size commands are
+// outstanding, so every one of them is guaranteed a completion slot in turn.
+static void seki_queue_fetch(SekiQueue *q)
+{
+    PCIDevice *dev = PCI_DEVICE(q->seki);
+
+    while (q->sq_head != q->sq_tail && q->outstanding < q->size) {
+        SekiRequest *req = g_new0(SekiRequest, 1);
+
+        pci_dma_read(dev, q->sq_base +
+                     (hwaddr)q->sq_head * sizeof(SekiCommand),
+                     &req->cmd, sizeof(req->cmd));
+        seki_command_from_le(&req->cmd);
+        if (q->seki->capture) {
+            seki_capture_command(q->seki->capture, q->id, 0, &req->cmd);
+        }
+        q->sq_head = (q->sq_head + 1) % q->size;
+        q->outstanding++;
+        seki_hist_add(q->depth_hist, q->outstanding);
+        trace_pcie_seki_fetch(q->seki, q->id, req->cmd.cid, req->cmd.opcode,
+                              q->outstanding);
+
+        pcie_seki_queue_submit(q, req);
+    }
+}
+
+// Write completions into the CQ while there is room.  Returns true if any
+// completion was posted.
+static bool seki_queue_post(SekiQueue *q)
+{
+    PCIDevice *dev = PCI_DEVICE(q->seki);
+    SekiRequest *req;
+    bool posted = false;
+
+    while ((req = QSIMPLEQ_FIRST(&q->cq_wait)) != NULL && !seki_cq_full(q)) {
+        SekiCompletion cqe = {
+            .cid = cpu_to_le32(req->cmd.cid),
+            .sq_head = cpu_to_le16(q->sq_head),
+            .status = cpu_to_le16((req->status << 1) | q->cq_phase),
+        };
+
+        QSIMPLEQ_REMOVE_HEAD(&q->cq_wait, next);
+        trace_pcie_seki_post(q->seki, q->id, req->cmd.cid, q->cq_tail,
+                             req->status);
+        pci_dma_write(dev, q->cq_base +
+                      (hwaddr)q->cq_tail * sizeof(SekiCompletion),
+                      &cqe, sizeof(cqe));
+        q->cq_tail++;
+        if (q->cq_tail == q->size) {
+            q->cq_tail = 0;
+            q->cq_phase = !q->cq_phase;
+        }
+        q->outstanding--;
+        g_free(req);
+        posted = true;
+    }
+
+    // Completions free up room for commands the guest already queued
+    if (posted) {
+        seki_queue_fetch(q);
+    }
+    return posted;
+}
+
+// Collect what the worker finished.  Legacy requests complete through the
+// STATUS register, the others wait for room in the CQ.  Returns true if the
+// guest needs an interrupt.
+static bool seki_queue_reap(SekiQueue *q)
+{
+    PCIESekiDeviceState *seki = q->seki;
+    QSIMPLEQ_HEAD(, SekiRequest) done = QSIMPLEQ_HEAD_INITIALIZER(done);
+    SekiRequest *req;
+    bool notify = false;
+
+    qemu_mutex_lock(&q->lock);
+    QSIMPLEQ_CONCAT(&done, &q->completed);
+    qemu_mutex_unlock(&q->lock);
+
+    while ((req = QSIMPLEQ_FIRST(&done)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&done, next);
+        pcie_seki_mark_output(seki, &req->cmd);
+        pcie_seki_count_command(seki, req);
+
+        if (req->legacy) {
+            atomic_or(&seki->status, req->status == SEKI_CQE_SUCCESS ?
+                                     SEKI_STATUS_DONE : SEKI_STATUS_ERROR);
+            atomic_and(&seki->status, ~SEKI_STATUS_BUSY);
+            g_free(req);
+            notify = true;
+        } else {
+            QSIMPLEQ_INSERT_TAIL(&q->cq_wait, req, next);
+        }
+    }
+
+    return seki_queue_post(q) || notify;
+}
+
+static void seki_irq_bh(void *opaque)
+{
+    PCIESekiDeviceState *seki = opaque;
+    PCIDevice *dev = PCI_DEVICE(seki);
+    bool notify = false;
+    uint32_t i;
+
+    for (i = 0; i < seki->num_queues; i++) {
+        notify |= seki_queue_reap(&seki->queues[i]);
+    }
+
+    if (notify && msi_enabled(dev)) {
+        trace_pcie_seki_irq(seki);
+        msi_notify(dev, 0);
+    }
+}
+
+
+// Queue registers
+uint64_t pcie_seki_queue_read(PCIESekiDeviceState *seki, hwaddr addr)
+{
+    SekiQueue *q;
+
+    addr -= SEKI_REG_QUEUE_BASE;
+    if (addr / SEKI_QUEUE_STRIDE >= seki->num_queues) {
+        return 0;
+    }
+    q = &seki->queues[addr / SEKI_QUEUE_STRIDE];
+
+    switch (addr % SEKI_QUEUE_STRIDE) {
+    case SEKI_QREG_SQ_BASE_LO:
+        return (uint32_t)q->sq_base;
+    case SEKI_QREG_SQ_BASE_HI:
+        return q->sq_base >> 32;
+    case SEKI_QREG_CQ_BASE_LO:
+        return (uint32_t)q->cq_base;
+    case SEKI_QREG_CQ_BASE_HI:
+        return q->cq_base >> 32;
+    case SEKI_QREG_SIZE:
+        return q->size;
+    case SEKI_QREG_SQ_TAIL:
+        return q->sq_tail;
+    case SEKI_QREG_SQ_HEAD:
+        return q->sq_head;
+    case SEKI_QREG_CQ_TAIL:
+        return q->cq_tail;
+    case SEKI_QREG_CQ_HEAD:
+        return q->cq_head;
+    }
+    return 0;
+}
+
+void pcie_seki_queue_write(PCIESekiDeviceState *seki, hwaddr addr,
+                           uint64_t val)
+{
+    PCIDevice *dev = PCI_DEVICE(seki);
+    SekiQueue *q;
+
+    addr -= SEKI_REG_QUEUE_BASE;
+    if (addr / SEKI_QUEUE_STRIDE >= seki->num_queues) {
+        return;
+    }
+    q = &seki->queues[addr / SEKI_QUEUE_STRIDE];
+
+    switch (addr % SEKI_QUEUE_STRIDE) {
+    case SEKI_QREG_SQ_BASE_LO:
+        q->sq_base = deposit64(q->sq_base, 0, 32, val);
+        break;
+    case SEKI_QREG_SQ_BASE_HI:
+        q->sq_base = deposit64(q->sq_base, 32, 32, val);
+        break;
+    case SEKI_QREG_CQ_BASE_LO:
+        q->cq_base = deposit64(q->cq_base, 0, 32, val);
+        break;
+    case SEKI_QREG_CQ_BASE_HI:
+        q->cq_base = deposit64(q->cq_base, 32, 32, val);
+        break;
+    case SEKI_QREG_SIZE:
+        if (q->outstanding || val > SEKI_MAX_QUEUE_SIZE || val == 1) {
+            break;
+        }
+        q->size = val;
+        q->sq_head = q->sq_tail = 0;
+        q->cq_head = q->cq_tail = 0;
+        q->cq_phase = true;
+        break;
+    case SEKI_QREG_SQ_TAIL:
+        if (val < q->size) {
+            q->sq_tail = val;
+            seki_queue_fetch(q);
+        }
+        break;
+    case SEKI_QREG_CQ_HEAD:
+        if (val < q->size) {
+            q->cq_head = val;
+            if (seki_queue_post(q) && msi_enabled(dev)) {
+                msi_notify(dev, 0);
+            }
+        }
+        break;
+    }
+}
+
+
+// Wait until the worker of q is idle.  While the queue is paused only the
+// command being executed is waited for.  The worker never takes the
+// iothread lock, so this is safe to call with it held.
+static void seki_queue_drain(SekiQueue *q)
+{
+    qemu_mutex_lock(&q->lock);
+    while ((!QSIMPLEQ_EMPTY(&q->submitted) && !q->paused) || q->busy) {
+        qemu_cond_wait(&q->cond, &q->lock);
+    }
+    qemu_mutex_unlock(&q->lock);
+}
+
+static void seki_queue_free_list(SekiQueue *q)
+{
+    SekiRequest *req;
+
+    // Commands are only left unexecuted while the queue is paused
+    qemu_mutex_lock(&q->lock);
+    QSIMPLEQ_CONCAT(&q->cq_wait, &q->submitted);
+    qemu_mutex_unlock(&q->lock);
+
+    while ((req = QSIMPLEQ_FIRST(&q->cq_wait)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&q->cq_wait, next);
+        g_free(req);
+    }
+}
+
+static void seki_queue_free_saved(SekiQueue *q)
+{
+    g_free(q->saved);
+    q->saved = NULL;
+    q->nr_saved = 0;
+}
+
+// Workers run only while the VM does.  When it stops, the command being
+// executed is finished and the rest stay queued, so a migration blackout
+// waits for at most one command per queue; the queued ones are migrated
+// and executed on the destination.
+static void seki_vm_state_change(void *opaque, int running, RunState state)
+{
+    PCIESekiDeviceState *seki = opaque;
+    uint32_t i;
+
+    for (i = 0; i < seki->num_queues; i++) {
+        SekiQueue *q = &seki->queues[i];
+        SekiRequest *req;
+
+        qemu_mutex_lock(&q->lock);
+        q->paused = !running;
+        qemu_cond_broadcast(&q->cond);
+        qemu_mutex_unlock(&q->lock);
+
+        if (running) {
+            continue;
+        }
+
+        seki_queue_drain(q);
+
+        // The final RAM pass of a migration runs before the device state is
+        // saved, so the output of commands that are not reaped yet must be
+        // marked dirty now
+        qemu_mutex_lock(&q->lock);
+        QSIMPLEQ_FOREACH(req, &q->completed, next) {
+            pcie_seki_mark_output(seki, &req->cmd);
+        }
+        qemu_mutex_unlock(&q->lock);
+    }
+
+    if (running) {
+        qemu_bh_schedule(seki->irq_bh);
+    }
+}
+
+// Called with the VM stopped.  Requests are saved in the order they were
+// submitted: waiting for CQ space, executed, then not yet executed.
+void pcie_seki_queue_pre_save(void *opaque)
+{
+    SekiQueue *q = opaque;
+    SekiRequest *req;
+    int n = 0;
+
+    seki_queue_free_saved(q);
+
+    qemu_mutex_lock(&q->lock);
+    QSIMPLEQ_FOREACH(req, &q->cq_wait, next) {
+        n++;
+    }
+    QSIMPLEQ_FOREACH(req, &q->completed, next) {
+        n++;
+    }
+    QSIMPLEQ_FOREACH(req, &q->submitted, next) {
+        n++;
+    }
+
+    q->saved = g_new0(SekiRequest, n);
+    QSIMPLEQ_FOREACH(req, &q->cq_wait, next) {
+        q->saved[q->nr_saved++] = *req;
+    }
+    QSIMPLEQ_FOREACH(req, &q->completed, next) {
+        q->saved[q->nr_saved++] = *req;
+    }
+    QSIMPLEQ_FOREACH(req, &q->submitted, next) {
+        q->saved[q->nr_saved++] = *req;
+    }
+    qemu_mutex_unlock(&q->lock);
+}
+
+// Requeue the requests of a freshly loaded queue.  Executed ones are
+// delivered by irq_bh, which the caller schedules.
+int pcie_seki_queue_post_load(void *opaque, int version_id)
+{
+    SekiQueue *q = opaque;
+    int i;
+
+    if (q->size > SEKI_MAX_QUEUE_SIZE || q->size == 1 ||
+        (q->size && (q->sq_head >= q->size || q->sq_tail >= q->size ||
+                     q->cq_head >= q->size || q->cq_tail >= q->size)) ||
+        q->outstanding > q->size) {
+        seki_queue_free_saved(q);
+        return -EINVAL;
+    }
+
+    qemu_mutex_lock(&q->lock);
+    for (i = 0; i < q->nr_saved; i++) {
+        SekiRequest *req = g_new0(SekiRequest, 1);
+
+        req->cmd = q->saved[i].cmd;
+        req->status = q->saved[i].status;
+        req->legacy = q->saved[i].legacy;
+        req->done = q->saved[i].done;
+        if (req->done) {
+            QSIMPLEQ_INSERT_TAIL(&q->completed, req, next);
+        } else {
+            QSIMPLEQ_INSERT_TAIL(&q->submitted, req, next);
+        }
+    }
+    qemu_cond_broadcast(&q->cond);
+    qemu_mutex_unlock(&q->lock);
+
+    seki_queue_free_saved(q);
+    return 0;
+}
+
+void pcie_seki_queue_init(PCIESekiDeviceState *seki)
+{
+    uint32_t i;
+
+    QEMU_BUILD_BUG_ON(sizeof(SekiCommand) != 64);
+    QEMU_BUILD_BUG_ON(sizeof(SekiCompletion) != 16);
+
+    seki->irq_bh = qemu_bh_new(seki_irq_bh, seki);
+    seki->queues = g_new0(SekiQueue, seki->num_queues);
+
+    for (i = 0; i < seki->num_queues; i++) {
+        SekiQueue *q = &seki->queues[i];
+
+        q->seki = seki;
+        q->id = i;
+        q->cq_phase = true;
+        q->paused = !runstate_is_running();
+        QSIMPLEQ_INIT(&q->cq_wait);
+        QSIMPLEQ_INIT(&q->submitted);
+        QSIMPLEQ_INIT(&q->completed);
+        qemu_mutex_init(&q->lock);
+        qemu_cond_init(&q->cond);
+        qemu_thread_create(&q->thread, "seki-queue", seki_queue_thread,
+                           q, QEMU_THREAD_JOINABLE);
+    }
+
+    seki->vm_state = qemu_add_vm_change_state_handler(seki_vm_state_change,
+                                                      seki);
+}
+
+void pcie_seki_queue_exit(PCIESekiDeviceState *seki)
+{
+    uint32_t i;
+
+    qemu_del_vm_change_state_handler(seki->vm_state);
+
+    for (i = 0; i < seki->num_queues; i++) {
+        SekiQueue *q = &seki->queues[i];
+
+        seki_queue_drain(q);
+        qemu_mutex_lock(&q->lock);
+        q->stopping = true;
+        qemu_cond_broadcast(&q->cond);
+        qemu_mutex_unlock(&q->lock);
+        qemu_thread_join(&q->thread);
+
+        QSIMPLEQ_CONCAT(&q->cq_wait, &q->completed);
+        seki_queue_free_list(q);
+        seki_queue_free_saved(q);
+        qemu_cond_destroy(&q->cond);
+        qemu_mutex_destroy(&q->lock);
+    }
+
+    qemu_bh_delete(seki->irq_bh);
+    g_free(seki->queues);
+    seki->queues = NULL;
+}
+
+// Let the commands in flight finish, then return every queue to the
+// unconfigured state
+void pcie_seki_queue_reset(PCIESekiDeviceState *seki)
+{
+    uint32_t i;
+
+    for (i = 0; i < seki->num_queues; i++) {
+        SekiQueue *q = &seki->queues[i];
+        SekiRequest *req;
+
+        seki_queue_drain(q);
+
+        qemu_mutex_lock(&q->lock);
+        QSIMPLEQ_FOREACH(req, &q->completed, next) {
+            pcie_seki_count_command(seki, req);
+        }
+        QSIMPLEQ_CONCAT(&q->cq_wait, &q->completed);
+        qemu_mutex_unlock(&q->lock);
+
+        // Output of completed commands is still guest visible
+        QSIMPLEQ_FOREACH(req, &q->cq_wait, next) {
+            pcie_seki_mark_output(seki, &req->cmd);
+        }
+        seki_queue_free_list(q);
+
+        q->sq_base = q->cq_base = 0;
+        q->size = 0;
+        q->sq_head = q->sq_tail = 0;
+        q->cq_head = q->cq_tail = 0;
+        q->cq_phase = true;
+        q->outstanding = 0;
+    }
+
+    qemu_bh_cancel(seki->irq_bh);
+    atomic_set(&seki->status, 0);
+    memset(&seki->regs, 0, sizeof(seki->regs));
+}
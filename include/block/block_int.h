@@ -188,6 +188,16 @@ struct BlockDriver {
 
     int (*bdrv_write_compressed)(BlockDriverState *bs, int64_t sector_num,
                                  const uint8_t *buf, int nb_sectors);
+    int coroutine_fn (*bdrv_co_write_compressed)(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, QEMUIOVector *qiov);
+
+    /*
+     * Copies nb_sectors from bs to dst without reading them into memory.
+     * Returns -ENOTSUP if the driver can't do that for this dst.
+     */
+    int coroutine_fn (*bdrv_co_copy_range)(BlockDriverState *bs,
+        int64_t sector_num, BlockDriverState *dst, int64_t dst_sector_num,
+        int nb_sectors);
 
     int (*bdrv_snapshot_create)(BlockDriverState *bs,
                                 QEMUSnapshotInfo *sn_info);
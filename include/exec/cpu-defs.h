@@ -29,6 +29,8 @@
 #include "qemu/queue.h"
 #ifndef CONFIG_USER_ONLY
 #include "exec/hwaddr.h"
+/* for TCG_TARGET_IMPLEMENTS_DYN_TLB */
+#include "tcg-target.h"
 #endif
 
 #ifndef TARGET_LONG_BITS
@@ -69,8 +71,15 @@ typedef uint64_t target_ulong;
 #define TB_JMP_PAGE_MASK (TB_JMP_CACHE_SIZE - TB_JMP_PAGE_SIZE)
 
 #if !defined(CONFIG_USER_ONLY)
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+/* The TLB of each MMU index is resized on flush, between these sizes,
+   depending on how much of it was used; see tlb_mmu_resize().  */
+#define CPU_TLB_DYN_MIN_BITS 6
+#define CPU_TLB_DYN_DEFAULT_BITS 8
+#else
 #define CPU_TLB_BITS 8
 #define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
+#endif
 /* use a fully associative victim tlb of 8 entries */
 #define CPU_VTLB_SIZE 8
 
@@ -102,11 +111,28 @@ typedef struct CPUTLBEntry {
 
 QEMU_BUILD_BUG_ON(sizeof(CPUTLBEntry) != (1 << CPU_TLB_ENTRY_BITS));
 
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+/* tlb_table[i] and iotlb[i] are allocated by cputlb.c and only valid
+   after tlb_flush(); tlb_mask[i] is (number of entries - 1) <<
+   CPU_TLB_ENTRY_BITS, so that the generated code can index tlb_table[i]
+   with a single AND.  These are rebuilt by tlb_flush() from the sizes
+   kept in CPUState, so targets may clear them on reset.  */
+#define CPU_COMMON_TLB_TABLES                                           \
+    uintptr_t tlb_mask[NB_MMU_MODES];                                   \
+    CPUTLBEntry *tlb_table[NB_MMU_MODES];                               \
+    hwaddr *iotlb[NB_MMU_MODES];                                        \
+
+#else
+#define CPU_COMMON_TLB_TABLES                                           \
+    CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
+    hwaddr iotlb[NB_MMU_MODES][CPU_TLB_SIZE];                           \
+
+#endif
+
 #define CPU_COMMON_TLB \
     /* The meaning of the MMU modes is defined in the target code. */   \
-    CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
+    CPU_COMMON_TLB_TABLES                                               \
     CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
-    hwaddr iotlb[NB_MMU_MODES][CPU_TLB_SIZE];                           \
     hwaddr iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];                        \
     target_ulong tlb_flush_addr;                                        \
     target_ulong tlb_flush_mask;                                        \
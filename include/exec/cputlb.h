@@ -21,6 +21,7 @@
 
 #if !defined(CONFIG_USER_ONLY)
 /* cputlb.c */
+void tlb_init(CPUState *cpu);
 void tlb_protect_code(ram_addr_t ram_addr);
 void tlb_unprotect_code_phys(CPUState *cpu, ram_addr_t ram_addr,
                              target_ulong vaddr);
@@ -71,6 +71,8 @@ typedef struct TranslationBlock TranslationBlock;
 #define OPPARAM_BUF_SIZE (OPC_BUF_SIZE * MAX_OPC_PARAM)
 
 #include "qemu/log.h"
+#include "qemu/atomic.h"
+#include "qemu/bitops.h"
 
 void gen_intermediate_code(CPUArchState *env, struct TranslationBlock *tb);
 void gen_intermediate_code_pc(CPUArchState *env, struct TranslationBlock *tb);
@@ -88,6 +90,7 @@ void QEMU_NORETURN cpu_io_recompile(CPUState *cpu, uintptr_t retaddr);
 TranslationBlock *tb_gen_code(CPUState *cpu,
                               target_ulong pc, target_ulong cs_base, int flags,
                               int cflags);
+bool tb_gen_superblock(CPUState *cpu, TranslationBlock *tb);
 void cpu_exec_init(CPUArchState *env);
 void QEMU_NORETURN cpu_loop_exit(CPUState *cpu);
 int page_unprotect(target_ulong address, uintptr_t pc, void *puc);
@@ -106,6 +109,16 @@ void tlb_set_page(CPUState *cpu, target_ulong vaddr,
                   hwaddr paddr, int prot,
                   int mmu_idx, target_ulong size);
 void tb_invalidate_phys_addr(AddressSpace *as, hwaddr addr);
+/* tb-cache.c */
+void tb_cache_open(const char *path, Error **errp);
+/* Fill @tb from the persistent translation cache, if it holds a block
+   for the guest code at @phys_pc; returns false if it does not.  */
+bool tb_cache_load(CPUState *cpu, TranslationBlock *tb,
+                   tb_page_addr_t phys_pc, int *code_size);
+/* Add @tb, just translated, to the cache if its code can be moved */
+void tb_cache_add(CPUState *cpu, TranslationBlock *tb,
+                  tb_page_addr_t phys_pc, int code_size);
+void tb_cache_dump_info(FILE *f, fprintf_function cpu_fprintf);
 #else
 static inline void tlb_flush_page(CPUState *cpu, target_ulong addr)
 {
@@ -114,12 +127,45 @@ static inline void tlb_flush_page(CPUState *cpu, target_ulong addr)
 static inline void tlb_flush(CPUState *cpu, int flush_global)
 {
 }
+
+static inline bool tb_cache_load(CPUState *cpu, TranslationBlock *tb,
+                                 tb_page_addr_t phys_pc, int *code_size)
+{
+    return false;
+}
+
+static inline void tb_cache_add(CPUState *cpu, TranslationBlock *tb,
+                                tb_page_addr_t phys_pc, int code_size)
+{
+}
 #endif
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
 
-#define CODE_GEN_PHYS_HASH_BITS     15
-#define CODE_GEN_PHYS_HASH_SIZE     (1 << CODE_GEN_PHYS_HASH_BITS)
+/* initial size of the TB hash table; it grows with the number of TBs */
+#define CODE_GEN_HTABLE_BITS     15
+#define CODE_GEN_HTABLE_SIZE     (1 << CODE_GEN_HTABLE_BITS)
+
+/* default number of executions after which a TB is retranslated as a
+   superblock; see tb_gen_superblock() */
+#define TB_SUPERBLOCK_THRESHOLD  1000
+extern int tcg_superblock_threshold;
+
+/* Runtime profile of the translated code, see query-tcg-profile.  While
+   tcg_profiling is set, TBs are translated with CF_PROFILE and count
+   their executions and helper calls.  Times are in nanoseconds.  */
+typedef struct TBProfile {
+    uint64_t gen_count;
+    uint64_t gen_ns;
+    uint64_t tlb_fill_count;
+    uint64_t tlb_fill_done;     /* fills that did not raise a guest fault */
+    uint64_t tlb_fill_ns;       /* of the fills that returned */
+    uint64_t restore_count;
+    uint64_t restore_ns;
+} TBProfile;
+
+extern bool tcg_profiling;
+extern TBProfile tb_profile;
 
 /* estimated block size for TB allocation */
 /* XXX: use a per code average code fragment size and modulate it
@@ -150,10 +196,14 @@ struct TranslationBlock {
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
 #define CF_NOCACHE     0x10000 /* To be freed after execution */
 #define CF_USE_ICOUNT  0x20000
+#define CF_INVALID     0x40000 /* Removed by tb_phys_invalidate() */
+#define CF_SUPERBLOCK  0x80000 /* Hot TB retranslated across direct jumps */
+#define CF_PROFILE     0x100000 /* Counts executions, see tcg_profiling */
+    int32_t hot_count;  /* executions left before becoming a superblock */
+    uint32_t gen_ns;    /* translation time, with CF_PROFILE */
+    uint64_t exec_count; /* with CF_PROFILE */
 
     void *tc_ptr;    /* pointer to the translated code */
-    /* next matching tb for physical address. */
-    struct TranslationBlock *phys_hash_next;
     /* first and second physical page containing code. The lower bit
        of the pointer tells the index in page_next[] */
     struct TranslationBlock *page_next[2];
@@ -176,20 +226,44 @@ struct TranslationBlock {
 };
 
 #include "exec/spinlock.h"
+#include "qemu/qht.h"
+
+/* The code buffer is split into up to CODE_GEN_MAX_REGIONS regions that
+   are filled in turn.  When the buffer is full, the oldest region is
+   evicted to make room instead of flushing every translation.  */
+#define CODE_GEN_MAX_REGIONS     8
+
+typedef struct TBRegion {
+    void *start;
+    void *max;          /* a new TB must start below this */
+    void *end;          /* end of the generated code, unless current */
+    TranslationBlock *tbs;      /* ordered by tc_ptr */
+    int nb_tbs;
+} TBRegion;
 
 typedef struct TBContext TBContext;
 
 struct TBContext {
 
     TranslationBlock *tbs;
-    TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+    TBRegion regions[CODE_GEN_MAX_REGIONS];
+    int nb_regions;
+    int cur_region;
+    size_t region_size;
+    int region_max_tbs;
+    /* TBs keyed on tb_hash_func(); lookups need no lock */
+    QHT htable;
     int nb_tbs;
-    /* any access to the tbs or the page table must use this lock */
+    /* any access to the tbs or the page table must use this lock;
+       see tb_lock() */
     spinlock_t tb_lock;
 
     /* statistics */
     int tb_flush_count;
     int tb_phys_invalidate_count;
+    int region_evict_count;
+    int tb_evict_count;
+    int superblock_count;
 
     int tb_invalidated_flag;
 };
@@ -209,15 +283,66 @@ static inline unsigned int tb_jmp_cache_hash_func(target_ulong pc)
 	    | (tmp & TB_JMP_ADDR_MASK));
 }
 
-static inline unsigned int tb_phys_hash_func(tb_page_addr_t pc)
+#define TB_HASH_PRIME32_1   2654435761U
+#define TB_HASH_PRIME32_2   2246822519U
+#define TB_HASH_PRIME32_3   3266489917U
+#define TB_HASH_PRIME32_4   668265263U
+#define TB_HASH_SEED        1
+
+/* xxHash32 of the lookup key of a TB.  The input has a fixed size, so the
+   generic loop reduces to four lane rounds and three tail rounds.  */
+static inline uint32_t tb_hash_func(tb_page_addr_t phys_pc, target_ulong pc,
+                                    uint32_t flags, target_ulong cs_base)
 {
-    return (pc >> 2) & (CODE_GEN_PHYS_HASH_SIZE - 1);
+    uint64_t a = phys_pc;
+    uint64_t b = pc;
+    uint64_t c = cs_base;
+    uint32_t v1 = TB_HASH_SEED + TB_HASH_PRIME32_1 + TB_HASH_PRIME32_2;
+    uint32_t v2 = TB_HASH_SEED + TB_HASH_PRIME32_2;
+    uint32_t v3 = TB_HASH_SEED;
+    uint32_t v4 = TB_HASH_SEED - TB_HASH_PRIME32_1;
+    uint32_t h;
+
+    v1 = rol32(v1 + (uint32_t)a * TB_HASH_PRIME32_2, 13) * TB_HASH_PRIME32_1;
+    v2 = rol32(v2 + (uint32_t)(a >> 32) * TB_HASH_PRIME32_2, 13) *
+         TB_HASH_PRIME32_1;
+    v3 = rol32(v3 + (uint32_t)b * TB_HASH_PRIME32_2, 13) * TB_HASH_PRIME32_1;
+    v4 = rol32(v4 + (uint32_t)(b >> 32) * TB_HASH_PRIME32_2, 13) *
+         TB_HASH_PRIME32_1;
+    h = rol32(v1, 1) + rol32(v2, 7) + rol32(v3, 12) + rol32(v4, 18);
+    h += 28;
+
+    h = rol32(h + (uint32_t)c * TB_HASH_PRIME32_3, 17) * TB_HASH_PRIME32_4;
+    h = rol32(h + (uint32_t)(c >> 32) * TB_HASH_PRIME32_3, 17) *
+        TB_HASH_PRIME32_4;
+    h = rol32(h + flags * TB_HASH_PRIME32_3, 17) * TB_HASH_PRIME32_4;
+
+    h ^= h >> 15;
+    h *= TB_HASH_PRIME32_2;
+    h ^= h >> 13;
+    h *= TB_HASH_PRIME32_3;
+    h ^= h >> 16;
+    return h;
 }
 
 void tb_free(TranslationBlock *tb);
 void tb_flush(CPUArchState *env);
+void tb_flush_async(CPUArchState *env);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
 
+/* Protects the translation structures.  This is tb_ctx.tb_lock in user
+   mode and the BQL with multi-threaded TCG; otherwise the single TCG
+   thread already holds the BQL. */
+void tb_lock(void);
+void tb_unlock(void);
+/* Drop tb_lock if held, after a longjmp out of the locked region */
+void tb_lock_reset(void);
+
+/* Serializes guest atomic read-modify-write sequences between vCPU
+   threads.  cpu_atomic_unlock() does nothing if the lock is not held. */
+void cpu_atomic_lock(void);
+void cpu_atomic_unlock(void);
+
 #if defined(USE_DIRECT_JUMP)
 
 #if defined(CONFIG_TCG_INTERPRETER)
@@ -233,8 +358,9 @@ void ppc_tb_set_jmp_target(uintptr_t jmp_addr, uintptr_t addr);
 #elif defined(__i386__) || defined(__x86_64__)
 static inline void tb_set_jmp_target1(uintptr_t jmp_addr, uintptr_t addr)
 {
-    /* patch the branch destination */
-    stl_le_p((void*)jmp_addr, addr - (jmp_addr + 4));
+    /* patch the branch destination; tcg_out_op aligns it so that the
+       store is atomic */
+    atomic_set((int32_t *)jmp_addr, addr - (jmp_addr + 4));
     /* no need to flush icache explicitly */
 }
 #elif defined(__s390x__)
@@ -348,6 +474,9 @@ bool io_mem_write(struct MemoryRegion *mr, hwaddr addr,
 
 void tlb_fill(CPUState *cpu, target_ulong addr, int is_write, int mmu_idx,
               uintptr_t retaddr);
+/* cputlb.c */
+void tcg_tlb_fill(CPUState *cpu, target_ulong addr, int is_write,
+                  int mmu_idx, uintptr_t retaddr);
 
 #endif
 
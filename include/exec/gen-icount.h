@@ -21,6 +21,10 @@ static inline void gen_tb_start(TranslationBlock *tb)
     tcg_gen_brcondi_i32(TCG_COND_NE, flag, 0, exitreq_label);
     tcg_temp_free_i32(flag);
 
+    if (tb->cflags & CF_PROFILE) {
+        tcg_gen_profile_count(&tb->exec_count);
+    }
+
     if (!(tb->cflags & CF_USE_ICOUNT)) {
         return;
     }
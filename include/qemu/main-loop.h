@@ -299,6 +299,30 @@ void qemu_mutex_lock_iothread(void);
  */
 void qemu_mutex_unlock_iothread(void);
 
+/**
+ * qemu_mutex_iothread_locked: Return lock status of the main loop mutex.
+ *
+ * The main loop mutex is the coarsest lock in QEMU, and as such it
+ * must always be taken outside other locks.  This function helps
+ * functions take different paths depending on whether the current
+ * thread is running within the main loop mutex, as vCPU threads of
+ * multi-threaded TCG do only part of the time.
+ *
+ * NOTE: tools are single-threaded and this always returns true there.
+ */
+bool qemu_mutex_iothread_locked(void);
+
+/**
+ * qemu_tcg_lock_iothread: Take the BQL from a vCPU thread if needed.
+ *
+ * With multi-threaded TCG, vCPU threads run translated code without the
+ * BQL and must take it before touching device or other global state.
+ * Returns true if the lock was taken here, in which case the caller
+ * must drop it with qemu_mutex_unlock_iothread().  If the code in between
+ * raises a guest exception, cpu_exec() drops the lock.
+ */
+bool qemu_tcg_lock_iothread(void);
+
 /* internal interfaces */
 
 void qemu_fd_register(int fd);
@@ -0,0 +1,81 @@
+/*
+ * QHT: a resizable hash table with lock-free lookups
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_QHT_H
+#define QEMU_QHT_H
+
+#include "qemu-common.h"
+#include "qemu/thread.h"
+
+/* QHT stores opaque pointers keyed on a caller-computed 32-bit hash.
+ *
+ * Buckets are one cache line each and hold a few (hash, pointer) pairs;
+ * a full bucket is chained to an overflow bucket.  Lookups never take a
+ * lock: they run inside an RCU read-side critical section and retry if a
+ * bucket's sequence count changed under them.  Writers serialize on a
+ * per-bucket spinlock, so inserts and removals in different buckets run in
+ * parallel.  Resizing builds a new bucket array and publishes it with RCU.
+ *
+ * The table does not own the stored pointers: they must stay valid until
+ * an RCU grace period has passed since their removal.
+ */
+
+typedef struct QHTMap QHTMap;
+
+typedef struct QHT {
+    QHTMap *map;
+    QemuMutex lock;             /* serializes resizes and whole-table ops */
+    unsigned int mode;
+} QHT;
+
+/* Grow the table when the overflow buckets become too many */
+#define QHT_MODE_AUTO_RESIZE    0x1
+
+typedef struct QHTStats {
+    size_t head_buckets;
+    size_t used_head_buckets;   /* head buckets with at least one entry */
+    size_t entries;
+    size_t max_chain;           /* longest chain, in buckets */
+    double avg_chain;           /* over the used head buckets */
+    double occupancy;           /* fraction of used slots in used chains */
+} QHTStats;
+
+/* Return true if @obj matches @userp */
+typedef bool QHTLookupFunc(const void *obj, const void *userp);
+typedef void QHTIterFunc(QHT *ht, void *p, uint32_t hash, void *userp);
+
+void qht_init(QHT *ht, size_t n_elems, unsigned int mode);
+void qht_destroy(QHT *ht);
+
+/* Insert @p.  Returns false if @p is already in the table.  @p must not be
+ * NULL. */
+bool qht_insert(QHT *ht, void *p, uint32_t hash);
+
+/* Must be called within an RCU read-side critical section.  Returns the
+ * first entry with hash @hash for which @func returns true, or NULL. */
+void *qht_lookup(QHT *ht, QHTLookupFunc *func, const void *userp,
+                 uint32_t hash);
+
+/* Remove @p.  Returns false if it was not in the table. */
+bool qht_remove(QHT *ht, const void *p, uint32_t hash);
+
+/* Remove all entries, keeping the size */
+void qht_reset(QHT *ht);
+/* Remove all entries and resize to fit @n_elems.  Returns true if the
+ * table was resized. */
+bool qht_reset_size(QHT *ht, size_t n_elems);
+/* Resize to fit @n_elems, keeping the entries */
+bool qht_resize(QHT *ht, size_t n_elems);
+
+/* Call @func on every entry; the table must not be modified meanwhile
+ * from within @func. */
+void qht_iter(QHT *ht, QHTIterFunc *func, void *userp);
+
+void qht_statistics(QHT *ht, QHTStats *stats);
+
+#endif /* QEMU_QHT_H */
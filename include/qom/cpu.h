@@ -228,6 +228,7 @@ struct kvm_run;
  * @can_do_io: Nonzero if memory-mapped IO is safe.
  * @env_ptr: Pointer to subclass-specific CPUArchState field.
  * @current_tb: Currently executing TB.
+ * @tlb_desc: Softmmu TLB tables and their sizing state, one per MMU index.
  * @gdb_regs: Additional GDB registers.
  * @gdb_num_regs: Number of total registers accessible to GDB.
  * @gdb_num_g_regs: Number of registers in GDB 'g' packets.
@@ -274,6 +275,7 @@ struct CPUState {
     void *env_ptr; /* CPUArchState */
     struct TranslationBlock *current_tb;
     struct TranslationBlock *tb_jmp_cache[TB_JMP_CACHE_SIZE];
+    struct CPUTLBDesc *tlb_desc;
     struct GDBRegisterState *gdb_regs;
     int gdb_num_regs;
     int gdb_num_g_regs;
@@ -326,6 +328,20 @@ extern struct CPUTailQ cpus;
 DECLARE_TLS(CPUState *, current_cpu);
 #define current_cpu tls_var(current_cpu)
 
+/* Multi-threaded TCG: each vCPU has a thread of its own and executes
+ * translated code outside the iothread lock.  Set by -tcg thread=multi
+ * before any vCPU is created.
+ */
+extern bool mttcg_enabled;
+
+/**
+ * qemu_tcg_mttcg_enabled:
+ * Check whether we are running MultiThread TCG or not.
+ *
+ * Returns: %true if we are in MTTCG mode %false otherwise.
+ */
+#define qemu_tcg_mttcg_enabled() (mttcg_enabled)
+
 /**
  * cpu_paging_enabled:
  * @cpu: The CPU whose state is to be inspected.
@@ -531,6 +547,20 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
  */
 void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
 
+/**
+ * async_run_exclusive:
+ * @func: The function to be executed.
+ * @data: Data to pass to the function.
+ *
+ * Schedules the function @func for execution once no vCPU executes
+ * translated code, with the iothread lock held; the vCPUs do not enter
+ * cpu_exec() again before it has run.  Used for changes to state that
+ * running vCPUs read without locks, such as the code buffer.  Without
+ * multi-threaded TCG @func runs immediately.  Must be called with the
+ * iothread lock held.
+ */
+void async_run_exclusive(void (*func)(void *data), void *data);
+
 /**
  * qemu_get_cpu:
  * @index: The CPUState@cpu_index value of the CPU to obtain.
@@ -155,6 +155,15 @@ BlockAcctStats *blk_get_stats(BlockBackend *blk);
 
 void *blk_aio_get(const AIOCBInfo *aiocb_info, BlockBackend *blk,
                   BlockCompletionFunc *cb, void *opaque);
+int coroutine_fn blk_co_readv(BlockBackend *blk, int64_t sector_num,
+                              int nb_sectors, QEMUIOVector *qiov);
+int coroutine_fn blk_co_writev(BlockBackend *blk, int64_t sector_num,
+                               int nb_sectors, QEMUIOVector *qiov);
+int coroutine_fn blk_co_write_compressed(BlockBackend *blk, int64_t sector_num,
+                                         int nb_sectors, QEMUIOVector *qiov);
+int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t sector_in,
+                                   BlockBackend *blk_out, int64_t sector_out,
+                                   int nb_sectors);
 int coroutine_fn blk_co_write_zeroes(BlockBackend *blk, int64_t sector_num,
                                      int nb_sectors, BdrvRequestFlags flags);
 int blk_write_compressed(BlockBackend *blk, int64_t sector_num,
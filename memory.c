@@ -25,6 +25,7 @@
 #include "exec/memory-internal.h"
 #include "exec/ram_addr.h"
 #include "sysemu/sysemu.h"
+#include "qemu/main-loop.h"
 
 //#define DEBUG_UNASSIGNED
 
@@ -1994,13 +1995,27 @@ void address_space_destroy(AddressSpace *as)
 
 bool io_mem_read(MemoryRegion *mr, hwaddr addr, uint64_t *pval, unsigned size)
 {
-    return memory_region_dispatch_read(mr, addr, pval, size);
+    bool locked = qemu_tcg_lock_iothread();
+    bool ret;
+
+    ret = memory_region_dispatch_read(mr, addr, pval, size);
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+    return ret;
 }
 
 bool io_mem_write(MemoryRegion *mr, hwaddr addr,
                   uint64_t val, unsigned size)
 {
-    return memory_region_dispatch_write(mr, addr, val, size);
+    bool locked = qemu_tcg_lock_iothread();
+    bool ret;
+
+    ret = memory_region_dispatch_write(mr, addr, val, size);
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+    return ret;
 }
 
 typedef struct MemoryRegionList MemoryRegionList;
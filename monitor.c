@@ -2923,6 +2923,20 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show memory devices",
         .mhandler.cmd = hmp_info_memory_devices,
     },
+    {
+        .name       = "seki",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show pcie-seki performance counters",
+        .mhandler.cmd = hmp_info_seki,
+    },
+    {
+        .name       = "tcg-profile",
+        .args_type  = "blocks:i?",
+        .params     = "[n]",
+        .help       = "show the TCG profile and the n most executed blocks",
+        .mhandler.cmd = hmp_info_tcg_profile,
+    },
     {
         .name       = NULL,
     },
@@ -3217,6 +3217,47 @@ STEXI
 Set TB size.
 ETEXI
 
+DEF("tcg", HAS_ARG, QEMU_OPTION_tcg, \
+    "-tcg [thread=single|multi][,superblock=n][,optimize=full|basic][,cache=file]\n" \
+    "                run all TCG vCPUs in one thread (default) or give\n" \
+    "                each vCPU its own thread\n" \
+    "                superblock=n retranslate blocks run n times (default 1000)\n" \
+    "                as superblocks; 0 disables\n" \
+    "                optimize=basic only folds constants and copies\n" \
+    "                cache=file keeps translated code in file across runs\n", QEMU_ARCH_ALL)
+STEXI
+@item -tcg [thread=single|multi][,superblock=@var{n}][,optimize=full|basic][,cache=@var{file}]
+@findex -tcg
+Select how TCG runs the guest vCPUs.  With @option{thread=single}, the
+default, all vCPUs take turns in a single host thread.  With
+@option{thread=multi} every vCPU gets its own host thread, so that
+multi-processor guests can use several host cores.  This is only
+available for some guest and host combinations, and not together with
+@option{-icount}.
+
+With @option{superblock=@var{n}}, a translated block that has run
+@var{n} times is translated again, following forward jumps within its
+page, so that the hot path of a loop body becomes a single block.  The
+default is 1000; 0 turns superblocks off.  Only x86 guests form
+superblocks at the moment.
+
+@option{optimize=full}, the default, has the TCG optimizer also forward
+values stored to the CPU state to later loads, drop redundant sign
+extensions and reuse common subexpressions within a basic block.
+@option{optimize=basic} limits it to constant and copy propagation, to
+compare generated code size (@code{info jit}) and speed with and without
+the extra pass.
+
+With @option{cache=@var{file}}, translated code is saved to @var{file}
+when QEMU exits and reused by later runs for guest code that has not
+changed, instead of being translated again.  The file is only used by the
+same QEMU binary with the same @option{-cpu} and @option{optimize}
+setting, and is rewritten otherwise.  Superblocks are off by default with
+a cache, since they are not cached.  This is only available on x86-64
+Linux hosts, and blocks are not cached with @option{-icount} or while
+debugging the guest.
+ETEXI
+
 DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming tcp:[host]:port[,to=maxport][,ipv4][,ipv6]\n" \
     "-incoming rdma:host:port[,ipv4][,ipv6]\n" \
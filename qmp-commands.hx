@@ -3981,4 +3981,145 @@ Example:
                  "write-threshold": 17179869184 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "query-seki",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_seki,
+    },
+
+SQMP
+query-seki
+----------
+
+Return the performance counters of all pcie-seki devices.
+
+Each device is represented by a json-object with the following keys:
+
+- "path": QOM path of the device (json-string)
+- "id": device ID (json-string, optional)
+- "card-id": peer id used by copy commands (json-int)
+- "blas": host BLAS backend in use (json-string)
+- "compute-threads": size of the host compute pool shared by all devices
+  (json-int)
+- "bytes-in": bytes moved into the device by the DMA engine (json-int)
+- "bytes-out": bytes moved out of the device by the DMA engine (json-int)
+- "bytes-p2p": bytes copied to the input of a peer device (json-int)
+- "commands-completed": successful commands (json-int)
+- "commands-failed": commands completed with an error status (json-int)
+- "flops": floating point operations of the successful commands (json-int)
+- "compute-time": total compute time in nanoseconds (json-int)
+- "compute-time-max": longest compute time of a command (json-int)
+- "compute-time-histogram": log2 histogram of the compute time of each
+  command in microseconds (json-array of json-int)
+- "queues": json-array of json-objects, one per command queue:
+     - "id": queue index (json-int)
+     - "size": ring entries, 0 if not set up (json-int)
+     - "outstanding": commands not completed yet (json-int)
+     - "depth-histogram": log2 histogram of the queue depth seen by each
+       fetched command (json-array of json-int)
+
+Histogram entry 0 counts zero, entry i > 0 counts values in [2^(i-1), 2^i);
+the last entry is open ended.
+
+Example:
+
+-> { "execute": "query-seki" }
+<- { "return": [
+       { "path": "/machine/peripheral/seki0", "id": "seki0",
+         "card-id": 0, "blas": "avx2", "compute-threads": 4,
+         "bytes-in": 16777216, "bytes-out": 8388608, "bytes-p2p": 0,
+         "commands-completed": 2, "commands-failed": 0,
+         "flops": 4294967296, "compute-time": 612000000,
+         "compute-time-max": 310000000,
+         "compute-time-histogram": [0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                    0, 0, 0, 2],
+         "queues": [ { "id": 0, "size": 64, "outstanding": 0,
+                       "depth-histogram": [0, 1, 1, 0, 0, 0, 0, 0, 0, 0,
+                                           0, 0, 0, 0, 0, 0] } ] } ] }
+
+EQMP
+
+    {
+        .name       = "tcg-profile",
+        .args_type  = "enable:b",
+        .mhandler.cmd_new = qmp_marshal_input_tcg_profile,
+    },
+
+SQMP
+tcg-profile
+-----------
+
+Start or stop the TCG profiler.  Starting it resets the counters.  Either
+way, the translated code is discarded and retranslated with or without
+the profiling counters.
+
+Arguments:
+
+- "enable": true to start the profiler, false to stop it (json-bool)
+
+Example:
+
+-> { "execute": "tcg-profile", "arguments": { "enable": true } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-tcg-profile",
+        .args_type  = "blocks:i?",
+        .mhandler.cmd_new = qmp_marshal_input_query_tcg_profile,
+    },
+
+SQMP
+query-tcg-profile
+-----------------
+
+Return the profile of the translated code since the profiler was started.
+Times are in nanoseconds.
+
+Arguments:
+
+- "blocks": how many of the most executed blocks to return, 10 by default
+  (json-int, optional)
+
+Return a json-object with the following information:
+
+- "enabled": true if the profiler is running (json-bool)
+- "translations": blocks translated (json-int)
+- "translation-time": time spent translating blocks (json-int)
+- "tlb-fills": softmmu TLB misses handled by the page table walk (json-int)
+- "tlb-fill-faults": TLB fills that raised a guest exception (json-int)
+- "tlb-fill-time": time spent in TLB fills that did not fault (json-int)
+- "restores": guest state recoveries from a host code address (json-int)
+- "restore-time": time spent recovering guest state (json-int)
+- "blocks": json-array of json-objects, most executed first:
+     - "pc": guest virtual address (json-int)
+     - "size": guest code size in bytes (json-int)
+     - "host-size": translated code size in bytes (json-int)
+     - "exec-count": number of executions (json-int)
+     - "translation-time": time taken to translate the block (json-int)
+     - "disassembly": guest code, one instruction per line (json-string)
+- "helpers": json-array of json-objects, most called first:
+     - "name": helper name (json-string)
+     - "calls": calls from translated code (json-int)
+
+Execution counts are kept by the translated blocks and are only available
+while the profiler runs.
+
+Example:
+
+-> { "execute": "query-tcg-profile", "arguments": { "blocks": 1 } }
+<- { "return": {
+       "enabled": true, "translations": 51822,
+       "translation-time": 412034511, "tlb-fills": 210443,
+       "tlb-fill-faults": 1201, "tlb-fill-time": 96112409,
+       "restores": 1380, "restore-time": 2301551,
+       "blocks": [ { "pc": 991098, "size": 5, "host-size": 160,
+                     "exec-count": 3315302, "translation-time": 10982,
+                     "disassembly": "0x00000000000f1f7a:  in     (%dx),%al\n0x00000000000f1f7b:  test   $0x1,%al\n0x00000000000f1f7d:  je     0xf1f7a\n" } ],
+       "helpers": [ { "name": "inb", "calls": 3315302 },
+                    { "name": "cc_compute_all", "calls": 902113 } ] } }
+
 EQMP
@@ -169,7 +169,7 @@ static __attribute__((unused))
 WORD_TYPE helper_le_ld_name(CPUArchState *env, target_ulong addr, int mmu_idx,
                             uintptr_t retaddr)
 {
-    int index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    int index = tlb_index(env, mmu_idx, addr);
     target_ulong tlb_addr = env->tlb_table[mmu_idx][index].ADDR_READ;
     uintptr_t haddr;
     DATA_TYPE res;
@@ -187,9 +187,11 @@ WORD_TYPE helper_le_ld_name(CPUArchState *env, target_ulong addr, int mmu_idx,
         }
 #endif
         if (!VICTIM_TLB_HIT(ADDR_READ)) {
-            tlb_fill(ENV_GET_CPU(env), addr, READ_ACCESS_TYPE,
-                     mmu_idx, retaddr);
+            tcg_tlb_fill(ENV_GET_CPU(env), addr, READ_ACCESS_TYPE,
+                         mmu_idx, retaddr);
         }
+        /* tlb_fill may have resized the TLB */
+        index = tlb_index(env, mmu_idx, addr);
         tlb_addr = env->tlb_table[mmu_idx][index].ADDR_READ;
     }
 
@@ -257,7 +259,7 @@ static __attribute__((unused))
 WORD_TYPE helper_be_ld_name(CPUArchState *env, target_ulong addr, int mmu_idx,
                             uintptr_t retaddr)
 {
-    int index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    int index = tlb_index(env, mmu_idx, addr);
     target_ulong tlb_addr = env->tlb_table[mmu_idx][index].ADDR_READ;
     uintptr_t haddr;
     DATA_TYPE res;
@@ -275,9 +277,11 @@ WORD_TYPE helper_be_ld_name(CPUArchState *env, target_ulong addr, int mmu_idx,
         }
 #endif
         if (!VICTIM_TLB_HIT(ADDR_READ)) {
-            tlb_fill(ENV_GET_CPU(env), addr, READ_ACCESS_TYPE,
-                     mmu_idx, retaddr);
+            tcg_tlb_fill(ENV_GET_CPU(env), addr, READ_ACCESS_TYPE,
+                         mmu_idx, retaddr);
         }
+        /* tlb_fill may have resized the TLB */
+        index = tlb_index(env, mmu_idx, addr);
         tlb_addr = env->tlb_table[mmu_idx][index].ADDR_READ;
     }
 
@@ -384,7 +388,7 @@ static inline void glue(io_write, SUFFIX)(CPUArchState *env,
 void helper_le_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
                        int mmu_idx, uintptr_t retaddr)
 {
-    int index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    int index = tlb_index(env, mmu_idx, addr);
     target_ulong tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
     uintptr_t haddr;
 
@@ -401,8 +405,11 @@ void helper_le_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
         }
 #endif
         if (!VICTIM_TLB_HIT(addr_write)) {
-            tlb_fill(ENV_GET_CPU(env), addr, MMU_DATA_STORE, mmu_idx, retaddr);
+            tcg_tlb_fill(ENV_GET_CPU(env), addr, MMU_DATA_STORE, mmu_idx,
+                         retaddr);
         }
+        /* tlb_fill may have resized the TLB */
+        index = tlb_index(env, mmu_idx, addr);
         tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
     }
 
@@ -465,7 +472,7 @@ void helper_le_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
 void helper_be_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
                        int mmu_idx, uintptr_t retaddr)
 {
-    int index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    int index = tlb_index(env, mmu_idx, addr);
     target_ulong tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
     uintptr_t haddr;
 
@@ -482,8 +489,11 @@ void helper_be_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
         }
 #endif
         if (!VICTIM_TLB_HIT(addr_write)) {
-            tlb_fill(ENV_GET_CPU(env), addr, MMU_DATA_STORE, mmu_idx, retaddr);
+            tcg_tlb_fill(ENV_GET_CPU(env), addr, MMU_DATA_STORE, mmu_idx,
+                         retaddr);
         }
+        /* tlb_fill may have resized the TLB */
+        index = tlb_index(env, mmu_idx, addr);
         tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
     }
 
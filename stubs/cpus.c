@@ -8,3 +8,8 @@ void cpu_resume(CPUState *cpu)
 void qemu_init_vcpu(CPUState *cpu)
 {
 }
+
+void async_run_exclusive(void (*func)(void *data), void *data)
+{
+    func(data);
+}
@@ -24,6 +24,7 @@
 
 #include "cpu.h"
 #include "tcg-op.h"
+#include "tcg-op-gvec.h"
 #include "qemu/log.h"
 #include "arm_ldst.h"
 #include "translate.h"
@@ -9089,6 +9090,49 @@ static void disas_simd_3same_float(DisasContext *s, uint32_t insn)
 }
 
 /* Integer op subgroup of C3.6.16. */
+/* Expand the integer three-reg-same ops that have a generic vector
+ * equivalent on the whole vector at once.  Returns false if the op
+ * must go through the per-element code.
+ */
+static bool gen_simd_3same_gvec(DisasContext *s, int opcode, int u,
+                                int size, int is_q, int rd, int rn, int rm)
+{
+    uint32_t dofs = vec_reg_offset(s, rd, 0, MO_64);
+    uint32_t aofs = vec_reg_offset(s, rn, 0, MO_64);
+    uint32_t bofs = vec_reg_offset(s, rm, 0, MO_64);
+    uint32_t oprsz = is_q ? 16 : 8;
+
+    switch (opcode) {
+    case 0x10: /* ADD, SUB */
+        if (u) {
+            tcg_gen_gvec_sub(cpu_env, size, dofs, aofs, bofs, oprsz);
+        } else {
+            tcg_gen_gvec_add(cpu_env, size, dofs, aofs, bofs, oprsz);
+        }
+        break;
+    case 0x11: /* CMTST, CMEQ */
+        if (!u) {
+            return false;
+        }
+        tcg_gen_gvec_cmp(cpu_env, TCG_COND_EQ, size, dofs, aofs, bofs, oprsz);
+        break;
+    case 0x6: /* CMGT, CMHI */
+        tcg_gen_gvec_cmp(cpu_env, u ? TCG_COND_GTU : TCG_COND_GT, size,
+                         dofs, aofs, bofs, oprsz);
+        break;
+    case 0x7: /* CMGE, CMHS */
+        tcg_gen_gvec_cmp(cpu_env, u ? TCG_COND_GEU : TCG_COND_GE, size,
+                         dofs, aofs, bofs, oprsz);
+        break;
+    default:
+        return false;
+    }
+    if (!is_q) {
+        clear_vec_high(s, rd);
+    }
+    return true;
+}
+
 static void disas_simd_3same_int(DisasContext *s, uint32_t insn)
 {
     int is_q = extract32(insn, 30, 1);
@@ -9138,6 +9182,10 @@ static void disas_simd_3same_int(DisasContext *s, uint32_t insn)
         return;
     }
 
+    if (gen_simd_3same_gvec(s, opcode, u, size, is_q, rd, rn, rm)) {
+        return;
+    }
+
     if (size == 3) {
         assert(is_q);
         for (pass = 0; pass < 2; pass++) {
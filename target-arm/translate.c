@@ -28,6 +28,7 @@
 #include "internals.h"
 #include "disas/disas.h"
 #include "tcg-op.h"
+#include "tcg-op-gvec.h"
 #include "qemu/log.h"
 #include "qemu/bitops.h"
 #include "arm_ldst.h"
@@ -3127,17 +3128,10 @@ static int disas_vfp_insn(DisasContext *s, uint32_t insn)
                     tmp = load_reg(s, rd);
                     if (insn & (1 << 23)) {
                         /* VDUP */
-                        if (size == 0) {
-                            gen_neon_dup_u8(tmp, 0);
-                        } else if (size == 1) {
-                            gen_neon_dup_low16(tmp);
-                        }
-                        for (n = 0; n <= pass * 2; n++) {
-                            tmp2 = tcg_temp_new_i32();
-                            tcg_gen_mov_i32(tmp2, tmp);
-                            neon_store_reg(rn, n, tmp2);
-                        }
-                        neon_store_reg(rn, n, tmp);
+                        tcg_gen_gvec_dup_i32(cpu_env, size,
+                                             vfp_reg_offset(1, rn),
+                                             pass ? 16 : 8, tmp);
+                        tcg_temp_free_i32(tmp);
                     } else {
                         /* VMOV */
                         switch (size) {
@@ -5070,6 +5064,62 @@ static const uint8_t neon_2rm_sizes[] = {
     [NEON_2RM_VCVT_UF] = 0x4,
 };
 
+/* Expand the three-registers-of-the-same-length integer ops that have a
+   generic vector equivalent on the whole D or Q register at once.
+   Returns false if the op must go through the per-pass code below.  */
+static bool gen_neon_3r_gvec(int op, int u, int size, int q,
+                             int rd, int rn, int rm)
+{
+    uint32_t dofs = vfp_reg_offset(1, rd);
+    uint32_t aofs = vfp_reg_offset(1, rn);
+    uint32_t bofs = vfp_reg_offset(1, rm);
+    uint32_t oprsz = q ? 16 : 8;
+
+    switch (op) {
+    case NEON_3R_VADD_VSUB:
+        if (!u) {
+            tcg_gen_gvec_add(cpu_env, size, dofs, aofs, bofs, oprsz);
+        } else {
+            tcg_gen_gvec_sub(cpu_env, size, dofs, aofs, bofs, oprsz);
+        }
+        return true;
+    case NEON_3R_LOGIC:
+        switch ((u << 2) | size) {
+        case 0: /* VAND */
+            tcg_gen_gvec_and(cpu_env, dofs, aofs, bofs, oprsz);
+            return true;
+        case 1: /* BIC */
+            tcg_gen_gvec_andc(cpu_env, dofs, aofs, bofs, oprsz);
+            return true;
+        case 2: /* VORR */
+            tcg_gen_gvec_or(cpu_env, dofs, aofs, bofs, oprsz);
+            return true;
+        case 3: /* VORN */
+            tcg_gen_gvec_orc(cpu_env, dofs, aofs, bofs, oprsz);
+            return true;
+        case 4: /* VEOR */
+            tcg_gen_gvec_xor(cpu_env, dofs, aofs, bofs, oprsz);
+            return true;
+        }
+        return false;
+    case NEON_3R_VTST_VCEQ:
+        if (!u) {
+            return false;
+        }
+        tcg_gen_gvec_cmp(cpu_env, TCG_COND_EQ, size, dofs, aofs, bofs, oprsz);
+        return true;
+    case NEON_3R_VCGT:
+        tcg_gen_gvec_cmp(cpu_env, u ? TCG_COND_GTU : TCG_COND_GT, size,
+                         dofs, aofs, bofs, oprsz);
+        return true;
+    case NEON_3R_VCGE:
+        tcg_gen_gvec_cmp(cpu_env, u ? TCG_COND_GEU : TCG_COND_GE, size,
+                         dofs, aofs, bofs, oprsz);
+        return true;
+    }
+    return false;
+}
+
 /* Translate a NEON data processing instruction.  Return nonzero if the
    instruction is invalid.
    We process data in a mixture of 32-bit and 64-bit chunks.
@@ -5164,6 +5214,9 @@ static int disas_neon_data_insn(DisasContext *s, uint32_t insn)
             tcg_temp_free_i32(tmp3);
             return 0;
         }
+        if (gen_neon_3r_gvec(op, u, size, q, rd, rn, rm)) {
+            return 0;
+        }
         if (size == 3 && op != NEON_3R_LOGIC) {
             /* 64-bit element instructions. */
             for (pass = 0; pass < (q ? 2 : 1); pass++) {
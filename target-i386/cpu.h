@@ -37,6 +37,9 @@
    close to the modifying instruction */
 #define TARGET_HAS_PRECISE_SMC
 
+/* the guest can run with one host thread per vCPU, see -tcg thread=multi */
+#define TARGET_SUPPORTS_MTTCG
+
 #ifdef TARGET_X86_64
 #define ELF_MACHINE     EM_X86_64
 #define ELF_MACHINE_UNAME "x86_64"
@@ -57,6 +57,7 @@ DEF_HELPER_2(hlt, void, env, int)
 DEF_HELPER_2(monitor, void, env, tl)
 DEF_HELPER_2(mwait, void, env, int)
 DEF_HELPER_2(pause, void, env, int)
+DEF_HELPER_2(tb_hot, void, env, ptr)
 DEF_HELPER_1(debug, void, env)
 DEF_HELPER_1(reset_rf, void, env)
 DEF_HELPER_3(raise_interrupt, void, env, int, int)
@@ -21,18 +21,17 @@
 #include "exec/helper-proto.h"
 #include "exec/cpu_ldst.h"
 
-/* broken thread support */
-
-static spinlock_t global_cpu_lock = SPIN_LOCK_UNLOCKED;
+/* LOCK prefixed instructions are not translated to host atomics; the
+   lock is held from the prefix to the end of the instruction.  */
 
 void helper_lock(void)
 {
-    spin_lock(&global_cpu_lock);
+    cpu_atomic_lock();
 }
 
 void helper_unlock(void)
 {
-    spin_unlock(&global_cpu_lock);
+    cpu_atomic_unlock();
 }
 
 void helper_cmpxchg8b(CPUX86State *env, target_ulong a0)
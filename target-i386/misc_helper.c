@@ -21,6 +21,7 @@
 #include "exec/ioport.h"
 #include "exec/helper-proto.h"
 #include "exec/cpu_ldst.h"
+#include "qemu/main-loop.h"
 
 void helper_outb(uint32_t port, uint32_t data)
 {
@@ -110,7 +111,12 @@ target_ulong helper_read_crN(CPUX86State *env, int reg)
         break;
     case 8:
         if (!(env->hflags2 & HF2_VINTR_MASK)) {
+            bool locked = qemu_tcg_lock_iothread();
+
             val = cpu_get_apic_tpr(x86_env_get_cpu(env)->apic_state);
+            if (locked) {
+                qemu_mutex_unlock_iothread();
+            }
         } else {
             val = env->v_tpr;
         }
@@ -134,7 +140,12 @@ void helper_write_crN(CPUX86State *env, int reg, target_ulong t0)
         break;
     case 8:
         if (!(env->hflags2 & HF2_VINTR_MASK)) {
+            bool locked = qemu_tcg_lock_iothread();
+
             cpu_set_apic_tpr(x86_env_get_cpu(env)->apic_state, t0);
+            if (locked) {
+                qemu_mutex_unlock_iothread();
+            }
         }
         env->v_tpr = t0 & 0x0f;
         break;
@@ -243,7 +254,14 @@ void helper_wrmsr(CPUX86State *env)
         env->sysenter_eip = val;
         break;
     case MSR_IA32_APICBASE:
-        cpu_set_apic_base(x86_env_get_cpu(env)->apic_state, val);
+        {
+            bool locked = qemu_tcg_lock_iothread();
+
+            cpu_set_apic_base(x86_env_get_cpu(env)->apic_state, val);
+            if (locked) {
+                qemu_mutex_unlock_iothread();
+            }
+        }
         break;
     case MSR_EFER:
         {
@@ -394,7 +412,14 @@ void helper_rdmsr(CPUX86State *env)
         val = env->sysenter_eip;
         break;
     case MSR_IA32_APICBASE:
-        val = cpu_get_apic_base(x86_env_get_cpu(env)->apic_state);
+        {
+            bool locked = qemu_tcg_lock_iothread();
+
+            val = cpu_get_apic_base(x86_env_get_cpu(env)->apic_state);
+            if (locked) {
+                qemu_mutex_unlock_iothread();
+            }
+        }
         break;
     case MSR_EFER:
         val = env->efer;
@@ -593,6 +618,20 @@ void helper_pause(CPUX86State *env, int next_eip_addend)
     do_pause(cpu);
 }
 
+/* Called at the start of @tb once it has run often enough */
+void helper_tb_hot(CPUX86State *env, void *ptr)
+{
+    CPUState *cs = CPU(x86_env_get_cpu(env));
+    TranslationBlock *tb = ptr;
+    target_ulong eip = tb->pc - tb->cs_base;
+
+    if (tb_gen_superblock(cs, tb)) {
+        /* nothing of the old TB has run yet, restart at its start */
+        env->eip = eip;
+        cpu_loop_exit(cs);
+    }
+}
+
 void helper_debug(CPUX86State *env)
 {
     CPUState *cs = CPU(x86_env_get_cpu(env));
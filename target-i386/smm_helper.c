@@ -19,6 +19,7 @@
 
 #include "cpu.h"
 #include "exec/helper-proto.h"
+#include "qemu/main-loop.h"
 
 /* SMM support */
 
@@ -308,7 +309,15 @@ void helper_rsm(CPUX86State *env)
     }
 #endif
     env->hflags &= ~HF_SMM_MASK;
-    cpu_smm_update(env);
+    {
+        /* remaps SMRAM in the chipset */
+        bool locked = qemu_tcg_lock_iothread();
+
+        cpu_smm_update(env);
+        if (locked) {
+            qemu_mutex_unlock_iothread();
+        }
+    }
 
     qemu_log_mask(CPU_LOG_INT, "SMM: after RSM\n");
     log_cpu_state_mask(CPU_LOG_INT, CPU(cpu), CPU_DUMP_CCOP);
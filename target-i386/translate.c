@@ -27,6 +27,7 @@
 #include "cpu.h"
 #include "disas/disas.h"
 #include "tcg-op.h"
+#include "tcg-op-gvec.h"
 #include "exec/cpu_ldst.h"
 
 #include "exec/helper-proto.h"
@@ -126,6 +127,7 @@ typedef struct DisasContext {
     int cpuid_ext2_features;
     int cpuid_ext3_features;
     int cpuid_7_0_ebx_features;
+    int tb_slots; /* goto_tb slots already emitted in this TB */
 } DisasContext;
 
 static void gen_eob(DisasContext *s);
@@ -2208,10 +2210,13 @@ static inline void gen_goto_tb(DisasContext *s, int tb_num, target_ulong eip)
 
     pc = s->cs_base + eip;
     tb = s->tb;
-    /* NOTE: we handle the case where the TB spans two pages here */
-    if ((pc & TARGET_PAGE_MASK) == (tb->pc & TARGET_PAGE_MASK) ||
-        (pc & TARGET_PAGE_MASK) == ((s->pc - 1) & TARGET_PAGE_MASK))  {
+    /* NOTE: we handle the case where the TB spans two pages here.
+       A superblock side exit may already own the slot.  */
+    if (!(s->tb_slots & (1 << tb_num)) &&
+        ((pc & TARGET_PAGE_MASK) == (tb->pc & TARGET_PAGE_MASK) ||
+         (pc & TARGET_PAGE_MASK) == ((s->pc - 1) & TARGET_PAGE_MASK)))  {
         /* jump to same page: we can use a direct jump */
+        s->tb_slots |= 1 << tb_num;
         tcg_gen_goto_tb(tb_num);
         gen_jmp_im(eip);
         tcg_gen_exit_tb((uintptr_t)tb + tb_num);
@@ -2222,6 +2227,45 @@ static inline void gen_goto_tb(DisasContext *s, int tb_num, target_ulong eip)
     }
 }
 
+/* Superblocks (CF_SUPERBLOCK) go on translating at the target of a
+   forward direct jump instead of ending the TB, as long as the target is
+   on the page of the TB start: the TB then still covers a single range
+   [tb->pc, tb->pc + tb->size) of one page, and invalidation on code
+   writes works as for a normal TB.  */
+static bool gen_sb_can_follow(DisasContext *s, target_ulong eip)
+{
+    target_ulong pc = s->cs_base + eip;
+
+    return (s->tb->cflags & CF_SUPERBLOCK) && s->jmp_opt &&
+           pc >= s->pc && pc - s->tb->pc < TARGET_PAGE_SIZE - 32 &&
+           ((pc + TARGET_MAX_INSN_SIZE - 1) & TARGET_PAGE_MASK) ==
+           (s->tb->pc & TARGET_PAGE_MASK);
+}
+
+/* In a superblock, turn a forward conditional jump into a side exit to
+   @val and go on translating at @next_eip.  cc_op is left dynamic by the
+   branch, but everything else known at translation time carries over.
+   Only one side exit gets a chained goto_tb slot, so a second forward
+   jcc ends the superblock as usual.  */
+static bool gen_sb_jcc(DisasContext *s, int b,
+                       target_ulong val, target_ulong next_eip)
+{
+    TCGLabel *l1;
+
+    if (val < next_eip || (s->tb_slots & 1) ||
+        !gen_sb_can_follow(s, next_eip)) {
+        return false;
+    }
+    l1 = gen_new_label();
+    gen_jcc1(s, b ^ 1, l1);
+    gen_goto_tb(s, 0, val);
+    gen_set_label(l1);
+    /* gen_goto_tb may have fallen back to gen_eob */
+    s->is_jmp = DISAS_NEXT;
+    s->tb_slots |= 1;
+    return true;
+}
+
 static inline void gen_jcc(DisasContext *s, int b,
                            target_ulong val, target_ulong next_eip)
 {
@@ -2582,7 +2626,8 @@ static void gen_jmp_tb(DisasContext *s, target_ulong eip, int tb_num)
 
 static void gen_jmp(DisasContext *s, target_ulong eip)
 {
-    gen_jmp_tb(s, eip, 0);
+    /* the first slot may be taken by a superblock side exit */
+    gen_jmp_tb(s, eip, s->tb_slots & 1);
 }
 
 static inline void gen_ldq_env_A0(DisasContext *s, int offset)
@@ -2973,6 +3018,74 @@ static const struct SSEOpHelper_eppi sse_op_table7[256] = {
     [0xdf] = AESNI_OP(aeskeygenassist),
 };
 
+/* Expand the integer MMX/SSE ops that have a generic vector equivalent
+   inline instead of calling the helper.  Returns false if @b has none.  */
+static bool gen_sse_gvec(int b, int op1_offset, int op2_offset, int oprsz)
+{
+    switch (b) {
+    case 0xfc: /* paddb */
+    case 0xfd: /* paddw */
+    case 0xfe: /* paddl */
+        tcg_gen_gvec_add(cpu_env, b - 0xfc, op1_offset, op1_offset,
+                         op2_offset, oprsz);
+        break;
+    case 0xd4: /* paddq */
+        tcg_gen_gvec_add(cpu_env, MO_64, op1_offset, op1_offset,
+                         op2_offset, oprsz);
+        break;
+    case 0xf8: /* psubb */
+    case 0xf9: /* psubw */
+    case 0xfa: /* psubl */
+    case 0xfb: /* psubq */
+        tcg_gen_gvec_sub(cpu_env, b - 0xf8, op1_offset, op1_offset,
+                         op2_offset, oprsz);
+        break;
+    case 0xdb: /* pand */
+        tcg_gen_gvec_and(cpu_env, op1_offset, op1_offset, op2_offset, oprsz);
+        break;
+    case 0xdf: /* pandn */
+        tcg_gen_gvec_andc(cpu_env, op1_offset, op2_offset, op1_offset, oprsz);
+        break;
+    case 0xeb: /* por */
+        tcg_gen_gvec_or(cpu_env, op1_offset, op1_offset, op2_offset, oprsz);
+        break;
+    case 0xef: /* pxor */
+        tcg_gen_gvec_xor(cpu_env, op1_offset, op1_offset, op2_offset, oprsz);
+        break;
+    case 0x74: /* pcmpeqb */
+    case 0x75: /* pcmpeqw */
+    case 0x76: /* pcmpeql */
+        tcg_gen_gvec_cmp(cpu_env, TCG_COND_EQ, b - 0x74, op1_offset,
+                         op1_offset, op2_offset, oprsz);
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+/* Same for the shifts by an immediate, @op being the modrm reg field */
+static bool gen_sse_gvec_shifti(int b, int op, int offset, int val,
+                                int oprsz)
+{
+    unsigned vece = (b & 3) == 1 ? MO_16 : (b & 3) == 2 ? MO_32 : MO_64;
+
+    switch (op) {
+    case 2: /* psrl */
+        tcg_gen_gvec_shri(cpu_env, vece, offset, offset, val, oprsz);
+        break;
+    case 4: /* psra */
+        tcg_gen_gvec_sari(cpu_env, vece, offset, offset, val, oprsz);
+        break;
+    case 6: /* psll */
+        tcg_gen_gvec_shli(cpu_env, vece, offset, offset, val, oprsz);
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
 static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                     target_ulong pc_start, int rex_r)
 {
@@ -3402,6 +3515,10 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                 rm = (modrm & 7);
                 op2_offset = offsetof(CPUX86State,fpregs[rm].mmx);
             }
+            if (gen_sse_gvec_shifti(b, (modrm >> 3) & 7, op2_offset, val,
+                                    is_xmm ? 16 : 8)) {
+                break;
+            }
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op2_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op1_offset);
             sse_fn_epp(cpu_env, cpu_ptr0, cpu_ptr1);
@@ -4389,6 +4506,9 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
             sse_fn_eppt(cpu_env, cpu_ptr0, cpu_ptr1, cpu_A0);
             break;
         default:
+            if (gen_sse_gvec(b, op1_offset, op2_offset, is_xmm ? 16 : 8)) {
+                break;
+            }
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
             sse_fn_epp(cpu_env, cpu_ptr0, cpu_ptr1);
@@ -6494,6 +6614,10 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         } else if (!CODE64(s)) {
             tval &= 0xffffffff;
         }
+        if (gen_sb_can_follow(s, tval)) {
+            s->pc = s->cs_base + tval;
+            break;
+        }
         gen_jmp(s, tval);
         break;
     case 0xea: /* ljmp im */
@@ -6516,6 +6640,10 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         if (dflag == MO_16) {
             tval &= 0xffff;
         }
+        if (gen_sb_can_follow(s, tval)) {
+            s->pc = s->cs_base + tval;
+            break;
+        }
         gen_jmp(s, tval);
         break;
     case 0x70 ... 0x7f: /* jcc Jb */
@@ -6533,7 +6661,9 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         if (dflag == MO_16) {
             tval &= 0xffff;
         }
-        gen_jcc(s, b, tval, next_eip);
+        if (!gen_sb_jcc(s, b, tval, next_eip)) {
+            gen_jcc(s, b, tval, next_eip);
+        }
         break;
 
     case 0x190 ... 0x19f: /* setcc Gv */
@@ -7904,6 +8034,32 @@ void optimize_flags_init(void)
 /* generate intermediate code in gen_opc_buf and gen_opparam_buf for
    basic block 'tb'. If search_pc is TRUE, also generate PC
    information for each intermediate instruction. */
+/* Count down the executions of @tb and have it retranslated as a
+   superblock once it gets hot.  This runs before any guest instruction,
+   so the helper can restart execution at the TB start.
+
+   The count is best-effort: it is not updated atomically, so with
+   multi-threaded TCG vCPUs running @tb at the same time can lose
+   decrements, which only delays the superblock, or all bring it to 0.
+   Each vCPU calls the helper when its own decrement yields 0, and
+   tb_gen_superblock() replaces @tb only once; the other vCPUs go on
+   running the code of the old TB, which is still correct.  */
+static void gen_tb_hot_count(TranslationBlock *tb)
+{
+    TCGv_ptr ptr = tcg_const_ptr(tb);
+    TCGv_i32 count = tcg_temp_new_i32();
+    TCGLabel *l1 = gen_new_label();
+
+    tcg_gen_ld_i32(count, ptr, offsetof(TranslationBlock, hot_count));
+    tcg_gen_subi_i32(count, count, 1);
+    tcg_gen_st_i32(count, ptr, offsetof(TranslationBlock, hot_count));
+    tcg_gen_brcondi_i32(TCG_COND_NE, count, 0, l1);
+    gen_helper_tb_hot(cpu_env, ptr);
+    gen_set_label(l1);
+    tcg_temp_free_i32(count);
+    tcg_temp_free_ptr(ptr);
+}
+
 static inline void gen_intermediate_code_internal(X86CPU *cpu,
                                                   TranslationBlock *tb,
                                                   bool search_pc)
@@ -7999,7 +8155,14 @@ static inline void gen_intermediate_code_internal(X86CPU *cpu,
     if (max_insns == 0)
         max_insns = CF_COUNT_MASK;
 
+    dc->tb_slots = 0;
+
     gen_tb_start(tb);
+    if (dc->jmp_opt && tcg_superblock_threshold &&
+        !(tb->cflags & (CF_SUPERBLOCK | CF_USE_ICOUNT | CF_NOCACHE |
+                        CF_COUNT_MASK))) {
+        gen_tb_hot_count(tb);
+    }
     for(;;) {
         if (unlikely(!QTAILQ_EMPTY(&cs->breakpoints))) {
             QTAILQ_FOREACH(bp, &cs->breakpoints, entry) {
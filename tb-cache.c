@@ -0,0 +1,589 @@
+/*
+ * Persistent translation cache
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/* Translated blocks are saved to a file when QEMU exits, and later runs of
+ * the same QEMU binary with the same -cpu and -tcg options copy them into
+ * the code buffer instead of translating the guest code again.
+ *
+ * A cached block is looked up by pc, cs_base and flags, and is only used
+ * if the guest code it was translated from is still in guest memory, byte
+ * for byte.  Blocks that cross a guest page are not cached.
+ *
+ * The code buffer, the prologue and QEMU itself are at other addresses in
+ * each run, so the host addresses in the code of a block, which the TCG
+ * backend notes as TCGCodeRelocs, are saved relative to one of them and
+ * moved when the block is loaded.  Blocks with other host addresses, such
+ * as pointers into the heap, are not cached.
+ */
+
+#include "config.h"
+#include "cpu.h"
+#include "exec/exec-all.h"
+#include "exec/ram_addr.h"
+#include "hw/boards.h"
+#include "qemu/error-report.h"
+#include "qemu/thread.h"
+#include "tcg/tcg.h"
+
+#if defined(TCG_TARGET_HAS_CODE_RELOCS) && defined(CONFIG_LINUX)
+
+#define TB_CACHE_MAGIC      "QEMUTBC"
+#define TB_CACHE_VERSION    2
+
+/* stop adding blocks once the cache holds this many bytes */
+#define TB_CACHE_MAX_SIZE   (256 * 1024 * 1024)
+
+/* the prologue takes the last 1024 bytes of the code buffer */
+#define TB_CACHE_PROLOGUE_SIZE 1024
+
+/* bounds of the QEMU executable, from the linker */
+extern const char __executable_start[], __etext[], _end[];
+
+typedef struct TBCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t features;      /* tcg_target_code_features() */
+    uint64_t image_size;
+    uint64_t image_hash;    /* of the text of the executable */
+    char id[256];           /* target, machine, CPU and TCG options */
+} TBCacheHeader;
+
+/* what the value of a TBCacheReloc is relative to */
+enum {
+    TB_CACHE_BASE_CONST,    /* not an address */
+    TB_CACHE_BASE_CODE,     /* the code of the block */
+    TB_CACHE_BASE_TB,       /* the TranslationBlock */
+    TB_CACHE_BASE_PROLOGUE,
+    TB_CACHE_BASE_IMAGE,    /* the QEMU executable */
+};
+
+typedef struct TBCacheReloc {
+    uint32_t offset;
+    uint8_t kind;           /* TCGCodeRelocKind */
+    uint8_t base;
+    uint16_t pad;
+    uint64_t value;
+} TBCacheReloc;
+
+/* A cached block.  In the file and in memory it is followed by its
+   relocations, its guest code and its host code.  */
+typedef struct TBCacheRecord {
+    uint64_t pc;
+    uint64_t cs_base;
+    uint64_t flags;
+    uint16_t size;
+    uint16_t icount;
+    uint16_t tb_next_offset[2];
+    uint16_t tb_jmp_offset[2];
+    uint32_t code_size;
+    uint32_t nb_relocs;
+} TBCacheRecord;
+
+typedef struct TBCacheEntry TBCacheEntry;
+
+struct TBCacheEntry {
+    TBCacheEntry *next;     /* with the same pc, cs_base and flags */
+    TBCacheRecord rec;
+    uint8_t data[];
+};
+
+typedef struct TBCache {
+    char *path;
+    /* protects the fields below; taken inside tb_lock */
+    QemuMutex lock;
+    bool loaded;
+    bool dirty;
+    TBCacheHeader header;
+    /* first TBCacheEntry, keyed on its TBCacheRecord */
+    GHashTable *table;
+    size_t size;
+    unsigned int hit_count;
+    unsigned int miss_count;
+    unsigned int store_count;
+} TBCache;
+
+static TBCache tb_cache;
+
+static size_t tb_cache_data_size(const TBCacheRecord *rec)
+{
+    return rec->nb_relocs * sizeof(TBCacheReloc) + rec->size + rec->code_size;
+}
+
+static TBCacheReloc *tb_cache_relocs(TBCacheEntry *e)
+{
+    return (TBCacheReloc *)e->data;
+}
+
+static uint8_t *tb_cache_guest_code(TBCacheEntry *e)
+{
+    return e->data + e->rec.nb_relocs * sizeof(TBCacheReloc);
+}
+
+static uint8_t *tb_cache_host_code(TBCacheEntry *e)
+{
+    return tb_cache_guest_code(e) + e->rec.size;
+}
+
+static guint tb_cache_hash(gconstpointer p)
+{
+    const TBCacheRecord *rec = p;
+    uint64_t h;
+
+    h = (rec->pc ^ rec->cs_base) * 0x9e3779b97f4a7c15ull ^ rec->flags;
+    return h ^ h >> 32;
+}
+
+static gboolean tb_cache_equal(gconstpointer a, gconstpointer b)
+{
+    const TBCacheRecord *ra = a;
+    const TBCacheRecord *rb = b;
+
+    return ra->pc == rb->pc && ra->cs_base == rb->cs_base &&
+           ra->flags == rb->flags;
+}
+
+static uint64_t tb_cache_hash_bytes(uint64_t hash, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ p[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+/* Describe this binary and configuration.  A file written by any other
+   is ignored.  Boards that pick their own CPU leave cpu_model NULL, so
+   the CPU is identified by its QOM type and the feature bits that the
+   translator checks.  */
+static void tb_cache_header_init(TBCacheHeader *h)
+{
+    const uint64_t *text = (const uint64_t *)__executable_start;
+    size_t i, n = (__etext - __executable_start) / sizeof(uint64_t);
+    const char *cpu_model = current_machine->cpu_model;
+    uint64_t hash = 0xcbf29ce484222325ull;
+    uint64_t cpu_hash = 0xcbf29ce484222325ull;
+
+    for (i = 0; i < n; i++) {
+        hash = (hash ^ text[i]) * 0x100000001b3ull;
+    }
+#if defined(TARGET_I386) || defined(TARGET_ARM)
+    {
+        CPUArchState *env = first_cpu->env_ptr;
+
+        cpu_hash = tb_cache_hash_bytes(cpu_hash, &env->features,
+                                       sizeof(env->features));
+    }
+#endif
+    if (cpu_model) {
+        cpu_hash = tb_cache_hash_bytes(cpu_hash, cpu_model, strlen(cpu_model));
+    }
+
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, TB_CACHE_MAGIC, sizeof(TB_CACHE_MAGIC));
+    h->version = TB_CACHE_VERSION;
+    h->features = tcg_target_code_features();
+    h->image_size = _end - __executable_start;
+    h->image_hash = hash;
+    /* the superblock threshold decides which blocks count their runs */
+    snprintf(h->id, sizeof(h->id),
+             "%s machine=%s cpu=%s cpu-hash=%016" PRIx64
+             " optimize=%s superblock=%d",
+             TARGET_NAME, MACHINE_GET_CLASS(current_machine)->name,
+             object_get_typename(OBJECT(first_cpu)), cpu_hash,
+             tcg_opt_redundancy ? "full" : "basic", tcg_superblock_threshold);
+}
+
+static void tb_cache_insert(TBCacheEntry *e)
+{
+    e->next = g_hash_table_lookup(tb_cache.table, &e->rec);
+    /* the key is the record of the first entry, so replace it too */
+    g_hash_table_replace(tb_cache.table, &e->rec, e);
+    tb_cache.size += sizeof(e->rec) + tb_cache_data_size(&e->rec);
+}
+
+/* Read the file on first use, when the CPU model is known */
+static void tb_cache_read(void)
+{
+    TBCacheHeader h;
+    TBCacheRecord rec;
+    TBCacheEntry *e;
+    FILE *f;
+
+    tb_cache.loaded = true;
+    tb_cache_header_init(&tb_cache.header);
+
+    f = fopen(tb_cache.path, "rb");
+    if (!f) {
+        return;
+    }
+    if (fread(&h, sizeof(h), 1, f) != 1 ||
+        memcmp(&h, &tb_cache.header, sizeof(h)) != 0) {
+        /* written by another QEMU; it is replaced on exit */
+        fclose(f);
+        tb_cache.dirty = true;
+        return;
+    }
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        if (rec.size == 0 || rec.size > TARGET_PAGE_SIZE ||
+            rec.code_size > TCG_MAX_OP_SIZE * OPC_BUF_SIZE ||
+            rec.nb_relocs > TCG_MAX_CODE_RELOCS ||
+            tb_cache.size >= TB_CACHE_MAX_SIZE) {
+            break;
+        }
+        e = g_malloc(sizeof(*e) + tb_cache_data_size(&rec));
+        e->rec = rec;
+        if (fread(e->data, tb_cache_data_size(&rec), 1, f) != 1) {
+            g_free(e);
+            break;
+        }
+        tb_cache_insert(e);
+    }
+    fclose(f);
+}
+
+static void tb_cache_save(void)
+{
+    GHashTableIter iter;
+    gpointer value;
+    TBCacheEntry *e;
+    char *tmp;
+    FILE *f;
+    bool ok;
+
+    qemu_mutex_lock(&tb_cache.lock);
+    if (!tb_cache.dirty) {
+        goto out;
+    }
+
+    tmp = g_strdup_printf("%s.tmp", tb_cache.path);
+    f = fopen(tmp, "wb");
+    if (!f) {
+        error_report("Could not write translation cache '%s': %s",
+                     tmp, strerror(errno));
+        g_free(tmp);
+        goto out;
+    }
+    ok = fwrite(&tb_cache.header, sizeof(tb_cache.header), 1, f) == 1;
+    g_hash_table_iter_init(&iter, tb_cache.table);
+    while (ok && g_hash_table_iter_next(&iter, NULL, &value)) {
+        for (e = value; e && ok; e = e->next) {
+            ok = fwrite(&e->rec, sizeof(e->rec), 1, f) == 1 &&
+                 fwrite(e->data, tb_cache_data_size(&e->rec), 1, f) == 1;
+        }
+    }
+    if (fclose(f) != 0) {
+        ok = false;
+    }
+    if (!ok || rename(tmp, tb_cache.path) < 0) {
+        error_report("Could not write translation cache '%s': %s",
+                     tb_cache.path, strerror(errno));
+        unlink(tmp);
+    }
+    g_free(tmp);
+    tb_cache.dirty = false;
+
+out:
+    qemu_mutex_unlock(&tb_cache.lock);
+}
+
+void tb_cache_open(const char *path, Error **errp)
+{
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 && errno != ENOENT) {
+        error_setg_errno(errp, errno, "Could not open translation cache '%s'",
+                         path);
+        return;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    tb_cache.path = g_strdup(path);
+    tb_cache.table = g_hash_table_new(tb_cache_hash, tb_cache_equal);
+    qemu_mutex_init(&tb_cache.lock);
+    atexit(tb_cache_save);
+}
+
+/* Whether @tb may be loaded from or added to the cache */
+static bool tb_cache_usable(CPUState *cpu, TranslationBlock *tb)
+{
+    return tb_cache.path && tb->cflags == 0 && !singlestep &&
+           !cpu->singlestep_enabled && QTAILQ_EMPTY(&cpu->breakpoints);
+}
+
+/* Copy the code of @e to tb->tc_ptr and move its host addresses.  Fails if
+   an address no longer fits the encoding that the backend chose for it,
+   since the backend would emit different code for it here.  */
+static bool tb_cache_relocate(TBCacheEntry *e, TranslationBlock *tb)
+{
+    TBCacheReloc *r = tb_cache_relocs(e);
+    uint8_t *code = tb->tc_ptr;
+    uint32_t i, field_size;
+    uintptr_t v, field;
+    int64_t x;
+
+    memcpy(code, tb_cache_host_code(e), e->rec.code_size);
+
+    for (i = 0; i < e->rec.nb_relocs; i++, r++) {
+        switch (r->base) {
+        case TB_CACHE_BASE_CONST:
+            v = r->value;
+            break;
+        case TB_CACHE_BASE_CODE:
+            v = (uintptr_t)code + r->value;
+            break;
+        case TB_CACHE_BASE_TB:
+            v = (uintptr_t)tb + r->value;
+            break;
+        case TB_CACHE_BASE_PROLOGUE:
+            v = (uintptr_t)tcg_ctx.code_gen_prologue + r->value;
+            break;
+        case TB_CACHE_BASE_IMAGE:
+            v = (uintptr_t)__executable_start + r->value;
+            break;
+        default:
+            return false;
+        }
+
+        field = (uintptr_t)code + r->offset;
+        field_size = 4;
+        switch (r->kind) {
+        case TCG_CODE_RELOC_BRANCH_PCREL32:
+            x = v - (field + 4);
+            if (x != (int32_t)x) {
+                return false;
+            }
+            break;
+        case TCG_CODE_RELOC_MOVI_ABS32:
+            x = v;
+            if (v == 0 || v != (uint32_t)v) {
+                return false;
+            }
+            break;
+        case TCG_CODE_RELOC_MOVI_ABS32S:
+            x = v;
+            if (v == (uint32_t)v || v != (int32_t)v) {
+                return false;
+            }
+            break;
+        case TCG_CODE_RELOC_MOVI_PCREL32:
+            x = v - (field + 4);
+            if (v == (uint32_t)v || v == (int32_t)v || x != (int32_t)x) {
+                return false;
+            }
+            break;
+        case TCG_CODE_RELOC_MOVI_ABS64:
+            x = v - (field + 5);
+            if (v == (uint32_t)v || v == (int32_t)v || x == (int32_t)x) {
+                return false;
+            }
+            x = v;
+            field_size = 8;
+            break;
+        default:
+            return false;
+        }
+        if (r->offset + field_size > e->rec.code_size) {
+            return false;
+        }
+        /* the host is little-endian */
+        memcpy(code + r->offset, &x, field_size);
+    }
+    return true;
+}
+
+bool tb_cache_load(CPUState *cpu, TranslationBlock *tb,
+                   tb_page_addr_t phys_pc, int *code_size)
+{
+    TBCacheRecord key;
+    TBCacheEntry *e;
+    uint8_t *guest;
+    bool found = false;
+
+    if (!tb_cache_usable(cpu, tb)) {
+        return false;
+    }
+    key.pc = tb->pc;
+    key.cs_base = tb->cs_base;
+    key.flags = tb->flags;
+    guest = qemu_get_ram_ptr(phys_pc);
+
+    qemu_mutex_lock(&tb_cache.lock);
+    if (!tb_cache.loaded) {
+        tb_cache_read();
+    }
+    for (e = g_hash_table_lookup(tb_cache.table, &key); e; e = e->next) {
+        if ((phys_pc & ~TARGET_PAGE_MASK) + e->rec.size <= TARGET_PAGE_SIZE &&
+            memcmp(guest, tb_cache_guest_code(e), e->rec.size) == 0) {
+            found = tb_cache_relocate(e, tb);
+            break;
+        }
+    }
+    if (found) {
+        tb->size = e->rec.size;
+        tb->icount = e->rec.icount;
+        tb->tb_next_offset[0] = e->rec.tb_next_offset[0];
+        tb->tb_next_offset[1] = e->rec.tb_next_offset[1];
+        tb->tb_jmp_offset[0] = e->rec.tb_jmp_offset[0];
+        tb->tb_jmp_offset[1] = e->rec.tb_jmp_offset[1];
+        *code_size = e->rec.code_size;
+        flush_icache_range((uintptr_t)tb->tc_ptr,
+                           (uintptr_t)tb->tc_ptr + e->rec.code_size);
+        tb_cache.hit_count++;
+    } else {
+        tb_cache.miss_count++;
+    }
+    qemu_mutex_unlock(&tb_cache.lock);
+    return found;
+}
+
+/* Record what the host address @cr->value is relative to */
+static bool tb_cache_classify(const TCGCodeReloc *cr, TranslationBlock *tb,
+                              int code_size, TBCacheReloc *r)
+{
+    uintptr_t v = cr->value;
+    uintptr_t prologue = (uintptr_t)tcg_ctx.code_gen_prologue;
+    uintptr_t image = (uintptr_t)__executable_start;
+
+    r->offset = cr->offset;
+    r->kind = cr->kind;
+    if (!cr->is_ptr) {
+        r->base = TB_CACHE_BASE_CONST;
+        r->value = v;
+    } else if (v - (uintptr_t)tb < sizeof(*tb)) {
+        r->base = TB_CACHE_BASE_TB;
+        r->value = v - (uintptr_t)tb;
+    } else if (v - (uintptr_t)tb->tc_ptr <= code_size) {
+        r->base = TB_CACHE_BASE_CODE;
+        r->value = v - (uintptr_t)tb->tc_ptr;
+    } else if (v - prologue < TB_CACHE_PROLOGUE_SIZE) {
+        r->base = TB_CACHE_BASE_PROLOGUE;
+        r->value = v - prologue;
+    } else if (v - image < _end - __executable_start) {
+        r->base = TB_CACHE_BASE_IMAGE;
+        r->value = v - image;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void tb_cache_add(CPUState *cpu, TranslationBlock *tb,
+                  tb_page_addr_t phys_pc, int code_size)
+{
+    TCGContext *s = &tcg_ctx;
+    TBCacheRecord rec;
+    TBCacheEntry *e, *head, *old, **pe;
+    size_t size;
+    int i;
+
+    if (!tb_cache_usable(cpu, tb) ||
+        s->nb_code_relocs < 0 || s->nb_ptr_consts > 0) {
+        return;
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    rec.pc = tb->pc;
+    rec.cs_base = tb->cs_base;
+    rec.flags = tb->flags;
+    rec.size = tb->size;
+    rec.icount = tb->icount;
+    rec.tb_next_offset[0] = tb->tb_next_offset[0];
+    rec.tb_next_offset[1] = tb->tb_next_offset[1];
+    rec.tb_jmp_offset[0] = tb->tb_jmp_offset[0];
+    rec.tb_jmp_offset[1] = tb->tb_jmp_offset[1];
+    rec.code_size = code_size;
+    rec.nb_relocs = s->nb_code_relocs;
+    size = sizeof(rec) + tb_cache_data_size(&rec);
+
+    e = g_malloc0(sizeof(*e) + tb_cache_data_size(&rec));
+    e->rec = rec;
+    for (i = 0; i < s->nb_code_relocs; i++) {
+        if (!tb_cache_classify(&s->code_relocs[i], tb, code_size,
+                               &tb_cache_relocs(e)[i])) {
+            g_free(e);
+            return;
+        }
+    }
+    memcpy(tb_cache_guest_code(e), qemu_get_ram_ptr(phys_pc), tb->size);
+    memcpy(tb_cache_host_code(e), tb->tc_ptr, code_size);
+
+    qemu_mutex_lock(&tb_cache.lock);
+    if (!tb_cache.loaded) {
+        tb_cache_read();
+    }
+
+    /* A block for the same guest code is only there if it could not be
+       loaded into this run; replace it.  */
+    head = g_hash_table_lookup(tb_cache.table, &rec);
+    for (pe = &head; *pe; pe = &(*pe)->next) {
+        if ((*pe)->rec.size == rec.size &&
+            memcmp(tb_cache_guest_code(*pe), tb_cache_guest_code(e),
+                   rec.size) == 0) {
+            old = *pe;
+            *pe = old->next;
+            if (head) {
+                g_hash_table_replace(tb_cache.table, &head->rec, head);
+            } else {
+                g_hash_table_remove(tb_cache.table, &rec);
+            }
+            tb_cache.size -= sizeof(old->rec) + tb_cache_data_size(&old->rec);
+            g_free(old);
+            break;
+        }
+    }
+
+    if (tb_cache.size + size > TB_CACHE_MAX_SIZE) {
+        g_free(e);
+    } else {
+        tb_cache_insert(e);
+        tb_cache.dirty = true;
+        tb_cache.store_count++;
+    }
+    qemu_mutex_unlock(&tb_cache.lock);
+}
+
+void tb_cache_dump_info(FILE *f, fprintf_function cpu_fprintf)
+{
+    if (!tb_cache.path) {
+        return;
+    }
+    qemu_mutex_lock(&tb_cache.lock);
+    cpu_fprintf(f, "TB cache            %u hits, %u misses, %u stored "
+                "(%zd bytes)\n", tb_cache.hit_count, tb_cache.miss_count,
+                tb_cache.store_count, tb_cache.size);
+    qemu_mutex_unlock(&tb_cache.lock);
+}
+
+#else
+
+void tb_cache_open(const char *path, Error **errp)
+{
+    error_setg(errp, "the translation cache is not supported on this host");
+}
+
+bool tb_cache_load(CPUState *cpu, TranslationBlock *tb,
+                   tb_page_addr_t phys_pc, int *code_size)
+{
+    return false;
+}
+
+void tb_cache_add(CPUState *cpu, TranslationBlock *tb,
+                  tb_page_addr_t phys_pc, int code_size)
+{
+}
+
+void tb_cache_dump_info(FILE *f, fprintf_function cpu_fprintf)
+{
+}
+
+#endif
@@ -31,6 +31,9 @@
 
 #define DEF_HELPER_FLAGS_2(name, flags, ret, t1, t2) \
   dh_ctype(ret) HELPER(name) (dh_ctype(t1), dh_ctype(t2));
+#define DEF_HELPER_FLAGS_4(name, flags, ret, t1, t2, t3, t4) \
+  dh_ctype(ret) HELPER(name) (dh_ctype(t1), dh_ctype(t2), dh_ctype(t3), \
+                              dh_ctype(t4));
 
 #include "tcg-runtime.h"
 
@@ -107,3 +110,37 @@ int64_t HELPER(mulsh_i64)(int64_t arg1, int64_t arg2)
     muls64(&l, &h, arg1, arg2);
     return h;
 }
+
+/* Vector comparisons, see tcg_gen_gvec_cmp().  @desc holds the vector size
+   in bytes, and the log2 of the element size in bytes from bit 16.  The
+   elements are extracted from host 64-bit words, as the inline expansions
+   do, so the result does not depend on the host byte order.  */
+
+#define DO_GVEC_CMP(NAME, TYPE, OP)                                     \
+void HELPER(NAME)(void *d, void *a, void *b, uint32_t desc)             \
+{                                                                       \
+    uint32_t oprsz = desc & 0xffff;                                     \
+    unsigned bits = 8 << (desc >> 16);                                  \
+    uint64_t lane = bits == 64 ? -1 : (1ull << bits) - 1;               \
+    uint64_t *pd = d, *pa = a, *pb = b;                                 \
+    uint32_t i;                                                         \
+    unsigned j;                                                         \
+                                                                        \
+    for (i = 0; i < oprsz / 8; i++) {                                   \
+        uint64_t r = 0;                                                 \
+                                                                        \
+        for (j = 0; j < 64; j += bits) {                                \
+            TYPE x = (TYPE)(pa[i] << (64 - bits - j)) >> (64 - bits);   \
+            TYPE y = (TYPE)(pb[i] << (64 - bits - j)) >> (64 - bits);   \
+            if (x OP y) {                                               \
+                r |= lane << j;                                         \
+            }                                                           \
+        }                                                               \
+        pd[i] = r;                                                      \
+    }                                                                   \
+}
+
+DO_GVEC_CMP(gvec_gt, int64_t, >)
+DO_GVEC_CMP(gvec_ge, int64_t, >=)
+DO_GVEC_CMP(gvec_gtu, uint64_t, >)
+DO_GVEC_CMP(gvec_geu, uint64_t, >=)
@@ -139,6 +139,14 @@ static bool have_bmi2;
 # define have_bmi2 0
 #endif
 
+#ifdef TCG_TARGET_HAS_CODE_RELOCS
+/* The optional host features that the generated code uses */
+uint32_t tcg_target_code_features(void)
+{
+    return have_cmov | have_movbe << 1 | have_bmi1 << 2 | have_bmi2 << 3;
+}
+#endif
+
 static tcg_insn_unit *tb_ret_addr;
 
 static void patch_reloc(tcg_insn_unit *code_ptr, int type,
@@ -306,6 +314,7 @@ static inline int tcg_target_const_match(tcg_target_long val, TCGType type,
 #define OPC_ARITH_GvEv	(0x03)		/* ... plus (ARITH_FOO << 3) */
 #define OPC_ANDN        (0xf2 | P_EXT38)
 #define OPC_ADD_GvEv	(OPC_ARITH_GvEv | (ARITH_ADD << 3))
+#define OPC_AND_GvEv	(OPC_ARITH_GvEv | (ARITH_AND << 3))
 #define OPC_BSWAP	(0xc8 | P_EXT)
 #define OPC_CALL_Jz	(0xe8)
 #define OPC_CMOVCC      (0x40 | P_EXT)  /* ... plus condition code */
@@ -333,6 +342,7 @@ static inline int tcg_target_const_match(tcg_target_long val, TCGType type,
 #define OPC_MOVSLQ	(0x63 | P_REXW)
 #define OPC_MOVZBL	(0xb6 | P_EXT)
 #define OPC_MOVZWL	(0xb7 | P_EXT)
+#define OPC_NOP		(0x90)
 #define OPC_POP_r32	(0x58)
 #define OPC_PUSH_r32	(0x50)
 #define OPC_PUSH_Iv	(0x68)
@@ -640,8 +650,18 @@ static inline void tcg_out_mov(TCGContext *s, TCGType type,
     }
 }
 
-static void tcg_out_movi(TCGContext *s, TCGType type,
-                         TCGReg ret, tcg_target_long arg)
+static inline void tcg_out_note_reloc(TCGContext *s, TCGCodeRelocKind kind,
+                                      bool is_ptr, tcg_target_long value)
+{
+#ifdef TCG_TARGET_HAS_CODE_RELOCS
+    tcg_note_code_reloc(s, kind, is_ptr, value);
+#endif
+}
+
+/* @is_ptr tells whether @arg is a host address, which must be noted even
+   where its encoding would not depend on the address of the code.  */
+static void tcg_out_movi_int(TCGContext *s, TCGType type, TCGReg ret,
+                             tcg_target_long arg, bool is_ptr)
 {
     tcg_target_long diff;
 
@@ -651,11 +671,17 @@ static void tcg_out_movi(TCGContext *s, TCGType type,
     }
     if (arg == (uint32_t)arg || type == TCG_TYPE_I32) {
         tcg_out_opc(s, OPC_MOVL_Iv + LOWREGMASK(ret), 0, ret, 0);
+        if (is_ptr) {
+            tcg_out_note_reloc(s, TCG_CODE_RELOC_MOVI_ABS32, true, arg);
+        }
         tcg_out32(s, arg);
         return;
     }
     if (arg == (int32_t)arg) {
         tcg_out_modrm(s, OPC_MOVL_EvIz + P_REXW, 0, ret);
+        if (is_ptr) {
+            tcg_out_note_reloc(s, TCG_CODE_RELOC_MOVI_ABS32S, true, arg);
+        }
         tcg_out32(s, arg);
         return;
     }
@@ -665,14 +691,27 @@ static void tcg_out_movi(TCGContext *s, TCGType type,
     if (diff == (int32_t)diff) {
         tcg_out_opc(s, OPC_LEA | P_REXW, ret, 0, 0);
         tcg_out8(s, (LOWREGMASK(ret) << 3) | 5);
+        tcg_out_note_reloc(s, TCG_CODE_RELOC_MOVI_PCREL32, is_ptr, arg);
         tcg_out32(s, diff);
         return;
     }
 
     tcg_out_opc(s, OPC_MOVL_Iv + P_REXW + LOWREGMASK(ret), 0, ret, 0);
+    tcg_out_note_reloc(s, TCG_CODE_RELOC_MOVI_ABS64, is_ptr, arg);
     tcg_out64(s, arg);
 }
 
+static void tcg_out_movi(TCGContext *s, TCGType type,
+                         TCGReg ret, tcg_target_long arg)
+{
+    tcg_out_movi_int(s, type, ret, arg, false);
+}
+
+static void tcg_out_movi_ptr(TCGContext *s, TCGReg ret, uintptr_t arg)
+{
+    tcg_out_movi_int(s, TCG_TYPE_PTR, ret, arg, true);
+}
+
 static inline void tcg_out_pushi(TCGContext *s, tcg_target_long val)
 {
     if (val == (int8_t)val) {
@@ -1105,8 +1144,14 @@ static void tcg_out_branch(TCGContext *s, int call, tcg_insn_unit *dest)
 
     if (disp == (int32_t)disp) {
         tcg_out_opc(s, call ? OPC_CALL_Jz : OPC_JMP_long, 0, 0, 0);
+        tcg_out_note_reloc(s, TCG_CODE_RELOC_BRANCH_PCREL32, true,
+                           (uintptr_t)dest);
         tcg_out32(s, disp);
     } else {
+#ifdef TCG_TARGET_HAS_CODE_RELOCS
+        /* Whether the branch is in range depends on where the code is */
+        tcg_note_code_fixed(s);
+#endif
         tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_R10, (uintptr_t)dest);
         tcg_out_modrm(s, OPC_GRP5,
                       call ? EXT5_CALLN_Ev : EXT5_JMPN_Ev, TCG_REG_R10);
@@ -1200,15 +1245,17 @@ static inline void tcg_out_tlb_load(TCGContext *s, TCGReg addrlo, TCGReg addrhi,
 
     tgen_arithi(s, ARITH_AND + trexw, r1,
                 TARGET_PAGE_MASK | ((1 << s_bits) - 1), 0);
-    tgen_arithi(s, ARITH_AND + hrexw, r0,
-                (CPU_TLB_SIZE - 1) << CPU_TLB_ENTRY_BITS, 0);
 
-    tcg_out_modrm_sib_offset(s, OPC_LEA + hrexw, r0, TCG_AREG0, r0, 0,
-                             offsetof(CPUArchState, tlb_table[mem_index][0])
-                             + which);
+    /* The TLB is resized at flush time: load its mask and base from env.  */
+    /* and tlb_mask(env), r0 */
+    tcg_out_modrm_offset(s, OPC_AND_GvEv + hrexw, r0, TCG_AREG0,
+                         offsetof(CPUArchState, tlb_mask[mem_index]));
+    /* add tlb_table(env), r0 */
+    tcg_out_modrm_offset(s, OPC_ADD_GvEv + hrexw, r0, TCG_AREG0,
+                         offsetof(CPUArchState, tlb_table[mem_index]));
 
-    /* cmp 0(r0), r1 */
-    tcg_out_modrm_offset(s, OPC_CMP_GvEv + trexw, r1, r0, 0);
+    /* cmp which(r0), r1 */
+    tcg_out_modrm_offset(s, OPC_CMP_GvEv + trexw, r1, r0, which);
 
     /* Prepare for both the fast path add of the tlb addend, and the slow
        path function argument setup.  There are two cases worth note:
@@ -1224,8 +1271,8 @@ static inline void tcg_out_tlb_load(TCGContext *s, TCGReg addrlo, TCGReg addrhi,
     s->code_ptr += 4;
 
     if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
-        /* cmp 4(r0), addrhi */
-        tcg_out_modrm_offset(s, OPC_CMP_GvEv, addrhi, r0, 4);
+        /* cmp which+4(r0), addrhi */
+        tcg_out_modrm_offset(s, OPC_CMP_GvEv, addrhi, r0, which + 4);
 
         /* jne slow_path */
         tcg_out_opc(s, OPC_JCC_long + JCC_JNE, 0, 0, 0);
@@ -1237,7 +1284,7 @@ static inline void tcg_out_tlb_load(TCGContext *s, TCGReg addrlo, TCGReg addrhi,
 
     /* add addend(r0), r1 */
     tcg_out_modrm_offset(s, OPC_ADD_GvEv + hrexw, r1, r0,
-                         offsetof(CPUTLBEntry, addend) - which);
+                         offsetof(CPUTLBEntry, addend));
 }
 
 /*
@@ -1304,8 +1351,8 @@ static void tcg_out_qemu_ld_slow_path(TCGContext *s, TCGLabelQemuLdst *l)
         /* The second argument is already loaded with addrlo.  */
         tcg_out_movi(s, TCG_TYPE_I32, tcg_target_call_iarg_regs[2],
                      l->mem_index);
-        tcg_out_movi(s, TCG_TYPE_PTR, tcg_target_call_iarg_regs[3],
-                     (uintptr_t)l->raddr);
+        tcg_out_movi_ptr(s, tcg_target_call_iarg_regs[3],
+                         (uintptr_t)l->raddr);
     }
 
     tcg_out_call(s, qemu_ld_helpers[opc & ~MO_SIGN]);
@@ -1403,10 +1450,10 @@ static void tcg_out_qemu_st_slow_path(TCGContext *s, TCGLabelQemuLdst *l)
 
         if (ARRAY_SIZE(tcg_target_call_iarg_regs) > 4) {
             retaddr = tcg_target_call_iarg_regs[4];
-            tcg_out_movi(s, TCG_TYPE_PTR, retaddr, (uintptr_t)l->raddr);
+            tcg_out_movi_ptr(s, retaddr, (uintptr_t)l->raddr);
         } else {
             retaddr = TCG_REG_RAX;
-            tcg_out_movi(s, TCG_TYPE_PTR, retaddr, (uintptr_t)l->raddr);
+            tcg_out_movi_ptr(s, retaddr, (uintptr_t)l->raddr);
             tcg_out_st(s, TCG_TYPE_PTR, retaddr, TCG_REG_ESP,
                        TCG_TARGET_CALL_STACK_OFFSET);
         }
@@ -1731,17 +1778,24 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
 
     switch(opc) {
     case INDEX_op_exit_tb:
-        tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_EAX, args[0]);
+        tcg_out_movi_ptr(s, TCG_REG_EAX, args[0]);
         tcg_out_jmp(s, tb_ret_addr);
         break;
     case INDEX_op_goto_tb:
         if (s->tb_jmp_offset) {
-            /* direct jump method */
+            /* direct jump method; align the displacement so that it can
+               be patched atomically while other threads execute it */
+            while (((uintptr_t)s->code_ptr + 1) & 3) {
+                tcg_out8(s, OPC_NOP);
+            }
             tcg_out8(s, OPC_JMP_long); /* jmp im */
             s->tb_jmp_offset[args[0]] = tcg_current_code_size(s);
             tcg_out32(s, 0);
         } else {
             /* indirect jump method */
+#ifdef TCG_TARGET_HAS_CODE_RELOCS
+            tcg_note_code_fixed(s);
+#endif
             tcg_out_modrm_offset(s, OPC_GRP5, EXT5_JMPN_Ev, -1,
                                  (intptr_t)(s->tb_next + args[0]));
         }
@@ -141,6 +141,15 @@ extern bool have_bmi1;
 # define TCG_AREG0 TCG_REG_EBP
 #endif
 
+/* goto_tb displacements are aligned and patched atomically */
+#define TCG_TARGET_SUPPORTS_MTTCG 1
+/* the softmmu fast path loads the TLB mask and table from env */
+#define TCG_TARGET_IMPLEMENTS_DYN_TLB 1
+#if TCG_TARGET_REG_BITS == 64
+/* host addresses in the generated code are noted, see TCGCodeReloc */
+#define TCG_TARGET_HAS_CODE_RELOCS 1
+#endif
+
 static inline void flush_icache_range(uintptr_t start, uintptr_t stop)
 {
 }
@@ -27,6 +27,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "qemu-common.h"
 #include "tcg-op.h"
@@ -1354,7 +1355,395 @@ static void tcg_constant_folding(TCGContext *s)
     }
 }
 
+/* Redundancy elimination within basic blocks.
+
+   Every definition of a temp gets a fresh version number, so that a value
+   recorded at some point can later be checked to be still there.  With
+   that, three kinds of redundancy are removed:
+
+   - loads from env that read a value stored or loaded before at the same
+     offset become moves from the temp that holds it;
+   - sign extensions of values already sign-extended from as many bits
+     become moves;
+   - pure operations already computed from the same input values become
+     moves from the earlier result (value numbering).
+
+   Any store through a base other than env, and any call that may have
+   side effects or read globals, forgets what is known about env.  */
+
+bool tcg_opt_redundancy = true;
+
+#define OPT_VN_BITS     8
+#define OPT_VN_SIZE     (1 << OPT_VN_BITS)
+#define OPT_MEM_SIZE    32
+
+typedef struct OptVNEntry {
+    uint32_t gen;
+    TCGOpcode opc;
+    TCGArg args[4];             /* inputs, then constant args */
+    uint32_t in_ver[2];
+    TCGArg out;
+    uint32_t out_ver;
+} OptVNEntry;
+
+typedef struct OptMemEntry {
+    TCGOpcode opc;              /* load that yields the value; 0 if unused */
+    intptr_t ofs;
+    TCGArg val;
+    uint32_t val_ver;
+} OptMemEntry;
+
+static uint32_t temp_ver[TCG_MAX_TEMPS];
+static uint8_t temp_sext[TCG_MAX_TEMPS];    /* 0 if unknown */
+static uint32_t cur_ver;
+static OptVNEntry vn_table[OPT_VN_SIZE];
+static uint32_t vn_gen;
+static OptMemEntry mem_table[OPT_MEM_SIZE];
+static int mem_next;
+
+static void redundancy_reset(int nb_temps)
+{
+    memset(temp_sext, 0, nb_temps);
+    memset(mem_table, 0, sizeof(mem_table));
+    vn_gen++;
+}
+
+static void redundancy_def(TCGArg temp, int sext)
+{
+    temp_ver[temp] = ++cur_ver;
+    temp_sext[temp] = sext;
+}
+
+/* Size of the env access done by a load or store, 0 if not one.  */
+static int env_access_size(TCGOpcode opc)
+{
+    switch (opc) {
+    CASE_OP_32_64(ld8u):
+    CASE_OP_32_64(ld8s):
+    CASE_OP_32_64(st8):
+        return 1;
+    CASE_OP_32_64(ld16u):
+    CASE_OP_32_64(ld16s):
+    CASE_OP_32_64(st16):
+        return 2;
+    case INDEX_op_ld_i32:
+    case INDEX_op_st_i32:
+    case INDEX_op_ld32u_i64:
+    case INDEX_op_ld32s_i64:
+    case INDEX_op_st32_i64:
+        return 4;
+    case INDEX_op_ld_i64:
+    case INDEX_op_st_i64:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+static bool is_env(TCGContext *s, TCGArg temp)
+{
+    return s->temps[temp].fixed_reg && s->temps[temp].reg == TCG_AREG0;
+}
+
+static void mem_forget(intptr_t ofs, int size)
+{
+    int i;
+
+    for (i = 0; i < OPT_MEM_SIZE; i++) {
+        OptMemEntry *e = &mem_table[i];
+
+        if (e->opc && e->ofs < ofs + size &&
+            ofs < e->ofs + env_access_size(e->opc)) {
+            e->opc = 0;
+        }
+    }
+}
+
+static void mem_record(TCGOpcode opc, intptr_t ofs, TCGArg val)
+{
+    OptMemEntry *e = &mem_table[mem_next];
+
+    mem_next = (mem_next + 1) % OPT_MEM_SIZE;
+    e->opc = opc;
+    e->ofs = ofs;
+    e->val = val;
+    e->val_ver = temp_ver[val];
+}
+
+static OptMemEntry *mem_find(TCGOpcode opc, intptr_t ofs)
+{
+    int i;
+
+    for (i = 0; i < OPT_MEM_SIZE; i++) {
+        OptMemEntry *e = &mem_table[i];
+
+        if (e->opc == opc && e->ofs == ofs &&
+            e->val_ver == temp_ver[e->val]) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/* Number of bits the result of @opc is sign-extended from, 0 if unknown */
+static int op_sext_bits(TCGContext *s, TCGOpcode opc, TCGArg *args,
+                        int nb_oargs, int nb_iargs)
+{
+    switch (opc) {
+    CASE_OP_32_64(ld8s):
+    CASE_OP_32_64(ext8s):
+        return 8;
+    CASE_OP_32_64(ld16s):
+    CASE_OP_32_64(ext16s):
+        return 16;
+    case INDEX_op_ld32s_i64:
+        return 32;
+    case INDEX_op_ext32s_i64:
+        return temp_sext[args[1]] && temp_sext[args[1]] < 32
+               ? temp_sext[args[1]] : 32;
+    CASE_OP_32_64(mov):
+        return s->temps[args[0]].type == s->temps[args[1]].type
+               ? temp_sext[args[1]] : 0;
+    CASE_OP_32_64(qemu_ld):
+        {
+            TCGMemOp mop = args[nb_oargs + nb_iargs];
+            int bits = 8 << (mop & MO_SIZE);
+
+            if (nb_oargs == 1 && (mop & MO_SIGN) && bits < op_bits(opc)) {
+                return bits;
+            }
+        }
+        return 0;
+    default:
+        return 0;
+    }
+}
+
+/* Return true if @opc computes its single output from its inputs only */
+static bool op_is_pure(TCGOpcode opc)
+{
+    switch (opc) {
+    CASE_OP_32_64(add):
+    CASE_OP_32_64(sub):
+    CASE_OP_32_64(mul):
+    CASE_OP_32_64(and):
+    CASE_OP_32_64(or):
+    CASE_OP_32_64(xor):
+    CASE_OP_32_64(shl):
+    CASE_OP_32_64(shr):
+    CASE_OP_32_64(sar):
+    CASE_OP_32_64(rotl):
+    CASE_OP_32_64(rotr):
+    CASE_OP_32_64(andc):
+    CASE_OP_32_64(orc):
+    CASE_OP_32_64(eqv):
+    CASE_OP_32_64(nand):
+    CASE_OP_32_64(nor):
+    CASE_OP_32_64(not):
+    CASE_OP_32_64(neg):
+    CASE_OP_32_64(muluh):
+    CASE_OP_32_64(mulsh):
+    CASE_OP_32_64(ext8s):
+    CASE_OP_32_64(ext8u):
+    CASE_OP_32_64(ext16s):
+    CASE_OP_32_64(ext16u):
+    case INDEX_op_ext32s_i64:
+    case INDEX_op_ext32u_i64:
+    CASE_OP_32_64(bswap16):
+    CASE_OP_32_64(bswap32):
+    case INDEX_op_bswap64_i64:
+    CASE_OP_32_64(deposit):
+    CASE_OP_32_64(setcond):
+    case INDEX_op_trunc_shr_i32:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Turn @op into "mov dst, src", or drop it if that is a no-op.  */
+static void redundancy_gen_mov(TCGContext *s, TCGOp *op, TCGArg *args,
+                               TCGArg src)
+{
+    TCGArg dst = args[0];
+
+    if (dst == src) {
+        tcg_op_remove(s, op);
+        return;
+    }
+    op->opc = op_to_mov(op->opc);
+    args[1] = src;
+    temp_ver[dst] = ++cur_ver;
+    temp_sext[dst] = s->temps[dst].type == s->temps[src].type
+                     ? temp_sext[src] : 0;
+}
+
+static bool tcg_redundancy_elim(TCGContext *s)
+{
+    int oi, oi_next, nb_temps = s->nb_temps, nb_globals = s->nb_globals;
+    bool changed = false;
+
+    memset(temp_ver, 0, nb_temps * sizeof(temp_ver[0]));
+    cur_ver = 0;
+    redundancy_reset(nb_temps);
+
+    for (oi = s->gen_first_op_idx; oi >= 0; oi = oi_next) {
+        TCGOp * const op = &s->gen_op_buf[oi];
+        TCGArg * const args = &s->gen_opparam_buf[op->args];
+        TCGOpcode opc = op->opc;
+        const TCGOpDef *def = &tcg_op_defs[opc];
+        int nb_oargs, nb_iargs, i, size;
+
+        oi_next = op->next;
+        if (opc == INDEX_op_call) {
+            nb_oargs = op->callo;
+            nb_iargs = op->calli;
+        } else {
+            nb_oargs = def->nb_oargs;
+            nb_iargs = def->nb_iargs;
+        }
+
+        if (def->flags & TCG_OPF_BB_END) {
+            redundancy_reset(nb_temps);
+            continue;
+        }
+
+        if (opc == INDEX_op_call) {
+            int flags = args[nb_oargs + nb_iargs + 1];
+
+            if (!(flags & (TCG_CALL_NO_READ_GLOBALS |
+                           TCG_CALL_NO_WRITE_GLOBALS))) {
+                for (i = 0; i < nb_globals; i++) {
+                    redundancy_def(i, 0);
+                }
+            }
+            /* the helper may write env; calls that read globals also
+               sync them back to env */
+            if ((flags & TCG_CALL_NO_RWG_SE) != TCG_CALL_NO_RWG_SE) {
+                memset(mem_table, 0, sizeof(mem_table));
+            }
+            for (i = 0; i < nb_oargs; i++) {
+                redundancy_def(args[i], 0);
+            }
+            continue;
+        }
+
+        /* Stores and loads on env */
+        size = env_access_size(opc);
+        if (size && nb_oargs == 0) {
+            if (!is_env(s, args[1])) {
+                memset(mem_table, 0, sizeof(mem_table));
+                continue;
+            }
+            mem_forget(args[2], size);
+            if (opc == INDEX_op_st_i32 || opc == INDEX_op_st_i64) {
+                mem_record(opc == INDEX_op_st_i32 ? INDEX_op_ld_i32
+                                                  : INDEX_op_ld_i64,
+                           args[2], args[0]);
+            }
+            continue;
+        }
+        if (size && is_env(s, args[1])) {
+            OptMemEntry *e = mem_find(opc, args[2]);
+
+            if (e && s->temps[e->val].type == s->temps[args[0]].type) {
+                redundancy_gen_mov(s, op, args, e->val);
+                changed = true;
+#ifdef CONFIG_PROFILER
+                s->opt_ld_fwd_count++;
+#endif
+                continue;
+            }
+            redundancy_def(args[0],
+                           op_sext_bits(s, opc, args, nb_oargs, nb_iargs));
+            mem_record(opc, args[2], args[0]);
+            continue;
+        }
+
+        /* Sign extensions of values that are sign-extended already */
+        switch (opc) {
+        CASE_OP_32_64(ext8s):
+            size = 8;
+            goto do_sext;
+        CASE_OP_32_64(ext16s):
+            size = 16;
+            goto do_sext;
+        case INDEX_op_ext32s_i64:
+            size = 32;
+        do_sext:
+            if (temp_sext[args[1]] && temp_sext[args[1]] <= size &&
+                s->temps[args[1]].type == s->temps[args[0]].type) {
+                redundancy_gen_mov(s, op, args, args[1]);
+                changed = true;
+#ifdef CONFIG_PROFILER
+                s->opt_ext_count++;
+#endif
+                continue;
+            }
+            break;
+        default:
+            break;
+        }
+
+        /* Value numbering of pure operations */
+        if (nb_oargs == 1 && op_is_pure(opc)) {
+            int nb_cargs = def->nb_cargs;
+            uint32_t h = opc;
+            OptVNEntry *e;
+
+            for (i = 1; i < 1 + nb_iargs + nb_cargs; i++) {
+                h = h * 31 + args[i];
+            }
+            e = &vn_table[(h ^ (h >> OPT_VN_BITS)) & (OPT_VN_SIZE - 1)];
+            if (e->gen == vn_gen && e->opc == opc &&
+                e->out_ver == temp_ver[e->out]) {
+                for (i = 0; i < nb_iargs; i++) {
+                    if (e->args[i] != args[1 + i] ||
+                        e->in_ver[i] != temp_ver[args[1 + i]]) {
+                        break;
+                    }
+                }
+                if (i == nb_iargs &&
+                    !memcmp(&e->args[nb_iargs], &args[1 + nb_iargs],
+                            nb_cargs * sizeof(TCGArg)) &&
+                    s->temps[e->out].type == s->temps[args[0]].type) {
+                    redundancy_gen_mov(s, op, args, e->out);
+                    changed = true;
+#ifdef CONFIG_PROFILER
+                    s->opt_cse_count++;
+#endif
+                    continue;
+                }
+            }
+            e->gen = vn_gen;
+            e->opc = opc;
+            for (i = 0; i < nb_iargs; i++) {
+                e->args[i] = args[1 + i];
+                e->in_ver[i] = temp_ver[args[1 + i]];
+            }
+            memcpy(&e->args[nb_iargs], &args[1 + nb_iargs],
+                   nb_cargs * sizeof(TCGArg));
+            redundancy_def(args[0],
+                           op_sext_bits(s, opc, args, nb_oargs, nb_iargs));
+            e->out = args[0];
+            e->out_ver = temp_ver[args[0]];
+            continue;
+        }
+
+        for (i = 0; i < nb_oargs; i++) {
+            redundancy_def(args[i],
+                           i ? 0 : op_sext_bits(s, opc, args,
+                                                nb_oargs, nb_iargs));
+        }
+    }
+    return changed;
+}
+
 void tcg_optimize(TCGContext *s)
 {
     tcg_constant_folding(s);
+    /* Forwarded values may be constants or copies; propagate them too */
+    if (tcg_opt_redundancy && tcg_redundancy_elim(s)) {
+        tcg_constant_folding(s);
+    }
 }
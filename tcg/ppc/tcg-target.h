@@ -106,6 +106,8 @@ typedef enum {
 #define TCG_TARGET_HAS_mulsh_i64        1
 #endif
 
+#define TCG_TARGET_IMPLEMENTS_DYN_TLB 0
+
 void flush_icache_range(uintptr_t start, uintptr_t stop);
 
 #endif
@@ -115,6 +115,8 @@ enum {
     TCG_AREG0 = TCG_REG_R10,
 };
 
+#define TCG_TARGET_IMPLEMENTS_DYN_TLB 0
+
 static inline void flush_icache_range(uintptr_t start, uintptr_t stop)
 {
 }
@@ -0,0 +1,423 @@
+/*
+ * Generic vector operations for TCG
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "tcg.h"
+#include "tcg-op.h"
+#include "tcg-op-gvec.h"
+
+#define MAX_OPRSZ 256
+
+/* @c replicated into every element of size @vece of a 64-bit word */
+static uint64_t dup_const(unsigned vece, uint64_t c)
+{
+    switch (vece) {
+    case MO_8:
+        return 0x0101010101010101ull * (uint8_t)c;
+    case MO_16:
+        return 0x0001000100010001ull * (uint16_t)c;
+    case MO_32:
+        return 0x0000000100000001ull * (uint32_t)c;
+    default:
+        return c;
+    }
+}
+
+static void check_size(uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                       uint32_t oprsz)
+{
+    tcg_debug_assert(oprsz > 0 && oprsz <= MAX_OPRSZ && oprsz % 8 == 0);
+    tcg_debug_assert(((dofs | aofs | bofs) & 7) == 0);
+}
+
+/* Expand d = fni(a, b) 64 bits at a time */
+typedef void GVecGen3Fn(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b);
+typedef void GVecGen2iFn(unsigned vece, TCGv_i64 d, TCGv_i64 a,
+                         unsigned shift);
+
+static void expand_3(TCGv_ptr base, unsigned vece, uint32_t dofs,
+                     uint32_t aofs, uint32_t bofs, uint32_t oprsz,
+                     GVecGen3Fn *fni)
+{
+    TCGv_i64 a = tcg_temp_new_i64();
+    TCGv_i64 b = tcg_temp_new_i64();
+    uint32_t i;
+
+    check_size(dofs, aofs, bofs, oprsz);
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(a, base, aofs + i);
+        tcg_gen_ld_i64(b, base, bofs + i);
+        fni(vece, a, a, b);
+        tcg_gen_st_i64(a, base, dofs + i);
+    }
+    tcg_temp_free_i64(a);
+    tcg_temp_free_i64(b);
+}
+
+static void expand_2i(TCGv_ptr base, unsigned vece, uint32_t dofs,
+                      uint32_t aofs, unsigned shift, uint32_t oprsz,
+                      GVecGen2iFn *fni)
+{
+    TCGv_i64 a = tcg_temp_new_i64();
+    uint32_t i;
+
+    check_size(dofs, aofs, 0, oprsz);
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(a, base, aofs + i);
+        fni(vece, a, a, shift);
+        tcg_gen_st_i64(a, base, dofs + i);
+    }
+    tcg_temp_free_i64(a);
+}
+
+static void store_dup(TCGv_ptr base, uint32_t dofs, uint32_t oprsz,
+                      TCGv_i64 val)
+{
+    uint32_t i;
+
+    check_size(dofs, 0, 0, oprsz);
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_st_i64(val, base, dofs + i);
+    }
+}
+
+/* Lane-wise add: add without the top bit of each lane, so that no carry
+   leaves the lane, then put the top bits back with their sum mod 2.  */
+static void gen_add(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 m, t1, t2;
+
+    if (vece == MO_64) {
+        tcg_gen_add_i64(d, a, b);
+        return;
+    }
+    m = tcg_const_i64(dup_const(vece, 1ull << ((8 << vece) - 1)));
+    t1 = tcg_temp_new_i64();
+    t2 = tcg_temp_new_i64();
+    tcg_gen_andc_i64(t1, a, m);
+    tcg_gen_andc_i64(t2, b, m);
+    tcg_gen_xor_i64(d, a, b);
+    tcg_gen_and_i64(d, d, m);
+    tcg_gen_add_i64(t1, t1, t2);
+    tcg_gen_xor_i64(d, d, t1);
+    tcg_temp_free_i64(m);
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+}
+
+/* Lane-wise sub: set the top bit of each lane of a so that no borrow
+   leaves the lane, then fix the top bits up.  */
+static void gen_sub(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 m, t1, t2;
+
+    if (vece == MO_64) {
+        tcg_gen_sub_i64(d, a, b);
+        return;
+    }
+    m = tcg_const_i64(dup_const(vece, 1ull << ((8 << vece) - 1)));
+    t1 = tcg_temp_new_i64();
+    t2 = tcg_temp_new_i64();
+    tcg_gen_or_i64(t1, a, m);
+    tcg_gen_andc_i64(t2, b, m);
+    tcg_gen_eqv_i64(d, a, b);
+    tcg_gen_and_i64(d, d, m);
+    tcg_gen_sub_i64(t1, t1, t2);
+    tcg_gen_xor_i64(d, d, t1);
+    tcg_temp_free_i64(m);
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+}
+
+static void gen_and(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_and_i64(d, a, b);
+}
+
+static void gen_or(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_or_i64(d, a, b);
+}
+
+static void gen_xor(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_xor_i64(d, a, b);
+}
+
+static void gen_andc(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_andc_i64(d, a, b);
+}
+
+static void gen_orc(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_orc_i64(d, a, b);
+}
+
+/* Turn the top bit of each lane of @d into all ones or all zeros in that
+   lane.  The products of the lanes do not overlap, so there is no carry.  */
+static void gen_expand_msb(unsigned vece, TCGv_i64 d)
+{
+    unsigned bits = 8 << vece;
+
+    tcg_gen_shri_i64(d, d, bits - 1);
+    tcg_gen_muli_i64(d, d, (1ull << bits) - 1);
+}
+
+/* The top bit of each lane of d is set iff the lane of a ^ b is not zero */
+static void gen_ne_msb(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 m = tcg_const_i64(dup_const(vece, (1ull << ((8 << vece) - 1))
+                                               - 1));
+    TCGv_i64 t = tcg_temp_new_i64();
+
+    tcg_gen_xor_i64(t, a, b);
+    tcg_gen_and_i64(d, t, m);
+    tcg_gen_add_i64(d, d, m);
+    tcg_gen_or_i64(d, d, t);
+    tcg_gen_andc_i64(d, d, m);
+    tcg_temp_free_i64(m);
+    tcg_temp_free_i64(t);
+}
+
+static void gen_eq(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    if (vece == MO_64) {
+        tcg_gen_setcond_i64(TCG_COND_EQ, d, a, b);
+        tcg_gen_neg_i64(d, d);
+        return;
+    }
+    gen_ne_msb(vece, d, a, b);
+    tcg_gen_xori_i64(d, d, dup_const(vece, 1ull << ((8 << vece) - 1)));
+    gen_expand_msb(vece, d);
+}
+
+static void gen_ne(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    if (vece == MO_64) {
+        tcg_gen_setcond_i64(TCG_COND_NE, d, a, b);
+        tcg_gen_neg_i64(d, d);
+        return;
+    }
+    gen_ne_msb(vece, d, a, b);
+    gen_expand_msb(vece, d);
+}
+
+static void gen_shli(unsigned vece, TCGv_i64 d, TCGv_i64 a, unsigned shift)
+{
+    uint64_t lane = (2ull << ((8 << vece) - 1)) - 1;
+
+    tcg_gen_shli_i64(d, a, shift);
+    if (vece != MO_64) {
+        tcg_gen_andi_i64(d, d, dup_const(vece, lane << shift));
+    }
+}
+
+static void gen_shri(unsigned vece, TCGv_i64 d, TCGv_i64 a, unsigned shift)
+{
+    uint64_t lane = (2ull << ((8 << vece) - 1)) - 1;
+
+    tcg_gen_shri_i64(d, a, shift);
+    if (vece != MO_64) {
+        tcg_gen_andi_i64(d, d, dup_const(vece, lane >> shift));
+    }
+}
+
+/* Shift right logically, then copy the shifted-in sign bit of each lane
+   into the bits above it: multiplying the sign bit by 2^(shift+1) - 2
+   sets exactly those, again without carries between lanes.  */
+static void gen_sari(unsigned vece, TCGv_i64 d, TCGv_i64 a, unsigned shift)
+{
+    unsigned bits = 8 << vece;
+    TCGv_i64 t;
+
+    if (vece == MO_64) {
+        tcg_gen_sari_i64(d, a, shift);
+        return;
+    }
+    gen_shri(vece, d, a, shift);
+    if (shift == 0) {
+        return;
+    }
+    t = tcg_temp_new_i64();
+    tcg_gen_andi_i64(t, d, dup_const(vece, 1ull << (bits - 1 - shift)));
+    tcg_gen_muli_i64(t, t, (2ull << shift) - 2);
+    tcg_gen_or_i64(d, d, t);
+    tcg_temp_free_i64(t);
+}
+
+void tcg_gen_gvec_add(TCGv_ptr base, unsigned vece, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs, uint32_t oprsz)
+{
+    expand_3(base, vece, dofs, aofs, bofs, oprsz, gen_add);
+}
+
+void tcg_gen_gvec_sub(TCGv_ptr base, unsigned vece, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs, uint32_t oprsz)
+{
+    expand_3(base, vece, dofs, aofs, bofs, oprsz, gen_sub);
+}
+
+void tcg_gen_gvec_and(TCGv_ptr base, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz)
+{
+    expand_3(base, MO_64, dofs, aofs, bofs, oprsz, gen_and);
+}
+
+void tcg_gen_gvec_or(TCGv_ptr base, uint32_t dofs, uint32_t aofs,
+                     uint32_t bofs, uint32_t oprsz)
+{
+    expand_3(base, MO_64, dofs, aofs, bofs, oprsz, gen_or);
+}
+
+void tcg_gen_gvec_xor(TCGv_ptr base, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz)
+{
+    if (aofs == bofs) {
+        tcg_gen_gvec_dupi(base, MO_64, dofs, oprsz, 0);
+        return;
+    }
+    expand_3(base, MO_64, dofs, aofs, bofs, oprsz, gen_xor);
+}
+
+void tcg_gen_gvec_andc(TCGv_ptr base, uint32_t dofs, uint32_t aofs,
+                       uint32_t bofs, uint32_t oprsz)
+{
+    expand_3(base, MO_64, dofs, aofs, bofs, oprsz, gen_andc);
+}
+
+void tcg_gen_gvec_orc(TCGv_ptr base, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz)
+{
+    expand_3(base, MO_64, dofs, aofs, bofs, oprsz, gen_orc);
+}
+
+void tcg_gen_gvec_shli(TCGv_ptr base, unsigned vece, uint32_t dofs,
+                       uint32_t aofs, unsigned shift, uint32_t oprsz)
+{
+    if (shift >= 8 << vece) {
+        tcg_gen_gvec_dupi(base, MO_64, dofs, oprsz, 0);
+        return;
+    }
+    expand_2i(base, vece, dofs, aofs, shift, oprsz, gen_shli);
+}
+
+void tcg_gen_gvec_shri(TCGv_ptr base, unsigned vece, uint32_t dofs,
+                       uint32_t aofs, unsigned shift, uint32_t oprsz)
+{
+    if (shift >= 8 << vece) {
+        tcg_gen_gvec_dupi(base, MO_64, dofs, oprsz, 0);
+        return;
+    }
+    expand_2i(base, vece, dofs, aofs, shift, oprsz, gen_shri);
+}
+
+void tcg_gen_gvec_sari(TCGv_ptr base, unsigned vece, uint32_t dofs,
+                       uint32_t aofs, unsigned shift, uint32_t oprsz)
+{
+    if (shift >= 8 << vece) {
+        shift = (8 << vece) - 1;
+    }
+    expand_2i(base, vece, dofs, aofs, shift, oprsz, gen_sari);
+}
+
+void tcg_gen_gvec_cmp(TCGv_ptr base, TCGCond cond, unsigned vece,
+                      uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz)
+{
+    void (*fn)(TCGv_ptr, TCGv_ptr, TCGv_ptr, TCGv_i32);
+    TCGv_ptr d, a, b;
+    TCGv_i32 desc;
+
+    switch (cond) {
+    case TCG_COND_EQ:
+        expand_3(base, vece, dofs, aofs, bofs, oprsz, gen_eq);
+        return;
+    case TCG_COND_NE:
+        expand_3(base, vece, dofs, aofs, bofs, oprsz, gen_ne);
+        return;
+    case TCG_COND_LT:
+    case TCG_COND_LE:
+    case TCG_COND_LTU:
+    case TCG_COND_LEU:
+        tcg_gen_gvec_cmp(base, tcg_swap_cond(cond), vece,
+                         dofs, bofs, aofs, oprsz);
+        return;
+    case TCG_COND_GT:
+        fn = gen_helper_gvec_gt;
+        break;
+    case TCG_COND_GE:
+        fn = gen_helper_gvec_ge;
+        break;
+    case TCG_COND_GTU:
+        fn = gen_helper_gvec_gtu;
+        break;
+    case TCG_COND_GEU:
+        fn = gen_helper_gvec_geu;
+        break;
+    default:
+        tcg_abort();
+    }
+
+    check_size(dofs, aofs, bofs, oprsz);
+    d = tcg_temp_new_ptr();
+    a = tcg_temp_new_ptr();
+    b = tcg_temp_new_ptr();
+    desc = tcg_const_i32(oprsz | (vece << 16));
+    tcg_gen_addi_ptr(d, base, dofs);
+    tcg_gen_addi_ptr(a, base, aofs);
+    tcg_gen_addi_ptr(b, base, bofs);
+    fn(d, a, b, desc);
+    tcg_temp_free_ptr(d);
+    tcg_temp_free_ptr(a);
+    tcg_temp_free_ptr(b);
+    tcg_temp_free_i32(desc);
+}
+
+void tcg_gen_gvec_dup_i64(TCGv_ptr base, unsigned vece, uint32_t dofs,
+                          uint32_t oprsz, TCGv_i64 in)
+{
+    TCGv_i64 t = tcg_temp_new_i64();
+
+    switch (vece) {
+    case MO_8:
+        tcg_gen_ext8u_i64(t, in);
+        tcg_gen_muli_i64(t, t, dup_const(MO_8, 1));
+        break;
+    case MO_16:
+        tcg_gen_ext16u_i64(t, in);
+        tcg_gen_muli_i64(t, t, dup_const(MO_16, 1));
+        break;
+    case MO_32:
+        tcg_gen_deposit_i64(t, in, in, 32, 32);
+        break;
+    default:
+        tcg_gen_mov_i64(t, in);
+        break;
+    }
+    store_dup(base, dofs, oprsz, t);
+    tcg_temp_free_i64(t);
+}
+
+void tcg_gen_gvec_dup_i32(TCGv_ptr base, unsigned vece, uint32_t dofs,
+                          uint32_t oprsz, TCGv_i32 in)
+{
+    TCGv_i64 t = tcg_temp_new_i64();
+
+    tcg_gen_extu_i32_i64(t, in);
+    tcg_gen_gvec_dup_i64(base, vece == MO_64 ? MO_32 : vece, dofs, oprsz, t);
+    tcg_temp_free_i64(t);
+}
+
+void tcg_gen_gvec_dupi(TCGv_ptr base, unsigned vece, uint32_t dofs,
+                       uint32_t oprsz, uint64_t imm)
+{
+    TCGv_i64 t = tcg_const_i64(dup_const(vece, imm));
+
+    store_dup(base, dofs, oprsz, t);
+    tcg_temp_free_i64(t);
+}
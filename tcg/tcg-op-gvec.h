@@ -0,0 +1,71 @@
+/*
+ * Generic vector operations for TCG
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef TCG_OP_GVEC_H
+#define TCG_OP_GVEC_H
+
+#include "tcg.h"
+
+/* These operate on vectors of @oprsz bytes (a multiple of 8, at most 256)
+ * stored at offsets from @base, which is normally cpu_env.  Offsets must
+ * be 8-byte aligned.  Destination and sources may be the same vector.
+ *
+ * @vece is the log2 of the element size in bytes, MO_8 to MO_64.
+ *
+ * The vectors are processed 64 bits at a time with ordinary integer TCG
+ * ops.  Lanes narrower than 64 bits are handled within the 64-bit word,
+ * masking the carries that would cross lane boundaries, so one add_i64
+ * does eight byte additions.  Only comparisons without such an expansion
+ * call an out-of-line helper, once for the whole vector.
+ *
+ * There are no TCG vector types or opcodes behind these, so no backend
+ * emits host vector instructions for them.  Frontends that use them now
+ * would not have to change if a backend did.
+ */
+
+void tcg_gen_gvec_add(TCGv_ptr base, unsigned vece, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs, uint32_t oprsz);
+void tcg_gen_gvec_sub(TCGv_ptr base, unsigned vece, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs, uint32_t oprsz);
+
+void tcg_gen_gvec_and(TCGv_ptr base, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz);
+void tcg_gen_gvec_or(TCGv_ptr base, uint32_t dofs, uint32_t aofs,
+                     uint32_t bofs, uint32_t oprsz);
+void tcg_gen_gvec_xor(TCGv_ptr base, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz);
+/* d = a & ~b */
+void tcg_gen_gvec_andc(TCGv_ptr base, uint32_t dofs, uint32_t aofs,
+                       uint32_t bofs, uint32_t oprsz);
+/* d = a | ~b */
+void tcg_gen_gvec_orc(TCGv_ptr base, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz);
+
+/* Shifts of every element by @shift.  Counts of the element width or more
+ * give zero for shli/shri and fill with the sign bit for sari.  */
+void tcg_gen_gvec_shli(TCGv_ptr base, unsigned vece, uint32_t dofs,
+                       uint32_t aofs, unsigned shift, uint32_t oprsz);
+void tcg_gen_gvec_shri(TCGv_ptr base, unsigned vece, uint32_t dofs,
+                       uint32_t aofs, unsigned shift, uint32_t oprsz);
+void tcg_gen_gvec_sari(TCGv_ptr base, unsigned vece, uint32_t dofs,
+                       uint32_t aofs, unsigned shift, uint32_t oprsz);
+
+/* Set each element of d to all ones if "a @cond b" holds, else to zero */
+void tcg_gen_gvec_cmp(TCGv_ptr base, TCGCond cond, unsigned vece,
+                      uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz);
+
+/* Replicate the low element of @in, or @imm, into every element */
+void tcg_gen_gvec_dup_i32(TCGv_ptr base, unsigned vece, uint32_t dofs,
+                          uint32_t oprsz, TCGv_i32 in);
+void tcg_gen_gvec_dup_i64(TCGv_ptr base, unsigned vece, uint32_t dofs,
+                          uint32_t oprsz, TCGv_i64 in);
+void tcg_gen_gvec_dupi(TCGv_ptr base, unsigned vece, uint32_t dofs,
+                       uint32_t oprsz, uint64_t imm);
+
+#endif
@@ -243,6 +243,35 @@ static void tcg_out_label(TCGContext *s, TCGLabel *l, tcg_insn_unit *ptr)
     l->u.value_ptr = ptr;
 }
 
+/* Note that the field about to be emitted at s->code_ptr encodes @value
+   in a way that depends on the address of the code, see TCGCodeReloc.  */
+static __attribute__((unused)) void tcg_note_code_reloc(TCGContext *s,
+                                                        TCGCodeRelocKind kind,
+                                                        bool is_ptr,
+                                                        uintptr_t value)
+{
+    TCGCodeReloc *r;
+
+    if (s->nb_code_relocs < 0) {
+        return;
+    }
+    if (s->nb_code_relocs == TCG_MAX_CODE_RELOCS) {
+        s->nb_code_relocs = -1;
+        return;
+    }
+    r = &s->code_relocs[s->nb_code_relocs++];
+    r->offset = tcg_current_code_size(s);
+    r->kind = kind;
+    r->is_ptr = is_ptr;
+    r->value = value;
+}
+
+/* The code being generated cannot be moved */
+static __attribute__((unused)) void tcg_note_code_fixed(TCGContext *s)
+{
+    s->nb_code_relocs = -1;
+}
+
 TCGLabel *gen_new_label(void)
 {
     TCGContext *s = &tcg_ctx;
@@ -323,6 +352,9 @@ static const TCGHelperInfo all_helpers[] = {
 #include "exec/helper-tcg.h"
 };
 
+/* calls of each of all_helpers[], counted with gen_profile */
+static uint64_t helper_calls[ARRAY_SIZE(all_helpers)];
+
 void tcg_context_init(TCGContext *s)
 {
     int op, total_args, n, i;
@@ -412,10 +444,41 @@ void tcg_func_start(TCGContext *s)
     s->gen_last_op_idx = -1;
     s->gen_next_op_idx = 0;
     s->gen_next_parm_idx = 0;
+    s->nb_ptr_consts = 0;
+    s->gen_profile = false;
 
     s->be = tcg_malloc(sizeof(TCGBackendData));
 }
 
+/* Increment a profiling counter.  Concurrent vCPUs may lose counts.  */
+void tcg_gen_profile_count(uint64_t *counter)
+{
+    TCGv_ptr ptr = tcg_const_ptr(counter);
+    TCGv_i64 t = tcg_temp_new_i64();
+
+    tcg_gen_ld_i64(t, ptr, 0);
+    tcg_gen_addi_i64(t, t, 1);
+    tcg_gen_st_i64(t, ptr, 0);
+    tcg_temp_free_i64(t);
+    tcg_temp_free_ptr(ptr);
+}
+
+void tcg_profile_helpers(TCGHelperProfileFunc *func, void *opaque)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(all_helpers); i++) {
+        if (helper_calls[i]) {
+            func(all_helpers[i].name, helper_calls[i], opaque);
+        }
+    }
+}
+
+void tcg_profile_reset_helpers(void)
+{
+    memset(helper_calls, 0, sizeof(helper_calls));
+}
+
 static inline void tcg_temp_alloc(TCGContext *s, int n)
 {
     if (n > TCG_MAX_TEMPS)
@@ -706,6 +769,10 @@ void tcg_gen_callN(TCGContext *s, void *func, TCGArg ret,
     flags = info->flags;
     sizemask = info->sizemask;
 
+    if (s->gen_profile) {
+        tcg_gen_profile_count(&helper_calls[info - all_helpers]);
+    }
+
 #if defined(__sparc__) && !defined(__arch64__) \
     && !defined(CONFIG_TCG_INTERPRETER)
     /* We have 64-bit values in one register, but need to pass as two
@@ -2303,6 +2370,7 @@ static inline int tcg_gen_code_common(TCGContext *s,
 
     s->code_buf = gen_code_buf;
     s->code_ptr = gen_code_buf;
+    s->nb_code_relocs = 0;
 
     tcg_out_tb_init(s);
 
@@ -2443,6 +2511,11 @@ void tcg_dump_info(FILE *f, fprintf_function cpu_fprintf)
                 * 100.0);
     cpu_fprintf(f, "liveness/code time  %0.1f%%\n", 
                 (double)s->la_time / (s->code_time ? s->code_time : 1) * 100.0);
+    cpu_fprintf(f, "redundant ops/TB    %0.2f env loads, %0.2f exts, "
+                "%0.2f values\n",
+                s->tb_count ? (double)s->opt_ld_fwd_count / s->tb_count : 0,
+                s->tb_count ? (double)s->opt_ext_count / s->tb_count : 0,
+                s->tb_count ? (double)s->opt_cse_count / s->tb_count : 0);
     cpu_fprintf(f, "cpu_restore count   %" PRId64 "\n",
                 s->restore_count);
     cpu_fprintf(f, "  avg cycles        %0.1f\n",
@@ -462,6 +462,26 @@ typedef struct TCGOp {
     signed next     : 16;
 } TCGOp;
 
+/* A host address, or a constant whose encoding depends on where the code
+   is, emitted into the code of a TB.  The persistent TB cache uses these
+   to move the code of a TB to another address, or into another run.  */
+typedef enum TCGCodeRelocKind {
+    TCG_CODE_RELOC_BRANCH_PCREL32, /* branch displacement */
+    TCG_CODE_RELOC_MOVI_ABS32,     /* zero-extended immediate */
+    TCG_CODE_RELOC_MOVI_ABS32S,    /* sign-extended immediate */
+    TCG_CODE_RELOC_MOVI_PCREL32,   /* pc-relative lea displacement */
+    TCG_CODE_RELOC_MOVI_ABS64,
+} TCGCodeRelocKind;
+
+typedef struct TCGCodeReloc {
+    uint32_t offset;    /* of the field, from the start of the code */
+    uint8_t kind;       /* TCGCodeRelocKind */
+    bool is_ptr;        /* value is a host address, else a constant */
+    uintptr_t value;
+} TCGCodeReloc;
+
+#define TCG_MAX_CODE_RELOCS 1024
+
 QEMU_BUILD_BUG_ON(NB_OPS > 0xff);
 QEMU_BUILD_BUG_ON(OPC_BUF_SIZE >= 0x7fff);
 QEMU_BUILD_BUG_ON(OPPARAM_BUF_SIZE >= 0x7fff);
@@ -494,7 +514,16 @@ struct TCGContext {
 
     tcg_insn_unit *code_ptr;
 
+    /* Relocations of the code being generated, -1 if it cannot be moved;
+       and the number of host pointer constants the front end used, which
+       cannot be told from other constants in the code.  */
+    int nb_code_relocs;
+    int nb_ptr_consts;
+    TCGCodeReloc code_relocs[TCG_MAX_CODE_RELOCS];
+
     GHashTable *helpers;
+    /* count helper calls in the code being generated, see CF_PROFILE */
+    bool gen_profile;
 
 #ifdef CONFIG_PROFILER
     /* profiling info */
@@ -513,6 +542,9 @@ struct TCGContext {
     int64_t opt_time;
     int64_t restore_count;
     int64_t restore_time;
+    int64_t opt_ld_fwd_count;
+    int64_t opt_ext_count;
+    int64_t opt_cse_count;
 #endif
 
 #ifdef CONFIG_DEBUG_TCG
@@ -559,6 +591,13 @@ struct TCGContext {
 
 extern TCGContext tcg_ctx;
 
+/* Host pointer constants are counted, see nb_ptr_consts */
+static inline intptr_t tcg_ptr_const(intptr_t val)
+{
+    tcg_ctx.nb_ptr_consts++;
+    return val;
+}
+
 /* The number of opcodes emitted so far.  */
 static inline int tcg_op_buf_count(void)
 {
@@ -595,6 +634,15 @@ static inline void *tcg_malloc(int size)
 void tcg_context_init(TCGContext *s);
 void tcg_prologue_init(TCGContext *s);
 void tcg_func_start(TCGContext *s);
+void tcg_gen_profile_count(uint64_t *counter);
+typedef void TCGHelperProfileFunc(const char *name, uint64_t calls,
+                                  void *opaque);
+/* Call @func for each helper called by code translated with gen_profile */
+void tcg_profile_helpers(TCGHelperProfileFunc *func, void *opaque);
+void tcg_profile_reset_helpers(void);
+#ifdef TCG_TARGET_HAS_CODE_RELOCS
+uint32_t tcg_target_code_features(void);
+#endif
 
 int tcg_gen_code(TCGContext *s, tcg_insn_unit *gen_code_buf);
 int tcg_gen_code_search_pc(TCGContext *s, tcg_insn_unit *gen_code_buf,
@@ -717,7 +765,8 @@ void tcg_add_target_add_op_defs(const TCGTargetOpDef *tdefs);
 #define TCGV_NAT_TO_PTR(n) MAKE_TCGV_PTR(GET_TCGV_I32(n))
 #define TCGV_PTR_TO_NAT(n) MAKE_TCGV_I32(GET_TCGV_PTR(n))
 
-#define tcg_const_ptr(V) TCGV_NAT_TO_PTR(tcg_const_i32((intptr_t)(V)))
+#define tcg_const_ptr(V) \
+    TCGV_NAT_TO_PTR(tcg_const_i32(tcg_ptr_const((intptr_t)(V))))
 #define tcg_global_reg_new_ptr(R, N) \
     TCGV_NAT_TO_PTR(tcg_global_reg_new_i32((R), (N)))
 #define tcg_global_mem_new_ptr(R, O, N) \
@@ -728,7 +777,8 @@ void tcg_add_target_add_op_defs(const TCGTargetOpDef *tdefs);
 #define TCGV_NAT_TO_PTR(n) MAKE_TCGV_PTR(GET_TCGV_I64(n))
 #define TCGV_PTR_TO_NAT(n) MAKE_TCGV_I64(GET_TCGV_PTR(n))
 
-#define tcg_const_ptr(V) TCGV_NAT_TO_PTR(tcg_const_i64((intptr_t)(V)))
+#define tcg_const_ptr(V) \
+    TCGV_NAT_TO_PTR(tcg_const_i64(tcg_ptr_const((intptr_t)(V))))
 #define tcg_global_reg_new_ptr(R, N) \
     TCGV_NAT_TO_PTR(tcg_global_reg_new_i64((R), (N)))
 #define tcg_global_mem_new_ptr(R, O, N) \
@@ -742,6 +792,9 @@ void tcg_gen_callN(TCGContext *s, void *func,
 
 void tcg_op_remove(TCGContext *s, TCGOp *op);
 void tcg_optimize(TCGContext *s);
+/* Also remove redundant env loads, sign extensions and computations in
+   tcg_optimize(); true by default */
+extern bool tcg_opt_redundancy;
 
 /* only used for debugging purposes */
 void tcg_dump_ops(TCGContext *s);
@@ -0,0 +1,2 @@
+/* test-softfloat builds softfloat for no particular target: the TARGET_*
+ * macros only select NaN handling, which it does not check.  */
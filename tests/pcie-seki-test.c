@@ -0,0 +1,828 @@
+/*
+ * QTest testcase for the pcie-seki DGEMM accelerator
+ *
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Two cards are programmed through their BARs only, the way a guest driver
+ * would: the legacy doorbell, the submission/completion queues, the DMA
+ * engine and peer-to-peer copies.  Results are checked against a naive
+ * reference DGEMM; matrix elements are small integers, so every backend
+ * must match it exactly.
+ *
+ * Bandwidth numbers are reported with g_test_maximized_result(), so they
+ * appear in the gtester log (make check-report.html) and with -v:
+ *
+ *     tests/pcie-seki-test -v
+ *     tests/pcie-seki-test -m perf -v
+ *
+ * They include the qtest round trips needed to ring doorbells and poll
+ * the device, so they are only comparable between runs on the same host.
+ * -m perf moves more data and adds a large DGEMM.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include "libqtest.h"
+#include "libqos/pci-pc.h"
+#include "libqos/malloc-pc.h"
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+
+#include "hw/pci/pcie_seki_cmd.h"
+
+#define SEKI_VENDOR_ID      0xFA58
+#define SEKI_DEVICE_ID      0x0961
+
+#define SEKI_TEST_CARDS     2
+#define SEKI_TEST_TIMEOUT   (30 * G_USEC_PER_SEC)
+#define SEKI_TEST_QSIZE     4       // small, so that tests wrap the rings
+
+typedef struct SekiCard {
+    QPCIDevice *dev;
+    void *ctrl;
+    uint64_t input;         // guest physical address of the BAR
+    uint64_t output;
+    uint32_t id;
+} SekiCard;
+
+typedef struct SekiTestQueue {
+    SekiCard *card;
+    int index;
+    uint64_t sq;
+    uint64_t cq;
+    uint32_t sq_tail;
+    uint32_t cq_head;
+    bool phase;
+    uint32_t cid;
+} SekiTestQueue;
+
+typedef struct SekiGemmCase {
+    uint32_t flags;
+    uint32_t m;
+    uint32_t n;
+    uint32_t k;
+    double alpha;
+    double beta;
+} SekiGemmCase;
+
+static const SekiGemmCase gemm_cases[] = {
+    { 0, 4, 3, 5, 1.0, 0.0 },
+    { SEKI_FLAG_TRANSA, 7, 5, 3, 2.0, 0.5 },
+    { SEKI_FLAG_TRANSB, 33, 17, 9, -1.0, 1.0 },
+    // Crosses the cache blocking in every dimension
+    { SEKI_FLAG_TRANSA | SEKI_FLAG_TRANSB, 130, 520, 257, 0.5, -2.0 },
+    { 0, 1, 1, 1, 3.0, 0.0 },
+};
+
+static QPCIBus *pcibus;
+static QGuestAllocator *alloc;
+static SekiCard cards[SEKI_TEST_CARDS];
+
+
+static uint32_t seki_readl(SekiCard *card, uint32_t reg)
+{
+    return qpci_io_readl(card->dev, card->ctrl + reg);
+}
+
+static void seki_writel(SekiCard *card, uint32_t reg, uint32_t val)
+{
+    qpci_io_writel(card->dev, card->ctrl + reg, val);
+}
+
+static void seki_writeq(SekiCard *card, uint32_t reg, uint64_t val)
+{
+    seki_writel(card, reg, val);
+    seki_writel(card, reg + 4, val >> 32);
+}
+
+static uint32_t seki_qreg(SekiTestQueue *q, uint32_t reg)
+{
+    return SEKI_REG_QUEUE_BASE + q->index * SEKI_QUEUE_STRIDE + reg;
+}
+
+static double seki_elapsed(gint64 start)
+{
+    return (g_get_monotonic_time() - start) / (double)G_USEC_PER_SEC;
+}
+
+static void seki_report_bandwidth(const char *what, uint64_t bytes,
+                                  double secs)
+{
+    g_test_maximized_result(bytes / MAX(secs, 1e-9) / (1 << 20),
+                            "%s: %.1f MB/s", what,
+                            bytes / MAX(secs, 1e-9) / (1 << 20));
+}
+
+
+// Matrices, little endian in guest memory and in the BARs
+static void write_matrix(uint64_t addr, const double *m, size_t n)
+{
+    uint64_t *buf = g_new(uint64_t, n);
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        buf[i] = cpu_to_le64(seki_double_to_reg(m[i]));
+    }
+    memwrite(addr, buf, n * sizeof(*buf));
+    g_free(buf);
+}
+
+static void read_matrix(uint64_t addr, double *m, size_t n)
+{
+    uint64_t *buf = g_new(uint64_t, n);
+    size_t i;
+
+    memread(addr, buf, n * sizeof(*buf));
+    for (i = 0; i < n; i++) {
+        m[i] = seki_reg_to_double(le64_to_cpu(buf[i]));
+    }
+    g_free(buf);
+}
+
+static void fill_matrix(double *m, size_t n, int seed)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        m[i] = (double)((i * 7 + seed * 13) % 11) - 5;
+    }
+}
+
+static void ref_dgemm(const SekiGemmRegs *r, const double *a,
+                      const double *b, double *c)
+{
+    bool transa = r->flags & SEKI_FLAG_TRANSA;
+    bool transb = r->flags & SEKI_FLAG_TRANSB;
+    double alpha = seki_reg_to_double(r->alpha);
+    double beta = seki_reg_to_double(r->beta);
+    uint32_t i, j, l;
+
+    for (j = 0; j < r->n; j++) {
+        for (i = 0; i < r->m; i++) {
+            double sum = 0;
+
+            for (l = 0; l < r->k; l++) {
+                double av = transa ? a[i * r->lda + l] : a[l * r->lda + i];
+                double bv = transb ? b[l * r->ldb + j] : b[j * r->ldb + l];
+                sum += av * bv;
+            }
+            c[j * r->ldc + i] = alpha * sum +
+                                (beta == 0 ? 0 : beta * c[j * r->ldc + i]);
+        }
+    }
+}
+
+
+// A DGEMM with operands placed in the BARs of a card, and its expected
+// result.  A has a padded leading dimension.
+typedef struct SekiGemm {
+    SekiGemmRegs regs;
+    double *a;
+    double *b;
+    double *c;
+    double *expect;
+    size_t a_len;
+    size_t b_len;
+    size_t c_len;
+} SekiGemm;
+
+static void seki_gemm_prepare(SekiGemm *g, SekiCard *card,
+                              const SekiGemmCase *tc, uint32_t c_offset)
+{
+    SekiGemmRegs *r = &g->regs;
+    uint32_t a_rows = (tc->flags & SEKI_FLAG_TRANSA) ? tc->k : tc->m;
+    uint32_t a_cols = (tc->flags & SEKI_FLAG_TRANSA) ? tc->m : tc->k;
+    uint32_t b_rows = (tc->flags & SEKI_FLAG_TRANSB) ? tc->n : tc->k;
+    uint32_t b_cols = (tc->flags & SEKI_FLAG_TRANSB) ? tc->k : tc->n;
+
+    memset(r, 0, sizeof(*r));
+    r->flags = tc->flags;
+    r->m = tc->m;
+    r->n = tc->n;
+    r->k = tc->k;
+    r->lda = a_rows + 1;
+    r->ldb = b_rows;
+    r->ldc = tc->m;
+    r->alpha = seki_double_to_reg(tc->alpha);
+    r->beta = seki_double_to_reg(tc->beta);
+
+    g->a_len = (size_t)r->lda * a_cols;
+    g->b_len = (size_t)r->ldb * b_cols;
+    g->c_len = (size_t)r->ldc * tc->n;
+    r->a_offset = 0;
+    r->b_offset = QEMU_ALIGN_UP(g->a_len * sizeof(double), 4096);
+    r->c_offset = c_offset;
+
+    g->a = g_new(double, g->a_len);
+    g->b = g_new(double, g->b_len);
+    g->c = g_new(double, g->c_len);
+    g->expect = g_new(double, g->c_len);
+    fill_matrix(g->a, g->a_len, 1);
+    fill_matrix(g->b, g->b_len, 2);
+    fill_matrix(g->expect, g->c_len, 3);
+
+    write_matrix(card->input + r->a_offset, g->a, g->a_len);
+    write_matrix(card->input + r->b_offset, g->b, g->b_len);
+    write_matrix(card->output + r->c_offset, g->expect, g->c_len);
+    ref_dgemm(r, g->a, g->b, g->expect);
+}
+
+static void seki_gemm_check(SekiGemm *g, SekiCard *card)
+{
+    size_t i;
+
+    read_matrix(card->output + g->regs.c_offset, g->c, g->c_len);
+    for (i = 0; i < g->c_len; i++) {
+        g_assert_cmpfloat(g->c[i], ==, g->expect[i]);
+    }
+}
+
+static void seki_gemm_free(SekiGemm *g)
+{
+    g_free(g->a);
+    g_free(g->b);
+    g_free(g->c);
+    g_free(g->expect);
+}
+
+
+// Legacy interface: registers plus the doorbell, one command at a time
+static void seki_legacy_program(SekiCard *card, const SekiGemmRegs *r)
+{
+    seki_writel(card, SEKI_REG_FLAGS, r->flags);
+    seki_writel(card, SEKI_REG_M, r->m);
+    seki_writel(card, SEKI_REG_N, r->n);
+    seki_writel(card, SEKI_REG_K, r->k);
+    seki_writel(card, SEKI_REG_LDA, r->lda);
+    seki_writel(card, SEKI_REG_LDB, r->ldb);
+    seki_writel(card, SEKI_REG_LDC, r->ldc);
+    seki_writel(card, SEKI_REG_A_OFFSET, r->a_offset);
+    seki_writel(card, SEKI_REG_B_OFFSET, r->b_offset);
+    seki_writel(card, SEKI_REG_C_OFFSET, r->c_offset);
+    seki_writeq(card, SEKI_REG_ALPHA_LO, r->alpha);
+    seki_writeq(card, SEKI_REG_BETA_LO, r->beta);
+}
+
+// Wait for any of the given status bits, clear and return them
+static uint32_t seki_wait_status(SekiCard *card, uint32_t bits)
+{
+    gint64 deadline = g_get_monotonic_time() + SEKI_TEST_TIMEOUT;
+    uint32_t status;
+
+    while (!((status = seki_readl(card, SEKI_REG_STATUS)) & bits)) {
+        g_assert(g_get_monotonic_time() < deadline);
+    }
+    seki_writel(card, SEKI_REG_STATUS, status & bits);
+    return status & bits;
+}
+
+static uint32_t seki_legacy_run(SekiCard *card, const SekiGemmRegs *r)
+{
+    seki_legacy_program(card, r);
+    seki_writel(card, SEKI_REG_DOORBELL, SEKI_CMD_DGEMM);
+    return seki_wait_status(card, SEKI_STATUS_DONE | SEKI_STATUS_ERROR);
+}
+
+
+// Queue interface
+static void seki_queue_init(SekiTestQueue *q, SekiCard *card, int index)
+{
+    static const uint8_t zero[SEKI_TEST_QSIZE * sizeof(SekiCompletion)];
+
+    memset(q, 0, sizeof(*q));
+    q->card = card;
+    q->index = index;
+    q->phase = true;
+    q->sq = guest_alloc(alloc, SEKI_TEST_QSIZE * sizeof(SekiCommand));
+    q->cq = guest_alloc(alloc, SEKI_TEST_QSIZE * sizeof(SekiCompletion));
+    memwrite(q->cq, zero, sizeof(zero));
+
+    seki_writeq(card, seki_qreg(q, SEKI_QREG_SQ_BASE_LO), q->sq);
+    seki_writeq(card, seki_qreg(q, SEKI_QREG_CQ_BASE_LO), q->cq);
+    seki_writel(card, seki_qreg(q, SEKI_QREG_SIZE), SEKI_TEST_QSIZE);
+    g_assert_cmpuint(seki_readl(card, seki_qreg(q, SEKI_QREG_SIZE)), ==,
+                     SEKI_TEST_QSIZE);
+}
+
+static void seki_queue_cleanup(SekiTestQueue *q)
+{
+    seki_writel(q->card, seki_qreg(q, SEKI_QREG_SIZE), 0);
+    guest_free(alloc, q->sq);
+    guest_free(alloc, q->cq);
+}
+
+// Fill in the cid and queue a command, returning its cid.  The caller
+// keeps at most SEKI_TEST_QSIZE - 1 commands outstanding.
+static uint32_t seki_queue_submit(SekiTestQueue *q, SekiCommand *cmd)
+{
+    SekiCommand le = *cmd;
+
+    le.cid = ++q->cid;
+    le.opcode = cpu_to_le32(le.opcode);
+    le.cid = cpu_to_le32(le.cid);
+    if (cmd->opcode == SEKI_CMD_COPY) {
+        le.copy.peer = cpu_to_le32(le.copy.peer);
+        le.copy.src_offset = cpu_to_le64(le.copy.src_offset);
+        le.copy.dst_offset = cpu_to_le64(le.copy.dst_offset);
+        le.copy.len = cpu_to_le64(le.copy.len);
+    } else {
+        SekiGemmRegs *r = &le.gemm;
+
+        r->flags = cpu_to_le32(r->flags);
+        r->m = cpu_to_le32(r->m);
+        r->n = cpu_to_le32(r->n);
+        r->k = cpu_to_le32(r->k);
+        r->lda = cpu_to_le32(r->lda);
+        r->ldb = cpu_to_le32(r->ldb);
+        r->ldc = cpu_to_le32(r->ldc);
+        r->a_offset = cpu_to_le32(r->a_offset);
+        r->b_offset = cpu_to_le32(r->b_offset);
+        r->c_offset = cpu_to_le32(r->c_offset);
+        r->alpha = cpu_to_le64(r->alpha);
+        r->beta = cpu_to_le64(r->beta);
+    }
+
+    memwrite(q->sq + q->sq_tail * sizeof(SekiCommand), &le, sizeof(le));
+    q->sq_tail = (q->sq_tail + 1) % SEKI_TEST_QSIZE;
+    seki_writel(q->card, seki_qreg(q, SEKI_QREG_SQ_TAIL), q->sq_tail);
+    return q->cid;
+}
+
+// Wait for the next completion and return its status code
+static uint16_t seki_queue_complete(SekiTestQueue *q, uint32_t *cid)
+{
+    gint64 deadline = g_get_monotonic_time() + SEKI_TEST_TIMEOUT;
+    uint64_t addr = q->cq + q->cq_head * sizeof(SekiCompletion);
+    SekiCompletion cqe;
+
+    for (;;) {
+        memread(addr, &cqe, sizeof(cqe));
+        if ((le16_to_cpu(cqe.status) & 1) == q->phase) {
+            break;
+        }
+        g_assert(g_get_monotonic_time() < deadline);
+    }
+
+    q->cq_head = (q->cq_head + 1) % SEKI_TEST_QSIZE;
+    if (!q->cq_head) {
+        q->phase = !q->phase;
+    }
+    seki_writel(q->card, seki_qreg(q, SEKI_QREG_CQ_HEAD), q->cq_head);
+
+    *cid = le32_to_cpu(cqe.cid);
+    return le16_to_cpu(cqe.status) >> 1;
+}
+
+static uint16_t seki_queue_run(SekiTestQueue *q, SekiCommand *cmd)
+{
+    uint32_t cid = seki_queue_submit(q, cmd);
+    uint32_t done;
+    uint16_t status = seki_queue_complete(q, &done);
+
+    g_assert_cmpuint(done, ==, cid);
+    return status;
+}
+
+
+static void test_registers(void)
+{
+    int i;
+
+    for (i = 0; i < SEKI_TEST_CARDS; i++) {
+        g_assert_cmphex(seki_readl(&cards[i], SEKI_REG_ID), ==,
+                        SEKI_ID_VALUE);
+        g_assert_cmpuint(seki_readl(&cards[i], SEKI_REG_NUM_QUEUES), ==, 2);
+        g_assert_cmphex(seki_readl(&cards[i], SEKI_REG_STATUS), ==, 0);
+
+        seki_writel(&cards[i], SEKI_REG_M, 0x1234);
+        g_assert_cmphex(seki_readl(&cards[i], SEKI_REG_M), ==, 0x1234);
+        seki_writel(&cards[i], SEKI_REG_M, 0);
+    }
+    g_assert_cmpuint(cards[0].id, !=, cards[1].id);
+}
+
+// [1 3; 2 4] * [5 7; 6 8] = [23 31; 34 46], column-major
+static void test_dgemm_known(void)
+{
+    static const double a[] = { 1, 2, 3, 4 };
+    static const double b[] = { 5, 6, 7, 8 };
+    static const double identity[] = { 1, 0, 0, 1 };
+    static const double ab[] = { 23, 34, 31, 46 };
+    static const double atb[] = { 17, 39, 23, 53 };
+    SekiCard *card = &cards[0];
+    SekiGemmRegs r = {
+        .m = 2, .n = 2, .k = 2,
+        .lda = 2, .ldb = 2, .ldc = 2,
+        .a_offset = 0, .b_offset = 64, .c_offset = 128,
+        .alpha = seki_double_to_reg(1.0),
+        .beta = seki_double_to_reg(0.0),
+    };
+    double c[4];
+    int i;
+
+    write_matrix(card->input, a, 4);
+    write_matrix(card->input + 64, b, 4);
+    g_assert_cmphex(seki_legacy_run(card, &r), ==, SEKI_STATUS_DONE);
+    read_matrix(card->output + 128, c, 4);
+    for (i = 0; i < 4; i++) {
+        g_assert_cmpfloat(c[i], ==, ab[i]);
+    }
+
+    r.flags = SEKI_FLAG_TRANSA;
+    g_assert_cmphex(seki_legacy_run(card, &r), ==, SEKI_STATUS_DONE);
+    read_matrix(card->output + 128, c, 4);
+    for (i = 0; i < 4; i++) {
+        g_assert_cmpfloat(c[i], ==, atb[i]);
+    }
+
+    // C := 2 * I * B + 0.5 * C leaves 2 * B + 0.5 * A' B
+    write_matrix(card->input, identity, 4);
+    r.flags = 0;
+    r.alpha = seki_double_to_reg(2.0);
+    r.beta = seki_double_to_reg(0.5);
+    g_assert_cmphex(seki_legacy_run(card, &r), ==, SEKI_STATUS_DONE);
+    read_matrix(card->output + 128, c, 4);
+    for (i = 0; i < 4; i++) {
+        g_assert_cmpfloat(c[i], ==, 2 * b[i] + 0.5 * atb[i]);
+    }
+}
+
+static void test_dgemm_legacy(void)
+{
+    SekiCard *card = &cards[0];
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(gemm_cases); i++) {
+        SekiGemm g;
+
+        seki_gemm_prepare(&g, card, &gemm_cases[i], 0);
+        g_assert_cmphex(seki_legacy_run(card, &g.regs), ==,
+                        SEKI_STATUS_DONE);
+        seki_gemm_check(&g, card);
+        seki_gemm_free(&g);
+    }
+}
+
+static void test_dgemm_queue(void)
+{
+    SekiCard *card = &cards[1];
+    SekiTestQueue q;
+    int round, i;
+
+    // Twice through the cases on a 4 entry ring wraps it and flips the
+    // phase bit
+    seki_queue_init(&q, card, 1);
+    for (round = 0; round < 2; round++) {
+        for (i = 0; i < ARRAY_SIZE(gemm_cases); i++) {
+            SekiCommand cmd = { .opcode = SEKI_CMD_DGEMM };
+            SekiGemm g;
+
+            seki_gemm_prepare(&g, card, &gemm_cases[i], 4096 * round);
+            cmd.gemm = g.regs;
+            g_assert_cmpuint(seki_queue_run(&q, &cmd), ==,
+                             SEKI_CQE_SUCCESS);
+            seki_gemm_check(&g, card);
+            seki_gemm_free(&g);
+        }
+    }
+    seki_queue_cleanup(&q);
+}
+
+static void test_dgemm_invalid(void)
+{
+    SekiCard *card = &cards[0];
+    SekiGemmRegs bad = {
+        .m = 4, .n = 4, .k = 4,
+        .lda = 4, .ldb = 4, .ldc = 4,
+        .c_offset = SEKI_OUTPUT_SIZE - 8,
+    };
+    SekiCommand cmd = { .opcode = 0x7f };
+    SekiTestQueue q;
+
+    g_assert_cmphex(seki_legacy_run(card, &bad), ==, SEKI_STATUS_ERROR);
+    seki_writel(card, SEKI_REG_DOORBELL, SEKI_CMD_COPY);
+    g_assert_cmphex(seki_wait_status(card, SEKI_STATUS_ERROR), ==,
+                    SEKI_STATUS_ERROR);
+
+    seki_queue_init(&q, card, 0);
+    g_assert_cmpuint(seki_queue_run(&q, &cmd), ==, SEKI_CQE_INVALID_OPCODE);
+
+    cmd.opcode = SEKI_CMD_DGEMM;
+    cmd.gemm = bad;
+    g_assert_cmpuint(seki_queue_run(&q, &cmd), ==, SEKI_CQE_INVALID_FIELD);
+
+    cmd.gemm.c_offset = 4;
+    g_assert_cmpuint(seki_queue_run(&q, &cmd), ==, SEKI_CQE_INVALID_FIELD);
+
+    cmd.opcode = SEKI_CMD_COPY;
+    cmd.copy = (SekiCopyRegs) {
+        .peer = SEKI_TEST_CARDS + 10,       // no such card
+        .len = 8,
+    };
+    g_assert_cmpuint(seki_queue_run(&q, &cmd), ==, SEKI_CQE_INVALID_FIELD);
+    seki_queue_cleanup(&q);
+}
+
+// Card 0 output BAR -> card 1 input BAR, without guest memory in between
+static void test_copy_peer(void)
+{
+    size_t len = g_test_perf() ? 16 << 20 : 1 << 20;
+    uint8_t *pattern = g_malloc(len);
+    uint8_t *back = g_malloc(len);
+    SekiCommand cmd = { .opcode = SEKI_CMD_COPY };
+    SekiTestQueue q;
+    gint64 start;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        pattern[i] = i * 31 + (i >> 12);
+    }
+    memwrite(cards[0].output + 8192, pattern, len);
+
+    cmd.copy.peer = cards[1].id;
+    cmd.copy.src_offset = 8192;
+    cmd.copy.dst_offset = 4096;
+    cmd.copy.len = len;
+
+    seki_queue_init(&q, &cards[0], 0);
+    start = g_get_monotonic_time();
+    g_assert_cmpuint(seki_queue_run(&q, &cmd), ==, SEKI_CQE_SUCCESS);
+    seki_report_bandwidth("peer-to-peer copy", len, seki_elapsed(start));
+    seki_queue_cleanup(&q);
+
+    memread(cards[1].input + 4096, back, len);
+    g_assert(memcmp(pattern, back, len) == 0);
+
+    g_free(pattern);
+    g_free(back);
+}
+
+// Run count descriptors of chunk bytes each between guest memory at buf
+// and offset 0 of a BAR, and return the elapsed time
+static double seki_dma_run(SekiCard *card, uint64_t buf, size_t chunk,
+                           int count, uint32_t flags)
+{
+    uint64_t ring = guest_alloc(alloc, (count + 1) * sizeof(SekiDmaDesc));
+    SekiDmaDesc desc;
+    gint64 start;
+    double secs;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        desc = (SekiDmaDesc) {
+            .addr = cpu_to_le64(buf + i * chunk),
+            .offset = cpu_to_le64(i * chunk),
+            .len = cpu_to_le32(chunk),
+            .flags = cpu_to_le32(flags),
+        };
+        memwrite(ring + i * sizeof(desc), &desc, sizeof(desc));
+    }
+
+    seki_writeq(card, SEKI_REG_DMA_RING_LO, ring);
+    seki_writel(card, SEKI_REG_DMA_RING_SIZE, count + 1);
+
+    start = g_get_monotonic_time();
+    seki_writel(card, SEKI_REG_DMA_TAIL, count);
+    g_assert_cmphex(seki_wait_status(card, SEKI_STATUS_DMA_DONE |
+                                           SEKI_STATUS_DMA_ERROR), ==,
+                    SEKI_STATUS_DMA_DONE);
+    secs = seki_elapsed(start);
+
+    g_assert_cmpuint(seki_readl(card, SEKI_REG_DMA_HEAD), ==, count);
+    for (i = 0; i < count; i++) {
+        memread(ring + i * sizeof(desc), &desc, sizeof(desc));
+        g_assert_cmphex(le32_to_cpu(desc.status), ==, SEKI_DMA_DESC_DONE);
+    }
+
+    seki_writel(card, SEKI_REG_DMA_RING_SIZE, 0);
+    guest_free(alloc, ring);
+    return secs;
+}
+
+static void test_dma(void)
+{
+    SekiCard *card = &cards[0];
+    size_t chunk = 64 << 10;
+    int count = g_test_perf() ? 256 : 16;
+    size_t len = chunk * count;
+    uint64_t buf = guest_alloc(alloc, len);
+    uint8_t *pattern = g_malloc(len);
+    uint8_t *back = g_malloc(len);
+    double secs;
+    size_t i;
+
+    // Guest memory -> input BAR
+    for (i = 0; i < len; i++) {
+        pattern[i] = i ^ (i >> 8);
+    }
+    memwrite(buf, pattern, len);
+    secs = seki_dma_run(card, buf, chunk, count, 0);
+    seki_report_bandwidth("DMA to device", len, secs);
+    memread(card->input, back, len);
+    g_assert(memcmp(pattern, back, len) == 0);
+
+    // Output BAR -> guest memory
+    for (i = 0; i < len; i++) {
+        pattern[i] = ~i ^ (i >> 16);
+    }
+    memwrite(card->output, pattern, len);
+    secs = seki_dma_run(card, buf, chunk, count, SEKI_DMA_FROM_DEVICE);
+    seki_report_bandwidth("DMA from device", len, secs);
+    memread(buf, back, len);
+    g_assert(memcmp(pattern, back, len) == 0);
+
+    guest_free(alloc, buf);
+    g_free(pattern);
+    g_free(back);
+}
+
+static void test_dma_invalid(void)
+{
+    SekiCard *card = &cards[1];
+    uint64_t ring = guest_alloc(alloc, 2 * sizeof(SekiDmaDesc));
+    uint64_t buf = guest_alloc(alloc, 4096);
+    // Runs past the end of the input BAR, which halts the engine
+    SekiDmaDesc desc = {
+        .addr = cpu_to_le64(buf),
+        .offset = cpu_to_le64(SEKI_INPUT_SIZE - 8),
+        .len = cpu_to_le32(4096),
+    };
+
+    memwrite(ring, &desc, sizeof(desc));
+    seki_writeq(card, SEKI_REG_DMA_RING_LO, ring);
+    seki_writel(card, SEKI_REG_DMA_RING_SIZE, 2);
+    seki_writel(card, SEKI_REG_DMA_TAIL, 1);
+    g_assert_cmphex(seki_wait_status(card, SEKI_STATUS_DMA_DONE |
+                                           SEKI_STATUS_DMA_ERROR), ==,
+                    SEKI_STATUS_DMA_ERROR);
+    memread(ring, &desc, sizeof(desc));
+    g_assert_cmphex(le32_to_cpu(desc.status), ==, SEKI_DMA_DESC_ERROR);
+
+    seki_writel(card, SEKI_REG_DMA_RING_SIZE, 0);
+    guest_free(alloc, ring);
+    guest_free(alloc, buf);
+}
+
+// Access bandwidth of the BARs as seen through qtest
+static void test_access(void)
+{
+    SekiCard *card = &cards[0];
+    int reads = g_test_perf() ? 100000 : 2000;
+    size_t len = g_test_perf() ? 16 << 20 : 1 << 20;
+    uint8_t *buf = g_malloc0(len);
+    gint64 start;
+    double secs;
+    int i;
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < reads; i++) {
+        g_assert_cmphex(seki_readl(card, SEKI_REG_ID), ==, SEKI_ID_VALUE);
+    }
+    secs = seki_elapsed(start);
+    g_test_maximized_result(reads / MAX(secs, 1e-9),
+                            "register reads: %.0f/s",
+                            reads / MAX(secs, 1e-9));
+
+    start = g_get_monotonic_time();
+    memwrite(card->input, buf, len);
+    seki_report_bandwidth("input BAR writes", len, seki_elapsed(start));
+
+    start = g_get_monotonic_time();
+    memread(card->output, buf, len);
+    seki_report_bandwidth("output BAR reads", len, seki_elapsed(start));
+
+    g_free(buf);
+}
+
+// One large DGEMM per card, concurrently, on the shared compute pool
+static void test_dgemm_perf(void)
+{
+    static const SekiGemmCase tc = { 0, 512, 512, 512, 1.0, 0.0 };
+    SekiTestQueue q[SEKI_TEST_CARDS];
+    SekiGemm g[SEKI_TEST_CARDS];
+    SekiCommand cmd = { .opcode = SEKI_CMD_DGEMM };
+    uint32_t cid;
+    gint64 start;
+    double secs;
+    int i;
+
+    for (i = 0; i < SEKI_TEST_CARDS; i++) {
+        seki_gemm_prepare(&g[i], &cards[i], &tc, 0);
+        seki_queue_init(&q[i], &cards[i], 0);
+    }
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < SEKI_TEST_CARDS; i++) {
+        cmd.gemm = g[i].regs;
+        seki_queue_submit(&q[i], &cmd);
+    }
+    for (i = 0; i < SEKI_TEST_CARDS; i++) {
+        g_assert_cmpuint(seki_queue_complete(&q[i], &cid), ==,
+                         SEKI_CQE_SUCCESS);
+    }
+    secs = seki_elapsed(start);
+    g_test_maximized_result(2e-9 * tc.m * tc.n * tc.k * SEKI_TEST_CARDS /
+                            MAX(secs, 1e-9), "dgemm %ux%ux%u x %d: %.2f GFLOPS",
+                            tc.m, tc.n, tc.k, SEKI_TEST_CARDS,
+                            2e-9 * tc.m * tc.n * tc.k * SEKI_TEST_CARDS /
+                            MAX(secs, 1e-9));
+
+    for (i = 0; i < SEKI_TEST_CARDS; i++) {
+        seki_gemm_check(&g[i], &cards[i]);
+        seki_gemm_free(&g[i]);
+        seki_queue_cleanup(&q[i]);
+    }
+}
+
+
+static void seki_card_found(QPCIDevice *dev, int devfn, void *data)
+{
+    int *found = data;
+
+    g_assert_cmpint(*found, <, SEKI_TEST_CARDS);
+    cards[(*found)++].dev = dev;
+}
+
+static void seki_setup(void)
+{
+    void *bar;
+    int found = 0;
+    int i;
+
+    pcibus = qpci_init_pc();
+    alloc = pc_alloc_init();
+    qpci_device_foreach(pcibus, SEKI_VENDOR_ID, SEKI_DEVICE_ID,
+                        seki_card_found, &found);
+    g_assert_cmpint(found, ==, SEKI_TEST_CARDS);
+
+    for (i = 0; i < SEKI_TEST_CARDS; i++) {
+        qpci_device_enable(cards[i].dev);
+    }
+
+    // The PC bus hands out BAR addresses in call order without aligning
+    // them, so map from the largest BAR down
+    for (i = 0; i < SEKI_TEST_CARDS; i++) {
+        bar = qpci_iomap(cards[i].dev, 2, NULL);
+        cards[i].input = (uintptr_t)bar;
+    }
+    for (i = 0; i < SEKI_TEST_CARDS; i++) {
+        bar = qpci_iomap(cards[i].dev, 4, NULL);
+        cards[i].output = (uintptr_t)bar;
+    }
+    for (i = 0; i < SEKI_TEST_CARDS; i++) {
+        cards[i].ctrl = qpci_iomap(cards[i].dev, 0, NULL);
+        cards[i].id = seki_readl(&cards[i], SEKI_REG_CARD_ID);
+    }
+}
+
+static void seki_teardown(void)
+{
+    int i;
+
+    for (i = 0; i < SEKI_TEST_CARDS; i++) {
+        g_free(cards[i].dev);
+    }
+    pc_alloc_uninit(alloc);
+    qpci_free_pc(pcibus);
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+    qtest_add_func("/pcie-seki/registers", test_registers);
+    qtest_add_func("/pcie-seki/dgemm/known", test_dgemm_known);
+    qtest_add_func("/pcie-seki/dgemm/legacy", test_dgemm_legacy);
+    qtest_add_func("/pcie-seki/dgemm/queue", test_dgemm_queue);
+    qtest_add_func("/pcie-seki/dgemm/invalid", test_dgemm_invalid);
+    qtest_add_func("/pcie-seki/dma", test_dma);
+    qtest_add_func("/pcie-seki/dma/invalid", test_dma_invalid);
+    qtest_add_func("/pcie-seki/copy/peer", test_copy_peer);
+    qtest_add_func("/pcie-seki/access", test_access);
+    if (g_test_perf()) {
+        qtest_add_func("/pcie-seki/dgemm/perf", test_dgemm_perf);
+    }
+
+    qtest_start("-device pcie-seki,queues=2 -device pcie-seki,queues=2");
+    seki_setup();
+    ret = g_test_run();
+    seki_teardown();
+    qtest_end();
+
+    return ret;
+}
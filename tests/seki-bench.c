@@ -0,0 +1,437 @@
+/*
+ * seki-bench.c: replay pcie-seki captures against the host compute backend
+ *
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Usage:
+ *     seki-bench [options] [capture...]
+ *
+ * Captures are written by '-device pcie-seki,capture=FILE'.  Each one is
+ * replayed in order, with no guest and no device model: input data is
+ * copied into a buffer standing in for the input BAR, and commands run on
+ * the same BLAS backends and compute pool as the device uses.  Without
+ * captures a synthetic workload is generated and replayed.
+ *
+ * The output reports, per capture and run:
+ *
+ *     commands: 34 (dgemm 32, copy 2, invalid 0)
+ *     dgemm: 9.12 GFLOPS
+ *     input data: 3321.4 MB/s, copy: 5510.9 MB/s
+ *     latency: p50 27411 us, p99 30119 us, max 30254 us
+ *     output checksum: 0x6c1f33f9a1f7e1b2
+ *
+ * Latency is the host time to execute a command.  The checksum of the
+ * output BAR after the replay only depends on the capture and the backend,
+ * not on the number of threads.
+ */
+
+#include <glib.h>
+#include <getopt.h>
+#include "qemu-common.h"
+#include "qemu/osdep.h"
+#include "qemu/error-report.h"
+#include "qemu/timer.h"
+#include "qapi/error.h"
+
+#include "hw/pci/pcie_seki_capture.h"
+
+#define SEKI_BENCH_CHUNK    (1 << 20)
+
+typedef struct SekiBench {
+    const SekiBlasBackend *be;
+    SekiPool *pool;
+    SekiPoolClient *client;
+    uint32_t card_id;
+    uint8_t *input;
+    uint8_t *output;
+    uint8_t *peer_input;    // input BAR of every other card
+
+    uint64_t commands;
+    uint64_t dgemms;
+    uint64_t copies;
+    uint64_t invalid;
+    uint64_t flops;
+    int64_t dgemm_ns;
+    uint64_t data_bytes;
+    int64_t data_ns;
+    uint64_t copy_bytes;
+    int64_t copy_ns;
+    GArray *latency;        // of int64_t, in ns
+} SekiBench;
+
+typedef struct SekiBenchGemm {
+    const SekiBlasBackend *be;
+    SekiDgemm g;
+} SekiBenchGemm;
+
+typedef struct SekiBenchCopy {
+    const uint8_t *src;
+    uint8_t *dst;
+    uint64_t len;
+} SekiBenchCopy;
+
+static void seki_bench_gemm_tile(void *opaque, int tile, void *scratch)
+{
+    SekiBenchGemm *job = opaque;
+
+    seki_dgemm_tile(job->be, &job->g, tile, scratch);
+}
+
+static void seki_bench_copy_chunk(void *opaque, int chunk, void *scratch)
+{
+    SekiBenchCopy *job = opaque;
+    uint64_t off = (uint64_t)chunk * SEKI_BENCH_CHUNK;
+
+    memcpy(job->dst + off, job->src + off,
+           MIN(job->len - off, SEKI_BENCH_CHUNK));
+}
+
+static void seki_bench_data(SekiBench *b, SekiCaptureData *d, uint64_t len)
+{
+    int64_t start;
+
+    if (d->offset > SEKI_INPUT_SIZE || len > SEKI_INPUT_SIZE - d->offset) {
+        fprintf(stderr, "seki-bench: input data out of range, skipped\n");
+        return;
+    }
+
+    start = get_clock();
+    memcpy(b->input + d->offset, d + 1, len);
+    b->data_ns += get_clock() - start;
+    b->data_bytes += len;
+}
+
+static void seki_bench_command(SekiBench *b, const SekiCommand *cmd)
+{
+    int64_t start = get_clock();
+    int64_t ns;
+
+    b->commands++;
+    if (cmd->opcode == SEKI_CMD_DGEMM && seki_gemm_valid(&cmd->gemm)) {
+        SekiBenchGemm job = { .be = b->be };
+
+        seki_gemm_setup(&job.g, &cmd->gemm, b->input, b->output);
+        seki_pool_run(b->client, seki_bench_gemm_tile, &job,
+                      seki_dgemm_tiles(&job.g));
+        ns = get_clock() - start;
+        b->dgemms++;
+        b->flops += 2 * (uint64_t)cmd->gemm.m * cmd->gemm.n * cmd->gemm.k;
+        b->dgemm_ns += ns;
+    } else if (cmd->opcode == SEKI_CMD_COPY && seki_copy_valid(&cmd->copy)) {
+        const SekiCopyRegs *r = &cmd->copy;
+        SekiBenchCopy job = {
+            .src = b->output + r->src_offset,
+            .dst = (r->peer == b->card_id ? b->input : b->peer_input) +
+                   r->dst_offset,
+            .len = r->len,
+        };
+
+        seki_pool_run(b->client, seki_bench_copy_chunk, &job,
+                      DIV_ROUND_UP(r->len, SEKI_BENCH_CHUNK));
+        ns = get_clock() - start;
+        b->copies++;
+        b->copy_bytes += r->len;
+        b->copy_ns += ns;
+    } else {
+        b->invalid++;
+        return;
+    }
+    g_array_append_val(b->latency, ns);
+}
+
+static int seki_bench_cmp(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int64_t seki_bench_percentile(GArray *a, int p)
+{
+    if (!a->len) {
+        return 0;
+    }
+    return g_array_index(a, int64_t, (a->len - 1) * p / 100);
+}
+
+static double seki_bench_mbps(uint64_t bytes, int64_t ns)
+{
+    return ns ? bytes * 1000.0 / ns : 0;
+}
+
+static uint64_t seki_bench_checksum(const uint8_t *buf, size_t len)
+{
+    const uint64_t *p = (const uint64_t *)buf;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < len / sizeof(*p); i++) {
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static void seki_bench_report(SekiBench *b)
+{
+    g_array_sort(b->latency, seki_bench_cmp);
+
+    printf("  commands: %" PRIu64 " (dgemm %" PRIu64 ", copy %" PRIu64
+           ", invalid %" PRIu64 ")\n",
+           b->commands, b->dgemms, b->copies, b->invalid);
+    printf("  dgemm: %.2f GFLOPS\n",
+           b->dgemm_ns ? (double)b->flops / b->dgemm_ns : 0);
+    printf("  input data: %.1f MB/s, copy: %.1f MB/s\n",
+           seki_bench_mbps(b->data_bytes, b->data_ns),
+           seki_bench_mbps(b->copy_bytes, b->copy_ns));
+    printf("  latency: p50 %" PRId64 " us, p99 %" PRId64 " us, max %" PRId64
+           " us\n", seki_bench_percentile(b->latency, 50) / 1000,
+           seki_bench_percentile(b->latency, 99) / 1000,
+           seki_bench_percentile(b->latency, 100) / 1000);
+    printf("  output checksum: 0x%016" PRIx64 "\n",
+           seki_bench_checksum(b->output, SEKI_OUTPUT_SIZE));
+}
+
+static int seki_bench_replay(SekiBench *b, const char *path)
+{
+    SekiCaptureHeader hdr;
+    SekiCaptureRecord rec;
+    Error *err = NULL;
+    void *payload;
+    FILE *f;
+    int rv;
+
+    f = seki_capture_read_open(path, &hdr, &err);
+    if (!f) {
+        error_report_err(err);
+        return -1;
+    }
+    if (hdr.input_size != SEKI_INPUT_SIZE ||
+        hdr.output_size != SEKI_OUTPUT_SIZE) {
+        fprintf(stderr, "seki-bench: '%s' was captured with different BAR "
+                "sizes\n", path);
+        fclose(f);
+        return -1;
+    }
+
+    b->card_id = hdr.card_id;
+    memset(b->input, 0, SEKI_INPUT_SIZE);
+    memset(b->output, 0, SEKI_OUTPUT_SIZE);
+    b->commands = b->dgemms = b->copies = b->invalid = 0;
+    b->flops = b->data_bytes = b->copy_bytes = 0;
+    b->dgemm_ns = b->data_ns = b->copy_ns = 0;
+    g_array_set_size(b->latency, 0);
+
+    while ((rv = seki_capture_read(f, &rec, &payload, &err)) > 0) {
+        if (rec.type == SEKI_CAPTURE_DATA) {
+            seki_bench_data(b, payload, rec.len - sizeof(SekiCaptureData));
+        } else {
+            seki_bench_command(b, &((SekiCaptureCommand *)payload)->cmd);
+        }
+        g_free(payload);
+    }
+    fclose(f);
+    if (rv < 0) {
+        error_report("%s: %s", path, error_get_pretty(err));
+        error_free(err);
+        return -1;
+    }
+
+    seki_bench_report(b);
+    return 0;
+}
+
+static void seki_bench_fill(SekiCapture *cap, uint64_t offset, int n,
+                            unsigned *seed)
+{
+    double *m = g_new(double, (size_t)n * n);
+    size_t i;
+
+    for (i = 0; i < (size_t)n * n; i++) {
+        m[i] = (double)rand_r(seed) / RAND_MAX - 0.5;
+        cpu_to_le64s((uint64_t *)&m[i]);
+    }
+    seki_capture_data(cap, offset, m, (size_t)n * n * sizeof(double));
+    g_free(m);
+}
+
+// A stand-in for an HPL trailing update: A and B are uploaded once, then
+// n x n x n DGEMMs alternate the transpose flags, and every eighth command
+// copies C back to the input BAR.
+static int seki_bench_synthesize(const char *path, int n, int count)
+{
+    uint64_t size = (uint64_t)n * n * sizeof(double);
+    unsigned seed = 1;
+    SekiCapture *cap;
+    Error *err = NULL;
+    int i;
+
+    cap = seki_capture_open(path, 0, &err);
+    if (!cap) {
+        error_report_err(err);
+        return -1;
+    }
+
+    seki_bench_fill(cap, 0, n, &seed);
+    seki_bench_fill(cap, size, n, &seed);
+    for (i = 0; i < count; i++) {
+        SekiCommand cmd = { .cid = i };
+
+        if (i % 8 == 7) {
+            cmd.opcode = SEKI_CMD_COPY;
+            cmd.copy.peer = 0;
+            cmd.copy.src_offset = 0;
+            cmd.copy.dst_offset = 2 * size;
+            cmd.copy.len = size;
+        } else {
+            cmd.opcode = SEKI_CMD_DGEMM;
+            cmd.gemm.flags = i & (SEKI_FLAG_TRANSA | SEKI_FLAG_TRANSB);
+            cmd.gemm.m = cmd.gemm.n = cmd.gemm.k = n;
+            cmd.gemm.lda = cmd.gemm.ldb = cmd.gemm.ldc = n;
+            cmd.gemm.a_offset = 0;
+            cmd.gemm.b_offset = size;
+            cmd.gemm.c_offset = 0;
+            cmd.gemm.alpha = seki_double_to_reg(1.0 / n);
+            cmd.gemm.beta = seki_double_to_reg(0.5);
+        }
+        seki_capture_command(cap, 0, 0, &cmd);
+    }
+
+    seki_capture_close(cap);
+    return 0;
+}
+
+static void usage(void)
+{
+    printf("Usage: seki-bench [options] [capture...]\n"
+           "Replay pcie-seki captures, or a synthetic workload if none are "
+           "given.\n\n"
+           "  -t N     compute threads (default: online CPUs)\n"
+           "  -b NAME  BLAS backend (default: " SEKI_BLAS_AUTO ")\n"
+           "  -r N     replay each capture N times (default: 1)\n"
+           "  -n N     synthetic workload: matrix size (default: 512)\n"
+           "  -c N     synthetic workload: commands (default: 32)\n"
+           "  -o FILE  keep the synthetic workload in FILE\n"
+           "  -h       show this help\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *backend = SEKI_BLAS_AUTO;
+    const char *synth_path = NULL;
+    char *tmp_path = NULL;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int repeat = 1, n = 512, count = 32;
+    SekiBench b = { 0 };
+    int c, i, r, ret = 0;
+
+    while ((c = getopt(argc, argv, "t:b:r:n:c:o:h")) != -1) {
+        switch (c) {
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'b':
+            backend = optarg;
+            break;
+        case 'r':
+            repeat = atoi(optarg);
+            break;
+        case 'n':
+            n = atoi(optarg);
+            break;
+        case 'c':
+            count = atoi(optarg);
+            break;
+        case 'o':
+            synth_path = optarg;
+            break;
+        case 'h':
+            usage();
+            return 0;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    if (threads < 1 || threads > SEKI_POOL_MAX_THREADS || repeat < 1 ||
+        n < 1 || 3 * (uint64_t)n * n * sizeof(double) > SEKI_INPUT_SIZE ||
+        count < 0) {
+        fprintf(stderr, "seki-bench: invalid argument\n");
+        return 1;
+    }
+
+    b.be = seki_blas_find(backend);
+    if (!b.be) {
+        char *list = seki_blas_list();
+
+        fprintf(stderr, "seki-bench: BLAS backend '%s' is not available, "
+                "use one of: %s\n", backend, list);
+        g_free(list);
+        return 1;
+    }
+
+    if (optind == argc) {
+        if (!synth_path) {
+            int fd = g_file_open_tmp("seki-bench-XXXXXX", &tmp_path, NULL);
+
+            if (fd < 0) {
+                fprintf(stderr, "seki-bench: cannot create a temporary "
+                        "file\n");
+                return 1;
+            }
+            close(fd);
+            synth_path = tmp_path;
+        }
+        if (seki_bench_synthesize(synth_path, n, count) < 0) {
+            ret = 1;
+            goto out;
+        }
+    }
+
+    b.pool = seki_pool_new(threads, seki_blas_scratch_size(b.be));
+    b.client = seki_pool_client_new(b.pool);
+    b.input = qemu_memalign(64, SEKI_INPUT_SIZE);
+    b.output = qemu_memalign(64, SEKI_OUTPUT_SIZE);
+    b.peer_input = qemu_memalign(64, SEKI_INPUT_SIZE);
+    b.latency = g_array_new(false, false, sizeof(int64_t));
+
+    printf("backend %s, %d compute threads\n", b.be->name, threads);
+    for (i = optind; i < argc || (i == optind && synth_path); i++) {
+        const char *path = i < argc ? argv[i] : synth_path;
+
+        for (r = 0; r < repeat; r++) {
+            printf("%s, run %d:\n", path, r + 1);
+            if (seki_bench_replay(&b, path) < 0) {
+                ret = 1;
+                break;
+            }
+        }
+    }
+
+    g_array_free(b.latency, true);
+    qemu_vfree(b.peer_input);
+    qemu_vfree(b.output);
+    qemu_vfree(b.input);
+    seki_pool_client_free(b.client);
+    seki_pool_free(b.pool);
+out:
+    if (tmp_path) {
+        unlink(tmp_path);
+        g_free(tmp_path);
+    }
+    return ret;
+}
@@ -0,0 +1,165 @@
+/*
+ * QTest testcase for the persistent translation cache
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The guest boots a sector that stores a signature and halts, twice or
+ * more in a row with the same cache file.  "info jit" tells how many
+ * blocks each run loaded from the cache.
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "libqtest.h"
+
+#define LOW(x) ((x) & 0xff)
+#define HIGH(x) (((x) >> 8) & 0xff)
+
+#define BOOT_SECTOR_ADDRESS 0x7c00
+#define SIGNATURE 0xdead
+#define SIGNATURE_OFFSET 0x10
+
+/* Boot sector code: write SIGNATURE into memory, then halt */
+static uint8_t boot_sector[0x7e000] = {
+    /* 7c00: mov $0xdead,%ax */
+    [0x00] = 0xb8,
+    [0x01] = LOW(SIGNATURE),
+    [0x02] = HIGH(SIGNATURE),
+    /* 7c03:  mov %ax,0x7c10 */
+    [0x03] = 0xa3,
+    [0x04] = LOW(BOOT_SECTOR_ADDRESS + SIGNATURE_OFFSET),
+    [0x05] = HIGH(BOOT_SECTOR_ADDRESS + SIGNATURE_OFFSET),
+    /* 7c06: cli */
+    [0x06] = 0xfa,
+    /* 7c07: hlt */
+    [0x07] = 0xf4,
+    /* 7c08: jmp 0x7c07=0x7c0a-3 */
+    [0x08] = 0xeb,
+    [0x09] = LOW(-3),
+    /* End of boot sector marker */
+    [0x1FE] = 0x55,
+    [0x1FF] = 0xAA,
+};
+
+static char disk[] = "/tmp/qtest.tb-cache-disk.XXXXXX";
+static char cache[] = "/tmp/qtest.tb-cache.XXXXXX";
+
+/* Boot with "-tcg cache=FILE@opts" and return how many blocks were loaded
+ * from the cache.  QEMU saves the cache when it exits.  */
+static unsigned int boot_with_cache(const char *opts)
+{
+    QDict *response;
+    const char *info;
+    unsigned int hits;
+    uint16_t signature = 0;
+    char *args;
+    int i;
+
+    args = g_strdup_printf("-machine accel=tcg -net none -display none "
+                           "-drive file=%s,format=raw -tcg cache=%s%s",
+                           disk, cache, opts);
+    qtest_start(args);
+
+    /* Wait at most 1 minute for the BIOS to boot the sector */
+    for (i = 0; i < 600; i++) {
+        signature = readw(BOOT_SECTOR_ADDRESS + SIGNATURE_OFFSET);
+        if (signature == SIGNATURE) {
+            break;
+        }
+        g_usleep(G_USEC_PER_SEC / 10);
+    }
+    g_assert_cmphex(signature, ==, SIGNATURE);
+
+    response = qmp("{'execute': 'human-monitor-command',"
+                   " 'arguments': {"
+                   "   'command-line': 'info jit'"
+                   "}}");
+    g_assert(response);
+    info = qdict_get_try_str(response, "return");
+    g_assert(info);
+    info = strstr(info, "TB cache");
+    g_assert(info);
+    g_assert_cmpint(sscanf(info, "TB cache %u hits", &hits), ==, 1);
+    QDECREF(response);
+
+    qtest_quit(global_qtest);
+    g_free(args);
+    return hits;
+}
+
+static void test_cache_reuse(void)
+{
+    unlink(cache);
+    g_assert_cmpuint(boot_with_cache(""), ==, 0);
+    g_assert_cmpuint(boot_with_cache(""), >, 0);
+}
+
+/* A cache written with other -tcg options, or for another machine or CPU,
+ * must not be loaded */
+static void test_cache_options(const char *opts)
+{
+    unlink(cache);
+    g_assert_cmpuint(boot_with_cache(""), ==, 0);
+    g_assert_cmpuint(boot_with_cache(""), >, 0);
+    g_assert_cmpuint(boot_with_cache(opts), ==, 0);
+    /* the file was rewritten for @opts */
+    g_assert_cmpuint(boot_with_cache(""), ==, 0);
+}
+
+static void test_cache_superblock(void)
+{
+    test_cache_options(",superblock=100");
+}
+
+static void test_cache_optimize(void)
+{
+    test_cache_options(",optimize=basic");
+}
+
+/* same default CPU model, but another board */
+static void test_cache_machine(void)
+{
+    test_cache_options(" -machine pc-i440fx-2.0");
+}
+
+static void test_cache_cpu_features(void)
+{
+    test_cache_options(" -cpu qemu64,+ssse3");
+}
+
+int main(int argc, char **argv)
+{
+    ssize_t len;
+    int fd, ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    /* the cache is only implemented for x86-64 Linux hosts */
+#if !defined(__x86_64__) || !defined(__linux__)
+    return g_test_run();
+#endif
+
+    fd = mkstemp(disk);
+    g_assert(fd >= 0);
+    len = write(fd, boot_sector, sizeof(boot_sector));
+    g_assert(len == sizeof(boot_sector));
+    close(fd);
+
+    fd = mkstemp(cache);
+    g_assert(fd >= 0);
+    close(fd);
+
+    qtest_add_func("tb-cache/reuse", test_cache_reuse);
+    qtest_add_func("tb-cache/superblock", test_cache_superblock);
+    qtest_add_func("tb-cache/optimize", test_cache_optimize);
+    qtest_add_func("tb-cache/machine", test_cache_machine);
+    qtest_add_func("tb-cache/cpu-features", test_cache_cpu_features);
+    ret = g_test_run();
+
+    unlink(disk);
+    unlink(cache);
+    return ret;
+}
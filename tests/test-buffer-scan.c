@@ -0,0 +1,106 @@
+/*
+ * Test buffer zero detection and comparison
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include <string.h>
+#include "qemu-common.h"
+
+#define BUF_SIZE 1024
+
+/*
+ * Every check runs once for each implementation the host supports, at
+ * all alignments and at lengths that exercise the unrolled loops and tails.
+ */
+static uint8_t buf_a[BUF_SIZE + 64];
+static uint8_t buf_b[BUF_SIZE + 64];
+
+static void test_find_nonzero(void)
+{
+    size_t align, len, pos;
+
+    memset(buf_a, 0, sizeof(buf_a));
+    do {
+        for (align = 0; align < 64; align += 7) {
+            uint8_t *p = buf_a + align;
+
+            for (len = 0; len <= BUF_SIZE; len += 61) {
+                g_assert_cmpint(buffer_find_nonzero_offset(p, len), ==, len);
+                g_assert(buffer_is_zero(p, len));
+
+                for (pos = 0; pos < len; pos += 13) {
+                    p[pos] = 0x40;
+                    g_assert_cmpint(buffer_find_nonzero_offset(p, len),
+                                    ==, pos);
+                    g_assert(!buffer_is_zero(p, len));
+                    p[pos] = 0;
+                }
+            }
+        }
+    } while (buffer_scan_next_accel());
+}
+
+static void test_find_diff(void)
+{
+    size_t align, len, pos;
+
+    memset(buf_a, 0x5a, sizeof(buf_a));
+    memset(buf_b, 0x5a, sizeof(buf_b));
+    do {
+        for (align = 0; align < 64; align += 7) {
+            uint8_t *a = buf_a + align;
+            uint8_t *b = buf_b + (align * 3) % 64;
+
+            for (len = 0; len <= BUF_SIZE; len += 61) {
+                g_assert_cmpint(buffer_find_diff(a, b, len), ==, len);
+                g_assert(buffer_is_equal(a, b, len));
+
+                for (pos = 0; pos < len; pos += 13) {
+                    b[pos] ^= 0x01;
+                    g_assert_cmpint(buffer_find_diff(a, b, len), ==, pos);
+                    g_assert(!buffer_is_equal(a, b, len));
+                    b[pos] ^= 0x01;
+                }
+            }
+        }
+    } while (buffer_scan_next_accel());
+}
+
+static void test_find_same(void)
+{
+    size_t i, align, len, pos;
+
+    for (i = 0; i < sizeof(buf_a); i++) {
+        buf_a[i] = i;
+        buf_b[i] = ~i;
+    }
+    do {
+        for (align = 0; align < 64; align += 7) {
+            uint8_t *a = buf_a + align;
+            uint8_t *b = buf_b + align;
+
+            for (len = 0; len <= BUF_SIZE; len += 61) {
+                g_assert_cmpint(buffer_find_same(a, b, len), ==, len);
+
+                for (pos = 0; pos < len; pos += 13) {
+                    b[pos] = a[pos];
+                    g_assert_cmpint(buffer_find_same(a, b, len), ==, pos);
+                    b[pos] = ~a[pos];
+                }
+            }
+        }
+    } while (buffer_scan_next_accel());
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/buffer-scan/find_nonzero", test_find_nonzero);
+    g_test_add_func("/buffer-scan/find_diff", test_find_diff);
+    g_test_add_func("/buffer-scan/find_same", test_find_same);
+    return g_test_run();
+}
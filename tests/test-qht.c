@@ -0,0 +1,205 @@
+/*
+ * QHT tests
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/qht.h"
+#include "qemu/rcu.h"
+#include "qemu/atomic.h"
+
+#define N 5000
+
+static QHT ht;
+static int32_t arr[N * 2];
+
+static uint32_t hash_of(int32_t v)
+{
+    /* force collisions now and then to exercise the overflow buckets */
+    return v % 3 ? v * 2654435761u : 0;
+}
+
+static bool is_equal(const void *obj, const void *userp)
+{
+    const int32_t *a = obj;
+    const int32_t *b = userp;
+
+    return *a == *b;
+}
+
+static void insert(int a, int b)
+{
+    int i;
+
+    for (i = a; i < b; i++) {
+        arr[i] = i;
+        g_assert(qht_insert(&ht, &arr[i], hash_of(i)));
+    }
+}
+
+static void rm(int a, int b)
+{
+    int i;
+
+    for (i = a; i < b; i++) {
+        g_assert(qht_remove(&ht, &arr[i], hash_of(i)));
+    }
+}
+
+static void check(int a, int b, bool expected)
+{
+    int i;
+
+    rcu_read_lock();
+    for (i = a; i < b; i++) {
+        int32_t val = i;
+        void *p = qht_lookup(&ht, is_equal, &val, hash_of(i));
+
+        if (expected) {
+            g_assert(p == &arr[i]);
+        } else {
+            g_assert(p == NULL);
+        }
+    }
+    rcu_read_unlock();
+}
+
+static void count_func(QHT *ht, void *p, uint32_t hash, void *userp)
+{
+    size_t *count = userp;
+
+    g_assert(hash == hash_of(*(int32_t *)p));
+    (*count)++;
+}
+
+static size_t count(void)
+{
+    size_t n = 0;
+
+    qht_iter(&ht, count_func, &n);
+    return n;
+}
+
+static void test_basic(void)
+{
+    qht_init(&ht, 0, 0);
+
+    check(0, N, false);
+    insert(0, N);
+    check(0, N, true);
+    g_assert(count() == N);
+
+    /* duplicates are rejected */
+    g_assert(!qht_insert(&ht, &arr[10], hash_of(10)));
+
+    rm(0, N / 2);
+    check(0, N / 2, false);
+    check(N / 2, N, true);
+    g_assert(!qht_remove(&ht, &arr[0], hash_of(0)));
+    g_assert(count() == N - N / 2);
+
+    /* removal keeps the chains packed, so re-inserting works */
+    insert(0, N / 2);
+    check(0, N, true);
+
+    qht_reset(&ht);
+    check(0, N, false);
+    g_assert(count() == 0);
+
+    qht_destroy(&ht);
+}
+
+static void test_resize(void)
+{
+    QHTStats st;
+
+    qht_init(&ht, 16, 0);
+    insert(0, N);
+
+    g_assert(qht_resize(&ht, N));
+    check(0, N, true);
+    g_assert(!qht_resize(&ht, N));
+
+    qht_statistics(&ht, &st);
+    g_assert(st.entries == N);
+    g_assert(st.used_head_buckets <= st.head_buckets);
+
+    g_assert(qht_reset_size(&ht, 64));
+    check(0, N, false);
+    insert(0, N);
+    check(0, N, true);
+
+    qht_destroy(&ht);
+}
+
+static void test_auto_resize(void)
+{
+    QHTStats before, after;
+
+    qht_init(&ht, 16, QHT_MODE_AUTO_RESIZE);
+    qht_statistics(&ht, &before);
+    insert(0, N * 2);
+    qht_statistics(&ht, &after);
+
+    g_assert(after.head_buckets > before.head_buckets);
+    g_assert(after.entries == N * 2);
+    check(0, N * 2, true);
+
+    qht_destroy(&ht);
+}
+
+/* Readers look up a stable set of entries while a writer keeps inserting
+ * and removing others, forcing resizes.  The stable entries must never go
+ * missing. */
+static bool stop;
+
+static void *reader_thread(void *opaque)
+{
+    rcu_register_thread();
+    while (!atomic_read(&stop)) {
+        check(0, N, true);
+    }
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void test_concurrent(void)
+{
+    QemuThread threads[2];
+    int i;
+
+    qht_init(&ht, 16, QHT_MODE_AUTO_RESIZE);
+    insert(0, N);
+
+    stop = false;
+    for (i = 0; i < ARRAY_SIZE(threads); i++) {
+        qemu_thread_create(&threads[i], "reader", reader_thread, NULL,
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < 20; i++) {
+        insert(N, N * 2);
+        rm(N, N * 2);
+        qht_resize(&ht, i % 2 ? 64 : N * 4);
+    }
+    atomic_mb_set(&stop, true);
+    for (i = 0; i < ARRAY_SIZE(threads); i++) {
+        qemu_thread_join(&threads[i]);
+    }
+
+    check(0, N, true);
+    check(N, N * 2, false);
+    qht_destroy(&ht);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/qht/basic", test_basic);
+    g_test_add_func("/qht/resize", test_resize);
+    g_test_add_func("/qht/auto-resize", test_auto_resize);
+    g_test_add_func("/qht/concurrent", test_concurrent);
+    return g_test_run();
+}
@@ -0,0 +1,254 @@
+/*
+ * Test the host FPU fast path of softfloat
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * float32/float64 add, sub, mul, div and sqrt take the host FPU fast path
+ * when the inexact flag is already set.  Each operation is run once with
+ * clear flags, which always goes through softfloat, and once with inexact
+ * set; the results and the other flags must be the same.
+ */
+
+#include <glib.h>
+#include <stdio.h>
+
+/* the fast path is static, include it to check when it is taken */
+#include "fpu/softfloat.c"
+
+enum {
+    FTZ_NONE,
+    FTZ_OUTPUT,
+    FTZ_INPUT,
+    FTZ_BOTH,
+};
+
+static const uint32_t f32_edge[] = {
+    0x00000000, 0x80000000,     /* zero */
+    0x00000001, 0x80000001,     /* smallest subnormal */
+    0x007fffff, 0x807fffff,     /* largest subnormal */
+    0x00800000, 0x80800000,     /* smallest normal */
+    0x00800001, 0x00ffffff,
+    0x01000000, 0x1f800000,     /* 2^-64 */
+    0x33800000,                 /* 2^-24 */
+    0x3e800000,                 /* 0.25 */
+    0x3eaaaaab,                 /* 1/3 */
+    0x3f000000, 0x3f7fffff,
+    0x3f800000, 0xbf800000,     /* 1 */
+    0x3f800001, 0x40000000, 0x40400000,
+    0x4b7fffff, 0x5f800000,     /* 2^64 */
+    0x7effffff,
+    0x7f7fffff, 0xff7fffff,     /* largest normal */
+    0x7f800000, 0xff800000,     /* infinity */
+    0x7fc00000, 0x7f800001,     /* NaNs */
+};
+
+static const uint64_t f64_edge[] = {
+    0x0000000000000000ull, 0x8000000000000000ull,
+    0x0000000000000001ull, 0x8000000000000001ull,
+    0x000fffffffffffffull, 0x800fffffffffffffull,
+    0x0010000000000000ull, 0x8010000000000000ull,
+    0x0010000000000001ull, 0x001fffffffffffffull,
+    0x0020000000000000ull, 0x1ff0000000000000ull,
+    0x3ca0000000000000ull,      /* 2^-53 */
+    0x3fd0000000000000ull,
+    0x3fd5555555555555ull,      /* 1/3 */
+    0x3fe0000000000000ull, 0x3fefffffffffffffull,
+    0x3ff0000000000000ull, 0xbff0000000000000ull,
+    0x3ff0000000000001ull, 0x4000000000000000ull, 0x4008000000000000ull,
+    0x433fffffffffffffull, 0x5ff0000000000000ull,
+    0x7fdfffffffffffffull,
+    0x7fefffffffffffffull, 0xffefffffffffffffull,
+    0x7ff0000000000000ull, 0xfff0000000000000ull,
+    0x7ff8000000000000ull, 0x7ff0000000000001ull,
+};
+
+static void status_init(float_status *s, int ftz, int flags)
+{
+    memset(s, 0, sizeof(*s));
+    set_float_rounding_mode(float_round_nearest_even, s);
+    set_flush_to_zero(ftz == FTZ_OUTPUT || ftz == FTZ_BOTH, s);
+    set_flush_inputs_to_zero(ftz == FTZ_INPUT || ftz == FTZ_BOTH, s);
+    set_float_exception_flags(flags, s);
+}
+
+static float32 f32_op(int op, float32 a, float32 b, float_status *s)
+{
+    switch (op) {
+    case hardfloat_add:
+        return float32_add(a, b, s);
+    case hardfloat_sub:
+        return float32_sub(a, b, s);
+    case hardfloat_mul:
+        return float32_mul(a, b, s);
+    case hardfloat_div:
+        return float32_div(a, b, s);
+    default:
+        return float32_sqrt(a, s);
+    }
+}
+
+static float64 f64_op(int op, float64 a, float64 b, float_status *s)
+{
+    switch (op) {
+    case hardfloat_add:
+        return float64_add(a, b, s);
+    case hardfloat_sub:
+        return float64_sub(a, b, s);
+    case hardfloat_mul:
+        return float64_mul(a, b, s);
+    case hardfloat_div:
+        return float64_div(a, b, s);
+    default:
+        return float64_sqrt(a, s);
+    }
+}
+
+static void f32_check(int op, uint32_t a, uint32_t b)
+{
+    float_status soft, hard;
+    float32 rs, rh;
+    int ftz;
+
+    for (ftz = FTZ_NONE; ftz <= FTZ_BOTH; ftz++) {
+        status_init(&soft, ftz, 0);
+        status_init(&hard, ftz, float_flag_inexact);
+        rs = f32_op(op, make_float32(a), make_float32(b), &soft);
+        rh = f32_op(op, make_float32(a), make_float32(b), &hard);
+        if (float32_val(rs) != float32_val(rh) ||
+            (get_float_exception_flags(&soft) | float_flag_inexact) !=
+            get_float_exception_flags(&hard)) {
+            fprintf(stderr, "float32 op %d ftz %d: %08x, %08x: "
+                    "softfloat %08x flags %#x, fast path %08x flags %#x\n",
+                    op, ftz, a, b, float32_val(rs),
+                    (uint8_t)get_float_exception_flags(&soft), float32_val(rh),
+                    (uint8_t)get_float_exception_flags(&hard));
+            g_assert_not_reached();
+        }
+    }
+}
+
+static void f64_check(int op, uint64_t a, uint64_t b)
+{
+    float_status soft, hard;
+    float64 rs, rh;
+    int ftz;
+
+    for (ftz = FTZ_NONE; ftz <= FTZ_BOTH; ftz++) {
+        status_init(&soft, ftz, 0);
+        status_init(&hard, ftz, float_flag_inexact);
+        rs = f64_op(op, make_float64(a), make_float64(b), &soft);
+        rh = f64_op(op, make_float64(a), make_float64(b), &hard);
+        if (float64_val(rs) != float64_val(rh) ||
+            (get_float_exception_flags(&soft) | float_flag_inexact) !=
+            get_float_exception_flags(&hard)) {
+            fprintf(stderr, "float64 op %d ftz %d: %016" PRIx64 ", %016"
+                    PRIx64 ": softfloat %016" PRIx64 " flags %#x, "
+                    "fast path %016" PRIx64 " flags %#x\n",
+                    op, ftz, a, b, float64_val(rs),
+                    (uint8_t)get_float_exception_flags(&soft), float64_val(rh),
+                    (uint8_t)get_float_exception_flags(&hard));
+            g_assert_not_reached();
+        }
+    }
+}
+
+/* The fast path must be taken for plain normal operands and results, and
+ * not for subnormal ones or results that may be tiny.  */
+static void test_fast_path_taken(void)
+{
+    float_status s;
+    float32 r32;
+    float64 r64;
+
+    if (!USE_HARDFLOAT) {
+        return;
+    }
+
+    status_init(&s, FTZ_NONE, 0);
+    g_assert(!float32_hardfloat(hardfloat_add, float32_one, float32_one,
+                                &r32, &s));
+    g_assert(!float64_hardfloat(hardfloat_add, float64_one, float64_one,
+                                &r64, &s));
+
+    status_init(&s, FTZ_NONE, float_flag_inexact);
+    g_assert(float32_hardfloat(hardfloat_add, float32_one, float32_one,
+                               &r32, &s));
+    g_assert_cmphex(float32_val(r32), ==, 0x40000000);
+    g_assert(float64_hardfloat(hardfloat_div, float64_one,
+                               make_float64(0x4008000000000000ull),
+                               &r64, &s));
+    g_assert_cmphex(float64_val(r64), ==, 0x3fd5555555555555ull);
+    g_assert_cmpint(get_float_exception_flags(&s), ==, float_flag_inexact);
+
+    /* subnormal input */
+    g_assert(!float32_hardfloat(hardfloat_mul, make_float32(0x00000001),
+                                float32_one, &r32, &s));
+    g_assert(!float64_hardfloat(hardfloat_mul, make_float64(1),
+                                float64_one, &r64, &s));
+    /* result at the bottom of the normal range */
+    g_assert(!float32_hardfloat(hardfloat_mul, make_float32(0x00800000),
+                                float32_one, &r32, &s));
+    g_assert(!float64_hardfloat(hardfloat_sub,
+                                make_float64(0x0020000000000000ull),
+                                make_float64(0x0018000000000000ull),
+                                &r64, &s));
+    /* other rounding modes */
+    set_float_rounding_mode(float_round_to_zero, &s);
+    g_assert(!float64_hardfloat(hardfloat_add, float64_one, float64_one,
+                                &r64, &s));
+}
+
+static void test_edge(void)
+{
+    int op;
+    size_t i, j;
+
+    for (op = hardfloat_add; op <= hardfloat_sqrt; op++) {
+        for (i = 0; i < ARRAY_SIZE(f32_edge); i++) {
+            for (j = 0; j < ARRAY_SIZE(f32_edge); j++) {
+                f32_check(op, f32_edge[i], f32_edge[j]);
+            }
+        }
+        for (i = 0; i < ARRAY_SIZE(f64_edge); i++) {
+            for (j = 0; j < ARRAY_SIZE(f64_edge); j++) {
+                f64_check(op, f64_edge[i], f64_edge[j]);
+            }
+        }
+    }
+}
+
+/* Random operands, half of them with exponents close to each other so
+ * that sums round and cancel in interesting ways.  */
+static void test_random(void)
+{
+    int n = g_test_thorough() ? 5000000 : 100000;
+    uint32_t a32, b32;
+    uint64_t a64, b64;
+    int i, op;
+
+    for (i = 0; i < n; i++) {
+        a32 = g_test_rand_int();
+        b32 = g_test_rand_int();
+        a64 = (uint64_t)g_test_rand_int() << 32 | (uint32_t)g_test_rand_int();
+        b64 = (uint64_t)g_test_rand_int() << 32 | (uint32_t)g_test_rand_int();
+        if (i & 1) {
+            b32 = (b32 & 0x80ffffff) | (a32 & 0x7f000000);
+            b64 = (b64 & 0x803fffffffffffffull) |
+                  (a64 & 0x7fc0000000000000ull);
+        }
+        for (op = hardfloat_add; op <= hardfloat_sqrt; op++) {
+            f32_check(op, a32, b32);
+            f64_check(op, a64, b64);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/softfloat/fast-path", test_fast_path_taken);
+    g_test_add_func("/softfloat/edge", test_edge);
+    g_test_add_func("/softfloat/random", test_random);
+    return g_test_run();
+}
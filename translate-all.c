@@ -55,11 +55,13 @@
 #endif
 #else
 #include "exec/address-spaces.h"
+#include "qmp-commands.h"
 #endif
 
 #include "exec/cputlb.h"
 #include "translate-all.h"
 #include "qemu/timer.h"
+#include "qemu/main-loop.h"
 
 //#define DEBUG_TB_INVALIDATE
 //#define DEBUG_FLUSH
@@ -126,6 +128,12 @@ static void *l1_map[V_L1_SIZE];
 /* code generation context */
 TCGContext tcg_ctx;
 
+/* executions of a TB before it is retranslated as a superblock, 0 = never */
+int tcg_superblock_threshold = TB_SUPERBLOCK_THRESHOLD;
+
+bool tcg_profiling;
+TBProfile tb_profile;
+
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2);
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr);
@@ -156,6 +164,7 @@ int cpu_gen_code(CPUArchState *env, TranslationBlock *tb, int *gen_code_size_ptr
     ti = profile_getclock();
 #endif
     tcg_func_start(s);
+    s->gen_profile = tb->cflags & CF_PROFILE;
 
     gen_intermediate_code(env, tb);
 
@@ -215,6 +224,8 @@ static int cpu_restore_state_from_tb(CPUState *cpu, TranslationBlock *tb,
     ti = profile_getclock();
 #endif
     tcg_func_start(s);
+    /* the code must come out the same as from cpu_gen_code() */
+    s->gen_profile = tb->cflags & CF_PROFILE;
 
     gen_intermediate_code_pc(env, tb);
 
@@ -260,10 +271,18 @@ static int cpu_restore_state_from_tb(CPUState *cpu, TranslationBlock *tb,
 bool cpu_restore_state(CPUState *cpu, uintptr_t retaddr)
 {
     TranslationBlock *tb;
+    int64_t ti = 0;
 
     tb = tb_find_pc(retaddr);
     if (tb) {
+        if (unlikely(tcg_profiling)) {
+            ti = get_clock();
+        }
         cpu_restore_state_from_tb(cpu, tb, retaddr);
+        if (unlikely(ti)) {
+            atomic_add(&tb_profile.restore_ns, get_clock() - ti);
+            atomic_inc(&tb_profile.restore_count);
+        }
         if (tb->cflags & CF_NOCACHE) {
             /* one-shot translation, invalidate it immediately */
             cpu->current_tb = NULL;
@@ -687,6 +706,79 @@ static inline void code_gen_alloc(size_t tb_size)
             g_malloc(tcg_ctx.code_gen_max_blocks * sizeof(TranslationBlock));
 }
 
+static void tb_regions_reset(void)
+{
+    TBContext *tb_ctx = &tcg_ctx.tb_ctx;
+    int i;
+
+    for (i = 0; i < tb_ctx->nb_regions; i++) {
+        tb_ctx->regions[i].end = tb_ctx->regions[i].start;
+        tb_ctx->regions[i].nb_tbs = 0;
+    }
+    tb_ctx->nb_tbs = 0;
+    tb_ctx->cur_region = 0;
+    tcg_ctx.code_gen_ptr = tb_ctx->regions[0].start;
+}
+
+/* Split the code buffer and the TB array into regions.  A region must
+   hold many TBs, or eviction would throw away hot code too often.  */
+static void tb_regions_init(void)
+{
+    TBContext *tb_ctx = &tcg_ctx.tb_ctx;
+    size_t slack = TCG_MAX_OP_SIZE * OPC_BUF_SIZE;
+    size_t size;
+    int i;
+
+    tb_ctx->nb_regions = MIN(CODE_GEN_MAX_REGIONS,
+                             tcg_ctx.code_gen_buffer_size / (slack * 4));
+    tb_ctx->nb_regions = MAX(tb_ctx->nb_regions, 1);
+    tb_ctx->region_size = (tcg_ctx.code_gen_buffer_size / tb_ctx->nb_regions)
+                          & ~(size_t)(CODE_GEN_ALIGN - 1);
+    tb_ctx->region_max_tbs = tcg_ctx.code_gen_max_blocks /
+                             tb_ctx->nb_regions;
+
+    for (i = 0; i < tb_ctx->nb_regions; i++) {
+        TBRegion *r = &tb_ctx->regions[i];
+
+        size = tb_ctx->region_size;
+        if (i == tb_ctx->nb_regions - 1) {
+            /* the last region takes the remainder */
+            size = tcg_ctx.code_gen_buffer_size - i * tb_ctx->region_size;
+        }
+        r->start = tcg_ctx.code_gen_buffer + i * tb_ctx->region_size;
+        r->max = r->start + size - slack;
+        r->tbs = tb_ctx->tbs + i * tb_ctx->region_max_tbs;
+    }
+    tb_regions_reset();
+}
+
+#if !defined(CONFIG_USER_ONLY) || defined(DEBUG_FLUSH)
+/* bytes of generated code in the buffer */
+static size_t tb_code_gen_size(void)
+{
+    TBContext *tb_ctx = &tcg_ctx.tb_ctx;
+    size_t size = 0;
+    int i;
+
+    for (i = 0; i < tb_ctx->nb_regions; i++) {
+        TBRegion *r = &tb_ctx->regions[i];
+
+        if (i == tb_ctx->cur_region) {
+            size += tcg_ctx.code_gen_ptr - r->start;
+        } else {
+            size += r->end - r->start;
+        }
+    }
+    return size;
+}
+#endif
+
+static void tb_htable_init(void)
+{
+    qht_init(&tcg_ctx.tb_ctx.htable, CODE_GEN_HTABLE_SIZE,
+             QHT_MODE_AUTO_RESIZE);
+}
+
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
    (in bytes) allocated to the translation buffer. Zero means default
    size. */
@@ -694,7 +786,8 @@ void tcg_exec_init(unsigned long tb_size)
 {
     cpu_gen_init();
     code_gen_alloc(tb_size);
-    tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
+    tb_htable_init();
+    tb_regions_init();
     tcg_register_jit(tcg_ctx.code_gen_buffer, tcg_ctx.code_gen_buffer_size);
     page_init();
 #if !defined(CONFIG_USER_ONLY) || !defined(CONFIG_USE_GUEST_BASE)
@@ -709,18 +802,21 @@ bool tcg_enabled(void)
     return tcg_ctx.code_gen_buffer != NULL;
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
+/* Allocate a new translation block in the current region.  Return NULL
+   if the region has too many translation blocks or too much generated
+   code. */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
+    TBContext *tb_ctx = &tcg_ctx.tb_ctx;
+    TBRegion *r = &tb_ctx->regions[tb_ctx->cur_region];
     TranslationBlock *tb;
 
-    if (tcg_ctx.tb_ctx.nb_tbs >= tcg_ctx.code_gen_max_blocks ||
-        (tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer) >=
-         tcg_ctx.code_gen_buffer_max_size) {
+    if (r->nb_tbs >= tb_ctx->region_max_tbs ||
+        tcg_ctx.code_gen_ptr >= r->max) {
         return NULL;
     }
-    tb = &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs++];
+    tb = &r->tbs[r->nb_tbs++];
+    tb_ctx->nb_tbs++;
     tb->pc = pc;
     tb->cflags = 0;
     return tb;
@@ -731,9 +827,11 @@ void tb_free(TranslationBlock *tb)
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (tcg_ctx.tb_ctx.nb_tbs > 0 &&
-            tb == &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs - 1]) {
+    TBRegion *r = &tcg_ctx.tb_ctx.regions[tcg_ctx.tb_ctx.cur_region];
+
+    if (r->nb_tbs > 0 && tb == &r->tbs[r->nb_tbs - 1]) {
         tcg_ctx.code_gen_ptr = tb->tc_ptr;
+        r->nb_tbs--;
         tcg_ctx.tb_ctx.nb_tbs--;
     }
 }
@@ -780,93 +878,125 @@ static void page_flush_tb(void)
     }
 }
 
+static __thread bool have_tb_lock;
+
+void tb_lock(void)
+{
+    assert(!have_tb_lock);
+#ifdef CONFIG_USER_ONLY
+    spin_lock(&tcg_ctx.tb_ctx.tb_lock);
+#else
+    if (qemu_tcg_mttcg_enabled()) {
+        qemu_mutex_lock_iothread();
+    }
+#endif
+    have_tb_lock = true;
+}
+
+void tb_unlock(void)
+{
+    assert(have_tb_lock);
+    have_tb_lock = false;
+#ifdef CONFIG_USER_ONLY
+    spin_unlock(&tcg_ctx.tb_ctx.tb_lock);
+#else
+    if (qemu_tcg_mttcg_enabled()) {
+        qemu_mutex_unlock_iothread();
+    }
+#endif
+}
+
+void tb_lock_reset(void)
+{
+    if (have_tb_lock) {
+        tb_unlock();
+    }
+}
+
 /* flush all the translation blocks */
-/* XXX: tb_flush is currently not thread safe */
+/* XXX: tb_flush is currently not thread safe; with multi-threaded TCG
+   it must only run through async_run_exclusive() */
 void tb_flush(CPUArchState *env1)
 {
     CPUState *cpu = ENV_GET_CPU(env1);
 
 #if defined(DEBUG_FLUSH)
     printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
-           (unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer),
+           (unsigned long)tb_code_gen_size(),
            tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.tb_ctx.nb_tbs > 0 ?
-           ((unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer)) /
-           tcg_ctx.tb_ctx.nb_tbs : 0);
+           (unsigned long)tb_code_gen_size() / tcg_ctx.tb_ctx.nb_tbs : 0);
 #endif
     if ((unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer)
         > tcg_ctx.code_gen_buffer_size) {
         cpu_abort(cpu, "Internal error: code buffer overflow\n");
     }
-    tcg_ctx.tb_ctx.nb_tbs = 0;
+    tb_regions_reset();
 
     CPU_FOREACH(cpu) {
         memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
     }
 
-    memset(tcg_ctx.tb_ctx.tb_phys_hash, 0, sizeof(tcg_ctx.tb_ctx.tb_phys_hash));
+    qht_reset_size(&tcg_ctx.tb_ctx.htable, CODE_GEN_HTABLE_SIZE);
     page_flush_tb();
 
-    tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     tcg_ctx.tb_ctx.tb_flush_count++;
 }
 
+static void tb_flush_exclusive(void *data)
+{
+    tb_flush(data);
+}
+
+/* flush all the translation blocks once no vCPU executes any of them.
+   Must be called with the iothread lock held. */
+void tb_flush_async(CPUArchState *env)
+{
+    async_run_exclusive(tb_flush_exclusive, env);
+}
+
 #ifdef DEBUG_TB_CHECK
 
-static void tb_invalidate_check(target_ulong address)
+static void do_tb_invalidate_check(QHT *ht, void *p, uint32_t hash,
+                                   void *userp)
 {
-    TranslationBlock *tb;
-    int i;
+    TranslationBlock *tb = p;
+    target_ulong addr = *(target_ulong *)userp;
 
-    address &= TARGET_PAGE_MASK;
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tb_ctx.tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
-            if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
-                  address >= tb->pc + tb->size)) {
-                printf("ERROR invalidate: address=" TARGET_FMT_lx
-                       " PC=%08lx size=%04x\n",
-                       address, (long)tb->pc, tb->size);
-            }
-        }
+    if (!(addr + TARGET_PAGE_SIZE <= tb->pc || addr >= tb->pc + tb->size)) {
+        printf("ERROR invalidate: address=" TARGET_FMT_lx
+               " PC=%08lx size=%04x\n", addr, (long)tb->pc, tb->size);
     }
 }
 
-/* verify that all the pages have correct rights for code */
-static void tb_page_check(void)
+static void tb_invalidate_check(target_ulong address)
 {
-    TranslationBlock *tb;
-    int i, flags1, flags2;
-
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tcg_ctx.tb_ctx.tb_phys_hash[i]; tb != NULL;
-                tb = tb->phys_hash_next) {
-            flags1 = page_get_flags(tb->pc);
-            flags2 = page_get_flags(tb->pc + tb->size - 1);
-            if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
-                printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
-                       (long)tb->pc, tb->size, flags1, flags2);
-            }
-        }
-    }
+    address &= TARGET_PAGE_MASK;
+    qht_iter(&tcg_ctx.tb_ctx.htable, do_tb_invalidate_check, &address);
 }
 
-#endif
-
-static inline void tb_hash_remove(TranslationBlock **ptb, TranslationBlock *tb)
+static void do_tb_page_check(QHT *ht, void *p, uint32_t hash, void *userp)
 {
-    TranslationBlock *tb1;
+    TranslationBlock *tb = p;
+    int flags1, flags2;
 
-    for (;;) {
-        tb1 = *ptb;
-        if (tb1 == tb) {
-            *ptb = tb1->phys_hash_next;
-            break;
-        }
-        ptb = &tb1->phys_hash_next;
+    flags1 = page_get_flags(tb->pc);
+    flags2 = page_get_flags(tb->pc + tb->size - 1);
+    if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
+        printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
+               (long)tb->pc, tb->size, flags1, flags2);
     }
 }
 
+/* verify that all the pages have correct rights for code */
+static void tb_page_check(void)
+{
+    qht_iter(&tcg_ctx.tb_ctx.htable, do_tb_page_check, NULL);
+}
+
+#endif
+
 static inline void tb_page_remove(TranslationBlock **ptb, TranslationBlock *tb)
 {
     TranslationBlock *tb1;
@@ -926,13 +1056,14 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     CPUState *cpu;
     PageDesc *p;
     unsigned int h, n1;
+    uint32_t hash;
     tb_page_addr_t phys_pc;
     TranslationBlock *tb1, *tb2;
 
     /* remove the TB from the hash list */
     phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
-    h = tb_phys_hash_func(phys_pc);
-    tb_hash_remove(&tcg_ctx.tb_ctx.tb_phys_hash[h], tb);
+    hash = tb_hash_func(phys_pc, tb->pc, tb->flags, tb->cs_base);
+    qht_remove(&tcg_ctx.tb_ctx.htable, tb, hash);
 
     /* remove the TB from the page list */
     if (tb->page_addr[0] != page_addr) {
@@ -947,6 +1078,8 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     }
 
     tcg_ctx.tb_ctx.tb_invalidated_flag = 1;
+    /* vCPU threads may still find the TB in their tb_jmp_cache */
+    atomic_or(&tb->cflags, CF_INVALID);
 
     /* remove the TB from the hash list */
     h = tb_jmp_cache_hash_func(tb->pc);
@@ -1034,6 +1167,45 @@ static void build_page_bitmap(PageDesc *p)
     }
 }
 
+/* Move on to the next region of the code buffer, evicting the TBs it
+   holds: they are the oldest translations in the buffer.  Jumps into them
+   from the other regions are unlinked by tb_phys_invalidate().  */
+static void tb_evict_region(void)
+{
+    TBContext *tb_ctx = &tcg_ctx.tb_ctx;
+    TBRegion *r = &tb_ctx->regions[tb_ctx->cur_region];
+    int i;
+
+    r->end = tcg_ctx.code_gen_ptr;
+    tb_ctx->cur_region = (tb_ctx->cur_region + 1) % tb_ctx->nb_regions;
+    r = &tb_ctx->regions[tb_ctx->cur_region];
+
+    for (i = 0; i < r->nb_tbs; i++) {
+        TranslationBlock *tb = &r->tbs[i];
+
+        /* TBs invalidated earlier are no longer in the page lists */
+        if (!(tb->cflags & CF_INVALID)) {
+            tb_phys_invalidate(tb, -1);
+            tb_ctx->tb_evict_count++;
+        }
+    }
+    tb_ctx->nb_tbs -= r->nb_tbs;
+    r->nb_tbs = 0;
+    r->end = r->start;
+    tcg_ctx.code_gen_ptr = r->start;
+    tb_ctx->region_evict_count++;
+}
+
+#if !defined(CONFIG_USER_ONLY)
+static bool tb_evict_queued;
+
+static void tb_evict_exclusive(void *data)
+{
+    tb_evict_queued = false;
+    tb_evict_region();
+}
+#endif
+
 TranslationBlock *tb_gen_code(CPUState *cpu,
                               target_ulong pc, target_ulong cs_base,
                               int flags, int cflags)
@@ -1043,15 +1215,33 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb_page_addr_t phys_pc, phys_page2;
     target_ulong virt_page2;
     int code_gen_size;
+    bool cached;
+    int64_t ti = 0;
 
     phys_pc = get_page_addr_code(env, pc);
     if (use_icount) {
         cflags |= CF_USE_ICOUNT;
     }
+    if (tcg_profiling) {
+        cflags |= CF_PROFILE;
+    }
     tb = tb_alloc(pc);
     if (!tb) {
-        /* flush must be done */
-        tb_flush(env);
+#if !defined(CONFIG_USER_ONLY)
+        if (qemu_tcg_mttcg_enabled()) {
+            /* Other vCPUs may be running code of the region to evict, so
+               the eviction waits until they are all out of cpu_exec().
+               Leave too and look the TB up again afterwards.  */
+            if (!tb_evict_queued) {
+                tb_evict_queued = true;
+                async_run_exclusive(tb_evict_exclusive, NULL);
+            }
+            cpu->exception_index = EXCP_INTERRUPT;
+            cpu_loop_exit(cpu);
+        }
+#endif
+        /* make room by evicting the oldest region */
+        tb_evict_region();
         /* cannot fail at this point */
         tb = tb_alloc(pc);
         /* Don't forget to invalidate previous TB info.  */
@@ -1061,7 +1251,20 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
-    cpu_gen_code(env, tb, &code_gen_size);
+    tb->hot_count = tcg_superblock_threshold;
+    tb->exec_count = 0;
+    if (cflags & CF_PROFILE) {
+        ti = get_clock();
+    }
+    cached = tb_cache_load(cpu, tb, phys_pc, &code_gen_size);
+    if (!cached) {
+        cpu_gen_code(env, tb, &code_gen_size);
+    }
+    if (cflags & CF_PROFILE) {
+        tb->gen_ns = get_clock() - ti;
+        tb_profile.gen_count++;
+        tb_profile.gen_ns += tb->gen_ns;
+    }
     tcg_ctx.code_gen_ptr = (void *)(((uintptr_t)tcg_ctx.code_gen_ptr +
             code_gen_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
 
@@ -1071,10 +1274,36 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     if ((pc & TARGET_PAGE_MASK) != virt_page2) {
         phys_page2 = get_page_addr_code(env, virt_page2);
     }
+    if (!cached && phys_page2 == -1) {
+        tb_cache_add(cpu, tb, phys_pc, code_gen_size);
+    }
     tb_link_page(tb, phys_pc, phys_page2);
     return tb;
 }
 
+/* Replace @tb, which has become hot, with a superblock translated from the
+   same pc.  Called from the code of @tb before any of its instructions has
+   run; returns false if another vCPU got there first.  */
+bool tb_gen_superblock(CPUState *cpu, TranslationBlock *tb)
+{
+    target_ulong pc, cs_base;
+    uint64_t flags;
+    bool ret = false;
+
+    tb_lock();
+    if (!(tb->cflags & (CF_INVALID | CF_SUPERBLOCK))) {
+        pc = tb->pc;
+        cs_base = tb->cs_base;
+        flags = tb->flags;
+        tb_phys_invalidate(tb, -1);
+        tb_gen_code(cpu, pc, cs_base, flags, CF_SUPERBLOCK);
+        tcg_ctx.tb_ctx.superblock_count++;
+        ret = true;
+    }
+    tb_unlock();
+    return ret;
+}
+
 /*
  * Invalidate all TBs which intersect with the target physical address range
  * [start;end[. NOTE: start and end may refer to *different* physical pages.
@@ -1380,17 +1609,11 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2)
 {
-    unsigned int h;
-    TranslationBlock **ptb;
+    uint32_t h;
 
     /* Grab the mmap lock to stop another thread invalidating this TB
        before we are done.  */
     mmap_lock();
-    /* add in the physical hash table */
-    h = tb_phys_hash_func(phys_pc);
-    ptb = &tcg_ctx.tb_ctx.tb_phys_hash[h];
-    tb->phys_hash_next = *ptb;
-    *ptb = tb;
 
     /* add in the page list */
     tb_alloc_page(tb, 0, phys_pc & TARGET_PAGE_MASK);
@@ -1412,6 +1635,11 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
         tb_reset_jump(tb, 1);
     }
 
+    /* add in the hash table last: lock-free lookups may find the TB as
+       soon as it is inserted */
+    h = tb_hash_func(phys_pc, tb->pc, tb->flags, tb->cs_base);
+    qht_insert(&tcg_ctx.tb_ctx.htable, tb, h);
+
 #ifdef DEBUG_TB_CHECK
     tb_page_check();
 #endif
@@ -1422,23 +1650,32 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
    tb[1].tc_ptr. Return NULL if not found */
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
 {
+    TBContext *tb_ctx = &tcg_ctx.tb_ctx;
+    TBRegion *r;
     int m_min, m_max, m;
     uintptr_t v;
     TranslationBlock *tb;
 
-    if (tcg_ctx.tb_ctx.nb_tbs <= 0) {
+    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer ||
+        tc_ptr >= (uintptr_t)tcg_ctx.code_gen_buffer +
+                  tcg_ctx.code_gen_buffer_size) {
         return NULL;
     }
-    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer ||
-        tc_ptr >= (uintptr_t)tcg_ctx.code_gen_ptr) {
+    m = (tc_ptr - (uintptr_t)tcg_ctx.code_gen_buffer) / tb_ctx->region_size;
+    r = &tb_ctx->regions[MIN(m, tb_ctx->nb_regions - 1)];
+    if (r->nb_tbs <= 0) {
+        return NULL;
+    }
+    if (tc_ptr >= (uintptr_t)(r == &tb_ctx->regions[tb_ctx->cur_region] ?
+                              tcg_ctx.code_gen_ptr : r->end)) {
         return NULL;
     }
     /* binary search (cf Knuth) */
     m_min = 0;
-    m_max = tcg_ctx.tb_ctx.nb_tbs - 1;
+    m_max = r->nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tcg_ctx.tb_ctx.tbs[m];
+        tb = &r->tbs[m];
         v = (uintptr_t)tb->tc_ptr;
         if (v == tc_ptr) {
             return tb;
@@ -1448,7 +1685,7 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
             m_min = m + 1;
         }
     }
-    return &tcg_ctx.tb_ctx.tbs[m_max];
+    return &r->tbs[m_max];
 }
 
 #if !defined(CONFIG_USER_ONLY)
@@ -1593,49 +1830,54 @@ void tb_flush_jmp_cache(CPUState *cpu, target_ulong addr)
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
-    int i, target_code_size, max_target_code_size;
+    TBContext *tb_ctx = &tcg_ctx.tb_ctx;
+    int i, j, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    size_t code_gen_size = tb_code_gen_size();
     TranslationBlock *tb;
+    QHTStats hst;
 
     target_code_size = 0;
     max_target_code_size = 0;
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for (i = 0; i < tcg_ctx.tb_ctx.nb_tbs; i++) {
-        tb = &tcg_ctx.tb_ctx.tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size) {
-            max_target_code_size = tb->size;
-        }
-        if (tb->page_addr[1] != -1) {
-            cross_page++;
-        }
-        if (tb->tb_next_offset[0] != 0xffff) {
-            direct_jmp_count++;
-            if (tb->tb_next_offset[1] != 0xffff) {
-                direct_jmp2_count++;
+    for (j = 0; j < tb_ctx->nb_regions; j++) {
+        for (i = 0; i < tb_ctx->regions[j].nb_tbs; i++) {
+            tb = &tb_ctx->regions[j].tbs[i];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size) {
+                max_target_code_size = tb->size;
+            }
+            if (tb->page_addr[1] != -1) {
+                cross_page++;
+            }
+            if (tb->tb_next_offset[0] != 0xffff) {
+                direct_jmp_count++;
+                if (tb->tb_next_offset[1] != 0xffff) {
+                    direct_jmp2_count++;
+                }
             }
         }
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
-    cpu_fprintf(f, "gen code size       %td/%zd\n",
-                tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer,
-                tcg_ctx.code_gen_buffer_max_size);
+    cpu_fprintf(f, "gen code size       %zd/%zd\n",
+                code_gen_size, tcg_ctx.code_gen_buffer_max_size);
+    cpu_fprintf(f, "code regions        %d of %zd bytes (current %d)\n",
+                tb_ctx->nb_regions, tb_ctx->region_size,
+                tb_ctx->cur_region);
     cpu_fprintf(f, "TB count            %d/%d\n",
             tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.code_gen_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
             tcg_ctx.tb_ctx.nb_tbs ? target_code_size /
                     tcg_ctx.tb_ctx.nb_tbs : 0,
             max_target_code_size);
-    cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-            tcg_ctx.tb_ctx.nb_tbs ? (tcg_ctx.code_gen_ptr -
-                                     tcg_ctx.code_gen_buffer) /
-                                     tcg_ctx.tb_ctx.nb_tbs : 0,
-                target_code_size ? (double) (tcg_ctx.code_gen_ptr -
-                                             tcg_ctx.code_gen_buffer) /
-                                             target_code_size : 0);
+    cpu_fprintf(f, "TB avg host size    %zd bytes (expansion ratio: %0.1f)\n",
+            tcg_ctx.tb_ctx.nb_tbs ? code_gen_size /
+                                    tcg_ctx.tb_ctx.nb_tbs : 0,
+                target_code_size ? (double) code_gen_size /
+                                            target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n", cross_page,
             tcg_ctx.tb_ctx.nb_tbs ? (cross_page * 100) /
                                     tcg_ctx.tb_ctx.nb_tbs : 0);
@@ -1646,11 +1888,25 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                 direct_jmp2_count,
                 tcg_ctx.tb_ctx.nb_tbs ? (direct_jmp2_count * 100) /
                         tcg_ctx.tb_ctx.nb_tbs : 0);
+
+    qht_statistics(&tcg_ctx.tb_ctx.htable, &hst);
+    cpu_fprintf(f, "TB hash buckets     %zu/%zu (%0.1f%% head buckets used)\n",
+                hst.used_head_buckets, hst.head_buckets,
+                hst.head_buckets ?
+                (double)hst.used_head_buckets * 100 / hst.head_buckets : 0);
+    cpu_fprintf(f, "TB hash occupancy   %0.1f%% avg chain occ., "
+                "avg chain %0.2f max=%zu buckets\n",
+                hst.occupancy * 100, hst.avg_chain, hst.max_chain);
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tcg_ctx.tb_ctx.tb_flush_count);
     cpu_fprintf(f, "TB invalidate count %d\n",
             tcg_ctx.tb_ctx.tb_phys_invalidate_count);
+    cpu_fprintf(f, "region evict count  %d (%d TBs evicted)\n",
+            tcg_ctx.tb_ctx.region_evict_count, tcg_ctx.tb_ctx.tb_evict_count);
+    cpu_fprintf(f, "superblock count    %d\n",
+            tcg_ctx.tb_ctx.superblock_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    tb_cache_dump_info(f, cpu_fprintf);
     tcg_dump_info(f, cpu_fprintf);
 }
 
@@ -1659,6 +1915,177 @@ void dump_opcount_info(FILE *f, fprintf_function cpu_fprintf)
     tcg_dump_op_count(f, cpu_fprintf);
 }
 
+static void tb_profile_set(void *data)
+{
+    tcg_profiling = (uintptr_t)data;
+    if (tcg_profiling) {
+        memset(&tb_profile, 0, sizeof(tb_profile));
+        tcg_profile_reset_helpers();
+    }
+    /* retranslate everything with or without the counters */
+    tb_flush(first_cpu->env_ptr);
+}
+
+void qmp_tcg_profile(bool enable, Error **errp)
+{
+    if (!tcg_enabled()) {
+        error_setg(errp, "the TCG profiler needs the TCG accelerator");
+        return;
+    }
+    async_run_exclusive(tb_profile_set, (void *)(uintptr_t)enable);
+}
+
+/* The target_disas() flags for the guest code of @tb */
+static int tb_disas_flags(TranslationBlock *tb)
+{
+#if defined(TARGET_I386)
+    if (tb->flags & HF_CS64_MASK) {
+        return 2;
+    }
+    return !(tb->flags & HF_CS32_MASK);
+#elif defined(TARGET_ARM)
+    if (ARM_TBFLAG_AARCH64_STATE(tb->flags)) {
+        return 4;
+    }
+    return ARM_TBFLAG_THUMB(tb->flags) | ARM_TBFLAG_BSWAP_CODE(tb->flags) << 1;
+#else
+    return 0;
+#endif
+}
+
+/* Execution counts are copied, since other vCPUs keep updating them */
+typedef struct TBProfileBlock {
+    TranslationBlock *tb;
+    uint64_t exec_count;
+    size_t host_size;
+} TBProfileBlock;
+
+static int tb_profile_block_cmp(const void *a, const void *b)
+{
+    const TBProfileBlock *pa = a;
+    const TBProfileBlock *pb = b;
+
+    if (pa->exec_count != pb->exec_count) {
+        return pa->exec_count < pb->exec_count ? 1 : -1;
+    }
+    return 0;
+}
+
+typedef struct TBProfileHelper {
+    const char *name;
+    uint64_t calls;
+} TBProfileHelper;
+
+static void tb_profile_add_helper(const char *name, uint64_t calls,
+                                  void *opaque)
+{
+    TBProfileHelper h = { .name = name, .calls = calls };
+
+    g_array_append_val((GArray *)opaque, h);
+}
+
+static int tb_profile_helper_cmp(const void *a, const void *b)
+{
+    const TBProfileHelper *ha = a;
+    const TBProfileHelper *hb = b;
+
+    if (ha->calls != hb->calls) {
+        return ha->calls < hb->calls ? 1 : -1;
+    }
+    return strcmp(ha->name, hb->name);
+}
+
+TcgProfileInfo *qmp_query_tcg_profile(bool has_blocks, int64_t blocks,
+                                      Error **errp)
+{
+    TBContext *tb_ctx = &tcg_ctx.tb_ctx;
+    TcgProfileInfo *info;
+    TBProfileBlock *pb;
+    GArray *helpers;
+    int i, j, n;
+
+    if (!has_blocks) {
+        blocks = 10;
+    }
+    if (blocks < 0) {
+        error_setg(errp, "the number of blocks must not be negative");
+        return NULL;
+    }
+
+    info = g_new0(TcgProfileInfo, 1);
+    info->enabled = tcg_profiling;
+    info->translations = tb_profile.gen_count;
+    info->translation_time = tb_profile.gen_ns;
+    info->tlb_fills = tb_profile.tlb_fill_count;
+    info->tlb_fill_faults = tb_profile.tlb_fill_count -
+                            tb_profile.tlb_fill_done;
+    info->tlb_fill_time = tb_profile.tlb_fill_ns;
+    info->restores = tb_profile.restore_count;
+    info->restore_time = tb_profile.restore_ns;
+
+    /* TBs are only added with the iothread lock held, like tb_lock */
+    n = 0;
+    for (j = 0; j < tb_ctx->nb_regions; j++) {
+        n += tb_ctx->regions[j].nb_tbs;
+    }
+    pb = g_new(TBProfileBlock, n);
+    n = 0;
+    for (j = 0; j < tb_ctx->nb_regions; j++) {
+        TBRegion *r = &tb_ctx->regions[j];
+        void *end = j == tb_ctx->cur_region ? tcg_ctx.code_gen_ptr : r->end;
+
+        for (i = 0; i < r->nb_tbs; i++) {
+            TranslationBlock *tb = &r->tbs[i];
+            uint64_t count = tb->exec_count;
+            void *next = i + 1 < r->nb_tbs ? r->tbs[i + 1].tc_ptr : end;
+
+            if ((tb->cflags & (CF_PROFILE | CF_INVALID)) != CF_PROFILE ||
+                count == 0) {
+                continue;
+            }
+            pb[n].tb = tb;
+            pb[n].exec_count = count;
+            pb[n].host_size = next - tb->tc_ptr;
+            n++;
+        }
+    }
+    qsort(pb, n, sizeof(*pb), tb_profile_block_cmp);
+    for (i = MIN(n, blocks) - 1; i >= 0; i--) {
+        TranslationBlock *tb = pb[i].tb;
+        TcgProfileBlockList *entry = g_new0(TcgProfileBlockList, 1);
+
+        entry->value = g_new0(TcgProfileBlock, 1);
+        entry->value->pc = tb->pc;
+        entry->value->size = tb->size;
+        entry->value->host_size = pb[i].host_size;
+        entry->value->exec_count = pb[i].exec_count;
+        entry->value->translation_time = tb->gen_ns;
+        entry->value->disassembly =
+            target_disas_str(first_cpu->env_ptr, tb->pc, tb->size,
+                             tb_disas_flags(tb));
+        entry->next = info->blocks;
+        info->blocks = entry;
+    }
+    g_free(pb);
+
+    helpers = g_array_new(false, false, sizeof(TBProfileHelper));
+    tcg_profile_helpers(tb_profile_add_helper, helpers);
+    g_array_sort(helpers, tb_profile_helper_cmp);
+    for (i = helpers->len - 1; i >= 0; i--) {
+        TBProfileHelper *h = &g_array_index(helpers, TBProfileHelper, i);
+        TcgProfileHelperList *entry = g_new0(TcgProfileHelperList, 1);
+
+        entry->value = g_new0(TcgProfileHelper, 1);
+        entry->value->name = g_strdup(h->name);
+        entry->value->calls = h->calls;
+        entry->next = info->helpers;
+        info->helpers = entry;
+    }
+    g_array_free(helpers, true);
+
+    return info;
+}
+
 #else /* CONFIG_USER_ONLY */
 
 void cpu_interrupt(CPUState *cpu, int mask)
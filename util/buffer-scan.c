@@ -0,0 +1,413 @@
+/*
+ * Zero detection and comparison of memory buffers
+ *
+ * Copyright (c) 2006 Fabrice Bellard
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Every scan comes in three flavours: a portable one working on 64-bit
+ * words, an SSE2 one that is always available on x86-64 hosts and an AVX2
+ * one that is picked at startup if the CPU and the OS support it.  All of
+ * them accept any length and alignment and return exact byte offsets, so
+ * callers don't need to care which one runs.
+ */
+
+#include "qemu-common.h"
+#include "qemu/bswap.h"
+#include "qemu/host-utils.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+typedef struct BufferScanAccel {
+    size_t (*find_nonzero)(const void *buf, size_t len);
+    size_t (*find_diff)(const void *a, const void *b, size_t len);
+    size_t (*find_same)(const void *a, const void *b, size_t len);
+} BufferScanAccel;
+
+#define ONES64  0x0101010101010101ULL
+#define HIGHS64 0x8080808080808080ULL
+
+/* Non-zero iff one of the bytes of @x is zero */
+static inline uint64_t haszero64(uint64_t x)
+{
+    return (x - ONES64) & ~x & HIGHS64;
+}
+
+static size_t find_nonzero_generic(const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        if (ldq_he_p(p + i) | ldq_he_p(p + i + 8) |
+            ldq_he_p(p + i + 16) | ldq_he_p(p + i + 24)) {
+            break;
+        }
+    }
+    for (; i + 8 <= len; i += 8) {
+        if (ldq_he_p(p + i)) {
+            break;
+        }
+    }
+    while (i < len && !p[i]) {
+        i++;
+    }
+    return i;
+}
+
+static size_t find_diff_generic(const void *a, const void *b, size_t len)
+{
+    const uint8_t *pa = a, *pb = b;
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        if ((ldq_he_p(pa + i) ^ ldq_he_p(pb + i)) |
+            (ldq_he_p(pa + i + 8) ^ ldq_he_p(pb + i + 8)) |
+            (ldq_he_p(pa + i + 16) ^ ldq_he_p(pb + i + 16)) |
+            (ldq_he_p(pa + i + 24) ^ ldq_he_p(pb + i + 24))) {
+            break;
+        }
+    }
+    for (; i + 8 <= len; i += 8) {
+        if (ldq_he_p(pa + i) != ldq_he_p(pb + i)) {
+            break;
+        }
+    }
+    while (i < len && pa[i] == pb[i]) {
+        i++;
+    }
+    return i;
+}
+
+static size_t find_same_generic(const void *a, const void *b, size_t len)
+{
+    const uint8_t *pa = a, *pb = b;
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        if (haszero64(ldq_he_p(pa + i) ^ ldq_he_p(pb + i))) {
+            break;
+        }
+    }
+    while (i < len && pa[i] != pb[i]) {
+        i++;
+    }
+    return i;
+}
+
+#ifdef __SSE2__
+#define LOAD128(p) _mm_loadu_si128((const __m128i *)(p))
+
+static size_t find_nonzero_sse2(const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 64 <= len; i += 64) {
+        __m128i t = _mm_or_si128(_mm_or_si128(LOAD128(p + i),
+                                              LOAD128(p + i + 16)),
+                                 _mm_or_si128(LOAD128(p + i + 32),
+                                              LOAD128(p + i + 48)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(t, zero)) != 0xffff) {
+            break;
+        }
+    }
+    for (; i + 16 <= len; i += 16) {
+        unsigned m = _mm_movemask_epi8(_mm_cmpeq_epi8(LOAD128(p + i), zero));
+        if (m != 0xffff) {
+            return i + ctz32(~m);
+        }
+    }
+    return i + find_nonzero_generic(p + i, len - i);
+}
+
+static size_t find_diff_sse2(const void *a, const void *b, size_t len)
+{
+    const uint8_t *pa = a, *pb = b;
+    size_t i = 0;
+
+    for (; i + 64 <= len; i += 64) {
+        __m128i e0 = _mm_cmpeq_epi8(LOAD128(pa + i), LOAD128(pb + i));
+        __m128i e1 = _mm_cmpeq_epi8(LOAD128(pa + i + 16),
+                                    LOAD128(pb + i + 16));
+        __m128i e2 = _mm_cmpeq_epi8(LOAD128(pa + i + 32),
+                                    LOAD128(pb + i + 32));
+        __m128i e3 = _mm_cmpeq_epi8(LOAD128(pa + i + 48),
+                                    LOAD128(pb + i + 48));
+        __m128i t = _mm_and_si128(_mm_and_si128(e0, e1),
+                                  _mm_and_si128(e2, e3));
+        if (_mm_movemask_epi8(t) != 0xffff) {
+            break;
+        }
+    }
+    for (; i + 16 <= len; i += 16) {
+        unsigned m = _mm_movemask_epi8(_mm_cmpeq_epi8(LOAD128(pa + i),
+                                                      LOAD128(pb + i)));
+        if (m != 0xffff) {
+            return i + ctz32(~m);
+        }
+    }
+    return i + find_diff_generic(pa + i, pb + i, len - i);
+}
+
+static size_t find_same_sse2(const void *a, const void *b, size_t len)
+{
+    const uint8_t *pa = a, *pb = b;
+    size_t i = 0;
+
+    for (; i + 64 <= len; i += 64) {
+        __m128i e0 = _mm_cmpeq_epi8(LOAD128(pa + i), LOAD128(pb + i));
+        __m128i e1 = _mm_cmpeq_epi8(LOAD128(pa + i + 16),
+                                    LOAD128(pb + i + 16));
+        __m128i e2 = _mm_cmpeq_epi8(LOAD128(pa + i + 32),
+                                    LOAD128(pb + i + 32));
+        __m128i e3 = _mm_cmpeq_epi8(LOAD128(pa + i + 48),
+                                    LOAD128(pb + i + 48));
+        __m128i t = _mm_or_si128(_mm_or_si128(e0, e1),
+                                 _mm_or_si128(e2, e3));
+        if (_mm_movemask_epi8(t)) {
+            break;
+        }
+    }
+    for (; i + 16 <= len; i += 16) {
+        unsigned m = _mm_movemask_epi8(_mm_cmpeq_epi8(LOAD128(pa + i),
+                                                      LOAD128(pb + i)));
+        if (m) {
+            return i + ctz32(m);
+        }
+    }
+    return i + find_same_generic(pa + i, pb + i, len - i);
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+/* Older <cpuid.h> lack these */
+#ifndef bit_OSXSAVE
+#define bit_OSXSAVE (1 << 27)
+#endif
+#ifndef bit_AVX
+#define bit_AVX     (1 << 28)
+#endif
+#ifndef bit_AVX2
+#define bit_AVX2    (1 << 5)
+#endif
+
+#define LOAD256(p) _mm256_loadu_si256((const __m256i *)(p))
+
+static bool buffer_scan_have_avx2(void)
+{
+    unsigned a, b, c, d;
+    uint32_t lo, hi;
+
+    /* the OS must save the YMM state, see xgetbv below */
+    if (__get_cpuid_max(0, 0) < 7) {
+        return false;
+    }
+    __cpuid(1, a, b, c, d);
+    if (!(c & bit_OSXSAVE) || !(c & bit_AVX)) {
+        return false;
+    }
+    asm volatile("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+    if ((lo & 6) != 6) {
+        return false;
+    }
+    __cpuid_count(7, 0, a, b, c, d);
+    return b & bit_AVX2;
+}
+
+static size_t __attribute__((target("avx2")))
+find_nonzero_avx2(const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 128 <= len; i += 128) {
+        __m256i t = _mm256_or_si256(_mm256_or_si256(LOAD256(p + i),
+                                                    LOAD256(p + i + 32)),
+                                    _mm256_or_si256(LOAD256(p + i + 64),
+                                                    LOAD256(p + i + 96)));
+        if (!_mm256_testz_si256(t, t)) {
+            break;
+        }
+    }
+    for (; i + 32 <= len; i += 32) {
+        uint32_t m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(LOAD256(p + i),
+                                                            zero));
+        if (m != 0xffffffff) {
+            return i + ctz32(~m);
+        }
+    }
+    return i + find_nonzero_generic(p + i, len - i);
+}
+
+static size_t __attribute__((target("avx2")))
+find_diff_avx2(const void *a, const void *b, size_t len)
+{
+    const uint8_t *pa = a, *pb = b;
+    size_t i = 0;
+
+    for (; i + 128 <= len; i += 128) {
+        __m256i x0 = _mm256_xor_si256(LOAD256(pa + i), LOAD256(pb + i));
+        __m256i x1 = _mm256_xor_si256(LOAD256(pa + i + 32),
+                                      LOAD256(pb + i + 32));
+        __m256i x2 = _mm256_xor_si256(LOAD256(pa + i + 64),
+                                      LOAD256(pb + i + 64));
+        __m256i x3 = _mm256_xor_si256(LOAD256(pa + i + 96),
+                                      LOAD256(pb + i + 96));
+        __m256i t = _mm256_or_si256(_mm256_or_si256(x0, x1),
+                                    _mm256_or_si256(x2, x3));
+        if (!_mm256_testz_si256(t, t)) {
+            break;
+        }
+    }
+    for (; i + 32 <= len; i += 32) {
+        uint32_t m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(LOAD256(pa + i),
+                                                            LOAD256(pb + i)));
+        if (m != 0xffffffff) {
+            return i + ctz32(~m);
+        }
+    }
+    return i + find_diff_generic(pa + i, pb + i, len - i);
+}
+
+static size_t __attribute__((target("avx2")))
+find_same_avx2(const void *a, const void *b, size_t len)
+{
+    const uint8_t *pa = a, *pb = b;
+    size_t i = 0;
+
+    for (; i + 128 <= len; i += 128) {
+        __m256i e0 = _mm256_cmpeq_epi8(LOAD256(pa + i), LOAD256(pb + i));
+        __m256i e1 = _mm256_cmpeq_epi8(LOAD256(pa + i + 32),
+                                       LOAD256(pb + i + 32));
+        __m256i e2 = _mm256_cmpeq_epi8(LOAD256(pa + i + 64),
+                                       LOAD256(pb + i + 64));
+        __m256i e3 = _mm256_cmpeq_epi8(LOAD256(pa + i + 96),
+                                       LOAD256(pb + i + 96));
+        __m256i t = _mm256_or_si256(_mm256_or_si256(e0, e1),
+                                    _mm256_or_si256(e2, e3));
+        if (!_mm256_testz_si256(t, t)) {
+            break;
+        }
+    }
+    for (; i + 32 <= len; i += 32) {
+        uint32_t m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(LOAD256(pa + i),
+                                                            LOAD256(pb + i)));
+        if (m) {
+            return i + ctz32(m);
+        }
+    }
+    return i + find_same_generic(pa + i, pb + i, len - i);
+}
+#endif
+
+/* Fastest first, the portable one last; entries the host can't run are
+ * skipped at startup */
+static const BufferScanAccel buffer_scan_accels[] = {
+#ifdef CONFIG_AVX2_OPT
+    { find_nonzero_avx2, find_diff_avx2, find_same_avx2 },
+#endif
+#ifdef __SSE2__
+    { find_nonzero_sse2, find_diff_sse2, find_same_sse2 },
+#endif
+    { find_nonzero_generic, find_diff_generic, find_same_generic },
+};
+
+static unsigned buffer_scan_best;
+/* Until buffer_scan_init() has checked what the host supports */
+static const BufferScanAccel *buffer_scan =
+    &buffer_scan_accels[ARRAY_SIZE(buffer_scan_accels) - 1];
+
+static void __attribute__((constructor)) buffer_scan_init(void)
+{
+#ifdef CONFIG_AVX2_OPT
+    if (!buffer_scan_have_avx2()) {
+        buffer_scan_best++;
+    }
+#endif
+    buffer_scan = &buffer_scan_accels[buffer_scan_best];
+}
+
+/*
+ * Switches to the next slower implementation, for testing.  Returns false,
+ * after going back to the fastest one, once the portable one was in use.
+ */
+bool buffer_scan_next_accel(void)
+{
+    if (++buffer_scan == &buffer_scan_accels[ARRAY_SIZE(buffer_scan_accels)]) {
+        buffer_scan = &buffer_scan_accels[buffer_scan_best];
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Returns the offset of the first non-zero byte of the buffer, or len if the
+ * buffer is all zero.
+ */
+size_t buffer_find_nonzero_offset(const void *buf, size_t len)
+{
+    return buffer_scan->find_nonzero(buf, len);
+}
+
+/*
+ * Checks if a buffer is all zeroes
+ */
+bool buffer_is_zero(const void *buf, size_t len)
+{
+    /* most non-zero buffers already differ in the first word */
+    if (len >= sizeof(uint64_t) && ldq_he_p(buf)) {
+        return false;
+    }
+    return buffer_scan->find_nonzero(buf, len) == len;
+}
+
+/*
+ * Returns the offset of the first byte that differs between a and b, or len
+ * if the buffers are equal.
+ */
+size_t buffer_find_diff(const void *a, const void *b, size_t len)
+{
+    return buffer_scan->find_diff(a, b, len);
+}
+
+/*
+ * Returns the offset of the first byte that is the same in a and b, or len
+ * if the buffers differ at every offset.
+ */
+size_t buffer_find_same(const void *a, const void *b, size_t len)
+{
+    return buffer_scan->find_same(a, b, len);
+}
+
+bool buffer_is_equal(const void *a, const void *b, size_t len)
+{
+    return buffer_scan->find_diff(a, b, len) == len;
+}
@@ -0,0 +1,557 @@
+/*
+ * QHT: a resizable hash table with lock-free lookups
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include <assert.h>
+#include "qemu/qht.h"
+#include "qemu/atomic.h"
+#include "qemu/rcu.h"
+
+/* A bucket fills exactly one cache line on the common hosts, so that a
+ * lookup that does not overflow costs a single cache miss. */
+#define QHT_BUCKET_ALIGN 64
+
+#if HOST_LONG_BITS == 32
+#define QHT_BUCKET_ENTRIES 6
+#else
+#define QHT_BUCKET_ENTRIES 4
+#endif
+
+/* With auto-resize, the table is doubled once the number of overflow
+ * buckets exceeds 1/QHT_ADDED_BUCKETS_THRESHOLD_DIV of the head buckets. */
+#define QHT_ADDED_BUCKETS_THRESHOLD_DIV 8
+
+/* Entries of a chain are kept packed at its front: the first empty slot
+ * ends the chain.  The sequence count of the head bucket covers the whole
+ * chain; the lock of the head bucket serializes its writers. */
+typedef struct QHTBucket {
+    int lock;
+    unsigned sequence;
+    uint32_t hashes[QHT_BUCKET_ENTRIES];
+    void *pointers[QHT_BUCKET_ENTRIES];
+    struct QHTBucket *next;
+} __attribute__((aligned(QHT_BUCKET_ALIGN))) QHTBucket;
+
+struct QHTMap {
+    struct rcu_head rcu;
+    QHTBucket *buckets;
+    size_t n_buckets;
+    size_t n_added_buckets;
+    size_t n_added_buckets_threshold;
+};
+
+static inline void qht_bucket_lock(QHTBucket *b)
+{
+    while (atomic_xchg(&b->lock, 1)) {
+        while (atomic_read(&b->lock)) {
+            /* spin */
+        }
+    }
+}
+
+static inline void qht_bucket_unlock(QHTBucket *b)
+{
+    smp_mb();
+    atomic_set(&b->lock, 0);
+}
+
+static inline void qht_bucket_write_begin(QHTBucket *b)
+{
+    atomic_set(&b->sequence, b->sequence + 1);
+    smp_wmb();
+}
+
+static inline void qht_bucket_write_end(QHTBucket *b)
+{
+    smp_wmb();
+    atomic_set(&b->sequence, b->sequence + 1);
+}
+
+static inline unsigned qht_bucket_read_begin(QHTBucket *b)
+{
+    /* Always fail if a write is in progress.  */
+    unsigned ret = atomic_read(&b->sequence) & ~1;
+
+    smp_rmb();
+    return ret;
+}
+
+static inline bool qht_bucket_read_retry(QHTBucket *b, unsigned start)
+{
+    smp_rmb();
+    return unlikely(atomic_read(&b->sequence) != start);
+}
+
+static inline QHTBucket *qht_map_to_bucket(QHTMap *map, uint32_t hash)
+{
+    return &map->buckets[hash & (map->n_buckets - 1)];
+}
+
+static inline bool qht_map_needs_resize(QHTMap *map)
+{
+    return atomic_read(&map->n_added_buckets) >
+           map->n_added_buckets_threshold;
+}
+
+static size_t qht_elems_to_buckets(size_t n_elems)
+{
+    return pow2ceil(MAX(n_elems / QHT_BUCKET_ENTRIES, 1));
+}
+
+static QHTMap *qht_map_create(size_t n_buckets)
+{
+    QHTMap *map = g_new0(QHTMap, 1);
+
+    map->n_buckets = n_buckets;
+    map->n_added_buckets_threshold =
+        MAX(n_buckets / QHT_ADDED_BUCKETS_THRESHOLD_DIV, 1);
+    map->buckets = qemu_memalign(QHT_BUCKET_ALIGN,
+                                 n_buckets * sizeof(QHTBucket));
+    memset(map->buckets, 0, n_buckets * sizeof(QHTBucket));
+    return map;
+}
+
+static void qht_map_destroy(QHTMap *map)
+{
+    size_t i;
+
+    for (i = 0; i < map->n_buckets; i++) {
+        QHTBucket *b = map->buckets[i].next;
+
+        while (b) {
+            QHTBucket *next = b->next;
+
+            qemu_vfree(b);
+            b = next;
+        }
+    }
+    qemu_vfree(map->buckets);
+    g_free(map);
+}
+
+static void qht_map_lock_buckets(QHTMap *map)
+{
+    size_t i;
+
+    for (i = 0; i < map->n_buckets; i++) {
+        qht_bucket_lock(&map->buckets[i]);
+    }
+}
+
+static void qht_map_unlock_buckets(QHTMap *map)
+{
+    size_t i;
+
+    for (i = 0; i < map->n_buckets; i++) {
+        qht_bucket_unlock(&map->buckets[i]);
+    }
+}
+
+void qht_init(QHT *ht, size_t n_elems, unsigned int mode)
+{
+    ht->mode = mode;
+    qemu_mutex_init(&ht->lock);
+    atomic_rcu_set(&ht->map, qht_map_create(qht_elems_to_buckets(n_elems)));
+}
+
+/* The caller must make sure that no other thread uses the table */
+void qht_destroy(QHT *ht)
+{
+    qht_map_destroy(ht->map);
+    qemu_mutex_destroy(&ht->lock);
+    memset(ht, 0, sizeof(*ht));
+}
+
+/* Lock the head bucket for @hash in the current map.  If a resize replaced
+ * the map meanwhile, wait for it under ht->lock: after that the map cannot
+ * change until the bucket is unlocked, because a resize locks all buckets.
+ * Must be called within an RCU read-side critical section. */
+static QHTBucket *qht_bucket_lock_current(QHT *ht, uint32_t hash,
+                                          QHTMap **pmap)
+{
+    QHTMap *map = atomic_rcu_read(&ht->map);
+    QHTBucket *b = qht_map_to_bucket(map, hash);
+
+    qht_bucket_lock(b);
+    if (likely(map == atomic_read(&ht->map))) {
+        *pmap = map;
+        return b;
+    }
+    qht_bucket_unlock(b);
+
+    qemu_mutex_lock(&ht->lock);
+    map = ht->map;
+    b = qht_map_to_bucket(map, hash);
+    qht_bucket_lock(b);
+    qemu_mutex_unlock(&ht->lock);
+    *pmap = map;
+    return b;
+}
+
+static void *qht_do_lookup(QHTBucket *head, QHTLookupFunc *func,
+                           const void *userp, uint32_t hash)
+{
+    QHTBucket *b = head;
+    int i;
+
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            if (atomic_read(&b->hashes[i]) == hash) {
+                void *p = atomic_rcu_read(&b->pointers[i]);
+
+                if (likely(p) && likely(func(p, userp))) {
+                    return p;
+                }
+            }
+        }
+        b = atomic_rcu_read(&b->next);
+    } while (b);
+
+    return NULL;
+}
+
+void *qht_lookup(QHT *ht, QHTLookupFunc *func, const void *userp,
+                 uint32_t hash)
+{
+    QHTMap *map = atomic_rcu_read(&ht->map);
+    QHTBucket *b = qht_map_to_bucket(map, hash);
+    unsigned version;
+    void *ret;
+
+    do {
+        version = qht_bucket_read_begin(b);
+        ret = qht_do_lookup(b, func, userp, hash);
+    } while (qht_bucket_read_retry(b, version));
+
+    return ret;
+}
+
+/* Call with the head bucket locked, or on a map that is not visible yet */
+static bool qht_insert__locked(QHTMap *map, QHTBucket *head, void *p,
+                               uint32_t hash, bool *needs_resize)
+{
+    QHTBucket *b = head;
+    QHTBucket *prev = NULL;
+    QHTBucket *new = NULL;
+    int i;
+
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            if (b->pointers[i] == NULL) {
+                goto found;
+            }
+            if (unlikely(b->pointers[i] == p)) {
+                return false;
+            }
+        }
+        prev = b;
+        b = b->next;
+    } while (b);
+
+    /* the chain is full: append a bucket */
+    b = qemu_memalign(QHT_BUCKET_ALIGN, sizeof(*b));
+    memset(b, 0, sizeof(*b));
+    new = b;
+    i = 0;
+    atomic_inc(&map->n_added_buckets);
+    if (unlikely(qht_map_needs_resize(map)) && needs_resize) {
+        *needs_resize = true;
+    }
+
+ found:
+    qht_bucket_write_begin(head);
+    if (new) {
+        atomic_rcu_set(&prev->next, b);
+    }
+    atomic_set(&b->hashes[i], hash);
+    atomic_rcu_set(&b->pointers[i], p);
+    qht_bucket_write_end(head);
+    return true;
+}
+
+static void qht_do_resize(QHT *ht, size_t n_buckets, bool reset);
+
+static void qht_grow_maybe(QHT *ht)
+{
+    QHTMap *map;
+
+    qemu_mutex_lock(&ht->lock);
+    map = ht->map;
+    /* another thread may have grown the table meanwhile */
+    if (qht_map_needs_resize(map)) {
+        qht_do_resize(ht, map->n_buckets * 2, false);
+    }
+    qemu_mutex_unlock(&ht->lock);
+}
+
+bool qht_insert(QHT *ht, void *p, uint32_t hash)
+{
+    QHTMap *map;
+    QHTBucket *b;
+    bool needs_resize = false;
+    bool ret;
+
+    assert(p);
+
+    rcu_read_lock();
+    b = qht_bucket_lock_current(ht, hash, &map);
+    ret = qht_insert__locked(map, b, p, hash, &needs_resize);
+    qht_bucket_unlock(b);
+    rcu_read_unlock();
+
+    if (unlikely(needs_resize) && (ht->mode & QHT_MODE_AUTO_RESIZE)) {
+        qht_grow_maybe(ht);
+    }
+    return ret;
+}
+
+/* Move the last entry of the chain into the slot at @pos of @orig, which
+ * is being removed, so that the chain stays packed. */
+static void qht_bucket_remove_entry(QHTBucket *orig, int pos)
+{
+    QHTBucket *b = orig;
+    QHTBucket *last_b = orig;
+    int last_i = pos;
+    int i = pos + 1;
+
+    for (;;) {
+        for (; i < QHT_BUCKET_ENTRIES; i++) {
+            if (b->pointers[i] == NULL) {
+                goto done;
+            }
+            last_b = b;
+            last_i = i;
+        }
+        b = b->next;
+        if (b == NULL) {
+            break;
+        }
+        i = 0;
+    }
+
+ done:
+    if (last_b != orig || last_i != pos) {
+        atomic_set(&orig->hashes[pos], last_b->hashes[last_i]);
+        atomic_set(&orig->pointers[pos], last_b->pointers[last_i]);
+    }
+    atomic_set(&last_b->hashes[last_i], 0);
+    atomic_set(&last_b->pointers[last_i], NULL);
+}
+
+static bool qht_remove__locked(QHTBucket *head, const void *p, uint32_t hash)
+{
+    QHTBucket *b = head;
+    int i;
+
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            void *q = b->pointers[i];
+
+            if (unlikely(q == NULL)) {
+                return false;
+            }
+            if (q == p) {
+                assert(b->hashes[i] == hash);
+                qht_bucket_write_begin(head);
+                qht_bucket_remove_entry(b, i);
+                qht_bucket_write_end(head);
+                return true;
+            }
+        }
+        b = b->next;
+    } while (b);
+
+    return false;
+}
+
+bool qht_remove(QHT *ht, const void *p, uint32_t hash)
+{
+    QHTMap *map;
+    QHTBucket *b;
+    bool ret;
+
+    rcu_read_lock();
+    b = qht_bucket_lock_current(ht, hash, &map);
+    ret = qht_remove__locked(b, p, hash);
+    qht_bucket_unlock(b);
+    rcu_read_unlock();
+    return ret;
+}
+
+/* Call with all buckets of @map locked */
+static void qht_map_reset__all_locked(QHTMap *map)
+{
+    size_t i;
+
+    for (i = 0; i < map->n_buckets; i++) {
+        QHTBucket *head = &map->buckets[i];
+        QHTBucket *b = head;
+        int j;
+
+        qht_bucket_write_begin(head);
+        do {
+            for (j = 0; j < QHT_BUCKET_ENTRIES; j++) {
+                if (b->pointers[j] == NULL) {
+                    goto done;
+                }
+                atomic_set(&b->hashes[j], 0);
+                atomic_set(&b->pointers[j], NULL);
+            }
+            b = b->next;
+        } while (b);
+    done:
+        qht_bucket_write_end(head);
+    }
+}
+
+void qht_reset(QHT *ht)
+{
+    QHTMap *map;
+
+    qemu_mutex_lock(&ht->lock);
+    map = ht->map;
+    qht_map_lock_buckets(map);
+    qht_map_reset__all_locked(map);
+    qht_map_unlock_buckets(map);
+    qemu_mutex_unlock(&ht->lock);
+}
+
+/* Call with ht->lock held.  Unless @reset, the entries are copied to the
+ * new map while all buckets of the old one are locked, so no insertion or
+ * removal is lost; lookups keep using the old map until it is replaced,
+ * and it is freed once they are done with it. */
+static void qht_do_resize(QHT *ht, size_t n_buckets, bool reset)
+{
+    QHTMap *old = ht->map;
+    QHTMap *new = qht_map_create(n_buckets);
+    size_t i;
+
+    qht_map_lock_buckets(old);
+    if (!reset) {
+        for (i = 0; i < old->n_buckets; i++) {
+            QHTBucket *b = &old->buckets[i];
+            int j;
+
+            do {
+                for (j = 0; j < QHT_BUCKET_ENTRIES; j++) {
+                    uint32_t hash = b->hashes[j];
+
+                    if (b->pointers[j] == NULL) {
+                        break;
+                    }
+                    qht_insert__locked(new, qht_map_to_bucket(new, hash),
+                                       b->pointers[j], hash, NULL);
+                }
+                b = b->next;
+            } while (b);
+        }
+    }
+    atomic_rcu_set(&ht->map, new);
+    qht_map_unlock_buckets(old);
+    call_rcu(old, qht_map_destroy, rcu);
+}
+
+bool qht_reset_size(QHT *ht, size_t n_elems)
+{
+    size_t n_buckets = qht_elems_to_buckets(n_elems);
+    bool resize = false;
+
+    qemu_mutex_lock(&ht->lock);
+    if (n_buckets != ht->map->n_buckets) {
+        qht_do_resize(ht, n_buckets, true);
+        resize = true;
+    } else {
+        qht_map_lock_buckets(ht->map);
+        qht_map_reset__all_locked(ht->map);
+        qht_map_unlock_buckets(ht->map);
+    }
+    qemu_mutex_unlock(&ht->lock);
+    return resize;
+}
+
+bool qht_resize(QHT *ht, size_t n_elems)
+{
+    size_t n_buckets = qht_elems_to_buckets(n_elems);
+    bool resize = false;
+
+    qemu_mutex_lock(&ht->lock);
+    if (n_buckets != ht->map->n_buckets) {
+        qht_do_resize(ht, n_buckets, false);
+        resize = true;
+    }
+    qemu_mutex_unlock(&ht->lock);
+    return resize;
+}
+
+void qht_iter(QHT *ht, QHTIterFunc *func, void *userp)
+{
+    QHTMap *map;
+    size_t i;
+
+    qemu_mutex_lock(&ht->lock);
+    map = ht->map;
+    qht_map_lock_buckets(map);
+    for (i = 0; i < map->n_buckets; i++) {
+        QHTBucket *b = &map->buckets[i];
+        int j;
+
+        do {
+            for (j = 0; j < QHT_BUCKET_ENTRIES; j++) {
+                if (b->pointers[j] == NULL) {
+                    break;
+                }
+                func(ht, b->pointers[j], b->hashes[j], userp);
+            }
+            b = b->next;
+        } while (b);
+    }
+    qht_map_unlock_buckets(map);
+    qemu_mutex_unlock(&ht->lock);
+}
+
+void qht_statistics(QHT *ht, QHTStats *stats)
+{
+    QHTMap *map;
+    size_t chain_buckets = 0;
+    size_t i;
+
+    memset(stats, 0, sizeof(*stats));
+
+    qemu_mutex_lock(&ht->lock);
+    map = ht->map;
+    qht_map_lock_buckets(map);
+    stats->head_buckets = map->n_buckets;
+    for (i = 0; i < map->n_buckets; i++) {
+        QHTBucket *b = &map->buckets[i];
+        size_t buckets = 0;
+        size_t entries = 0;
+        int j;
+
+        do {
+            buckets++;
+            for (j = 0; j < QHT_BUCKET_ENTRIES && b->pointers[j]; j++) {
+                entries++;
+            }
+            b = b->next;
+        } while (b);
+
+        if (entries) {
+            stats->used_head_buckets++;
+            stats->entries += entries;
+            stats->max_chain = MAX(stats->max_chain, buckets);
+            chain_buckets += buckets;
+        }
+    }
+    qht_map_unlock_buckets(map);
+    qemu_mutex_unlock(&ht->lock);
+
+    if (stats->used_head_buckets) {
+        stats->avg_chain = (double)chain_buckets / stats->used_head_buckets;
+        stats->occupancy = (double)stats->entries /
+                           (chain_buckets * QHT_BUCKET_ENTRIES);
+    }
+}
@@ -474,6 +474,29 @@ static QemuOptsList qemu_icount_opts = {
     },
 };
 
+static QemuOptsList qemu_tcg_opts = {
+    .name = "tcg",
+    .implied_opt_name = "thread",
+    .merge_lists = true,
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_tcg_opts.head),
+    .desc = {
+        {
+            .name = "thread",
+            .type = QEMU_OPT_STRING,
+        }, {
+            .name = "superblock",
+            .type = QEMU_OPT_NUMBER,
+        }, {
+            .name = "optimize",
+            .type = QEMU_OPT_STRING,
+        }, {
+            .name = "cache",
+            .type = QEMU_OPT_STRING,
+        },
+        { /* end of list */ }
+    },
+};
+
 static QemuOptsList qemu_semihosting_config_opts = {
     .name = "semihosting-config",
     .implied_opt_name = "enable",
@@ -2736,6 +2759,7 @@ int main(int argc, char **argv, char **envp)
     DisplayState *ds;
     int cyls, heads, secs, translation;
     QemuOpts *hda_opts = NULL, *opts, *machine_opts, *icount_opts = NULL;
+    QemuOpts *tcg_opts = NULL;
     QemuOptsList *olist;
     int optind;
     const char *optarg;
@@ -2803,6 +2827,7 @@ int main(int argc, char **argv, char **envp)
     qemu_add_opts(&qemu_name_opts);
     qemu_add_opts(&qemu_numa_opts);
     qemu_add_opts(&qemu_icount_opts);
+    qemu_add_opts(&qemu_tcg_opts);
     qemu_add_opts(&qemu_semihosting_config_opts);
 
     runstate_init();
@@ -3615,6 +3640,12 @@ int main(int argc, char **argv, char **envp)
                     exit(1);
                 }
                 break;
+            case QEMU_OPTION_tcg:
+                tcg_opts = qemu_opts_parse(qemu_find_opts("tcg"), optarg, 1);
+                if (!tcg_opts) {
+                    exit(1);
+                }
+                break;
             case QEMU_OPTION_incoming:
                 incoming = optarg;
                 runstate_set(RUN_STATE_INMIGRATE);
@@ -4119,6 +4150,16 @@ int main(int argc, char **argv, char **envp)
         configure_icount(icount_opts, &error_abort);
         qemu_opts_del(icount_opts);
     }
+    if (tcg_opts) {
+        Error *local_err = NULL;
+
+        qemu_tcg_configure(tcg_opts, &local_err);
+        if (local_err) {
+            error_report_err(local_err);
+            exit(1);
+        }
+        qemu_opts_del(tcg_opts);
+    }
 
     /* clean up network at qemu process termination */
     atexit(&net_cleanup);